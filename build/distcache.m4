@@ -78,6 +78,48 @@ if test "$dc_poll_prefer" = "yes"; then
 else
 	AC_MSG_RESULT(no)
 fi
+AH_TEMPLATE(PREFER_EPOLL, [Define to 1 if you prefer epoll where available])
+dc_epoll_prefer="yes"
+AC_ARG_ENABLE(epoll,
+AC_HELP_STRING(
+	[--disable-epoll],
+	[don't prefer 'epoll' to 'poll' and 'select' where available]),
+[
+	if test "x$enableval" != "x"; then
+		if test "$enableval" != "yes" -a "$enableval" != "no"; then
+			AC_MSG_ERROR("invalid syntax: --enable-epoll=$enableval")
+		fi
+		dc_epoll_prefer=$enableval
+	fi
+])
+AC_MSG_CHECKING(whether to prefer epoll where available)
+if test "$dc_epoll_prefer" = "yes"; then
+	AC_DEFINE(PREFER_EPOLL)
+	AC_MSG_RESULT(yes)
+else
+	AC_MSG_RESULT(no)
+fi
+AH_TEMPLATE(PREFER_IO_URING, [Define to 1 if you prefer io_uring where available])
+dc_io_uring_prefer="no"
+AC_ARG_ENABLE(io-uring,
+AC_HELP_STRING(
+	[--enable-io-uring],
+	[prefer 'io_uring' to 'epoll' where available]),
+[
+	if test "x$enableval" != "x"; then
+		if test "$enableval" != "yes" -a "$enableval" != "no"; then
+			AC_MSG_ERROR("invalid syntax: --enable-io-uring=$enableval")
+		fi
+		dc_io_uring_prefer=$enableval
+	fi
+])
+AC_MSG_CHECKING(whether to prefer io_uring where available)
+if test "$dc_io_uring_prefer" = "yes"; then
+	AC_DEFINE(PREFER_IO_URING)
+	AC_MSG_RESULT(yes)
+else
+	AC_MSG_RESULT(no)
+fi
 
 dnl Put in stubs. These are properly implemented in ssl/acinclude.m4
 dnl but we want them to appear in "./configure --help"
@@ -6,13 +6,35 @@ THISDIR=`pwd`
 DC_SERVER_PROG="$THISDIR/sessserver/dc_server"
 DC_SERVER_UNIX="$THISDIR/unix.dc_server"
 DC_SERVER_PID="$THISDIR/pid.dc_server"
+DC_SERVER2_UNIX="$THISDIR/unix.dc_server2"
+DC_SERVER2_PID="$THISDIR/pid.dc_server2"
+DC_THREADED_UNIX="$THISDIR/unix.dc_threaded"
+DC_THREADED_PID="$THISDIR/pid.dc_threaded"
+DC_PROCS_UNIX="$THISDIR/unix.dc_procs"
+DC_PROCS_PID="$THISDIR/pid.dc_procs"
 DC_CLIENT_PROG="$THISDIR/sessclient/dc_client"
 DC_CLIENT_UNIX="$THISDIR/unix.dc_client"
 DC_CLIENT_PID="$THISDIR/pid.dc_client"
+DC_SPREAD_UNIX="$THISDIR/unix.dc_spread"
+DC_SPREAD_PID="$THISDIR/pid.dc_spread"
+DC_SILENT_UNIX="$THISDIR/unix.dc_silent"
+DC_LATE_UNIX="$THISDIR/unix.dc_late"
+DC_LATE_PID="$THISDIR/pid.dc_late"
+DC_FAKE_UNIX="$THISDIR/unix.dc_fake"
+DC_FRONT_UNIX="$THISDIR/unix.dc_front"
+DC_FRONT_PID="$THISDIR/pid.dc_front"
 DC_TEST="$THISDIR/test/dc_test -timeout 30 -timevar 10"
+DC_CACHE_TEST="$THISDIR/test/dc_cache_test"
 
 DC_SERVER="$DC_SERVER_PROG -listen UNIX:$DC_SERVER_UNIX -pidfile $DC_SERVER_PID -daemon"
 DC_CLIENT="$DC_CLIENT_PROG -listen UNIX:$DC_CLIENT_UNIX -pidfile $DC_CLIENT_PID -daemon -server UNIX:$DC_SERVER_UNIX"
+DC_SERVER2="$DC_SERVER_PROG -listen UNIX:$DC_SERVER2_UNIX -pidfile $DC_SERVER2_PID -daemon"
+DC_THREADED="$DC_SERVER_PROG -listen UNIX:$DC_THREADED_UNIX -pidfile $DC_THREADED_PID -daemon -threads 4"
+DC_PROCS="$DC_SERVER_PROG -listen UNIX:$DC_PROCS_UNIX -pidfile $DC_PROCS_PID -daemon -processes 3"
+DC_LATE="$DC_SERVER_PROG -listen UNIX:$DC_LATE_UNIX -pidfile $DC_LATE_PID -daemon"
+DC_SPREAD="$DC_CLIENT_PROG -listen UNIX:$DC_SPREAD_UNIX -pidfile $DC_SPREAD_PID -daemon -server UNIX:$DC_SERVER_UNIX -server UNIX:$DC_SERVER2_UNIX"
+DC_FRONT="$DC_CLIENT_PROG -listen UNIX:$DC_FRONT_UNIX -pidfile $DC_FRONT_PID -daemon -retry 100 -server UNIX:$DC_FAKE_UNIX"
+DC_NEAR="$DC_FRONT -nearcache 64 -nearttl 60000"
 
 cleanup() {
 	if [ -f "$DC_SERVER_PID" ]; then
@@ -21,8 +43,35 @@ cleanup() {
 	if [ -f "$DC_CLIENT_PID" ]; then
 		kill `cat $DC_CLIENT_PID` || echo "couldn't kill 'dc_client'!"
 	fi
+	if [ -f "$DC_SERVER2_PID" ]; then
+		kill `cat $DC_SERVER2_PID` || echo "couldn't kill second 'dc_server'!"
+	fi
+	if [ -f "$DC_SPREAD_PID" ]; then
+		kill `cat $DC_SPREAD_PID` || echo "couldn't kill second 'dc_client'!"
+	fi
+	if [ -f "$DC_THREADED_PID" ]; then
+		kill `cat $DC_THREADED_PID` || echo "couldn't kill threaded 'dc_server'!"
+	fi
 	rm -f $DC_SERVER_PID $DC_SERVER_UNIX
 	rm -f $DC_CLIENT_PID $DC_CLIENT_UNIX
+	rm -f $DC_SERVER2_PID $DC_SERVER2_UNIX
+	rm -f $DC_SPREAD_PID $DC_SPREAD_UNIX
+	# The worker processes exit once their supervisor has gone
+	if [ -f "$DC_PROCS_PID" ]; then
+		kill `cat $DC_PROCS_PID` || echo "couldn't kill 'dc_server' processes!"
+	fi
+	rm -f $DC_THREADED_PID $DC_THREADED_UNIX
+	rm -f $DC_PROCS_PID $DC_PROCS_UNIX
+	if [ -f "$DC_LATE_PID" ]; then
+		kill `cat $DC_LATE_PID` || echo "couldn't kill third 'dc_server'!"
+	fi
+	rm -f $DC_SILENT_UNIX
+	rm -f $DC_LATE_PID $DC_LATE_UNIX
+	if [ -f "$DC_FRONT_PID" ]; then
+		kill `cat $DC_FRONT_PID` || echo "couldn't kill third 'dc_client'!"
+	fi
+	rm -f $DC_FAKE_UNIX
+	rm -f $DC_FRONT_PID $DC_FRONT_UNIX
 }
 
 bang() {
@@ -31,21 +80,45 @@ bang() {
 	exit 1
 }
 
-# run_test $1 $2 $3
+# run_test $1 $2 $3 [$4 $5]
 # $1: number of operations
-# $2: "server" or "client" (target address)
+# $2: "server", "client", "spread", "threads" or "procs" (target address,
+#     "spread" is a dc_client spreading sessions over two dc_servers, "threads"
+#     a dc_server with 4 worker threads, "procs" one with 3 worker processes)
 # $3: "temporary" or "persistent"  (whether to use -persistent)
+# $4: if given, "batch", "async" or "pool" to send the operations in batches of
+#     up to $5, to keep up to $5 of them outstanding asynchronously, or to run
+#     them from $5 threads sharing a DC_POOL
 run_test() {
 	text="$1 random operations"
 	cmd="$DC_TEST -ops $1 -connect UNIX:"
 	if [ "$2" = "server" ]; then
-		text="$text direct to"
+		text="$text direct to dc_server"
 		cmd="$cmd$DC_SERVER_UNIX"
-	else
-		text="$text through"
+	elif [ "$2" = "client" ]; then
+		text="$text through dc_client"
 		cmd="$cmd$DC_CLIENT_UNIX"
+	elif [ "$2" = "threads" ]; then
+		text="$text direct to dc_server with 4 threads"
+		cmd="$cmd$DC_THREADED_UNIX"
+	elif [ "$2" = "procs" ]; then
+		text="$text direct to dc_server with 3 processes"
+		cmd="$cmd$DC_PROCS_UNIX"
+	else
+		text="$text through dc_client over 2 servers"
+		cmd="$cmd$DC_SPREAD_UNIX"
 	fi
-	text="$text dc_$2 ($3 connections) ... "
+	if [ "$4" = "batch" ]; then
+		text="$text in batches of $5"
+		cmd="$cmd -batch $5"
+	elif [ "$4" = "async" ]; then
+		text="$text, $5 at a time asynchronously"
+		cmd="$cmd -async $5"
+	elif [ "$4" = "pool" ]; then
+		text="$text from $5 threads sharing a pool"
+		cmd="$cmd -pool $5"
+	fi
+	text="$text ($3 connections) ... "
 	if [ "$3" = "persistent" ]; then
 		cmd="$cmd -persistent"
 	fi
@@ -74,26 +147,129 @@ if [ -S "$DC_SERVER_UNIX" ]; then
 	BAILREASON="$BAILREASON (unix.dc_server exists)"
 fi
 
+if [ -f "$DC_SERVER2_PID" ]; then
+	BAILOUT=yes
+	BAILREASON="$BAILREASON (pid.dc_server2 exists)"
+fi
+
+if [ -S "$DC_SERVER2_UNIX" ]; then
+	BAILOUT=yes
+	BAILREASON="$BAILREASON (unix.dc_server2 exists)"
+fi
+
 if [ "x$BAILOUT" != "xno" ]; then
 	bang
 fi
 
+printf "Checking the eviction policies of the default cache ... "
+$DC_CACHE_TEST 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
+echo "SUCCESS"
+echo ""
+
 printf "Starting dc_server daemon on %s ... " "$DC_SERVER_UNIX"
 $DC_SERVER 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
 echo "SUCCESS"
 printf "Starting dc_client daemon on %s ... " "$DC_CLIENT_UNIX"
 $DC_CLIENT 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
 echo "SUCCESS"
+printf "Starting second dc_server daemon on %s ... " "$DC_SERVER2_UNIX"
+$DC_SERVER2 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
+echo "SUCCESS"
+printf "Starting dc_client daemon over both servers on %s ... " "$DC_SPREAD_UNIX"
+$DC_SPREAD 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
+echo "SUCCESS"
+printf "Starting dc_server daemon with 4 threads on %s ... " "$DC_THREADED_UNIX"
+$DC_THREADED 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
+echo "SUCCESS"
+printf "Starting dc_server daemon with 3 processes on %s ... " "$DC_PROCS_UNIX"
+$DC_PROCS 1> /dev/null 2> /dev/null || (echo "FAILED" && exit 1) || exit 1
+echo "SUCCESS"
 
 echo ""
 
 sleep 1
 
+printf "Checking timeouts against a server that never answers ... "
+$DC_TEST -ops 100 -connect UNIX:$DC_SERVER_UNIX -silent UNIX:$DC_SILENT_UNIX \
+	1> /dev/null 2> /dev/null && echo "SUCCESS" || echo "FAILED"
+
+# The cluster check expects the server on $DC_LATE_UNIX to start after it does
+printf "Checking a cluster ejects a server until it starts ... "
+$DC_TEST -ops 100 -connect UNIX:$DC_SERVER_UNIX -cluster UNIX:$DC_LATE_UNIX \
+	1> /dev/null 2> /dev/null &
+CLUSTER_TEST=$!
+sleep 1
+$DC_LATE 1> /dev/null 2> /dev/null
+wait $CLUSTER_TEST && echo "SUCCESS" || echo "FAILED"
+
+# In the coalescing check, dc_test stands in for the server behind a dc_client
+# (so there are no random operations, they'd go to the stand-in too)
+printf "Checking dc_client coalesces identical lookups ... "
+$DC_TEST -ops 0 -connect UNIX:$DC_FRONT_UNIX -coalesce UNIX:$DC_FAKE_UNIX \
+	1> /dev/null 2> /dev/null &
+COALESCE_TEST=$!
+sleep 1
+$DC_FRONT 1> /dev/null 2> /dev/null
+wait $COALESCE_TEST && echo "SUCCESS" || echo "FAILED"
+kill `cat $DC_FRONT_PID` && rm -f $DC_FRONT_PID
+
+printf "Checking dc_client's near-cache ... "
+$DC_TEST -ops 0 -connect UNIX:$DC_FRONT_UNIX -nearcache UNIX:$DC_FAKE_UNIX \
+	1> /dev/null 2> /dev/null &
+NEAR_TEST=$!
+sleep 1
+$DC_NEAR 1> /dev/null 2> /dev/null
+wait $NEAR_TEST && echo "SUCCESS" || echo "FAILED"
+kill `cat $DC_FRONT_PID` && rm -f $DC_FRONT_PID
+
 run_test 8000 server temporary
 run_test 8000 server persistent
 
 run_test 8000 client temporary
 run_test 8000 client persistent
 
+run_test 8000 spread temporary
+run_test 8000 spread persistent
+
+run_test 8000 threads temporary
+run_test 8000 threads persistent
+
+run_test 8000 procs temporary
+run_test 8000 procs persistent
+
+run_test 8000 server temporary batch 16
+run_test 8000 server persistent batch 16
+run_test 8000 client persistent batch 16
+run_test 8000 spread persistent batch 16
+run_test 8000 threads persistent batch 16
+run_test 8000 procs persistent batch 16
+
+run_test 8000 server persistent async 32
+run_test 8000 client persistent async 32
+run_test 8000 spread persistent async 32
+run_test 8000 threads persistent async 32
+run_test 8000 procs persistent async 32
+
+run_test 8000 server persistent pool 8
+run_test 8000 client persistent pool 8
+
+# Kill one of the worker processes outright, the others should carry on serving
+# and the supervisor should start a new one in its place
+printf "Checking dc_server's processes survive one being killed ... "
+DC_PROCS_SUPERVISOR=`cat $DC_PROCS_PID`
+DC_PROCS_WORKER=`ps -eo pid,ppid | awk -v sup="$DC_PROCS_SUPERVISOR" \
+	'$2 == sup { print $1; exit }'`
+if [ -n "$DC_PROCS_WORKER" ] && kill -9 $DC_PROCS_WORKER && \
+		$DC_TEST -ops 2000 -connect UNIX:$DC_PROCS_UNIX \
+			1> /dev/null 2> /dev/null && sleep 2 && \
+		[ `ps -eo pid,ppid | awk -v sup="$DC_PROCS_SUPERVISOR" \
+			'$2 == sup' | wc -l` -eq 3 ] && \
+		$DC_TEST -ops 2000 -connect UNIX:$DC_PROCS_UNIX -persistent \
+			1> /dev/null 2> /dev/null; then
+	echo "SUCCESS"
+else
+	echo "FAILED"
+fi
+
 cleanup
 
@@ -27,15 +27,28 @@
  * compatibility. It merely provides a way for dependant source code to provide
  * pre-processing rules that ensure that source code is being compiled using an
  * acceptable version of the distcache API. */
-#define DISTCACHE_CLIENT_API	0x0001
+#define DISTCACHE_CLIENT_API	0x0006
 
 /* This is an "implementation" version - it will be bumped each time a change is
  * made that could affect binary compatibility with dependant libraries or a
  * behavioural change takes place that could affect interoperation. */
-#define DISTCACHE_CLIENT_BINARY	0x0001
+#define DISTCACHE_CLIENT_BINARY	0x0002
 
-/* Our black-box type */
+/* Our black-box types */
 typedef struct st_DC_CTX DC_CTX;
+typedef struct st_DC_POOL DC_POOL;
+typedef struct st_DC_RING DC_RING;
+typedef struct st_DC_CLUSTER DC_CLUSTER;
+/* libnal's selector type, see <libnal/nal.h> */
+struct st_NAL_SELECTOR;
+
+/* The completion callback for asynchronous operations. 'result' is 1 if the
+ * operation succeeded (or for "has", the session is in the cache), 0 if it
+ * didn't, and -1 if the request failed altogether. For a successful "get", the
+ * session is in 'sess_data', which is only valid for the callback's duration. */
+typedef void (*DC_CTX_async_cb)(void *cb_arg, int result,
+			const unsigned char *sess_data,
+			unsigned int sess_len);
 
 /* Flags for use in DC_CTX_new() */
 #define DC_CTX_FLAG_PERSISTENT		(unsigned int)0x0001
@@ -46,6 +59,11 @@ typedef struct st_DC_CTX DC_CTX;
 /* The minimum allowable "timeout" (in milliseconds) of new sessions */
 #define DC_MIN_TIMEOUT			500
 
+/* Return values of DC_CTX_get_error() */
+#define DC_CTX_ERR_NONE			0
+#define DC_CTX_ERR_FAILED		1
+#define DC_CTX_ERR_TIMEOUT		2
+
 /*****************/
 /* API functions */
 
@@ -87,4 +105,154 @@ int DC_CTX_has_session(DC_CTX *ctx,
 			const unsigned char *id_data,
 			unsigned int id_len);
 
+/* Set timeouts (in milliseconds, zero for none) for establishing a connection
+ * and for each blocking operation as a whole. The call timeout overrides the
+ * latter for the next blocking operation only. */
+void DC_CTX_set_timeouts(DC_CTX *ctx, unsigned long connect_msecs,
+			unsigned long op_msecs);
+void DC_CTX_set_call_timeout(DC_CTX *ctx, unsigned long op_msecs);
+/* Says why the last blocking operation failed, DC_CTX_ERR_NONE means the
+ * cache itself answered (eg. the session wasn't found). */
+int DC_CTX_get_error(const DC_CTX *ctx);
+
+/* Queue operations to be sent to the cache together in one request by
+ * DC_CTX_batch_send(). These fail if the operation won't fit in the batch. */
+int DC_CTX_batch_add_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs);
+int DC_CTX_batch_remove_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len);
+int DC_CTX_batch_get_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len);
+int DC_CTX_batch_has_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len);
+/* Sends the queued operations, returning how many of them (from the start of
+ * the batch) the cache performed, or -1 for failure. */
+int DC_CTX_batch_send(DC_CTX *ctx);
+/* Walks the results of the last DC_CTX_batch_send() in order. Returns 1 if the
+ * operation succeeded, 0 if it didn't, and -1 once there are no more results.
+ * For "get"s, the session is returned in 'sess_data' and 'sess_len'. */
+int DC_CTX_batch_result(DC_CTX *ctx,
+			const unsigned char **sess_data,
+			unsigned int *sess_len);
+
+/* Attach a persistent DC_CTX to the caller's selector for asynchronous use,
+ * after which blocking operations on it fail. */
+int DC_CTX_to_select(DC_CTX *ctx, struct st_NAL_SELECTOR *sel);
+void DC_CTX_from_select(DC_CTX *ctx);
+/* Submit asynchronous operations, 'cb' is called from DC_CTX_process() */
+int DC_CTX_async_add_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs,
+			DC_CTX_async_cb cb, void *cb_arg);
+int DC_CTX_async_remove_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg);
+int DC_CTX_async_get_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg);
+int DC_CTX_async_has_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg);
+/* Performs network I/O after each select and calls the callbacks of any
+ * completed operations. */
+int DC_CTX_process(DC_CTX *ctx);
+/* The number of asynchronous operations not yet completed */
+unsigned int DC_CTX_async_num(const DC_CTX *ctx);
+/* Non-zero once the connection for asynchronous operations is established */
+int DC_CTX_async_connected(const DC_CTX *ctx);
+/* Drops the connection and fails every outstanding asynchronous operation, eg.
+ * when the caller's own timeout for them has passed */
+void DC_CTX_async_abort(DC_CTX *ctx);
+
+/* A DC_POOL is a thread-safe equivalent of a persistent DC_CTX, sharing
+ * 'num_conns' connections to the target between any number of threads. Returns
+ * NULL if threads aren't supported. */
+DC_POOL *DC_POOL_new(const char *target, unsigned int num_conns);
+/* Destroy a DC_POOL, no other thread may be using it */
+void DC_POOL_free(DC_POOL *pool);
+/* Set timeouts (in milliseconds, zero for none) for establishing each
+ * connection and for each operation, see DC_CTX_set_timeouts() */
+void DC_POOL_set_timeouts(DC_POOL *pool, unsigned long connect_msecs,
+			unsigned long op_msecs);
+/* These behave like their DC_CTX equivalents */
+int DC_POOL_add_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs);
+int DC_POOL_remove_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len);
+int DC_POOL_get_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			unsigned char *result_storage,
+			unsigned int result_size,
+			unsigned int *result_used);
+int DC_POOL_has_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len);
+
+/* A DC_RING maps session ids to servers by consistent hashing, with 'points'
+ * points on the ring per server (zero for the default). Servers are identified
+ * by their address strings and returned as indexes into 'servers'. */
+DC_RING *DC_RING_new(const char *const *servers, unsigned int num,
+			unsigned int points);
+void DC_RING_free(DC_RING *ring);
+/* Returns the live server a session belongs to, or -1 if none are live */
+int DC_RING_lookup(const DC_RING *ring, const unsigned char *id_data,
+			unsigned int id_len);
+/* Ejects a server (its sessions move to the other servers) or restores it */
+void DC_RING_set_live(DC_RING *ring, unsigned int idx, int live);
+int DC_RING_is_live(const DC_RING *ring, unsigned int idx);
+
+/* A DC_CLUSTER spreads sessions over several cache servers with a DC_RING,
+ * with a DC_CTX (created with 'flags') per server. Servers whose operations
+ * keep failing are ejected for a while. */
+DC_CLUSTER *DC_CLUSTER_new(const char *const *targets, unsigned int num,
+			unsigned int flags);
+void DC_CLUSTER_free(DC_CLUSTER *cl);
+/* Sets the timeouts of every server's DC_CTX, see DC_CTX_set_timeouts() */
+void DC_CLUSTER_set_timeouts(DC_CLUSTER *cl, unsigned long connect_msecs,
+			unsigned long op_msecs);
+/* Eject servers after 'fail_limit' failed operations in a row, and try them
+ * again after 'retry_msecs' */
+void DC_CLUSTER_set_ejection(DC_CLUSTER *cl, unsigned int fail_limit,
+			unsigned long retry_msecs);
+/* These behave like their DC_CTX equivalents */
+int DC_CLUSTER_add_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs);
+int DC_CLUSTER_remove_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len);
+int DC_CLUSTER_get_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			unsigned char *result_storage,
+			unsigned int result_size,
+			unsigned int *result_used);
+int DC_CLUSTER_has_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len);
+/* The number of servers that haven't been ejected */
+unsigned int DC_CLUSTER_num_live(const DC_CLUSTER *cl);
+
 #endif /* !defined(HEADER_DISTCACHE_DC_CLIENT_H) */
@@ -44,7 +44,7 @@
  * compatible with older versions. When a bug-fix or enhancement can not do
  * this, an incompatible bump in the protocol version is necessary.
  *
- * For the current protocol version, 0x0010, each message is of this basic
+ * For the current protocol version, 0x0012, each message is of this basic
  * format;
  *
  * unsigned long (4-bytes)              proto_level
@@ -104,6 +104,7 @@
  *                         DC_OP_GET
  *                         DC_OP_REMOVE
  *                         DC_OP_HAVE
+ *                         DC_OP_BATCH
  *
  * All operations can return a one-byte response which is to be interpreted as
  * an "error" value (in the case of "ADD", and "REMOVE" this includes an "OK"
@@ -139,6 +140,19 @@
  *    it to an application. The format is the same as DC_OP_GET, and the return
  *    value is a 1-byte boolean value from chosen from the DC_ERR type (YES/NO
  *    is DC_ERR_OK/DC_ERR_NOTOK respectively).
+ * DC_OP_BATCH;
+ *    This operation carries several of the above operations in one request,
+ *    so that bulk work doesn't cost a round-trip per session. It was added in
+ *    protocol version 0x0012. The payload is a 4-byte count of entries
+ *    followed by the entries themselves, each of which is a 1-byte
+ *    operation (one of the four above), a 4-byte length, and that many bytes
+ *    of the operation's usual request data. The response has the same format,
+ *    with each entry carrying the operation's usual response data. The
+ *    entries are answered in order, but if the next result won't fit in the
+ *    response then it and the rest of the batch are left undone. So the
+ *    response count says how many of the leading entries were performed, and
+ *    the caller can send the remainder again (a session too large to ever
+ *    fit in a batch response has to be fetched with DC_OP_GET).
  */
 
 typedef enum {
@@ -150,9 +164,14 @@ typedef enum {
 	DC_OP_ADD = 0,
 	DC_OP_GET,
 	DC_OP_REMOVE,
-	DC_OP_HAVE
+	DC_OP_HAVE,
+	DC_OP_BATCH
 } DC_OP;
 
+/* The size of a DC_OP_BATCH payload's count, and of each entry's header */
+#define DC_BATCH_COUNT_SIZE	4
+#define DC_BATCH_ENTRY_SIZE	5
+
 /* These error codes work for *all* operations. That's why per-operation errors
  * are numbered from 100 onwards. */
 typedef enum {
@@ -207,9 +226,10 @@ int DC_MSG_start_response(const DC_MSG *request,
 				DC_MSG *response);
 /* Given a message, calculate the space required for encoding */
 unsigned int DC_MSG_encoding_size(const DC_MSG *msg);
-/* Encode a message (returns encoding size) */
-unsigned int DC_MSG_encode(const DC_MSG *msg, unsigned char *ptr,
-				unsigned int data_len);
+/* Encode a message, with its payload taken from 'payload', onto the end of
+ * 'buffer' (returns encoding size) */
+unsigned int DC_MSG_encode(const DC_MSG *msg, const unsigned char *payload,
+				NAL_BUFFER *buffer);
 /* Given a (supposed) encoding, examine it */
 DC_DECODE_STATE DC_MSG_pre_decode(const unsigned char *data,
 				unsigned int data_len);
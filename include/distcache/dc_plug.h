@@ -38,7 +38,7 @@
  * incompatible behavioural (or binary formatting) changes should cause an
  * corresponding bump in the most-significant word (the "protocol version") and
  * thus "officially" break interoperability with prior versions. */
-#define DISTCACHE_PROTO_VER	0x11
+#define DISTCACHE_PROTO_VER	0x12
 #define DISTCACHE_PATCH_LEVEL	0x00
 #define DISTCACHE_PROTO_LEVEL	DISTCACHE_MAKE_PROTO_LEVEL(\
 					DISTCACHE_PROTO_VER,DISTCACHE_PATCH_LEVEL)
@@ -48,7 +48,8 @@ typedef enum {
 	DC_CMD_ADD,
 	DC_CMD_GET,
 	DC_CMD_REMOVE,
-	DC_CMD_HAVE
+	DC_CMD_HAVE,
+	DC_CMD_BATCH
 } DC_CMD;
 
 /* The maximum size of "data" in a single message (or "frame") */
@@ -78,6 +79,9 @@ typedef struct st_DC_PLUG DC_PLUG;
 /* General "plug" functions */
 DC_PLUG *DC_PLUG_new(NAL_CONNECTION *conn, unsigned int flags);
 int DC_PLUG_free(DC_PLUG *plug);
+/* Closes the connection and discards any partial messages, keeping the memory.
+ * The plug can be used again once its connection has been recreated. */
+void DC_PLUG_reset(DC_PLUG *plug);
 int DC_PLUG_to_select(DC_PLUG *plug, NAL_SELECTOR *sel);
 void DC_PLUG_from_select(DC_PLUG *plug);
 int DC_PLUG_io(DC_PLUG *plug);
@@ -113,6 +117,12 @@ int DC_PLUG_write_more(DC_PLUG *plug,
 		const unsigned char *data, unsigned int data_len);
 /* Commit an in-progress "write". */
 int DC_PLUG_commit(DC_PLUG *plug);
+/* Equivalent to "write_more" followed by "commit", except that if the "write"
+ * has no payload yet, as many frames as there's room for in the connection's
+ * send buffer are encoded directly from 'data' without copying it into the
+ * plug first. 'data' need only remain valid for the duration of the call. */
+int DC_PLUG_commit_data(DC_PLUG *plug,
+		const unsigned char *data, unsigned int data_len);
 /* Rollback an in-progress "write" (previous data added by calls to "write" and
  * perhaps "write_more" will be discarded). */
 int DC_PLUG_rollback(DC_PLUG *plug);
@@ -27,10 +27,11 @@
  * suddenly). */
 
 /* The minimum/maximum size of a cache (in terms of sessions). NB: the maximum
- * allows for a cache that will be over 8Mb, even if filled with small sessions.
- * If filled with large sessions, this could be much larger still. */
+ * allows for a cache that will be several Gb, even if filled with small
+ * sessions, so in practice a cache this size will be bounded by memory (see
+ * DC_SERVER_new_ex()). */
 #define DC_CACHE_MIN_SIZE		64
-#define DC_CACHE_MAX_SIZE		60000
+#define DC_CACHE_MAX_SIZE		16777216
 /* The maximum number of milli-seconds we let sessions live for */
 #define DC_MAX_EXPIRY			(unsigned long)604800000 /* 7 days */
 /* The largest session object we allow. For SSL/TLS, if architectures encode
@@ -39,11 +40,42 @@
  * a problem. Otherwise it should be more than enough! */
 #define DC_MAX_DATA_LEN			32768
 
+/* The most size classes a cache implementation can report in DC_CACHE_STATS */
+#define DC_CACHE_STATS_MAX_CLASSES	32
+/* The most partitions a shared cache can be split into */
+#define DC_CACHE_MAX_STRIPES		1024
+
 /* Our black-box types */
 typedef struct st_DC_SERVER DC_SERVER;
 typedef struct st_DC_CLIENT DC_CLIENT;
 typedef struct st_DC_CACHE  DC_CACHE;
 
+/* Statistics that a cache implementation can optionally report about its
+ * storage, see DC_SERVER_get_stats(). */
+typedef struct st_DC_CACHE_STATS {
+	/* Payload storage broken down by size class. 'chunks_total' is the
+	 * number of chunks of 'chunk_size' bytes that the class's slabs hold,
+	 * 'chunks_used' is how many of those currently store a session. */
+	unsigned int num_classes;
+	struct {
+		unsigned int chunk_size;
+		unsigned int slabs;
+		unsigned int chunks_used, chunks_total;
+	} classes[DC_CACHE_STATS_MAX_CLASSES];
+	/* The size of each slab, and how many aren't assigned to a class */
+	unsigned int slab_size;
+	unsigned int slabs_total, slabs_free;
+	/* The number of sessions evicted to make room for others, and how
+	 * long (in milli-seconds) the most recent victim and the average
+	 * victim had been in the cache. */
+	unsigned long evictions;
+	unsigned long victim_age_last, victim_age_avg;
+	/* The number of slabs emptied to give to another size class when
+	 * the storage was full, and the sessions evicted with them (which
+	 * aren't counted in 'evictions'). */
+	unsigned long slab_moves, slab_evictions;
+} DC_CACHE_STATS;
+
 /* This structure holds the "cache" implementation. It allows callers to provide
  * their own form of cache storage (or otherwise, in the case of proxies). */
 typedef struct st_DC_CACHE_cb {
@@ -76,6 +108,50 @@ typedef struct st_DC_CACHE_cb {
 				const struct timeval *now);
 } DC_CACHE_cb;
 
+/* Optional handlers a cache implementation can provide on top of DC_CACHE_cb,
+ * see DC_SERVER_set_cache_ex(). They're kept apart so that DC_CACHE_cb keeps
+ * its layout, and 'ext_size' must be set to sizeof(DC_CACHE_EXT_cb) so that
+ * handlers can be added to the end of this one without breaking
+ * implementations built before they were. Any handler may be NULL. */
+typedef struct st_DC_CACHE_EXT_cb {
+	unsigned int	ext_size;
+	/* Reports statistics, if the implementation keeps any */
+	int		(*cache_stats)(DC_CACHE *cache,
+				DC_CACHE_STATS *stats);
+	/* Creates a cache bounded by 'max_memory' bytes as well as
+	 * 'max_sessions'. Either may be zero, meaning the implementation
+	 * should derive it from the other. */
+	DC_CACHE *	(*cache_new_ex)(unsigned int max_sessions,
+				unsigned long max_memory);
+	/* Both or neither, a zero-copy alternative to cache_get.
+	 * This returns the stored session and sets 'len' to its length, or
+	 * returns NULL if there's no such session. The session stays pinned
+	 * (neither changed nor freed) until cache_release is called, and no
+	 * other cache handlers are called in between. */
+	const unsigned char *(*cache_get_ref)(DC_CACHE *cache,
+				const struct timeval *now,
+				const unsigned char *session_id,
+				unsigned int session_id_len,
+				unsigned int *len);
+	void		(*cache_release)(DC_CACHE *cache);
+} DC_CACHE_EXT_cb;
+
+/* The policies the builtin cache can use to choose which session to evict
+ * when it is full, see DC_SERVER_set_default_cache_ex(). */
+typedef enum {
+	DC_CACHE_EVICT_EXPIRY,	/* the session due to expire soonest */
+	DC_CACHE_EVICT_LRU,	/* the least-recently used session */
+	DC_CACHE_EVICT_CLOCK,	/* CLOCK (second-chance FIFO) */
+	DC_CACHE_EVICT_SIEVE	/* SIEVE (FIFO with a lazily sweeping hand) */
+} DC_CACHE_EVICT;
+
+/* A server's forwarding callback, see DC_SERVER_set_forward(). 'op' is the
+ * operation (DC_OP_ADD, DC_OP_GET, DC_OP_REMOVE or DC_OP_HAVE), 'data' is its
+ * request data, and its result may be no larger than 'room' bytes. */
+typedef int (*DC_SERVER_forward_cb)(void *fwd_arg, DC_CLIENT *clnt, int op,
+			const unsigned char *data, unsigned int data_len,
+			unsigned int room);
+
 /* Flags for use in DC_SERVER_new_client() */
 #define DC_CLIENT_FLAG_NOFREE_CONN		(unsigned int)0x0001
 #define DC_CLIENT_FLAG_IN_SERVER		(unsigned int)0x0002
@@ -84,6 +160,13 @@ typedef struct st_DC_CACHE_cb {
  * must have been called prior to creating a server with this function. */
 DC_SERVER *DC_SERVER_new(unsigned int max_sessions);
 
+/* As DC_SERVER_new(), but the cache's storage can also be bounded by a memory
+ * budget in bytes. Either value may be zero (but not both), in which case the
+ * cache implementation sizes itself from the other. A non-zero 'max_memory'
+ * requires a cache implementation with a 'cache_new_ex' handler. */
+DC_SERVER *DC_SERVER_new_ex(unsigned int max_sessions,
+				unsigned long max_memory);
+
 /* Destroy a session cache server (NB: all clients that aren't created with
  * DC_CLIENT_FLAG_IN_SERVER should be destroyed in advance). */
 void DC_SERVER_free(DC_SERVER *ctx);
@@ -94,15 +177,49 @@ void DC_SERVER_free(DC_SERVER *ctx);
  * implementation won't be linked into the application. */
 int DC_SERVER_set_default_cache(void);
 
+/* As DC_SERVER_set_default_cache(), but selects the policy the builtin cache
+ * uses to evict sessions when it is full. "get" and "have" operations count
+ * as uses of a session for the LRU, CLOCK and SIEVE policies, and only one
+ * session is evicted for each one that needs room. The default is
+ * DC_CACHE_EVICT_EXPIRY. */
+int DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT policy);
+
+/* As DC_SERVER_set_default_cache_ex(), but caches are created in anonymous
+ * shared memory so that processes forked after DC_SERVER_new() all use the same
+ * cache. The cache is split into 'stripes' partitions, chosen by hashing the
+ * session id, each with its own process-shared lock. Where robust mutexes are
+ * available, a partition whose lock was held by a process that died is emptied
+ * rather than left inconsistent. Returns zero if the platform can't support
+ * this. */
+int DC_SERVER_set_shared_cache(DC_CACHE_EVICT policy, unsigned int stripes);
+
 /* This function causes a custom cache implementation to be used in all
  * "DC_SERVER"s created. */
 int DC_SERVER_set_cache(const DC_CACHE_cb *impl);
 
+/* As DC_SERVER_set_cache(), but with optional handlers too. 'ext' may be NULL,
+ * otherwise it is copied so it needn't outlive the call. */
+int DC_SERVER_set_cache_ex(const DC_CACHE_cb *impl,
+				const DC_CACHE_EXT_cb *ext);
+
+/* Returns the cache implementation that "DC_SERVER"s will be created with,
+ * or NULL if none has been set. This allows a custom implementation to wrap
+ * the builtin one (eg. to partition sessions across several caches). */
+const DC_CACHE_cb *DC_SERVER_get_cache(void);
+
+/* Returns the optional handlers of that implementation, those it didn't
+ * provide are NULL. Returns NULL if no implementation has been set. */
+const DC_CACHE_EXT_cb *DC_SERVER_get_cache_ex(void);
+
 /* Find out the number of session items currently stored in the server.
  * Automatically flushes expired cache items before deciding the result. */
 unsigned int DC_SERVER_items_stored(DC_SERVER *ctx,
 				const struct timeval *now);
 
+/* Get the cache implementation's statistics. Returns zero if the cache
+ * implementation doesn't support them. */
+int DC_SERVER_get_stats(DC_SERVER *ctx, DC_CACHE_STATS *stats);
+
 /* Reset the server's counter of cache operations to zero. */
 void DC_SERVER_reset_operations(DC_SERVER *ctx);
 
@@ -110,6 +227,33 @@ void DC_SERVER_reset_operations(DC_SERVER *ctx);
  * call to 'DC_SERVER_reset_operations'. */
 unsigned long DC_SERVER_num_operations(DC_SERVER *ctx);
 
+/* Gives the server a callback that sees each cache operation its clients ask
+ * for (including each one in a batch) before its own cache does, eg. to pass
+ * operations to whichever thread owns a session. The callback returns zero to
+ * leave the operation to the server, or -1 to fail the client's request. If it
+ * returns 1 it has taken the operation, and must later pass the result to
+ * DC_SERVER_forwarded(). Until then the client's later requests wait, and the
+ * client mustn't be destroyed other than by DC_SERVER_clients_io() or
+ * DC_SERVER_free(). A NULL 'fwd' removes the callback. */
+void DC_SERVER_set_forward(DC_SERVER *ctx, DC_SERVER_forward_cb fwd,
+				void *fwd_arg);
+
+/* Performs an operation, as given to a forwarding callback, on the server's
+ * own cache. The result is written to 'result', which has room for 'room'
+ * bytes. Returns the length of the result, zero if the request is corrupt, or
+ * -1 if the result won't fit (in which case nothing was done). */
+int DC_SERVER_do_op(DC_SERVER *ctx, const struct timeval *now, int op,
+				const unsigned char *data, unsigned int data_len,
+				unsigned char *result, unsigned int room);
+
+/* Completes an operation taken by the forwarding callback, with a result as
+ * returned by DC_SERVER_do_op(). Any other operations in the same batch are
+ * carried on with, and the response is sent once the request is complete.
+ * Returns zero if the client failed (or died while it waited), in which case
+ * it should be destroyed as for DC_SERVER_process_client(). */
+int DC_SERVER_forwarded(DC_CLIENT *clnt, const struct timeval *now,
+				const unsigned char *result, int result_len);
+
 /* Create a new client for a server */
 DC_CLIENT *DC_SERVER_new_client(DC_SERVER *ctx,
 				NAL_CONNECTION *conn,
@@ -41,6 +41,9 @@ typedef struct st_NAL_BUFFER NAL_BUFFER;
 /********************/
 
 void		NAL_config_set_nagle(int enabled);
+int		NAL_config_set_reuseport(int enabled);
+int		NAL_config_set_accept_batch(unsigned int max);
+int		NAL_config_set_uring(int enabled);
 
 /*********************/
 /* Address functions */
@@ -56,6 +59,7 @@ int		NAL_ADDRESS_set_def_buffer_size(NAL_ADDRESS *addr,
 				unsigned int def_buffer_size);
 int		NAL_ADDRESS_can_connect(const NAL_ADDRESS *addr);
 int		NAL_ADDRESS_can_listen(const NAL_ADDRESS *addr);
+int		NAL_ADDRESS_can_reuseport(const NAL_ADDRESS *addr);
 
 /**********************/
 /* Selector functions */
@@ -68,9 +72,12 @@ int		NAL_SELECTOR_select(NAL_SELECTOR *sel,
 				unsigned long usec_timeout,
 				int use_timeout);
 unsigned int	NAL_SELECTOR_num_objects(const NAL_SELECTOR *sel);
+NAL_CONNECTION *NAL_SELECTOR_get_ready(NAL_SELECTOR *sel);
 /* implementation-specific constructors */
 NAL_SELECTOR *	NAL_SELECTOR_new_fdselect(void);
 NAL_SELECTOR *	NAL_SELECTOR_new_fdpoll(void);
+NAL_SELECTOR *	NAL_SELECTOR_new_epoll(void);
+NAL_SELECTOR *	NAL_SELECTOR_new_uring(void);
 
 /********************************/
 /* Listener functions (general) */
@@ -157,6 +164,19 @@ unsigned int 	NAL_BUFFER_read(NAL_BUFFER *buf,
 				unsigned int size);
 unsigned int	NAL_BUFFER_transfer(NAL_BUFFER *dest, NAL_BUFFER *src,
 				unsigned int max);
+/* The buffer's contents (and its free space) can wrap around the end of its
+ * storage, so each is described by up to NAL_BUFFER_IOV_MAX segments. These
+ * return the number of segments filled in (zero if there's nothing), and
+ * never move any data, unlike NAL_BUFFER_data() and NAL_BUFFER_write_ptr(). */
+#define NAL_BUFFER_IOV_MAX	2
+typedef struct st_NAL_BUFFER_IOV {
+	unsigned char *ptr;
+	unsigned int len;
+} NAL_BUFFER_IOV;
+unsigned int	NAL_BUFFER_data_iov(const NAL_BUFFER *buf,
+				NAL_BUFFER_IOV *iov);
+unsigned int	NAL_BUFFER_unused_iov(const NAL_BUFFER *buf,
+				NAL_BUFFER_IOV *iov);
 
 /***************** WARNING START ********************/
 /* These functions manipulate internal data directly and are to be used with
@@ -202,6 +202,8 @@ void NAL_ADDRESS_vtable_link(NAL_ADDRESS_vtable *vt);
 /* vtables */
 const NAL_SELECTOR_vtable *sel_fdselect(void);
 const NAL_SELECTOR_vtable *sel_fdpoll(void);
+const NAL_SELECTOR_vtable *sel_epoll(void);
+const NAL_SELECTOR_vtable *sel_uring(void);
 
 /* The "type" of a selector */
 typedef enum {
@@ -213,13 +215,17 @@ typedef enum {
 	NAL_SELECTOR_TYPE_FDSELECT,
 	/* poll(2) */
 	NAL_SELECTOR_TYPE_FDPOLL,
+	/* epoll(7) */
+	NAL_SELECTOR_TYPE_EPOLL,
+	/* epoll(7) readiness, with I/O batched through io_uring(7) */
+	NAL_SELECTOR_TYPE_URING,
 	/* Custom implementation types start here */
 	NAL_SELECTOR_TYPE_CUSTOM = 100
 } NAL_SELECTOR_TYPE;
 
 /* general-purpose "ctrl" commands are scoped as follows */
 typedef enum {
-	/* Control commands specific to fdselect and fdpoll start here */
+	/* Control commands specific to fd-based selectors start here */
 	NAL_SELECTOR_CTRL_FD = 0x0100,
 	/* Custom commands start here */
 	NAL_SELECTOR_CTRL_CUSTOM = 0x0800
@@ -113,6 +113,15 @@
 #if defined(HAVE_NETINET_TCP_H)
 #include <netinet/tcp.h>
 #endif
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#endif
+#if defined(HAVE_SYS_UIO_H)
+#include <sys/uio.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
 #if defined(HAVE_SYS_POLL_H)
 #include <sys/poll.h>
 #endif
@@ -134,6 +143,12 @@
 #if defined(HAVE_SYS_UN_H)
 #include <sys/un.h>
 #endif
+#if defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+#if defined(HAVE_SCHED_H)
+#include <sched.h>
+#endif
 #if defined(HAVE_SYS_WAIT_H)
 #include <sys/wait.h>
 #endif
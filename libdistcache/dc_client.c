@@ -37,9 +37,25 @@
 /***************************************/
 /* The "DC_CTX" structure details */
 
+/* An asynchronous request, queued until it's written to the plug and then
+ * outstanding until its response arrives. */
+typedef struct st_DC_ASYNC DC_ASYNC;
+struct st_DC_ASYNC {
+	DC_ASYNC *next;
+	unsigned long request_uid;
+	DC_CMD cmd;
+	DC_CTX_async_cb cb;
+	void *cb_arg;
+	/* The request data, freed once it's been written */
+	unsigned char *data;
+	unsigned int data_len;
+};
+
 struct st_DC_CTX {
 	NAL_ADDRESS *address;
 	DC_PLUG *plug;
+	/* The connection underneath 'plug' */
+	NAL_CONNECTION *conn;
 	unsigned int flags;
 	pid_t current_pid;
 	/* State for the DC_CTX_reget_session() handling */
@@ -52,42 +68,113 @@ struct st_DC_CTX {
 	/* Storage for sent data (to go to the plug) */
 	unsigned char send_data[DC_MAX_TOTAL_DATA];
 	unsigned int send_data_len;
+	/* The batch being queued, its entries start after room for the count */
+	unsigned char batch_data[DC_MAX_TOTAL_DATA];
+	unsigned int batch_data_len, batch_num;
+	/* The results of the last batch still to be walked, in 'read_data' */
+	const unsigned char *batch_res;
+	unsigned int batch_res_len, batch_res_num;
+	/* The caller's selector, if we're being driven asynchronously */
+	NAL_SELECTOR *sel;
+	/* Our own selector for blocking operations, kept between them */
+	NAL_SELECTOR *tsel;
+	/* A disconnected plug (and the connection underneath it) kept so that
+	 * connecting again doesn't have to allocate anything */
+	DC_PLUG *spare;
+	NAL_CONNECTION *spare_conn;
+	/* Timeouts in milliseconds (zero for none) for establishing connections
+	 * and for whole blocking operations, and a one-off override of the
+	 * latter for the next operation. */
+	unsigned long connect_msecs, op_msecs, call_msecs;
+	int call_set;
+	/* Why the last blocking operation failed */
+	int error;
+	/* The request_uid for our next request. Responses are only ever matched
+	 * against our own requests, so this needn't be shared with other
+	 * contexts (and as it isn't, contexts in different threads don't race
+	 * on it). */
+	unsigned long next_uid;
+	/* Asynchronous requests waiting to be written, then those waiting for
+	 * a response (both in order) */
+	DC_ASYNC *unsent, *unsent_tail;
+	DC_ASYNC *sent, *sent_tail;
+	unsigned int async_num;
 };
 
 /****************************************/
 /* Internal networking helper functions */
 
-static DC_PLUG *int_temp_connect(DC_CTX *ctx)
+/* Closes a plug's connection, keeping the plug for reuse if we don't already
+ * have a spare */
+static void int_temp_close(DC_CTX *ctx, DC_PLUG *plug, NAL_CONNECTION *conn)
+{
+	if(ctx->spare) {
+		DC_PLUG_free(plug);
+		return;
+	}
+	DC_PLUG_reset(plug);
+	ctx->spare = plug;
+	ctx->spare_conn = conn;
+}
+
+static DC_PLUG *int_temp_connect(DC_CTX *ctx, NAL_CONNECTION **pconn)
 {
 	NAL_CONNECTION *conn;
 	DC_PLUG *plug;
-	if(((conn = NAL_CONNECTION_new()) != NULL) &&
-			NAL_CONNECTION_create(conn, ctx->address) &&
-			((plug = DC_PLUG_new(conn,
-				DC_PLUG_FLAG_TO_SERVER)) != NULL))
-		return plug;
-	if(conn)
-		NAL_CONNECTION_free(conn);
-	return NULL;
+	if(ctx->spare) {
+		plug = ctx->spare;
+		conn = ctx->spare_conn;
+		ctx->spare = NULL;
+	} else {
+		if((conn = NAL_CONNECTION_new()) == NULL)
+			return NULL;
+		if((plug = DC_PLUG_new(conn, DC_PLUG_FLAG_TO_SERVER)) == NULL) {
+			NAL_CONNECTION_free(conn);
+			return NULL;
+		}
+	}
+	if(!NAL_CONNECTION_create(conn, ctx->address)) {
+		int_temp_close(ctx, plug, conn);
+		return NULL;
+	}
+	*pconn = conn;
+	return plug;
 }
 
-static int int_connect(DC_CTX *ctx)
+static void int_disconnect(DC_CTX *ctx)
 {
-	/* Cleanup any previous connection */
 	if(ctx->plug) {
-		DC_PLUG_free(ctx->plug);
+		int_temp_close(ctx, ctx->plug, ctx->conn);
 		ctx->plug = NULL;
 	}
-	if((ctx->plug = int_temp_connect(ctx)) == NULL)
+}
+
+static int int_connect(DC_CTX *ctx)
+{
+	/* Cleanup any previous connection */
+	int_disconnect(ctx);
+	if((ctx->plug = int_temp_connect(ctx, &ctx->conn)) == NULL)
 		return 0;
 	return 1;
 }
 
-static int int_netloop(DC_PLUG *plug, NAL_SELECTOR *sel)
+/* Returns zero for an I/O error, or -1 if 'deadline' (if any) passes first */
+static int int_netloop(DC_PLUG *plug, NAL_SELECTOR *sel,
+			const struct timeval *deadline)
 {
 	int ret;
+	struct timeval now;
+	unsigned long usecs;
 reselect:
-	ret = NAL_SELECTOR_select(sel, 0, 0);
+	if(deadline) {
+		SYS_gettime(&now);
+		if(SYS_timecmp(&now, deadline) >= 0)
+			return -1;
+		usecs = (unsigned long)(deadline->tv_sec - now.tv_sec) *
+				1000000 + deadline->tv_usec - now.tv_usec;
+		ret = NAL_SELECTOR_select(sel, usecs, 1);
+	} else
+		ret = NAL_SELECTOR_select(sel, 0, 0);
 	if((ret < 0) && (errno != EINTR))
 		return 0;
 	if(ret <= 0)
@@ -97,25 +184,105 @@ reselect:
 	return 1;
 }
 
+/* The deadline for the next network wait is the operation's, or the
+ * connection's if that's sooner and the connection isn't yet established. */
+static const struct timeval *int_deadline(const struct timeval *op,
+			const struct timeval *conn_deadline,
+			const NAL_CONNECTION *conn)
+{
+	if(!conn_deadline || NAL_CONNECTION_is_established(conn))
+		return op;
+	if(!op || (SYS_timecmp(conn_deadline, op) < 0))
+		return conn_deadline;
+	return op;
+}
+
+/* We encode "add"s as;
+ *   4 bytes            (timeout)
+ *   4 bytes            (id_len)
+ *   'id_len' bytes     (id_data)
+ *   'sess_len' bytes   (sess_data)
+ * and the caller makes sure 'ptr' has room for all of that. */
+static int int_encode_add(unsigned char *ptr,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs)
+{
+	unsigned int check = 8;
+	if(!NAL_encode_uint32(&ptr, &check, timeout_msecs) ||
+			!NAL_encode_uint32(&ptr, &check, id_len))
+		return 0;
+	assert(check == 0);
+	/* Copy in the session-id and the session data */
+	SYS_memcpy_n(unsigned char, ptr, id_data, id_len);
+	ptr += id_len;
+	SYS_memcpy_n(unsigned char, ptr, sess_data, sess_len);
+	return 1;
+}
+
 /**************************************************************************
  * The core "operation" function. Takes a command type and input data and *
  * generates return data. Handles generating request frames, interpreting *
  * response frames, and all network logic.                                */
-static unsigned long global_uid = 1;
+/* If there's a connect timeout, sets 'tv' to the deadline for a connection
+ * that's being made now. */
+static const struct timeval *int_conn_deadline(const DC_CTX *ctx,
+			struct timeval *tv)
+{
+	if(!ctx->connect_msecs)
+		return NULL;
+	SYS_gettime(tv);
+	SYS_timeadd(tv, tv, ctx->connect_msecs);
+	return tv;
+}
 
 static int int_transact(DC_CTX *ctx, DC_CMD cmd)
 {
 	DC_PLUG *plug;
-	NAL_SELECTOR *sel;
+	NAL_CONNECTION *conn;
 	DC_CMD check_cmd;
 	const unsigned char *ret_data;
 	unsigned int ret_len;
 	pid_t pid;
-	int toreturn = 0;
-	int retried = 0;
+	int ret, toreturn = 0;
+	int retried = 0, forked = 0;
+	/* Deadlines for the whole operation and for establishing a connection
+	 * made during it */
+	struct timeval op_tv, conn_tv;
+	const struct timeval *op_deadline = NULL, *conn_deadline = NULL;
+	unsigned long msecs = ctx->op_msecs;
 	/* The request_uid for this transaction */
-	unsigned long check_uid, request_uid = global_uid++;
+	unsigned long check_uid, request_uid = ctx->next_uid++;
 
+	ctx->error = DC_CTX_ERR_FAILED;
+	/* A per-call timeout only applies to this one operation */
+	if(ctx->call_set) {
+		msecs = ctx->call_msecs;
+		ctx->call_set = 0;
+	}
+	/* The plug belongs to the caller's selector when we're being driven
+	 * asynchronously, so blocking operations aren't possible. Nor can they
+	 * be interleaved with outstanding asynchronous requests. */
+	if(ctx->sel || ctx->async_num)
+		return 0;
+	/* Our selector may be kernel state (eg. epoll) that a child process
+	 * shares with its parent, so the child needs its own. Nothing is left
+	 * registered with it between operations, so this can't disturb the
+	 * parent. */
+	if((pid = SYS_getpid()) != ctx->current_pid) {
+		NAL_SELECTOR_free(ctx->tsel);
+		if((ctx->tsel = NAL_SELECTOR_new()) == NULL)
+			return 0;
+		ctx->current_pid = pid;
+		forked = 1;
+	}
+	if(msecs) {
+		SYS_gettime(&op_tv);
+		SYS_timeadd(&op_tv, &op_tv, msecs);
+		op_deadline = &op_tv;
+	}
 	/* This is the point where if the previous operation was a "get" but
 	 * this one is not, we will cancel our "last_get" state. This means that
 	 * even if something fails here, a "reget" call to followup on the last
@@ -124,32 +291,33 @@ static int int_transact(DC_CTX *ctx, DC_CMD cmd)
 	 * doesn't work! :-) */
 	if(cmd != DC_CMD_GET)
 		ctx->last_op_was_get = 0;
-	/* Reset our buffer for incoming data */
+	/* Reset our buffer for incoming data, and with it any batch results */
 	ctx->read_data_len = 0;
+	ctx->batch_res_num = 0;
 	/* Handle connection logic based on flags */
 	if(ctx->flags & DC_CTX_FLAG_PERSISTENT) {
-		/* (re)connect due to 'pid' or 'late' checks? */
-		if(((ctx->flags & DC_CTX_FLAG_PERSISTENT_PIDCHECK) &&
-				((pid = SYS_getpid()) != ctx->current_pid)) ||
-				((ctx->flags & DC_CTX_FLAG_PERSISTENT_LATE)
-					&& !ctx->plug)) {
+		/* (re)connect due to the 'pid' check, or because we're 'late' or
+		 * a previous operation dropped the connection? */
+		if((forked && (ctx->flags & DC_CTX_FLAG_PERSISTENT_PIDCHECK)) ||
+				!ctx->plug) {
 			if(!int_connect(ctx))
 				return 0;
+			conn_deadline = int_conn_deadline(ctx, &conn_tv);
 		}
 		plug = ctx->plug;
+		conn = ctx->conn;
 	} else {
 		/* Get a temporary connection */
-		if((plug = int_temp_connect(ctx)) == NULL)
+		if((plug = int_temp_connect(ctx, &conn)) == NULL)
 			return 0;
+		conn_deadline = int_conn_deadline(ctx, &conn_tv);
 	}
-	/* Get our selector ready */
-	if((sel = NAL_SELECTOR_new()) == NULL)
-		goto err;
-	if(!DC_PLUG_to_select(plug, sel))
+	if(!DC_PLUG_to_select(plug, ctx->tsel))
 		goto err;
 	/* Do the network loop. This writes "send_data" into the
 	 * plug and hopes for a response until either;
 	 *  - I/O fails,
+	 *  - a deadline passes,
 	 *  - we receive a "complete" response (if this happens before the
 	 *    request is fully sent, it's an error anyway), or
 	 *  - we have decoding failures (eg. mismatched request_uids, corrupt
@@ -162,7 +330,10 @@ restart_after_net_err:
 			!DC_PLUG_commit(plug)))
 		goto err;
 reselect:
-	if(!int_netloop(plug, sel))
+	if((ret = int_netloop(plug, ctx->tsel, int_deadline(op_deadline,
+					conn_deadline, conn))) < 0)
+		goto timeout;
+	if(!ret)
 		goto net_err;
 	if(!DC_PLUG_read(plug, 0, &check_uid, &check_cmd,
 				&ret_data, &ret_len))
@@ -174,32 +345,191 @@ reselect:
 	SYS_memcpy_n(unsigned char, ctx->read_data, ret_data, ret_len);
 	/* Success */
 	DC_PLUG_consume(plug);
+	ctx->error = DC_CTX_ERR_NONE;
 	toreturn = 1;
 err:
 	/* Data sent (or the whole operation blew up), so reset this */
 	ctx->send_data_len = 0;
 	/* Cleanup */
 	if(!(ctx->flags & DC_CTX_FLAG_PERSISTENT) && plug)
-		DC_PLUG_free(plug);
+		int_temp_close(ctx, plug, conn);
 	else if(plug)
 		DC_PLUG_from_select(plug);
-	if(sel)
-		NAL_SELECTOR_free(sel);
 	return toreturn;
+timeout:
+	ctx->error = DC_CTX_ERR_TIMEOUT;
+	/* The response may still turn up later, so a persistent connection
+	 * can't be trusted for the next operation. Drop it. */
+	if(ctx->flags & DC_CTX_FLAG_PERSISTENT) {
+		int_disconnect(ctx);
+		plug = NULL;
+	}
+	goto err;
 net_err:
-	if(retried || !(ctx->flags & DC_CTX_FLAG_PERSISTENT) ||
-			!(ctx->flags & DC_CTX_FLAG_PERSISTENT_RETRY))
+	if(!(ctx->flags & DC_CTX_FLAG_PERSISTENT))
+		goto err;
+	if(retried || !(ctx->flags & DC_CTX_FLAG_PERSISTENT_RETRY)) {
+		/* The connection is no use to the next operation either, which
+		 * will make a new one */
+		int_disconnect(ctx);
+		plug = NULL;
 		goto err;
+	}
 	/* retry */
 	retried = 1;
+	plug = NULL;
 	if(!int_connect(ctx))
 		goto err;
 	plug = ctx->plug;
-	if(!DC_PLUG_to_select(plug, sel))
+	conn = ctx->conn;
+	conn_deadline = int_conn_deadline(ctx, &conn_tv);
+	if(!DC_PLUG_to_select(plug, ctx->tsel))
 		goto err;
 	goto restart_after_net_err;
 }
 
+/*******************************************/
+/* Internal asynchronous operation helpers */
+
+static void int_async_free(DC_ASYNC *a)
+{
+	if(a->data)
+		SYS_free(unsigned char, a->data);
+	SYS_free(DC_ASYNC, a);
+}
+
+static void int_async_free_list(DC_ASYNC *a)
+{
+	DC_ASYNC *next;
+	while(a) {
+		next = a->next;
+		int_async_free(a);
+		a = next;
+	}
+}
+
+/* Drops the connection and fails every request, written or not. A new
+ * connection is made when the next request is submitted. */
+static void int_async_abort(DC_CTX *ctx)
+{
+	DC_ASYNC *a, *next;
+	int_disconnect(ctx);
+	/* Detach the lists first, as callbacks can submit new requests */
+	if((a = ctx->sent) != NULL)
+		ctx->sent_tail->next = ctx->unsent;
+	else
+		a = ctx->unsent;
+	ctx->sent = ctx->sent_tail = ctx->unsent = ctx->unsent_tail = NULL;
+	ctx->async_num = 0;
+	while(a) {
+		next = a->next;
+		a->cb(a->cb_arg, -1, NULL, 0);
+		int_async_free(a);
+		a = next;
+	}
+}
+
+/* Writes queued requests into the plug until it's busy, the network I/O
+ * happens the next time the caller's selector says it can. */
+static void int_async_flush(DC_CTX *ctx)
+{
+	DC_ASYNC *a;
+	while((a = ctx->unsent) != NULL) {
+		if(!DC_PLUG_write(ctx->plug, 0, a->request_uid, a->cmd,
+					a->data, a->data_len))
+			/* Still busy with the previous request */
+			return;
+		if(!DC_PLUG_commit(ctx->plug)) {
+			DC_PLUG_rollback(ctx->plug);
+			return;
+		}
+		SYS_free(unsigned char, a->data);
+		a->data = NULL;
+		/* Move it to the list awaiting responses */
+		if((ctx->unsent = a->next) == NULL)
+			ctx->unsent_tail = NULL;
+		a->next = NULL;
+		if(ctx->sent_tail)
+			ctx->sent_tail->next = a;
+		else
+			ctx->sent = a;
+		ctx->sent_tail = a;
+	}
+}
+
+/* Queues a new request, returning where the caller should put its 'len' bytes
+ * of request data before calling int_async_flush(). */
+static unsigned char *int_async_new(DC_CTX *ctx, DC_CMD cmd,
+			unsigned int len, DC_CTX_async_cb cb, void *cb_arg)
+{
+	DC_ASYNC *a;
+	if(!ctx->sel || !cb || !len || (len > DC_MAX_TOTAL_DATA))
+		return NULL;
+	/* (Re)connect if need be, straight into the caller's selector */
+	if(!ctx->plug) {
+		if(!int_connect(ctx))
+			return NULL;
+		if(!DC_PLUG_to_select(ctx->plug, ctx->sel)) {
+			int_disconnect(ctx);
+			return NULL;
+		}
+	}
+	if((a = SYS_malloc(DC_ASYNC, 1)) == NULL)
+		return NULL;
+	if((a->data = SYS_malloc(unsigned char, len)) == NULL) {
+		SYS_free(DC_ASYNC, a);
+		return NULL;
+	}
+	a->next = NULL;
+	a->request_uid = ctx->next_uid++;
+	a->cmd = cmd;
+	a->cb = cb;
+	a->cb_arg = cb_arg;
+	a->data_len = len;
+	if(ctx->unsent_tail)
+		ctx->unsent_tail->next = a;
+	else
+		ctx->unsent = a;
+	ctx->unsent_tail = a;
+	ctx->async_num++;
+	return a->data;
+}
+
+static int int_async_id(DC_CTX *ctx, DC_CMD cmd,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg)
+{
+	unsigned char *ptr;
+	assert(id_data && id_len && (id_len <= DC_MAX_TOTAL_DATA));
+	if((ptr = int_async_new(ctx, cmd, id_len, cb, cb_arg)) == NULL)
+		return 0;
+	SYS_memcpy_n(unsigned char, ptr, id_data, id_len);
+	int_async_flush(ctx);
+	return 1;
+}
+
+/* Interprets a response the same way as the blocking functions do */
+static int int_async_result(DC_CMD cmd, const unsigned char *data,
+			unsigned int len)
+{
+	switch(cmd) {
+	case DC_CMD_GET:
+		return (len >= 5);
+	case DC_CMD_HAVE:
+		if(len != 1)
+			break;
+		if(data[0] == DC_ERR_OK)
+			return 1;
+		if(data[0] == DC_ERR_NOTOK)
+			return 0;
+		break;
+	default:
+		return ((len == 1) && (data[0] == DC_ERR_OK));
+	}
+	return -1;
+}
+
 /***************************/
 /* Exposed (API) functions */
 
@@ -213,8 +543,21 @@ DC_CTX *DC_CTX_new(const char *target, unsigned int flags)
 	ctx->plug = NULL;
 	ctx->last_op_was_get = ctx->last_get_id_len = 0;
 	ctx->read_data_len = ctx->send_data_len = 0;
-	/* Construct the target address */
-	if(((ctx->address = NAL_ADDRESS_new()) == NULL) ||
+	ctx->batch_data_len = DC_BATCH_COUNT_SIZE;
+	ctx->batch_num = ctx->batch_res_num = 0;
+	ctx->sel = NULL;
+	ctx->address = NULL;
+	ctx->spare = NULL;
+	ctx->conn = NULL;
+	ctx->connect_msecs = ctx->op_msecs = ctx->call_msecs = 0;
+	ctx->call_set = 0;
+	ctx->error = DC_CTX_ERR_NONE;
+	ctx->next_uid = 1;
+	ctx->unsent = ctx->unsent_tail = ctx->sent = ctx->sent_tail = NULL;
+	ctx->async_num = 0;
+	/* Construct our selector and the target address */
+	if(((ctx->tsel = NAL_SELECTOR_new()) == NULL) ||
+			((ctx->address = NAL_ADDRESS_new()) == NULL) ||
 			!NAL_ADDRESS_create(ctx->address, target,
 				DC_CTX_BUFFER_SIZE) ||
 			!NAL_ADDRESS_can_connect(ctx->address))
@@ -232,6 +575,10 @@ err:
 			NAL_ADDRESS_free(ctx->address);
 		if(ctx->plug)
 			DC_PLUG_free(ctx->plug);
+		if(ctx->spare)
+			DC_PLUG_free(ctx->spare);
+		if(ctx->tsel)
+			NAL_SELECTOR_free(ctx->tsel);
 		SYS_free(DC_CTX, ctx);
 	}
 	return NULL;
@@ -239,8 +586,14 @@ err:
 
 void DC_CTX_free(DC_CTX *ctx)
 {
+	/* Outstanding asynchronous requests are dropped without callbacks */
+	int_async_free_list(ctx->sent);
+	int_async_free_list(ctx->unsent);
 	if(ctx->plug)
 		DC_PLUG_free(ctx->plug);
+	if(ctx->spare)
+		DC_PLUG_free(ctx->spare);
+	NAL_SELECTOR_free(ctx->tsel);
 	NAL_ADDRESS_free(ctx->address);
 	SYS_free(DC_CTX, ctx);
 }
@@ -252,32 +605,17 @@ int DC_CTX_add_session(DC_CTX *ctx,
 			unsigned int sess_len,
 			unsigned long timeout_msecs)
 {
-	unsigned char *ptr;
-	unsigned int check;
 	/* Make sure the input is sensible */
 	assert(id_data && sess_data && id_len && sess_len &&
 			(id_len <= DC_MAX_TOTAL_DATA) &&
 			(timeout_msecs > DC_MIN_TIMEOUT));
-	/* We encode "add"s as;
-	 *   4 bytes            (timeout)
-	 *   4 bytes            (id_len)
-	 *   'id_len' bytes     (id_data)
-	 *   'sess_len' bytes   (sess_data) */
-	ctx->send_data_len = id_len + sess_len + 8;
 	/* Check this isn't too big */
-	if(ctx->send_data_len > DC_MAX_TOTAL_DATA)
+	if(id_len + sess_len + 8 > DC_MAX_TOTAL_DATA)
 		return 0;
-	ptr = ctx->send_data;
-	check = ctx->send_data_len;
-	if(!NAL_encode_uint32(&ptr, &check, timeout_msecs) ||
-			!NAL_encode_uint32(&ptr, &check, id_len))
+	if(!int_encode_add(ctx->send_data, id_data, id_len, sess_data,
+				sess_len, timeout_msecs))
 		return 0;
-	assert((check + 8) == ctx->send_data_len);
-	assert((ctx->send_data + 8) == ptr);
-	/* Copy in the session-id and the session data */
-	SYS_memcpy_n(unsigned char, ptr, id_data, id_len);
-	ptr += id_len;
-	SYS_memcpy_n(unsigned char, ptr, sess_data, sess_len);
+	ctx->send_data_len = id_len + sess_len + 8;
 	/* Do the network operation */
 	if(!int_transact(ctx, DC_CMD_ADD))
 		/* The transaction itself failed. */
@@ -405,3 +743,289 @@ int DC_CTX_has_session(DC_CTX *ctx,
 	}
 	return -1;
 }
+
+/* Appends an entry header to the batch being queued, returning where the
+ * caller should put the 'len' bytes of the operation's request data. */
+static unsigned char *int_batch_entry(DC_CTX *ctx, DC_OP op, unsigned int len)
+{
+	unsigned char *ptr = ctx->batch_data + ctx->batch_data_len;
+	unsigned int check = DC_BATCH_ENTRY_SIZE;
+	if(ctx->batch_data_len + DC_BATCH_ENTRY_SIZE + len > DC_MAX_TOTAL_DATA)
+		return NULL;
+	if(!NAL_encode_char(&ptr, &check, (unsigned char)op) ||
+			!NAL_encode_uint32(&ptr, &check, len))
+		return NULL;
+	ctx->batch_data_len += DC_BATCH_ENTRY_SIZE + len;
+	ctx->batch_num++;
+	return ptr;
+}
+
+static int int_batch_id(DC_CTX *ctx, DC_OP op,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	unsigned char *ptr;
+	assert(id_data && id_len && (id_len <= DC_MAX_TOTAL_DATA));
+	if((ptr = int_batch_entry(ctx, op, id_len)) == NULL)
+		return 0;
+	SYS_memcpy_n(unsigned char, ptr, id_data, id_len);
+	return 1;
+}
+
+int DC_CTX_batch_add_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs)
+{
+	unsigned char *ptr;
+	assert(id_data && sess_data && id_len && sess_len &&
+			(id_len <= DC_MAX_TOTAL_DATA) &&
+			(timeout_msecs > DC_MIN_TIMEOUT));
+	/* The entry is encoded just like DC_CTX_add_session()'s request */
+	if((id_len + sess_len + 8 > DC_MAX_TOTAL_DATA) || ((ptr =
+			int_batch_entry(ctx, DC_OP_ADD,
+				id_len + sess_len + 8)) == NULL))
+		return 0;
+	return int_encode_add(ptr, id_data, id_len, sess_data, sess_len,
+				timeout_msecs);
+}
+
+int DC_CTX_batch_remove_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	return int_batch_id(ctx, DC_OP_REMOVE, id_data, id_len);
+}
+
+int DC_CTX_batch_get_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	return int_batch_id(ctx, DC_OP_GET, id_data, id_len);
+}
+
+int DC_CTX_batch_has_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	return int_batch_id(ctx, DC_OP_HAVE, id_data, id_len);
+}
+
+int DC_CTX_batch_send(DC_CTX *ctx)
+{
+	const unsigned char *ptr;
+	unsigned char *enc = ctx->batch_data;
+	unsigned int check = DC_BATCH_COUNT_SIZE, num = ctx->batch_num;
+	unsigned long done;
+	if(!num)
+		return 0;
+	if(!NAL_encode_uint32(&enc, &check, num))
+		return -1;
+	SYS_memcpy_n(unsigned char, ctx->send_data, ctx->batch_data,
+			ctx->batch_data_len);
+	ctx->send_data_len = ctx->batch_data_len;
+	/* The queue is emptied whether or not this works */
+	ctx->batch_data_len = DC_BATCH_COUNT_SIZE;
+	ctx->batch_num = 0;
+	if(!int_transact(ctx, DC_CMD_BATCH))
+		return -1;
+	ptr = ctx->read_data;
+	check = ctx->read_data_len;
+	if(!NAL_decode_uint32(&ptr, &check, &done) || (done > num))
+		return -1;
+	ctx->batch_res = ptr;
+	ctx->batch_res_len = check;
+	ctx->batch_res_num = done;
+	return (int)done;
+}
+
+int DC_CTX_batch_result(DC_CTX *ctx,
+			const unsigned char **sess_data,
+			unsigned int *sess_len)
+{
+	unsigned char op;
+	unsigned long len;
+	const unsigned char *data;
+	if(!ctx->batch_res_num)
+		return -1;
+	if(!NAL_decode_char(&ctx->batch_res, &ctx->batch_res_len, &op) ||
+			!NAL_decode_uint32(&ctx->batch_res,
+				&ctx->batch_res_len, &len) ||
+			!len || (len > ctx->batch_res_len)) {
+		/* Garbled, there's nothing more to trust */
+		ctx->batch_res_num = 0;
+		return -1;
+	}
+	data = ctx->batch_res;
+	ctx->batch_res += len;
+	ctx->batch_res_len -= len;
+	ctx->batch_res_num--;
+	switch(op) {
+	case DC_OP_GET:
+		/* As in DC_CTX_get_session(), short responses are errors */
+		if(len < 5)
+			return 0;
+		if(sess_data)
+			*sess_data = data;
+		if(sess_len)
+			*sess_len = len;
+		return 1;
+	case DC_OP_ADD:
+	case DC_OP_REMOVE:
+	case DC_OP_HAVE:
+		return ((len == 1) && (data[0] == DC_ERR_OK));
+	default:
+		break;
+	}
+	ctx->batch_res_num = 0;
+	return -1;
+}
+
+int DC_CTX_to_select(DC_CTX *ctx, NAL_SELECTOR *sel)
+{
+	if(!(ctx->flags & DC_CTX_FLAG_PERSISTENT) || ctx->sel)
+		return 0;
+	if(ctx->plug && !DC_PLUG_to_select(ctx->plug, sel))
+		return 0;
+	ctx->sel = sel;
+	return 1;
+}
+
+void DC_CTX_from_select(DC_CTX *ctx)
+{
+	if(!ctx->sel)
+		return;
+	if(ctx->plug)
+		DC_PLUG_from_select(ctx->plug);
+	ctx->sel = NULL;
+}
+
+int DC_CTX_async_add_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs,
+			DC_CTX_async_cb cb, void *cb_arg)
+{
+	unsigned char *ptr;
+	assert(id_data && sess_data && id_len && sess_len &&
+			(id_len <= DC_MAX_TOTAL_DATA) &&
+			(timeout_msecs > DC_MIN_TIMEOUT));
+	if((id_len + sess_len + 8 > DC_MAX_TOTAL_DATA) || ((ptr =
+			int_async_new(ctx, DC_CMD_ADD, id_len + sess_len + 8,
+				cb, cb_arg)) == NULL))
+		return 0;
+	/* This can't fail given the room, so the request is always good */
+	int_encode_add(ptr, id_data, id_len, sess_data, sess_len,
+			timeout_msecs);
+	int_async_flush(ctx);
+	return 1;
+}
+
+int DC_CTX_async_remove_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg)
+{
+	return int_async_id(ctx, DC_CMD_REMOVE, id_data, id_len, cb, cb_arg);
+}
+
+int DC_CTX_async_get_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg)
+{
+	return int_async_id(ctx, DC_CMD_GET, id_data, id_len, cb, cb_arg);
+}
+
+int DC_CTX_async_has_session(DC_CTX *ctx,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			DC_CTX_async_cb cb, void *cb_arg)
+{
+	return int_async_id(ctx, DC_CMD_HAVE, id_data, id_len, cb, cb_arg);
+}
+
+int DC_CTX_process(DC_CTX *ctx)
+{
+	DC_ASYNC *a, *prev;
+	unsigned long request_uid;
+	DC_CMD cmd;
+	const unsigned char *data;
+	unsigned int len;
+	int res;
+
+	if(!ctx->sel)
+		return 0;
+	if(!ctx->plug)
+		/* Nothing has been submitted since the last failure */
+		return 1;
+	if(!DC_PLUG_io(ctx->plug))
+		goto err;
+	while(DC_PLUG_read(ctx->plug, 0, &request_uid, &cmd, &data, &len)) {
+		/* The server answers in order, so this is normally the first */
+		for(prev = NULL, a = ctx->sent; a &&
+				(a->request_uid != request_uid);
+				prev = a, a = a->next)
+			;
+		if(!a || (a->cmd != cmd) || !len || (len > DC_MAX_TOTAL_DATA))
+			goto err;
+		if(prev)
+			prev->next = a->next;
+		else
+			ctx->sent = a->next;
+		if(ctx->sent_tail == a)
+			ctx->sent_tail = prev;
+		ctx->async_num--;
+		res = int_async_result(cmd, data, len);
+		if((cmd == DC_CMD_GET) && (res > 0))
+			a->cb(a->cb_arg, res, data, len);
+		else
+			a->cb(a->cb_arg, res, NULL, 0);
+		int_async_free(a);
+		if(!DC_PLUG_consume(ctx->plug))
+			goto err;
+	}
+	/* Responses make room for any requests that were held back */
+	int_async_flush(ctx);
+	return 1;
+err:
+	int_async_abort(ctx);
+	return 0;
+}
+
+unsigned int DC_CTX_async_num(const DC_CTX *ctx)
+{
+	return ctx->async_num;
+}
+
+int DC_CTX_async_connected(const DC_CTX *ctx)
+{
+	return (ctx->plug && NAL_CONNECTION_is_established(ctx->conn));
+}
+
+void DC_CTX_async_abort(DC_CTX *ctx)
+{
+	int_async_abort(ctx);
+}
+
+void DC_CTX_set_timeouts(DC_CTX *ctx, unsigned long connect_msecs,
+			unsigned long op_msecs)
+{
+	ctx->connect_msecs = connect_msecs;
+	ctx->op_msecs = op_msecs;
+}
+
+void DC_CTX_set_call_timeout(DC_CTX *ctx, unsigned long op_msecs)
+{
+	ctx->call_msecs = op_msecs;
+	ctx->call_set = 1;
+}
+
+int DC_CTX_get_error(const DC_CTX *ctx)
+{
+	return ctx->error;
+}
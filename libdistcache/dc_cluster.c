@@ -0,0 +1,234 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_LIB
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include <distcache/dc_client.h>
+#include <libsys/post.h>
+
+/* By default, a server is ejected after this many operations in a row have
+ * failed, and isn't tried again for this long */
+#define DC_CLUSTER_DEF_FAIL_LIMIT	2
+#define DC_CLUSTER_DEF_RETRY_MSECS	10000
+
+/******************************************/
+/* The "DC_CLUSTER" structure details */
+
+typedef struct st_DC_CLUSTER_SERVER {
+	DC_CTX *ctx;
+	/* Operations in a row that have failed */
+	unsigned int fails;
+	/* If the server's been ejected, when it should be tried again */
+	struct timeval retry;
+} DC_CLUSTER_SERVER;
+
+struct st_DC_CLUSTER {
+	DC_RING *ring;
+	DC_CLUSTER_SERVER *servers;
+	unsigned int num, num_ejected;
+	unsigned int fail_limit;
+	unsigned long retry_msecs;
+};
+
+/*************************************/
+/* Internal server selection helpers */
+
+/* Chooses the server for a session, first putting back any ejected servers
+ * that are due to be tried again. Returns -1 if there isn't one. */
+static int int_pick(DC_CLUSTER *cl, const unsigned char *id_data,
+			unsigned int id_len)
+{
+	unsigned int idx;
+	struct timeval now;
+	if(cl->num_ejected) {
+		SYS_gettime(&now);
+		for(idx = 0; idx < cl->num; idx++)
+			if(!DC_RING_is_live(cl->ring, idx) && (SYS_timecmp(&now,
+					&cl->servers[idx].retry) >= 0)) {
+				DC_RING_set_live(cl->ring, idx, 1);
+				cl->num_ejected--;
+			}
+	}
+	return DC_RING_lookup(cl->ring, id_data, id_len);
+}
+
+/* Records how an operation on server 'idx' went, returning non-zero if it
+ * should be tried again. A miss is a perfectly good answer, only failures to
+ * get one count against the server. A failed operation is retried once, or if
+ * the failure gets the server ejected, on the next server round the ring (but
+ * no more times than there are servers, in case they're all failing). */
+static int int_again(DC_CLUSTER *cl, int idx, int ok, unsigned int *tries)
+{
+	DC_CLUSTER_SERVER *s = cl->servers + idx;
+	(*tries)++;
+	if(ok || (DC_CTX_get_error(s->ctx) == DC_CTX_ERR_NONE)) {
+		s->fails = 0;
+		return 0;
+	}
+	if(++s->fails >= cl->fail_limit) {
+		/* Its sessions go to the next servers round the ring until
+		 * it's tried again */
+		DC_RING_set_live(cl->ring, idx, 0);
+		cl->num_ejected++;
+		s->fails = 0;
+		SYS_gettime(&s->retry);
+		SYS_timeadd(&s->retry, &s->retry, cl->retry_msecs);
+		return (*tries <= cl->num);
+	}
+	return (*tries == 1);
+}
+
+/***************************/
+/* Exposed (API) functions */
+
+DC_CLUSTER *DC_CLUSTER_new(const char *const *targets, unsigned int num,
+			unsigned int flags)
+{
+	unsigned int idx;
+	DC_CLUSTER *cl = SYS_malloc(DC_CLUSTER, 1);
+	if(!cl)
+		return NULL;
+	cl->num = num;
+	cl->num_ejected = 0;
+	cl->fail_limit = DC_CLUSTER_DEF_FAIL_LIMIT;
+	cl->retry_msecs = DC_CLUSTER_DEF_RETRY_MSECS;
+	cl->servers = NULL;
+	if((cl->ring = DC_RING_new(targets, num, 0)) == NULL)
+		goto err;
+	if((cl->servers = SYS_malloc(DC_CLUSTER_SERVER, num)) == NULL)
+		goto err;
+	SYS_zero_n(DC_CLUSTER_SERVER, cl->servers, num);
+	/* A server that's down when we start is a failure like any other, so
+	 * persistent connections are made when they're first used */
+	if(flags & DC_CTX_FLAG_PERSISTENT)
+		flags |= DC_CTX_FLAG_PERSISTENT_LATE;
+	for(idx = 0; idx < num; idx++)
+		if((cl->servers[idx].ctx = DC_CTX_new(targets[idx],
+						flags)) == NULL)
+			goto err;
+	return cl;
+err:
+	DC_CLUSTER_free(cl);
+	return NULL;
+}
+
+void DC_CLUSTER_free(DC_CLUSTER *cl)
+{
+	unsigned int idx;
+	if(cl->servers) {
+		for(idx = 0; idx < cl->num; idx++)
+			if(cl->servers[idx].ctx)
+				DC_CTX_free(cl->servers[idx].ctx);
+		SYS_free(DC_CLUSTER_SERVER, cl->servers);
+	}
+	if(cl->ring)
+		DC_RING_free(cl->ring);
+	SYS_free(DC_CLUSTER, cl);
+}
+
+void DC_CLUSTER_set_timeouts(DC_CLUSTER *cl, unsigned long connect_msecs,
+			unsigned long op_msecs)
+{
+	unsigned int idx;
+	for(idx = 0; idx < cl->num; idx++)
+		DC_CTX_set_timeouts(cl->servers[idx].ctx, connect_msecs,
+				op_msecs);
+}
+
+void DC_CLUSTER_set_ejection(DC_CLUSTER *cl, unsigned int fail_limit,
+			unsigned long retry_msecs)
+{
+	cl->fail_limit = (fail_limit ? fail_limit : 1);
+	cl->retry_msecs = retry_msecs;
+}
+
+int DC_CLUSTER_add_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs)
+{
+	int idx, ret = 0;
+	unsigned int tries = 0;
+	while((idx = int_pick(cl, id_data, id_len)) >= 0) {
+		ret = DC_CTX_add_session(cl->servers[idx].ctx, id_data, id_len,
+				sess_data, sess_len, timeout_msecs);
+		if(!int_again(cl, idx, ret, &tries))
+			break;
+	}
+	return ret;
+}
+
+int DC_CLUSTER_remove_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	int idx, ret = 0;
+	unsigned int tries = 0;
+	while((idx = int_pick(cl, id_data, id_len)) >= 0) {
+		ret = DC_CTX_remove_session(cl->servers[idx].ctx, id_data,
+				id_len);
+		if(!int_again(cl, idx, ret, &tries))
+			break;
+	}
+	return ret;
+}
+
+int DC_CLUSTER_get_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			unsigned char *result_storage,
+			unsigned int result_size,
+			unsigned int *result_used)
+{
+	int idx, ret = 0;
+	unsigned int tries = 0;
+	while((idx = int_pick(cl, id_data, id_len)) >= 0) {
+		ret = DC_CTX_get_session(cl->servers[idx].ctx, id_data, id_len,
+				result_storage, result_size, result_used);
+		if(!int_again(cl, idx, ret, &tries))
+			break;
+	}
+	return ret;
+}
+
+int DC_CLUSTER_has_session(DC_CLUSTER *cl,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	int idx, ret = -1;
+	unsigned int tries = 0;
+	while((idx = int_pick(cl, id_data, id_len)) >= 0) {
+		ret = DC_CTX_has_session(cl->servers[idx].ctx, id_data,
+				id_len);
+		if(!int_again(cl, idx, ret >= 0, &tries))
+			break;
+	}
+	return ret;
+}
+
+unsigned int DC_CLUSTER_num_live(const DC_CLUSTER *cl)
+{
+	return cl->num - cl->num_ejected;
+}
@@ -85,6 +85,10 @@ static int DC_MSG_set_cmd(DC_MSG *msg, DC_CMD cmd)
 		msg->op_class = DC_CLASS_USER;
 		msg->operation = DC_OP_HAVE;
 		return 1;
+	case DC_CMD_BATCH:
+		msg->op_class = DC_CLASS_USER;
+		msg->operation = DC_OP_BATCH;
+		return 1;
 	default:
 		break;
 	}
@@ -104,6 +108,8 @@ static DC_CMD int_get_cmd(unsigned char op_class, unsigned char operation)
 			return DC_CMD_REMOVE;
 		case DC_OP_HAVE:
 			return DC_CMD_HAVE;
+		case DC_OP_BATCH:
+			return DC_CMD_BATCH;
 		default:
 			goto err;
 		}
@@ -126,11 +132,13 @@ static DC_CMD DC_MSG_get_cmd(const DC_MSG *msg)
  * the 'DC_MSG' structure definition and its encoding format.
  */
 
+/* The fixed size fields total 14 bytes */
+#define DC_MSG_HEADER_SIZE	14
+
 static unsigned int DC_MSG_encoding_size(const DC_MSG *msg)
 {
 	assert(msg->data_len <= DC_MSG_MAX_DATA);
-	/* The fixed size fields total 10 bytes */
-	return (14 + msg->data_len);
+	return (DC_MSG_HEADER_SIZE + msg->data_len);
 }
 
 /* This function checks various things, but one very important role is that it
@@ -149,8 +157,10 @@ static DC_DECODE_STATE DC_MSG_pre_decode(const unsigned char *data,
 	 * someone accidently sends us an 12-byte "hello" for some other
 	 * protocol, and we sit and wait for a never-to-arrive 13th byte, we're
 	 * more likely to catch it. */
-	if(data_len-- < 5)
+	if(data_len < 5)
 		return DC_DECODE_STATE_INCOMPLETE;
+	/* Account for proto_level and is_response */
+	data_len -= 5;
 	/* To avoid violating the encapsulation of libnal, we have to use the
 	 * proper decoding function to verify sanity of the protocol version. */
 	{
@@ -207,7 +217,8 @@ static DC_DECODE_STATE DC_MSG_pre_decode(const unsigned char *data,
 #ifdef DC_MSG_DEBUG
 static const char *str_dump_class[] = { "DC_CLASS_USER", NULL };
 static const char *str_dump_op[] = { "DC_OP_ADD", "DC_OP_GET",
-				"DC_OP_REMOVE", "DC_OP_HAVE", NULL };
+				"DC_OP_REMOVE", "DC_OP_HAVE", "DC_OP_BATCH",
+				NULL };
 static const char *dump_int_to_str(int val, const char **strs)
 {
 	while(val && *strs) {
@@ -234,7 +245,7 @@ static void debug_dump_bin(FILE *f, const char *prefix,
 	}
 }
 
-static void dump_msg(const DC_MSG *msg)
+static void dump_msg(const DC_MSG *msg, const unsigned char *data)
 {
 	SYS_fprintf(SYS_stderr, "DC_MSG_DEBUG: dumping message...\n");
 	SYS_fprintf(SYS_stderr, "   proto_level:  %08x\n",
@@ -252,7 +263,7 @@ static void dump_msg(const DC_MSG *msg)
 		msg->complete, (msg->complete ? "complete" : "incomplete"));
 	SYS_fprintf(SYS_stderr, "   data_len:     %u\n", msg->data_len);
 	SYS_fprintf(SYS_stderr, "   data:\n");
-	debug_dump_bin(SYS_stderr, "       ", msg->data, msg->data_len);
+	debug_dump_bin(SYS_stderr, "       ", data, msg->data_len);
 }
 #endif
 
@@ -260,16 +271,23 @@ static void dump_msg(const DC_MSG *msg)
  * gate. This is where our protocol version is inserted into all outgoing
  * messages. The corresponding *incoming* version control gate is in
  * DC_MSG_pre_decode() where the protocol version of the peer will be decoded
- * and either accepted or rejected. */
-static unsigned int DC_MSG_encode(const DC_MSG *msg, unsigned char *ptr,
-				unsigned int data_len)
+ * and either accepted or rejected. The frame is appended to 'buffer' and its
+ * msg->data_len bytes of payload are taken from 'payload' rather than
+ * msg->data, so callers can frame data where it lies. Returns zero if there
+ * isn't room for the whole frame. */
+static unsigned int DC_MSG_encode(const DC_MSG *msg,
+				const unsigned char *payload,
+				NAL_BUFFER *buffer)
 {
-	unsigned int len = data_len;
+	unsigned char header[DC_MSG_HEADER_SIZE], *ptr = header;
+	unsigned int len = DC_MSG_HEADER_SIZE;
+	if(NAL_BUFFER_unused(buffer) < DC_MSG_encoding_size(msg))
+		return 0;
 #if 0
 	/* oops, OK so there's an exception here - msg is *const* so the actual
-	 * setting of the proto_level will be done one level up just before the
-	 * only place this function is called from, which is in
-	 * DC_PLUG_IO_write_flush(). That code has a comment pointing here so if
+	 * setting of the proto_level will be done one level up, in
+	 * DC_PLUG_IO_frame(), which prepares every frame this function is
+	 * called for. That code has a comment pointing here so if
 	 * you change any of this horrible great hack-around, don't forget to
 	 * change the code and the comment up there!!! */
 	msg->proto_level = DISTCACHE_PROTO_LEVEL;
@@ -280,16 +298,17 @@ static unsigned int DC_MSG_encode(const DC_MSG *msg, unsigned char *ptr,
 			!NAL_encode_char(&ptr, &len, msg->op_class) ||
 			!NAL_encode_char(&ptr, &len, msg->operation) ||
 			!NAL_encode_char(&ptr, &len, msg->complete) ||
-			!NAL_encode_uint16(&ptr, &len, msg->data_len) ||
-			!NAL_encode_bin(&ptr, &len, msg->data,
-				msg->data_len))
+			!NAL_encode_uint16(&ptr, &len, msg->data_len))
 		return 0;
-	/* check 'len' didn't wrap down past zero! */
-	assert(data_len >= len);
+	assert(len == 0);
+	/* The buffer handles any wrapping of its free space */
+	NAL_BUFFER_write(buffer, header, DC_MSG_HEADER_SIZE);
+	if(msg->data_len)
+		NAL_BUFFER_write(buffer, payload, msg->data_len);
 #ifdef DC_MSG_DEBUG
-	dump_msg(msg);
+	dump_msg(msg, payload);
 #endif
-	return data_len - len;
+	return DC_MSG_encoding_size(msg);
 }
 
 static unsigned int DC_MSG_decode(DC_MSG *msg, const unsigned char *data,
@@ -312,7 +331,7 @@ static unsigned int DC_MSG_decode(DC_MSG *msg, const unsigned char *data,
 	/* check 'len' didn't wrap down past zero! */
 	assert(data_len >= len);
 #ifdef DC_MSG_DEBUG
-	dump_msg(msg);
+	dump_msg(msg, msg->data);
 #endif
 	/* "pre_decode" should already be testing this, so abort if it slips
 	 * through to here. */
@@ -543,11 +562,25 @@ static int DC_PLUG_IO_consume(DC_PLUG_IO *io, int to_server,
 
 /* "DC_PLUG_IO" write-specific functions */
 
+/* Prepares io->msg for the next frame of the command being written, given the
+ * number of payload bytes still to go. */
+static int DC_PLUG_IO_frame(DC_PLUG_IO *io, int to_server, unsigned int left)
+{
+	io->msg.is_response = (to_server ? 0 : 1);
+	if(!DC_MSG_set_cmd(&io->msg, io->cmd))
+		return 0;
+	io->msg.request_uid = io->request_uid;
+	io->msg.data_len = (left > DC_MSG_MAX_DATA ? DC_MSG_MAX_DATA : left);
+	io->msg.complete = ((io->msg.data_len == left) ? 1 : 0);
+	/* HACK ALERT: read the important the note in DC_MSG_encode()'s "#if 0"
+	 * code before changing any of this. */
+	io->msg.proto_level = DISTCACHE_PROTO_LEVEL; /* <-- this is the hack */
+	return 1;
+}
+
 static int DC_PLUG_IO_write_flush(DC_PLUG_IO *io, int to_server,
 				NAL_BUFFER *buffer)
 {
-	unsigned char *buf_ptr;
-	unsigned int buf_len, tmp;
 
 	switch(io->state) {
 	case PLUG_EMPTY:
@@ -563,28 +596,12 @@ static int DC_PLUG_IO_write_flush(DC_PLUG_IO *io, int to_server,
 		return 0;
 	}
 start_over:
-	buf_ptr = NAL_BUFFER_write_ptr(buffer);
-	buf_len = NAL_BUFFER_unused(buffer);
 	/* Construct the frame */
-	io->msg.is_response = (to_server ? 0 : 1);
-	if(!DC_MSG_set_cmd(&io->msg, io->cmd))
+	if(!DC_PLUG_IO_frame(io, to_server, io->data_used))
 		return 0;
-	io->msg.request_uid = io->request_uid;
-	io->msg.data_len = (io->data_used > DC_MSG_MAX_DATA ?
-			DC_MSG_MAX_DATA : io->data_used);
-	io->msg.complete = ((io->msg.data_len == io->data_used) ? 1 : 0);
-	SYS_memcpy_n(unsigned char, io->msg.data, io->data, io->msg.data_len);
-	/* Check its encoding size */
-	if(DC_MSG_encoding_size(&io->msg) > buf_len)
-		/* Can't do anything */
+	/* Encode it, unless there isn't room yet */
+	if(!DC_MSG_encode(&io->msg, io->data, buffer))
 		return 1;
-	/* HACK ALERT: read the important the note in DC_MSG_encode()'s "#if 0"
-	 * code before changing any of this. */
-	io->msg.proto_level = DISTCACHE_PROTO_LEVEL; /* <-- this is the hack */
-	tmp = DC_MSG_encode(&io->msg, buf_ptr, buf_len);
-	if(!tmp)
-		return 0;
-	NAL_BUFFER_wrote(buffer, tmp);
 	/* It's encoded, so adjust our state */
 	io->data_used -= io->msg.data_len;
 	if(io->data_used) {
@@ -683,6 +700,37 @@ static int DC_PLUG_IO_commit(DC_PLUG_IO *io, int to_server,
 	return DC_PLUG_IO_write_flush(io, to_server, buffer);
 }
 
+static int DC_PLUG_IO_commit_data(DC_PLUG_IO *io, int to_server,
+			NAL_BUFFER *buffer,
+			const unsigned char *data,
+			unsigned int data_len)
+{
+	if((io->state != PLUG_USER) || io->data_used)
+		/* Something is ahead of 'data', so it has to be queued after */
+		return (DC_PLUG_IO_write_more(io, data, data_len) &&
+			DC_PLUG_IO_commit(io, to_server, buffer));
+	if(data_len > DC_MAX_TOTAL_DATA)
+		return 0;
+	/* Encode as many frames as there's room for straight from 'data' */
+	do {
+		if(!DC_PLUG_IO_frame(io, to_server, data_len))
+			return 0;
+		if(!DC_MSG_encode(&io->msg, data, buffer)) {
+			/* Out of room, the rest waits in the plug */
+			if(!DC_PLUG_IO_make_space(io, data_len))
+				return 0;
+			SYS_memcpy_n(unsigned char, io->data, data, data_len);
+			io->data_used = data_len;
+			io->state = PLUG_IO;
+			return 1;
+		}
+		data += io->msg.data_len;
+		data_len -= io->msg.data_len;
+	} while(data_len);
+	io->state = PLUG_EMPTY;
+	return 1;
+}
+
 static int DC_PLUG_IO_rollback(DC_PLUG_IO *io)
 {
 	switch(io->state) {
@@ -727,6 +775,13 @@ int DC_PLUG_free(DC_PLUG *plug)
 	return 1;
 }
 
+void DC_PLUG_reset(DC_PLUG *plug)
+{
+	NAL_CONNECTION_reset(plug->conn);
+	plug->read.state = plug->write.state = PLUG_EMPTY;
+	plug->read.data_used = plug->write.data_used = 0;
+}
+
 int DC_PLUG_to_select(DC_PLUG *plug, NAL_SELECTOR *sel)
 {
 	return NAL_CONNECTION_add_to_selector(plug->conn, sel);
@@ -793,6 +848,15 @@ int DC_PLUG_commit(DC_PLUG *plug)
 			NAL_CONNECTION_get_send(plug->conn));
 }
 
+int DC_PLUG_commit_data(DC_PLUG *plug,
+			const unsigned char *data,
+			unsigned int data_len)
+{
+	return DC_PLUG_IO_commit_data(&plug->write,
+			plug->flags & DC_PLUG_FLAG_TO_SERVER,
+			NAL_CONNECTION_get_send(plug->conn), data, data_len);
+}
+
 int DC_PLUG_rollback(DC_PLUG *plug)
 {
 	return DC_PLUG_IO_rollback(&plug->write);
@@ -0,0 +1,503 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_LIB
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include <distcache/dc_client.h>
+#include <distcache/dc_plug.h>
+#include <distcache/dc_internal.h>
+#include <libsys/post.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && \
+		defined(HAVE_SYNC_BUILTINS)
+
+/* The most connections a pool will share */
+#define DC_POOL_MAX_CONNS	64
+
+/****************************************/
+/* The "DC_POOL" structure details */
+
+/* A caller's request. It lives on the caller's stack, as the caller waits
+ * until 'done' is set. Once submitted, it stays on the connection's 'sent' list
+ * until the leader sees it's done, which is before the caller can return. */
+typedef struct st_DC_POOL_REQ DC_POOL_REQ;
+struct st_DC_POOL_REQ {
+	DC_POOL_REQ *next;
+	DC_CMD cmd;
+	const unsigned char *id_data;
+	unsigned int id_len;
+	const unsigned char *sess_data;
+	unsigned int sess_len;
+	unsigned long timeout_msecs;
+	/* Where a "get" puts the session */
+	unsigned char *result_storage;
+	unsigned int result_size, *result_used;
+	/* When the request fails, if 'has_deadline' is set */
+	struct timeval deadline;
+	int has_deadline;
+	/* Set (with the connection locked) once the request has finished, with
+	 * 'result' as given to a DC_CTX_async_cb */
+	int done, result;
+};
+
+/* Each connection is an asynchronous DC_CTX with a selector of its own. There
+ * is no I/O thread - instead, one of the callers waiting on the connection
+ * "leads", running the selector loop on everyone's behalf until its own
+ * request is answered, and then another caller takes over. The DC_CTX can't
+ * be touched while the leader is in NAL_SELECTOR_select(), so other callers'
+ * requests are queued, and a byte written to 'wake_fd' breaks the leader out
+ * to submit them. 'wake_conn' is the other end of the pipe. */
+typedef struct st_DC_POOL_CONN {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int lock_init, cond_init;
+	DC_CTX *ctx;
+	NAL_SELECTOR *sel;
+	int wake_fd;
+	NAL_CONNECTION *wake_conn;
+	/* Set while a wakeup byte is on its way */
+	int wake_pending;
+	/* Set while a caller is leading */
+	int leading;
+	/* Requests waiting to be submitted to 'ctx', in order */
+	DC_POOL_REQ *queued, *queued_tail;
+	/* Requests submitted to 'ctx', in no particular order */
+	DC_POOL_REQ *sent;
+	/* Timeouts, see DC_POOL_set_timeouts() */
+	unsigned long connect_msecs, op_msecs;
+	/* When the connection attempt fails, if 'conn_armed' is set */
+	struct timeval conn_tv;
+	int conn_armed;
+} DC_POOL_CONN;
+
+struct st_DC_POOL {
+	DC_POOL_CONN *conns;
+	unsigned int num;
+	/* Callers are spread across the connections in turn */
+	unsigned int next;
+};
+
+/********************/
+/* Internal helpers */
+
+static void int_wake(DC_POOL_CONN *c)
+{
+	if(c->wake_pending)
+		return;
+	c->wake_pending = 1;
+	while((write(c->wake_fd, "", 1) < 0) && (errno == EINTR))
+		;
+}
+
+static void int_done(void *cb_arg, int result,
+			const unsigned char *sess_data,
+			unsigned int sess_len)
+{
+	DC_POOL_REQ *req = cb_arg;
+	unsigned int tocopy = sess_len;
+	if(sess_data) {
+		/* As with DC_CTX_get_session(), 'result_used' gets the session
+		 * length even if the caller's storage is too small. */
+		*req->result_used = sess_len;
+		if(tocopy > req->result_size)
+			tocopy = req->result_size;
+		if(req->result_storage && tocopy)
+			SYS_memcpy_n(unsigned char, req->result_storage,
+					sess_data, tocopy);
+	}
+	req->result = result;
+	req->done = 1;
+}
+
+/* Submits the queued requests to the DC_CTX, returning non-zero if any of them
+ * failed (and so are already done) */
+static int int_submit(DC_POOL_CONN *c)
+{
+	int ok, failed = 0;
+	DC_POOL_REQ *req;
+	while((req = c->queued) != NULL) {
+		if((c->queued = req->next) == NULL)
+			c->queued_tail = NULL;
+		switch(req->cmd) {
+		case DC_CMD_ADD:
+			ok = DC_CTX_async_add_session(c->ctx, req->id_data,
+					req->id_len, req->sess_data,
+					req->sess_len, req->timeout_msecs,
+					int_done, req);
+			break;
+		case DC_CMD_REMOVE:
+			ok = DC_CTX_async_remove_session(c->ctx, req->id_data,
+					req->id_len, int_done, req);
+			break;
+		case DC_CMD_GET:
+			ok = DC_CTX_async_get_session(c->ctx, req->id_data,
+					req->id_len, int_done, req);
+			break;
+		default:
+			ok = DC_CTX_async_has_session(c->ctx, req->id_data,
+					req->id_len, int_done, req);
+			break;
+		}
+		if(!ok) {
+			int_done(req, -1, NULL, 0);
+			failed = 1;
+		} else {
+			req->next = c->sent;
+			c->sent = req;
+		}
+	}
+	return failed;
+}
+
+/* Forgets the submitted requests that are done, and if any of those left (or
+ * the connection attempt) has run out of time, fails them all and drops the
+ * connection, as a blocking DC_CTX does. Returns -1 if it did that, otherwise
+ * non-zero if 'tv' has been set to the nearest deadline. */
+static int int_expire(DC_POOL_CONN *c, struct timeval *tv)
+{
+	DC_POOL_REQ **preq, *req;
+	const struct timeval *next = NULL;
+	struct timeval now;
+	preq = &c->sent;
+	while((req = *preq) != NULL) {
+		if(req->done)
+			*preq = req->next;
+		else
+			preq = &req->next;
+	}
+	if(!c->sent) {
+		c->conn_armed = 0;
+		return 0;
+	}
+	SYS_gettime(&now);
+	if(!c->connect_msecs || DC_CTX_async_connected(c->ctx))
+		c->conn_armed = 0;
+	else {
+		if(!c->conn_armed) {
+			SYS_timeadd(&c->conn_tv, &now, c->connect_msecs);
+			c->conn_armed = 1;
+		}
+		next = &c->conn_tv;
+	}
+	for(req = c->sent; req; req = req->next)
+		if(req->has_deadline && (!next ||
+				(SYS_timecmp(&req->deadline, next) < 0)))
+			next = &req->deadline;
+	if(!next)
+		return 0;
+	if(SYS_timecmp(&now, next) < 0) {
+		SYS_timecpy(tv, next);
+		return 1;
+	}
+	/* Everything submitted is called back with -1, so is done */
+	DC_CTX_async_abort(c->ctx);
+	c->sent = NULL;
+	c->conn_armed = 0;
+	return -1;
+}
+
+/* Waits for the network, until 'deadline' if it's given */
+static int int_select(NAL_SELECTOR *sel, const struct timeval *deadline)
+{
+	struct timeval now;
+	unsigned long usecs = 0;
+	if(!deadline)
+		return NAL_SELECTOR_select(sel, 0, 0);
+	SYS_gettime(&now);
+	if(SYS_timecmp(&now, deadline) < 0)
+		usecs = (unsigned long)(deadline->tv_sec - now.tv_sec) *
+				1000000 + deadline->tv_usec - now.tv_usec;
+	return NAL_SELECTOR_select(sel, usecs, 1);
+}
+
+/* Runs the connection's selector loop until 'mine' is done. Called and returns
+ * with the connection locked, which is dropped while waiting for the network. */
+static void int_lead(DC_POOL_CONN *c, DC_POOL_REQ *mine)
+{
+	int ret, timed;
+	struct timeval deadline;
+	NAL_BUFFER *wake_buf = NAL_CONNECTION_get_read(c->wake_conn);
+	c->leading = 1;
+	for(;;) {
+		if(int_submit(c))
+			pthread_cond_broadcast(&c->cond);
+		/* This also forgets the requests that are done, so it has to
+		 * happen before their callers can see the lock again */
+		if((timed = int_expire(c, &deadline)) < 0)
+			pthread_cond_broadcast(&c->cond);
+		/* Once submitted, 'mine' is only done from DC_CTX_process() or
+		 * int_expire() (or it failed to submit), so we can't leave any
+		 * sooner */
+		if(mine->done)
+			break;
+		pthread_mutex_unlock(&c->lock);
+		ret = int_select(c->sel, timed ? &deadline : NULL);
+		pthread_mutex_lock(&c->lock);
+		/* Clear 'wake_pending' before looking at the queue again, so
+		 * that a request queued after we look always wakes us. */
+		c->wake_pending = 0;
+		NAL_CONNECTION_io(c->wake_conn);
+		NAL_BUFFER_read(wake_buf, NULL, NAL_BUFFER_used(wake_buf));
+		if(ret > 0) {
+			/* This fails the outstanding requests if the connection
+			 * has broken, the next submission reconnects. */
+			DC_CTX_process(c->ctx);
+			pthread_cond_broadcast(&c->cond);
+		}
+	}
+	c->leading = 0;
+	/* Someone else has to lead if there are requests still waiting */
+	pthread_cond_broadcast(&c->cond);
+}
+
+static int int_run(DC_POOL *pool, DC_POOL_REQ *req)
+{
+	DC_POOL_CONN *c = pool->conns +
+			(__sync_fetch_and_add(&pool->next, 1) % pool->num);
+	req->next = NULL;
+	req->done = 0;
+	pthread_mutex_lock(&c->lock);
+	if(c->op_msecs) {
+		SYS_gettime(&req->deadline);
+		SYS_timeadd(&req->deadline, &req->deadline, c->op_msecs);
+		req->has_deadline = 1;
+	}
+	if(c->queued_tail)
+		c->queued_tail->next = req;
+	else
+		c->queued = req;
+	c->queued_tail = req;
+	if(c->leading)
+		int_wake(c);
+	while(!req->done) {
+		if(!c->leading)
+			int_lead(c, req);
+		else
+			pthread_cond_wait(&c->cond, &c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return req->result;
+}
+
+static void int_req_init(DC_POOL_REQ *req, DC_CMD cmd,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	SYS_zero(DC_POOL_REQ, req);
+	req->cmd = cmd;
+	req->id_data = id_data;
+	req->id_len = id_len;
+}
+
+static int int_conn_init(DC_POOL_CONN *c, const char *target)
+{
+	int fds[2];
+	char wake_addr[32];
+	NAL_ADDRESS *addr;
+	if(pthread_mutex_init(&c->lock, NULL) != 0)
+		return 0;
+	c->lock_init = 1;
+	if(pthread_cond_init(&c->cond, NULL) != 0)
+		return 0;
+	c->cond_init = 1;
+	/* The DC_CTX connects when the first request is submitted */
+	if(((c->ctx = DC_CTX_new(target, DC_CTX_FLAG_PERSISTENT |
+				DC_CTX_FLAG_PERSISTENT_LATE)) == NULL) ||
+			((c->sel = NAL_SELECTOR_new()) == NULL) ||
+			!DC_CTX_to_select(c->ctx, c->sel) ||
+			((c->wake_conn = NAL_CONNECTION_new()) == NULL) ||
+			((addr = NAL_ADDRESS_new()) == NULL))
+		return 0;
+	if(pipe(fds) != 0) {
+		NAL_ADDRESS_free(addr);
+		return 0;
+	}
+	c->wake_fd = fds[1];
+	sprintf(wake_addr, "FD:%d:-1", fds[0]);
+	if(!NAL_ADDRESS_create(addr, wake_addr, 64) ||
+			!NAL_CONNECTION_create(c->wake_conn, addr)) {
+		close(fds[0]);
+		NAL_ADDRESS_free(addr);
+		return 0;
+	}
+	NAL_ADDRESS_free(addr);
+	return NAL_CONNECTION_add_to_selector(c->wake_conn, c->sel);
+}
+
+static void int_conn_finish(DC_POOL_CONN *c)
+{
+	/* Frees the DC_CTX's connection, and so takes it out of 'sel' */
+	if(c->ctx)
+		DC_CTX_free(c->ctx);
+	if(c->wake_conn)
+		NAL_CONNECTION_free(c->wake_conn);
+	if(c->wake_fd != -1)
+		close(c->wake_fd);
+	if(c->sel)
+		NAL_SELECTOR_free(c->sel);
+	if(c->cond_init)
+		pthread_cond_destroy(&c->cond);
+	if(c->lock_init)
+		pthread_mutex_destroy(&c->lock);
+}
+
+/***************************/
+/* Exposed (API) functions */
+
+DC_POOL *DC_POOL_new(const char *target, unsigned int num_conns)
+{
+	unsigned int idx;
+	DC_POOL *pool;
+	if(!num_conns || (num_conns > DC_POOL_MAX_CONNS))
+		return NULL;
+	if((pool = SYS_malloc(DC_POOL, 1)) == NULL)
+		return NULL;
+	if((pool->conns = SYS_malloc(DC_POOL_CONN, num_conns)) == NULL) {
+		SYS_free(DC_POOL, pool);
+		return NULL;
+	}
+	SYS_zero_n(DC_POOL_CONN, pool->conns, num_conns);
+	for(idx = 0; idx < num_conns; idx++)
+		pool->conns[idx].wake_fd = -1;
+	pool->num = num_conns;
+	pool->next = 0;
+	for(idx = 0; idx < num_conns; idx++)
+		if(!int_conn_init(pool->conns + idx, target)) {
+			DC_POOL_free(pool);
+			return NULL;
+		}
+	return pool;
+}
+
+void DC_POOL_free(DC_POOL *pool)
+{
+	unsigned int idx;
+	for(idx = 0; idx < pool->num; idx++)
+		int_conn_finish(pool->conns + idx);
+	SYS_free(DC_POOL_CONN, pool->conns);
+	SYS_free(DC_POOL, pool);
+}
+
+void DC_POOL_set_timeouts(DC_POOL *pool, unsigned long connect_msecs,
+			unsigned long op_msecs)
+{
+	unsigned int idx;
+	DC_POOL_CONN *c;
+	for(idx = 0; idx < pool->num; idx++) {
+		c = pool->conns + idx;
+		pthread_mutex_lock(&c->lock);
+		c->connect_msecs = connect_msecs;
+		c->op_msecs = op_msecs;
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+int DC_POOL_add_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs)
+{
+	DC_POOL_REQ req;
+	int_req_init(&req, DC_CMD_ADD, id_data, id_len);
+	req.sess_data = sess_data;
+	req.sess_len = sess_len;
+	req.timeout_msecs = timeout_msecs;
+	return (int_run(pool, &req) > 0);
+}
+
+int DC_POOL_remove_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	DC_POOL_REQ req;
+	int_req_init(&req, DC_CMD_REMOVE, id_data, id_len);
+	return (int_run(pool, &req) > 0);
+}
+
+int DC_POOL_get_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			unsigned char *result_storage,
+			unsigned int result_size,
+			unsigned int *result_used)
+{
+	DC_POOL_REQ req;
+	int_req_init(&req, DC_CMD_GET, id_data, id_len);
+	req.result_storage = result_storage;
+	req.result_size = result_size;
+	req.result_used = result_used;
+	return (int_run(pool, &req) > 0);
+}
+
+int DC_POOL_has_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	DC_POOL_REQ req;
+	int_req_init(&req, DC_CMD_HAVE, id_data, id_len);
+	return int_run(pool, &req);
+}
+
+#else /* !(pthreads && __sync builtins) */
+
+DC_POOL *DC_POOL_new(const char *target, unsigned int num_conns)
+{
+	return NULL;
+}
+void DC_POOL_free(DC_POOL *pool) { }
+void DC_POOL_set_timeouts(DC_POOL *pool, unsigned long connect_msecs,
+			unsigned long op_msecs) { }
+int DC_POOL_add_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			const unsigned char *sess_data,
+			unsigned int sess_len,
+			unsigned long timeout_msecs)
+{
+	return 0;
+}
+int DC_POOL_remove_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	return 0;
+}
+int DC_POOL_get_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len,
+			unsigned char *result_storage,
+			unsigned int result_size,
+			unsigned int *result_used)
+{
+	return 0;
+}
+int DC_POOL_has_session(DC_POOL *pool,
+			const unsigned char *id_data,
+			unsigned int id_len)
+{
+	return -1;
+}
+
+#endif /* !(pthreads && __sync builtins) */
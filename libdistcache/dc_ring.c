@@ -0,0 +1,193 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_LIB
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include <distcache/dc_client.h>
+#include <libsys/post.h>
+
+/* The number of points each server gets on the ring if the caller doesn't say,
+ * as ketama uses */
+#define DC_RING_DEFAULT_POINTS	160
+/* Sanity limits */
+#define DC_RING_MAX_SERVERS	1024
+#define DC_RING_MAX_POINTS	1024
+
+/***************************************/
+/* The "DC_RING" structure details */
+
+typedef struct st_DC_RING_POINT {
+	unsigned long hash;
+	unsigned int idx;
+} DC_RING_POINT;
+
+struct st_DC_RING {
+	/* Every server's points, sorted by hash */
+	DC_RING_POINT *points;
+	unsigned int num_points;
+	/* Which servers are live, and how many */
+	unsigned char *live;
+	unsigned int num, num_live;
+};
+
+/*****************************/
+/* Internal hashing functions */
+
+/* FNV-1a, finished with murmur3's mixer. The names hashed for a server's points
+ * differ only in their last few characters, and FNV-1a alone doesn't spread
+ * those well enough over the ring. */
+static unsigned long int_hash_update(unsigned long h,
+			const unsigned char *ptr, unsigned int len)
+{
+	while(len--) {
+		h ^= *(ptr++);
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	return h;
+}
+
+static unsigned long int_hash_final(unsigned long h)
+{
+	h ^= h >> 16;
+	h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+	h ^= h >> 13;
+	h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Point 'n' of a server is the hash of "<address>-<n>". Servers are known by
+ * their addresses rather than their positions in the list, so that adding a
+ * server only moves the sessions that are now its own. */
+static unsigned long int_point_hash(const char *server, unsigned int n)
+{
+	char suffix[16];
+	unsigned long h = 2166136261UL;
+	h = int_hash_update(h, (const unsigned char *)server, strlen(server));
+	sprintf(suffix, "-%u", n);
+	h = int_hash_update(h, (const unsigned char *)suffix, strlen(suffix));
+	return int_hash_final(h);
+}
+
+static int int_point_cmp(const void *a, const void *b)
+{
+	const DC_RING_POINT *pa = a, *pb = b;
+	if(pa->hash != pb->hash)
+		return (pa->hash < pb->hash ? -1 : 1);
+	/* Collisions are broken by list order, so every client agrees */
+	if(pa->idx != pb->idx)
+		return (pa->idx < pb->idx ? -1 : 1);
+	return 0;
+}
+
+/***************************/
+/* Exposed (API) functions */
+
+DC_RING *DC_RING_new(const char *const *servers, unsigned int num,
+			unsigned int points)
+{
+	unsigned int idx, n;
+	DC_RING_POINT *p;
+	DC_RING *ring;
+	if(!points)
+		points = DC_RING_DEFAULT_POINTS;
+	if(!num || (num > DC_RING_MAX_SERVERS) ||
+			(points > DC_RING_MAX_POINTS))
+		return NULL;
+	if((ring = SYS_malloc(DC_RING, 1)) == NULL)
+		return NULL;
+	ring->points = SYS_malloc(DC_RING_POINT, num * points);
+	ring->live = SYS_malloc(unsigned char, num);
+	if(!ring->points || !ring->live) {
+		DC_RING_free(ring);
+		return NULL;
+	}
+	ring->num_points = num * points;
+	ring->num = ring->num_live = num;
+	for(idx = 0, p = ring->points; idx < num; idx++) {
+		ring->live[idx] = 1;
+		for(n = 0; n < points; n++, p++) {
+			p->hash = int_point_hash(servers[idx], n);
+			p->idx = idx;
+		}
+	}
+	qsort(ring->points, ring->num_points, sizeof(DC_RING_POINT),
+			int_point_cmp);
+	return ring;
+}
+
+void DC_RING_free(DC_RING *ring)
+{
+	if(ring->points)
+		SYS_free(DC_RING_POINT, ring->points);
+	if(ring->live)
+		SYS_free(unsigned char, ring->live);
+	SYS_free(DC_RING, ring);
+}
+
+int DC_RING_lookup(const DC_RING *ring, const unsigned char *id_data,
+			unsigned int id_len)
+{
+	const DC_RING_POINT *p;
+	unsigned int lo = 0, hi = ring->num_points, walked;
+	unsigned long h;
+	if(!ring->num_live)
+		return -1;
+	h = int_hash_final(int_hash_update(2166136261UL, id_data, id_len));
+	/* Find the first point at or after 'h' */
+	while(lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if(ring->points[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* The session belongs to that point's server, or if that's been
+	 * ejected, to the next live server round the ring. That way only the
+	 * ejected server's sessions move, and they spread over the others. */
+	for(walked = 0; walked < ring->num_points; walked++, lo++) {
+		if(lo == ring->num_points)
+			lo = 0;
+		p = ring->points + lo;
+		if(ring->live[p->idx])
+			return (int)p->idx;
+	}
+	/* Can't happen with 'num_live' non-zero */
+	return -1;
+}
+
+void DC_RING_set_live(DC_RING *ring, unsigned int idx, int live)
+{
+	if((idx >= ring->num) || (!ring->live[idx] == !live))
+		return;
+	ring->live[idx] = (live ? 1 : 0);
+	if(live)
+		ring->num_live++;
+	else
+		ring->num_live--;
+}
+
+int DC_RING_is_live(const DC_RING *ring, unsigned int idx)
+{
+	return ((idx < ring->num) && ring->live[idx]);
+}
@@ -34,10 +34,15 @@
 #define DC_CLIENT_STORE_START_SIZE	DC_MSG_MAX_DATA
 /* The starting size for a client's "response" when first allocated */
 #define DC_CLIENT_RESPONSE_START_SIZE	DC_MSG_MAX_DATA
+/* The most requests answered for one client in one processing pass, so that a
+ * client pipelining lots of requests can't starve the others. */
+#define DC_CLIENT_PIPELINE_MAX		32
 
-/* Our only global - the cache "implementation" we create new 'DC_SERVER'
- * structures with. */
+/* Our only globals - the cache "implementation" we create new 'DC_SERVER'
+ * structures with, and its optional handlers (copied, see
+ * DC_SERVER_set_cache_ex()). */
 static const DC_CACHE_cb *default_cache_implementation = NULL;
+static DC_CACHE_EXT_cb default_cache_ext;
 
 /******************************************/
 /* The "DC_SERVER" structure details */
@@ -45,6 +50,7 @@ static const DC_CACHE_cb *default_cache_implementation = NULL;
 struct st_DC_SERVER {
 	/* The implementation used corresponding to this server structure */
 	const DC_CACHE_cb *vt;
+	DC_CACHE_EXT_cb ext;
 	/* The (resizable array of) clients */
 	DC_CLIENT **clients;
 	unsigned int clients_used, clients_size;
@@ -52,6 +58,9 @@ struct st_DC_SERVER {
 	DC_CACHE *cache;
 	/* The counter of cache operations */
 	unsigned long ops;
+	/* The forwarding callback, see DC_SERVER_set_forward() */
+	DC_SERVER_forward_cb fwd;
+	void *fwd_arg;
 };
 
 struct st_DC_CLIENT {
@@ -67,6 +76,16 @@ struct st_DC_CLIENT {
 	/* Storage for sent data (to go to the plug) */
 	unsigned char send_data[DC_MAX_TOTAL_DATA];
 	unsigned int send_data_len;
+	/* The command being answered, and our place in it if it's a batch */
+	DC_CMD cmd;
+	unsigned long batch_num, batch_done;
+	unsigned int batch_pos, batch_len, batch_start;
+	unsigned char batch_op;
+	/* Set while an operation is out with the forwarding callback. Nothing
+	 * more is read from the plug until it comes back, and if the client
+	 * dies in the meantime it isn't destroyed until then. */
+	int forwarded;
+	int dead;
 };
 
 /****************************************************/
@@ -89,107 +108,303 @@ static void int_server_del_client(DC_SERVER *ctx, unsigned int idx)
 /*********************************************************************/
 /* Internal functions to perform specific session caching operations */
 
-static void int_response_1byte(DC_CLIENT *clnt, unsigned char val)
+/* Each operation writes its response data to 'res', which has room for 'room'
+ * bytes (always at least one), and returns the number of bytes written. It
+ * returns zero for a corrupt request, or -1 if the response doesn't fit. */
+
+static int int_response_1byte(unsigned char *res, unsigned char val)
 {
-	clnt->send_data[0] = val;
-	clnt->send_data_len = 1;
+	*res = val;
+	return 1;
 }
 
-static int int_do_op_add(DC_CLIENT *clnt, const struct timeval *now)
+static int int_op_add(DC_SERVER *ctx, const struct timeval *now,
+			const unsigned char *data, unsigned int data_len,
+			unsigned char *res)
 {
-	int res;
-	unsigned long msecs, id_len, data_len;
-	unsigned char *p = clnt->read_data;
-	unsigned int p_len = clnt->read_data_len;
+	int ret;
+	unsigned long msecs, id_len, sess_len;
+	const unsigned char *p = data;
+	unsigned int p_len = data_len;
 
 	/* We encode "add"s as;
 	 *   4 bytes            (timeout)
 	 *   4 bytes            (id_len)
 	 *   'id_len' bytes     (id_data)
 	 *   'sess_len' bytes   (sess_data) */
-	if(!NAL_decode_uint32((const unsigned char **)&p, &p_len, &msecs) ||
-			!NAL_decode_uint32((const unsigned char **)&p,
-				&p_len, &id_len))
+	if(!NAL_decode_uint32(&p, &p_len, &msecs) ||
+			!NAL_decode_uint32(&p, &p_len, &id_len))
 		return 0;
-	assert((p_len + 8) == clnt->read_data_len);
-	assert(p == (clnt->read_data + 8));
-	if(msecs > DC_MAX_EXPIRY) {
-		int_response_1byte(clnt, DC_ADD_ERR_TIMEOUT_RANGE);
-		return 1;
-	}
-	if(id_len >= p_len) {
-		int_response_1byte(clnt, DC_ADD_ERR_CORRUPT);
-		return 1;
-	}
-	if(!id_len || (id_len > DC_MAX_ID_LEN)) {
-		int_response_1byte(clnt, DC_ADD_ERR_ID_RANGE);
-		return 1;
-	}
-	data_len = p_len - id_len;
-	if(!data_len || (data_len > DC_MAX_DATA_LEN)) {
-		int_response_1byte(clnt, DC_ADD_ERR_DATA_RANGE);
-		return 1;
-	}
-	res = clnt->server->vt->cache_add(clnt->server->cache, now, msecs,
-			p, id_len, p + id_len, data_len);
-	if(res)
-		int_response_1byte(clnt, DC_ERR_OK);
-	else
-		int_response_1byte(clnt, DC_ADD_ERR_MATCHING_SESSION);
-	return 1;
+	assert((p_len + 8) == data_len);
+	assert(p == (data + 8));
+	if(msecs > DC_MAX_EXPIRY)
+		return int_response_1byte(res, DC_ADD_ERR_TIMEOUT_RANGE);
+	if(id_len >= p_len)
+		return int_response_1byte(res, DC_ADD_ERR_CORRUPT);
+	if(!id_len || (id_len > DC_MAX_ID_LEN))
+		return int_response_1byte(res, DC_ADD_ERR_ID_RANGE);
+	sess_len = p_len - id_len;
+	if(!sess_len || (sess_len > DC_MAX_DATA_LEN))
+		return int_response_1byte(res, DC_ADD_ERR_DATA_RANGE);
+	ret = ctx->vt->cache_add(ctx->cache, now, msecs,
+			p, id_len, p + id_len, sess_len);
+	return int_response_1byte(res, (unsigned char)(ret ? DC_ERR_OK :
+				DC_ADD_ERR_MATCHING_SESSION));
 }
 
-static int int_do_op_get(DC_CLIENT *clnt, const struct timeval *now)
+static int int_op_get(DC_SERVER *ctx, const struct timeval *now,
+			const unsigned char *id, unsigned int id_len,
+			unsigned char *res, unsigned int room)
 {
 	unsigned int len;
-	len = clnt->server->vt->cache_get(clnt->server->cache, now,
-			clnt->read_data, clnt->read_data_len, NULL, 0);
-	if(!len) {
-		int_response_1byte(clnt, DC_ERR_NOTOK);
-		return 1;
-	}
+	len = ctx->vt->cache_get(ctx->cache, now, id, id_len, NULL, 0);
+	if(!len)
+		return int_response_1byte(res, DC_ERR_NOTOK);
 	/* Make sure we have enough allocated room for the response */
-	if(len > DC_MAX_TOTAL_DATA)
-		return 0;
+	if(len > room)
+		return -1;
 	/* NB: It's ok to pass in the session id again like this - the cache
 	 * implementation automatically caches the lookup from the first call,
 	 * so this one will not actually involve any searching. */
-	len = clnt->server->vt->cache_get(clnt->server->cache, now,
-				clnt->read_data, clnt->read_data_len,
-				clnt->send_data, DC_MAX_TOTAL_DATA);
-	assert(len && (len <= DC_MAX_TOTAL_DATA));
-	if(!len)
-		/* shouldn't happen, equals "bug" */
+	len = ctx->vt->cache_get(ctx->cache, now, id, id_len, res, room);
+	assert(len && (len <= room));
+	/* If it's zero, that shouldn't happen and equals "bug" */
+	return (int)len;
+}
+
+static int int_op_remove(DC_SERVER *ctx, const struct timeval *now,
+			const unsigned char *id, unsigned int id_len,
+			unsigned char *res)
+{
+	return int_response_1byte(res, (unsigned char)(ctx->vt->cache_remove(
+				ctx->cache, now, id, id_len) ?
+				DC_ERR_OK : DC_ERR_NOTOK));
+}
+
+static int int_op_have(DC_SERVER *ctx, const struct timeval *now,
+			const unsigned char *id, unsigned int id_len,
+			unsigned char *res)
+{
+	return int_response_1byte(res, (unsigned char)(ctx->vt->cache_have(
+				ctx->cache, now, id, id_len) ?
+				DC_ERR_OK : DC_ERR_NOTOK));
+}
+
+static int int_op(DC_SERVER *ctx, const struct timeval *now, int op,
+			const unsigned char *data, unsigned int data_len,
+			unsigned char *res, unsigned int room)
+{
+	assert(room > 0);
+	switch(op) {
+	case DC_OP_ADD:
+		return int_op_add(ctx, now, data, data_len, res);
+	case DC_OP_GET:
+		return int_op_get(ctx, now, data, data_len, res, room);
+	case DC_OP_REMOVE:
+		return int_op_remove(ctx, now, data, data_len, res);
+	case DC_OP_HAVE:
+		return int_op_have(ctx, now, data, data_len, res);
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* Offers an operation to the server's forwarding callback, if it has one.
+ * Returns zero if the operation is left to us, 1 if it has been taken (and
+ * 'forwarded' is set), or -1 if the callback failed it. */
+static int int_forward(DC_CLIENT *clnt, int op, const unsigned char *data,
+			unsigned int data_len)
+{
+	int ret;
+	DC_SERVER *ctx = clnt->server;
+	if(!ctx->fwd)
 		return 0;
-	clnt->send_data_len = len;
-	return 1;
+	ret = ctx->fwd(ctx->fwd_arg, clnt, op, data, data_len,
+			DC_MAX_TOTAL_DATA - clnt->send_data_len);
+	if(ret > 0)
+		clnt->forwarded = 1;
+	return ret;
 }
 
-static int int_do_op_remove(DC_CLIENT *clnt, const struct timeval *now)
+/* Performs an operation for a client in our own cache, appending the result to
+ * 'send_data'. Returns as the int_op_***() functions do. */
+static int int_client_local(DC_CLIENT *clnt, const struct timeval *now, int op,
+			const unsigned char *data, unsigned int data_len)
 {
-	if(clnt->server->vt->cache_remove(clnt->server->cache, now,
-				clnt->read_data, clnt->read_data_len))
-		int_response_1byte(clnt, DC_ERR_OK);
-	else
-		int_response_1byte(clnt, DC_ERR_NOTOK);
-	return 1;
+	int ret = int_op(clnt->server, now, op, data, data_len,
+			clnt->send_data + clnt->send_data_len,
+			DC_MAX_TOTAL_DATA - clnt->send_data_len);
+	if(ret > 0)
+		clnt->send_data_len += ret;
+	return ret;
+}
 
+/* As int_client_local(), unless the operation is forwarded */
+static int int_client_op(DC_CLIENT *clnt, const struct timeval *now, int op,
+			const unsigned char *data, unsigned int data_len)
+{
+	int ret = int_forward(clnt, op, data, data_len);
+	if(ret)
+		return (ret > 0);
+	return int_client_local(clnt, now, op, data, data_len);
 }
 
-static int int_do_op_have(DC_CLIENT *clnt, const struct timeval *now)
+/* The same as int_client_op() for a single "get" request, but the response is
+ * framed straight from the cache's storage if the implementation allows. */
+static int int_do_op_get_ref(DC_CLIENT *clnt, const struct timeval *now)
 {
-	if(clnt->server->vt->cache_have(clnt->server->cache, now,
-				clnt->read_data, clnt->read_data_len))
-		int_response_1byte(clnt, DC_ERR_OK);
-	else
-		int_response_1byte(clnt, DC_ERR_NOTOK);
+	int ret;
+	unsigned int len;
+	const unsigned char *ref;
+	if((ret = int_forward(clnt, DC_OP_GET, clnt->read_data,
+					clnt->read_data_len)) != 0)
+		return (ret > 0);
+	if(!clnt->server->ext.cache_get_ref)
+		return (int_client_local(clnt, now, DC_OP_GET, clnt->read_data,
+					clnt->read_data_len) > 0);
+	ref = clnt->server->ext.cache_get_ref(clnt->server->cache, now,
+			clnt->read_data, clnt->read_data_len, &len);
+	if(!ref) {
+		clnt->send_data_len = int_response_1byte(clnt->send_data,
+					DC_ERR_NOTOK);
+		return 1;
+	}
+	/* Frame the response straight from the cache's storage. This commits
+	 * it, so there's nothing left in 'send_data'. */
+	ret = ((len <= DC_MAX_TOTAL_DATA) &&
+		DC_PLUG_commit_data(clnt->plug, ref, len));
+	clnt->server->ext.cache_release(clnt->server->cache);
+	clnt->send_data_len = 0;
+	return ret;
+}
+
+/* We encode "batch"es as;
+ *   4 bytes            (num)
+ *   'num' entries of;
+ *     1 byte             (operation)
+ *     4 bytes            (len)
+ *     'len' bytes        (the operation's request data)
+ * and the response is the same, carrying each operation's response data. We
+ * stop at the first result that doesn't fit and the count we send back says
+ * how many entries were done. The client keeps its place in the batch so that
+ * we can pick up again after an entry that was forwarded. */
+
+/* Finishes the batch, returns zero if it was corrupt */
+static int int_batch_end(DC_CLIENT *clnt)
+{
+	unsigned char *ptr = clnt->send_data;
+	unsigned int check = DC_BATCH_COUNT_SIZE;
+	/* Only a complete batch can have left no trailing data */
+	if((clnt->batch_done == clnt->batch_num) &&
+			(clnt->batch_pos < clnt->read_data_len))
+		return 0;
+	return NAL_encode_uint32(&ptr, &check, clnt->batch_done);
+}
+
+/* Finishes the entry started at 'batch_start', given its operation's result.
+ * Returns -1 if the result didn't fit, in which case the batch stops there. */
+static int int_batch_entry(DC_CLIENT *clnt, int ret)
+{
+	unsigned char *ptr = clnt->send_data + clnt->batch_start;
+	unsigned int check = DC_BATCH_ENTRY_SIZE;
+	if(!ret)
+		return 0;
+	if(ret < 0) {
+		/* No room for the result, leave the rest undone */
+		clnt->send_data_len = clnt->batch_start;
+		return -1;
+	}
+	if(!NAL_encode_char(&ptr, &check, clnt->batch_op) ||
+			!NAL_encode_uint32(&ptr, &check, clnt->send_data_len -
+				clnt->batch_start - DC_BATCH_ENTRY_SIZE))
+		return 0;
+	clnt->batch_pos += clnt->batch_len;
+	clnt->batch_done++;
 	return 1;
+}
+
+/* Answers the batch's entries from 'batch_pos' onwards. This returns as soon
+ * as an entry is forwarded, and DC_SERVER_forwarded() carries on from there. */
+static int int_batch_run(DC_CLIENT *clnt, const struct timeval *now)
+{
+	int ret;
+	unsigned char op;
+	unsigned long len;
+	const unsigned char *p;
+	unsigned int p_len;
+
+	while(clnt->batch_done < clnt->batch_num) {
+		p = clnt->read_data + clnt->batch_pos;
+		p_len = clnt->read_data_len - clnt->batch_pos;
+		if(!NAL_decode_char(&p, &p_len, &op) ||
+				!NAL_decode_uint32(&p, &p_len, &len) ||
+				(len > p_len))
+			return 0;
+		/* Every result needs room for its header and at least 1 byte */
+		if(clnt->send_data_len + DC_BATCH_ENTRY_SIZE >=
+				DC_MAX_TOTAL_DATA)
+			break;
+		/* Batches don't nest */
+		if(op >= DC_OP_BATCH)
+			return 0;
+		clnt->batch_op = op;
+		clnt->batch_pos = p - clnt->read_data;
+		clnt->batch_len = (unsigned int)len;
+		clnt->batch_start = clnt->send_data_len;
+		clnt->send_data_len += DC_BATCH_ENTRY_SIZE;
+		ret = int_client_op(clnt, now, op, p, (unsigned int)len);
+		if(clnt->forwarded)
+			return 1;
+		if((ret = int_batch_entry(clnt, ret)) == 0)
+			return 0;
+		if(ret < 0)
+			break;
+	}
+	return int_batch_end(clnt);
+}
+
+static int int_do_op_batch(DC_CLIENT *clnt, const struct timeval *now)
+{
+	unsigned long num;
+	const unsigned char *p = clnt->read_data;
+	unsigned int p_len = clnt->read_data_len;
+	if(!NAL_decode_uint32(&p, &p_len, &num))
+		return 0;
+	clnt->batch_num = num;
+	clnt->batch_done = 0;
+	clnt->batch_pos = DC_BATCH_COUNT_SIZE;
+	clnt->send_data_len = DC_BATCH_COUNT_SIZE;
+	return int_batch_run(clnt, now);
+}
 
+/* Sends the response in 'send_data' and finishes the request that is open in
+ * the client's plug. */
+static int int_end_operation(DC_CLIENT *clnt)
+{
+	/* Responses always have a payload, so if 'send_data' is empty then the
+	 * operation has already committed it. */
+	if(clnt->send_data_len && (!DC_PLUG_write_more(clnt->plug,
+				clnt->send_data, clnt->send_data_len) ||
+			!DC_PLUG_commit(clnt->plug))) {
+		DC_PLUG_rollback(clnt->plug);
+		DC_PLUG_consume(clnt->plug);
+		return 0;
+	}
+	if(!DC_PLUG_consume(clnt->plug))
+		return 0;
+	/* Operation done */
+	clnt->server->ops++;
+	return 1;
 }
 
+/* Answers the request that is open for reading in the client's plug. Returns
+ * zero for an error, or -1 if the plug is still busy writing a previous
+ * response, in which case the request is left open to be retried later. If an
+ * operation is forwarded, the request is left open until it comes back. */
 static int int_do_operation(DC_CLIENT *clnt, const struct timeval *now)
 {
-	int toret = 1, plug_read = 1, plug_write = 0;
+	int toret;
 	unsigned long request_uid;
 	DC_CMD cmd;
 	const unsigned char *payload_data;
@@ -198,56 +413,55 @@ static int int_do_operation(DC_CLIENT *clnt, const struct timeval *now)
 	/* Try a read on the plug. We resume because this function is only
 	 * called if the top-level function detected a request using "read". */
 	if(!DC_PLUG_read(clnt->plug, 1, &request_uid, &cmd,
-				&payload_data, &payload_len))
-		goto err;
-	/* Make sure we don't forget to consume this request */
-	plug_read = 1;
-	/* Try and prepare writing of the response */
+				&payload_data, &payload_len)) {
+		DC_PLUG_consume(clnt->plug);
+		return 0;
+	}
+	/* Try and prepare writing of the response. This only fails if the
+	 * previous response is still waiting for room in the send buffer. */
 	if(!DC_PLUG_write(clnt->plug, 0, request_uid, cmd, NULL, 0))
-		goto err;
-	/* Make sure we don't forget to commit this response */
-	plug_write = 1;
+		return -1;
 	/* Now duplicate the payload into our clnt buffer */
 	assert(payload_len <= DC_MAX_TOTAL_DATA);
 	if(payload_len)
 		SYS_memcpy_n(unsigned char, clnt->read_data,
 				payload_data, payload_len);
 	clnt->read_data_len = payload_len;
+	clnt->send_data_len = 0;
+	clnt->cmd = cmd;
 	/* Switch on the command type */
 	switch(cmd) {
 	case DC_CMD_ADD:
-		toret = int_do_op_add(clnt, now);
+		toret = int_client_op(clnt, now, DC_OP_ADD, clnt->read_data,
+					clnt->read_data_len);
 		break;
 	case DC_CMD_GET:
-		toret = int_do_op_get(clnt, now);
+		toret = int_do_op_get_ref(clnt, now);
 		break;
 	case DC_CMD_REMOVE:
-		toret = int_do_op_remove(clnt, now);
+		toret = int_client_op(clnt, now, DC_OP_REMOVE, clnt->read_data,
+					clnt->read_data_len);
 		break;
 	case DC_CMD_HAVE:
-		toret = int_do_op_have(clnt, now);
+		toret = int_client_op(clnt, now, DC_OP_HAVE, clnt->read_data,
+					clnt->read_data_len);
+		break;
+	case DC_CMD_BATCH:
+		toret = int_do_op_batch(clnt, now);
 		break;
 	default:
-		goto err;
+		toret = 0;
+		break;
 	}
-	if(!toret)
-		goto err;
-	if(!DC_PLUG_write_more(clnt->plug, clnt->send_data,
-				clnt->send_data_len) ||
-			!DC_PLUG_commit(clnt->plug))
-		goto err;
-	plug_write = 0;
-	if(!DC_PLUG_consume(clnt->plug))
-		goto err;
-	/* Operation done */
-	clnt->server->ops++;
-	return toret;
-err:
-	if(plug_read)
+	if(toret <= 0) {
 		DC_PLUG_consume(clnt->plug);
-	if(plug_write)
 		DC_PLUG_rollback(clnt->plug);
-	return 0;
+		return 0;
+	}
+	if(clnt->forwarded)
+		/* DC_SERVER_forwarded() finishes the request */
+		return 1;
+	return int_end_operation(clnt);
 }
 
 /***************************/
@@ -255,22 +469,66 @@ err:
 
 int DC_SERVER_set_cache(const DC_CACHE_cb *impl)
 {
+	return DC_SERVER_set_cache_ex(impl, NULL);
+}
+
+int DC_SERVER_set_cache_ex(const DC_CACHE_cb *impl,
+			const DC_CACHE_EXT_cb *ext)
+{
+	DC_CACHE_EXT_cb tmp;
 	if(!impl || !impl->cache_new || !impl->cache_free ||
 			!impl->cache_add || !impl->cache_get ||
 			!impl->cache_remove || !impl->cache_have ||
 			!impl->cache_num_items)
 		return 0;
+	SYS_zero(DC_CACHE_EXT_cb, &tmp);
+	if(ext) {
+		/* An implementation built against an older (smaller) version
+		 * of the structure leaves the handlers it doesn't know about
+		 * NULL, and we ignore any we don't know about. */
+		if(ext->ext_size < sizeof(ext->ext_size))
+			return 0;
+		SYS_memcpy_n(unsigned char, (unsigned char *)&tmp,
+			(const unsigned char *)ext,
+			(ext->ext_size < sizeof(tmp) ? ext->ext_size :
+				sizeof(tmp)));
+	}
+	tmp.ext_size = sizeof(tmp);
+	if(!tmp.cache_get_ref != !tmp.cache_release)
+		return 0;
 	default_cache_implementation = impl;
+	SYS_memcpy(DC_CACHE_EXT_cb, &default_cache_ext, &tmp);
 	return 1;
 }
 
+const DC_CACHE_cb *DC_SERVER_get_cache(void)
+{
+	return default_cache_implementation;
+}
+
+const DC_CACHE_EXT_cb *DC_SERVER_get_cache_ex(void)
+{
+	if(!default_cache_implementation)
+		return NULL;
+	return &default_cache_ext;
+}
+
 DC_SERVER *DC_SERVER_new(unsigned int max_sessions)
+{
+	return DC_SERVER_new_ex(max_sessions, 0);
+}
+
+DC_SERVER *DC_SERVER_new_ex(unsigned int max_sessions,
+			unsigned long max_memory)
 {
 	DC_SERVER *toret;
 	if(!default_cache_implementation)
 		/* A cache implementation must be set before we can create
 		 * server structures. */
 		return NULL;
+	if(max_memory && !default_cache_ext.cache_new_ex)
+		/* The implementation can't be sized by memory */
+		return NULL;
 	toret = SYS_malloc(DC_SERVER, 1);
 	if(!toret)
 		return NULL;
@@ -281,7 +539,11 @@ DC_SERVER *DC_SERVER_new(unsigned int max_sessions)
 		return NULL;
 	}
 	toret->vt = default_cache_implementation;
-	toret->cache = toret->vt->cache_new(max_sessions);
+	SYS_memcpy(DC_CACHE_EXT_cb, &toret->ext, &default_cache_ext);
+	if(toret->ext.cache_new_ex)
+		toret->cache = toret->ext.cache_new_ex(max_sessions, max_memory);
+	else
+		toret->cache = toret->vt->cache_new(max_sessions);
 	if(!toret->cache) {
 		SYS_free(DC_CLIENT *, toret->clients);
 		SYS_free(DC_SERVER, toret);
@@ -290,6 +552,8 @@ DC_SERVER *DC_SERVER_new(unsigned int max_sessions)
 	toret->clients_used = 0;
 	toret->clients_size = DC_SERVER_START_SIZE;
 	toret->ops = 0;
+	toret->fwd = NULL;
+	toret->fwd_arg = NULL;
 	return toret;
 }
 
@@ -317,6 +581,13 @@ unsigned int DC_SERVER_items_stored(DC_SERVER *ctx,
 	return ctx->vt->cache_num_items(ctx->cache, now);
 }
 
+int DC_SERVER_get_stats(DC_SERVER *ctx, DC_CACHE_STATS *stats)
+{
+	if(!ctx->ext.cache_stats)
+		return 0;
+	return ctx->ext.cache_stats(ctx->cache, stats);
+}
+
 void DC_SERVER_reset_operations(DC_SERVER *ctx)
 {
 	ctx->ops = 0;
@@ -327,6 +598,57 @@ unsigned long DC_SERVER_num_operations(DC_SERVER *ctx)
 	return ctx->ops;
 }
 
+void DC_SERVER_set_forward(DC_SERVER *ctx, DC_SERVER_forward_cb fwd,
+			void *fwd_arg)
+{
+	ctx->fwd = fwd;
+	ctx->fwd_arg = fwd_arg;
+}
+
+int DC_SERVER_do_op(DC_SERVER *ctx, const struct timeval *now, int op,
+			const unsigned char *data, unsigned int data_len,
+			unsigned char *result, unsigned int room)
+{
+	if(!room)
+		return -1;
+	return int_op(ctx, now, op, data, data_len, result, room);
+}
+
+int DC_SERVER_forwarded(DC_CLIENT *clnt, const struct timeval *now,
+			const unsigned char *result, int result_len)
+{
+	int ret = result_len;
+	assert(clnt->forwarded);
+	clnt->forwarded = 0;
+	if(clnt->dead)
+		/* The request went with the connection */
+		return 0;
+	if(ret > 0) {
+		if((unsigned int)ret > DC_MAX_TOTAL_DATA - clnt->send_data_len)
+			ret = 0;
+		else {
+			SYS_memcpy_n(unsigned char, clnt->send_data +
+					clnt->send_data_len, result, ret);
+			clnt->send_data_len += ret;
+		}
+	}
+	if(clnt->cmd == DC_CMD_BATCH) {
+		if((ret = int_batch_entry(clnt, ret)) > 0)
+			ret = int_batch_run(clnt, now);
+		else if(ret < 0)
+			ret = int_batch_end(clnt);
+	} else
+		ret = (ret > 0);
+	if(!ret) {
+		DC_PLUG_consume(clnt->plug);
+		DC_PLUG_rollback(clnt->plug);
+	} else if(!clnt->forwarded)
+		ret = int_end_operation(clnt);
+	if(!ret)
+		clnt->dead = 1;
+	return ret;
+}
+
 DC_CLIENT *DC_SERVER_new_client(DC_SERVER *ctx,
 			NAL_CONNECTION *conn, unsigned int flags)
 {
@@ -361,6 +683,7 @@ DC_CLIENT *DC_SERVER_new_client(DC_SERVER *ctx,
 	c->plug = plug;
 	c->flags = flags;
 	c->read_data_len = c->send_data_len = 0;
+	c->forwarded = c->dead = 0;
 	ctx->clients[ctx->clients_used++] = c;
 	return c;
 }
@@ -385,12 +708,30 @@ int DC_SERVER_process_client(DC_CLIENT *clnt,
 	unsigned long request_uid;
 	DC_CMD cmd;
 	const unsigned char *payload_data;
-	unsigned int payload_len;
-	if(!DC_PLUG_read(clnt->plug, 0, &request_uid, &cmd,
-				&payload_data, &payload_len))
-		/* No request to read */
+	unsigned int payload_len, budget = DC_CLIENT_PIPELINE_MAX;
+	int ret;
+	if(clnt->forwarded)
+		/* Requests are answered in order, so the rest have to wait */
 		return 1;
-	return int_do_operation(clnt, now);
+	/* Answer every complete request that's already buffered, up to our
+	 * budget. Consuming each one decodes the next, and the responses queue
+	 * up in the send buffer to go out together in the next I/O pass. We
+	 * "resume" so that a request left open by a stall is picked up again. */
+	while(budget--) {
+		if(!DC_PLUG_read(clnt->plug, 1, &request_uid, &cmd,
+					&payload_data, &payload_len))
+			/* No request to read */
+			return 1;
+		if((ret = int_do_operation(clnt, now)) <= 0)
+			/* An error, or we have to wait for the send buffer */
+			return (ret < 0);
+		if(clnt->forwarded)
+			return 1;
+	}
+	/* Out of budget. Anything still buffered waits for the next pass, which
+	 * won't be delayed because the responses we've queued make the
+	 * connection writable straight away. */
+	return 1;
 }
 
 /*****************************************************************************/
@@ -402,9 +743,16 @@ int DC_SERVER_clients_io(DC_SERVER *ctx, const struct timeval *now)
 	DC_CLIENT *client;
 	while(idx < ctx->clients_used) {
 		client = ctx->clients[idx];
-		if((client->flags & DC_CLIENT_FLAG_IN_SERVER) &&
-				(!DC_PLUG_io(client->plug) ||
+		if(!(client->flags & DC_CLIENT_FLAG_IN_SERVER)) {
+			idx++;
+			continue;
+		}
+		if(!client->dead && (!DC_PLUG_io(client->plug) ||
 				!DC_SERVER_process_client(client, now)))
+			client->dead = 1;
+		/* A client waiting on a forwarded operation is kept until it
+		 * comes back */
+		if(client->dead && !client->forwarded)
 			int_server_del_client(ctx, idx);
 		else
 			idx++;
@@ -38,30 +38,131 @@
 /******************************************/
 /* The "DC_CACHE" structure details */
 
+/* Items are referred to by their index in the cache's item table, which never
+ * moves. This value is used as a "NULL" index in lists and hash chains. */
+#define DC_ITEM_NONE		((unsigned int)-1)
+
+/* Session payloads (the session id followed by the session data) are carved
+ * from fixed-size slabs. Slabs are allocated as the cache first needs them, up
+ * to the cache's limit, and are then kept, so a cache that has warmed up never
+ * calls malloc/free. A slab serves one size class while it has chunks in use
+ * and goes back to the pool of free slabs once its last chunk is freed, so a
+ * shift in the mix of session sizes doesn't strand memory in one class. Once
+ * every slab is in use, a session whose class has no free chunk gets one
+ * either by evicting a session from its class (or a bigger one) or by emptying
+ * a slab of another class and reassigning it, see int_slab_reclaim(). */
+#define DC_SLAB_SIZE		65536
+#define DC_SLAB_MIN_CHUNK	64
+#define DC_SLAB_MAX_CHUNK	(DC_MAX_ID_LEN + DC_MAX_DATA_LEN)
+#define DC_SLAB_MAX_CLASSES	DC_CACHE_STATS_MAX_CLASSES
+/* When sizing the arena from a session count, we allow for sessions of this
+ * average size. It's only a limit, slabs are allocated as sessions need them.
+ * Larger sessions are fine, but if the arena fills up before the item table
+ * does, sessions are expired early to make room. */
+#define DC_SLAB_AVG_ITEM	4096
+/* When sizing the item table from a memory budget alone, we assume sessions
+ * are this small on average so that it is the arena, not the item table, that
+ * runs out first. */
+#define DC_MEMORY_AVG_ITEM	512
+
+typedef struct st_DC_SLAB {
+	/* The slab's memory, once it has been allocated */
+	unsigned char *mem;
+	/* The size class this slab is carved for (only valid while in use) */
+	unsigned int cls;
+	/* The number of chunks handed out, the number of chunks carved from the
+	 * slab so far, and the first of the chunks that have been freed back
+	 * to the slab (each free chunk stores the index of the next). */
+	unsigned int used, carved, free_chunk;
+	/* Links in our class's list of partially-used slabs (or, for unused
+	 * slabs, 'next' links the free list). */
+	unsigned int prev, next;
+	/* The first of the items stored in this slab */
+	unsigned int items;
+} DC_SLAB;
+
+typedef struct st_DC_SLAB_CLASS {
+	unsigned int chunk_size, chunks_per_slab;
+	/* The first slab in this class with at least one free chunk */
+	unsigned int partial;
+	/* Counters for statistics */
+	unsigned int slabs, chunks_used;
+} DC_SLAB_CLASS;
+
 /* stores a single cache item */
 typedef struct st_DC_ITEM {
 	/* The time at which we will expire this session (calculated locally -
 	 * the client sends us a number of milli-seconds, and the server adds
 	 * that to the local time when the "add" operation is processed). */
 	struct timeval expiry;
-	/* The length of the session_id and the encoded session respectively */
-	unsigned int id_len, data_len;
-	/* A block of memory containing the session_id followed by the encoded
-	 * session. */
+	/* The timeout the session was added with, so we know its age */
+	unsigned int timeout;
+	/* The length of the session_id (no more than DC_MAX_ID_LEN) and the
+	 * encoded session respectively */
+	unsigned char id_len;
+	/* Set by "get"s and "have"s, for the CLOCK and SIEVE policies */
+	unsigned char referenced;
+	unsigned int data_len;
+	/* A chunk from the slab arena containing the session_id followed by the
+	 * encoded session, and the slab it was carved from. */
 	unsigned char *ptr;
+	unsigned int slab;
+	/* Links in our slab's list of items, so it can be emptied */
+	unsigned int slab_prev, slab_next;
+	/* The hash of the session_id, saves recomputing it when unlinking and
+	 * lets us skip most memcmp()s when walking a bucket. */
+	unsigned int hash;
+	/* Our position in the expiry heap */
+	unsigned int heap_idx;
+	/* Links in the eviction list (or, for unused items, 'next' links the
+	 * free list). */
+	unsigned int prev, next;
+	/* The next item in the same hash bucket */
+	unsigned int hash_next;
 } DC_ITEM;
 
 struct st_DC_CACHE {
-	/* Our session storage */
+	/* Our session storage. Items never move once allocated, unused items
+	 * are chained from 'unused'. */
 	DC_ITEM *items;
-	unsigned int items_used, items_size;
-	unsigned int expire_delta;
+	unsigned int items_used, items_size, unused;
+	/* A binary min-heap of item indices keyed on expiry, so the next
+	 * session to expire is always 'heap[0]'. It has 'items_used' entries
+	 * and each item records its own position ('heap_idx') so it can be
+	 * removed from the middle without searching. */
+	unsigned int *heap;
+	/* How we choose a session to evict when we're full. Except for
+	 * DC_CACHE_EVICT_EXPIRY, which just uses the heap, sessions are
+	 * linked from 'first' (newest) to 'last' (oldest) and, for SIEVE,
+	 * 'hand' is where the last search for a victim stopped. */
+	DC_CACHE_EVICT policy;
+	unsigned int first, last, hand;
+	/* Eviction statistics */
+	unsigned long evictions;
+	double victim_age_total;
+	unsigned long victim_age_last;
+	unsigned long slab_moves, slab_evictions;
+	/* The hash index over session ids. 'buckets_mask + 1' is a power of two
+	 * at least as large as 'items_size'. */
+	unsigned int *buckets;
+	unsigned long buckets_mask;
+	/* Payload storage, up to 'slabs_total' slabs of DC_SLAB_SIZE, of
+	 * which the first 'slabs_ready' have been allocated. They're malloc'd
+	 * one at a time, except in shared caches where they're taken in order
+	 * from 'arena' (otherwise NULL), which the kernel only backs with
+	 * memory as it's touched. */
+	unsigned char *arena;
+	DC_SLAB *slabs;
+	unsigned int slabs_total, slabs_ready, slabs_free, free_slab;
+	DC_SLAB_CLASS classes[DC_SLAB_MAX_CLASSES];
+	unsigned int num_classes;
 	/* Cached lookups. Mostly used so that a call to "DC_CACHE_get" with a
 	 * NULL 'store' (to find the size of the session to be copied before
 	 * finding room to copy it to) followed by another call with a non-NULL
 	 * 'store' doesn't do two searches. It also helps if an "add" operation
 	 * is followed immediately by a "get" or "remove" (eg. session
-	 * resumption and renegotiation, respectively). */
+	 * resumption and renegotiation, respectively). Since the hash index
+	 * was added this is only a fast-path, lookups don't depend on it. */
 	unsigned char cached_id[DC_MAX_ID_LEN];
 	unsigned int cached_id_len;
 	int cached_idx; /* -1 means a cached lookup for a session that doesn't
@@ -94,36 +195,15 @@ static unsigned int cached_hits = 0;
 #define CACHED_HIT
 #endif
 
-/* 'num' entries have been scrolled off the front of the cache, take the
- * appropriate action with the cached-lookup */
-static void int_lookup_expired(DC_CACHE *cache, unsigned int num)
-{
-	/* The whole list slipped 'num' to the left */
-	cache->cached_idx -= num;
-	/* If that put cached_idx into the red, it means the cached item has
-	 * been removed. */
-	if(cache->cached_idx < 0) {
-		cache->cached_idx = -1;
-		CACHED_REMOVE
-	}
-}
-
 /* A specific index in the cache has been removed - check if this affects the
- * cached-lookup. */
+ * cached-lookup. Items don't move, so nothing else needs adjusting. */
 static void int_lookup_removed(DC_CACHE *cache, unsigned int idx)
 {
-	/* At worst case, the last item in the array was deleted and
-	 * cache->items_used has already been decremented so idx is the first
-	 * unused spot in the array. */
-	assert(idx <= cache->items_used);
 	if(cache->cached_idx == (int)idx) {
 		/* Our cached item was the one removed */
 		cache->cached_idx = -1;
 		CACHED_REMOVE
-	} else if(cache->cached_idx > (int)idx)
-		/* Our cached item was after the removed item, so the index has
-		 * moved left */
-		cache->cached_idx--;
+	}
 }
 
 /* This function is to use the cached-lookup prior to doing an actual search */
@@ -159,151 +239,735 @@ static void int_lookup_set(DC_CACHE *cache,
 	cache->cached_idx = idx;
 }
 
+/*******************************************************/
+/* Internal functions to manage the session-id hashing */
+
+/* FNV-1a. Session ids are usually random already, this just has to spread
+ * whatever we're given evenly over the buckets. */
+static unsigned int int_hash(const unsigned char *ptr, unsigned int len)
+{
+	unsigned long h = 2166136261UL;
+	while(len--) {
+		h ^= *(ptr++);
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	return (unsigned int)h;
+}
+
+static void int_hash_link(DC_CACHE *cache, unsigned int idx)
+{
+	DC_ITEM *item = cache->items + idx;
+	unsigned int *bucket = cache->buckets +
+				(item->hash & cache->buckets_mask);
+	item->hash_next = *bucket;
+	*bucket = idx;
+}
+
+static void int_hash_unlink(DC_CACHE *cache, unsigned int idx)
+{
+	DC_ITEM *item = cache->items + idx;
+	unsigned int *pidx = cache->buckets +
+				(item->hash & cache->buckets_mask);
+	while(*pidx != idx) {
+		assert(*pidx != DC_ITEM_NONE);
+		pidx = &cache->items[*pidx].hash_next;
+	}
+	*pidx = item->hash_next;
+}
+
+/*************************************************/
+/* Internal functions to manage the expiry heap */
+
+#define HEAP_EXPIRY(c,h)	(&(c)->items[(c)->heap[h]].expiry)
+
+static void int_heap_set(DC_CACHE *cache, unsigned int pos, unsigned int idx)
+{
+	cache->heap[pos] = idx;
+	cache->items[idx].heap_idx = pos;
+}
+
+/* Move the item at heap position 'pos' towards the root until its parent
+ * doesn't expire after it. Returns the final position. */
+static unsigned int int_heap_up(DC_CACHE *cache, unsigned int pos)
+{
+	unsigned int idx = cache->heap[pos], parent;
+	const struct timeval *expiry = &cache->items[idx].expiry;
+	while(pos > 0) {
+		parent = (pos - 1) / 2;
+		if(SYS_timecmp(HEAP_EXPIRY(cache, parent), expiry) <= 0)
+			break;
+		int_heap_set(cache, pos, cache->heap[parent]);
+		pos = parent;
+	}
+	int_heap_set(cache, pos, idx);
+	return pos;
+}
+
+/* Move the item at heap position 'pos' away from the root until neither of
+ * its children expire before it. */
+static void int_heap_down(DC_CACHE *cache, unsigned int pos)
+{
+	unsigned int idx = cache->heap[pos], child;
+	const struct timeval *expiry = &cache->items[idx].expiry;
+	while((child = pos * 2 + 1) < cache->items_used) {
+		if((child + 1 < cache->items_used) &&
+				(SYS_timecmp(HEAP_EXPIRY(cache, child + 1),
+					HEAP_EXPIRY(cache, child)) < 0))
+			child++;
+		if(SYS_timecmp(expiry, HEAP_EXPIRY(cache, child)) <= 0)
+			break;
+		int_heap_set(cache, pos, cache->heap[child]);
+		pos = child;
+	}
+	int_heap_set(cache, pos, idx);
+}
+
+/* NB: the caller must have already incremented 'items_used' */
+static void int_heap_insert(DC_CACHE *cache, unsigned int idx)
+{
+	int_heap_set(cache, cache->items_used - 1, idx);
+	int_heap_up(cache, cache->items_used - 1);
+}
+
+/* NB: the caller must have already decremented 'items_used' */
+static void int_heap_remove(DC_CACHE *cache, unsigned int idx)
+{
+	unsigned int pos = cache->items[idx].heap_idx;
+	if(pos == cache->items_used)
+		/* It was the last entry, nothing to fill in */
+		return;
+	/* Move the last entry into the hole and restore heap order */
+	int_heap_set(cache, pos, cache->heap[cache->items_used]);
+	if(int_heap_up(cache, pos) == pos)
+		int_heap_down(cache, pos);
+}
+
+/************************************************/
+/* Internal functions to manage the slab arena */
+
+#define SLAB_PTR(c,s)		((c)->slabs[s].mem)
+#define CHUNK_PTR(c,s,n)	(SLAB_PTR(c,s) + \
+			(unsigned long)(n) * (c)->classes[(c)->slabs[s].cls].chunk_size)
+
+static void int_slab_link(DC_CACHE *cache, unsigned int *head, unsigned int s)
+{
+	DC_SLAB *slab = cache->slabs + s;
+	slab->prev = DC_ITEM_NONE;
+	slab->next = *head;
+	if(*head != DC_ITEM_NONE)
+		cache->slabs[*head].prev = s;
+	*head = s;
+}
+
+static void int_slab_unlink(DC_CACHE *cache, unsigned int *head, unsigned int s)
+{
+	DC_SLAB *slab = cache->slabs + s;
+	if(slab->prev == DC_ITEM_NONE)
+		*head = slab->next;
+	else
+		cache->slabs[slab->prev].next = slab->next;
+	if(slab->next != DC_ITEM_NONE)
+		cache->slabs[slab->next].prev = slab->prev;
+}
+
+/* The memory used per session by the item table, heap and hash index */
+#define DC_ITEM_OVERHEAD	(sizeof(DC_ITEM) + 2 * sizeof(unsigned int))
+
+/* Sets up the size classes in 'classes' and returns how many there are */
+static unsigned int int_slab_classes(DC_SLAB_CLASS *classes)
+{
+	unsigned int num = 0, size = DC_SLAB_MIN_CHUNK;
+	DC_SLAB_CLASS *c = classes;
+	/* Each class is ~25% bigger than the last (8-byte aligned) */
+	do {
+		if(size > DC_SLAB_MAX_CHUNK)
+			size = DC_SLAB_MAX_CHUNK;
+		assert(num < DC_SLAB_MAX_CLASSES);
+		c->chunk_size = size;
+		c->chunks_per_slab = DC_SLAB_SIZE / size;
+		c->partial = DC_ITEM_NONE;
+		c->slabs = c->chunks_used = 0;
+		num++;
+		c++;
+		size = ((size + size / 4) + 7) & ~7;
+	} while(c[-1].chunk_size < DC_SLAB_MAX_CHUNK);
+	return num;
+}
+
+/* Puts all the slabs that have been allocated back in the free pool */
+static void int_slab_init(DC_CACHE *cache)
+{
+	unsigned int idx;
+	cache->num_classes = int_slab_classes(cache->classes);
+	cache->free_slab = DC_ITEM_NONE;
+	for(idx = cache->slabs_ready; idx-- > 0; ) {
+		cache->slabs[idx].next = cache->free_slab;
+		cache->free_slab = idx;
+	}
+	cache->slabs_free = cache->slabs_total;
+}
+
+/* Allocates another slab into the free pool, returns zero if the cache already
+ * has all it's allowed (or there's no memory for it). */
+static int int_slab_grow(DC_CACHE *cache)
+{
+	unsigned int s = cache->slabs_ready;
+	DC_SLAB *slab = cache->slabs + s;
+	if(s == cache->slabs_total)
+		return 0;
+	if(cache->arena)
+		slab->mem = cache->arena + (unsigned long)s * DC_SLAB_SIZE;
+	else if((slab->mem = SYS_malloc(unsigned char, DC_SLAB_SIZE)) == NULL)
+		return 0;
+	slab->next = cache->free_slab;
+	cache->free_slab = s;
+	cache->slabs_ready++;
+	return 1;
+}
+
+/* Take a chunk from class 'cls', which must have a partially-used slab or
+ * there must be a free slab available. The slab is returned in 'ps'. */
+static unsigned char *int_slab_carve(DC_CACHE *cache, unsigned int cls,
+			unsigned int *ps)
+{
+	DC_SLAB_CLASS *c = cache->classes + cls;
+	unsigned int s = c->partial;
+	unsigned char *ptr;
+	DC_SLAB *slab;
+	if(s == DC_ITEM_NONE) {
+		/* Dedicate a free slab to this class */
+		s = cache->free_slab;
+		assert(s != DC_ITEM_NONE);
+		slab = cache->slabs + s;
+		cache->free_slab = slab->next;
+		cache->slabs_free--;
+		slab->cls = cls;
+		slab->used = slab->carved = 0;
+		slab->free_chunk = DC_ITEM_NONE;
+		slab->items = DC_ITEM_NONE;
+		int_slab_link(cache, &c->partial, s);
+		c->slabs++;
+	}
+	slab = cache->slabs + s;
+	if(slab->free_chunk != DC_ITEM_NONE) {
+		ptr = CHUNK_PTR(cache, s, slab->free_chunk);
+		SYS_memcpy(unsigned int, &slab->free_chunk,
+				(unsigned int *)ptr);
+	} else
+		ptr = CHUNK_PTR(cache, s, slab->carved++);
+	if(++slab->used == c->chunks_per_slab)
+		/* No longer partial */
+		int_slab_unlink(cache, &c->partial, s);
+	c->chunks_used++;
+	*ps = s;
+	return ptr;
+}
+
+/* The smallest class with chunks of at least 'len' bytes */
+static unsigned int int_slab_class(const DC_CACHE *cache, unsigned int len)
+{
+	unsigned int cls = 0;
+	assert(len && (len <= DC_SLAB_MAX_CHUNK));
+	while(cache->classes[cls].chunk_size < len)
+		cls++;
+	return cls;
+}
+
+/* Returns NULL if the arena has no room for a chunk of 'len' bytes, otherwise
+ * the slab it came from is returned in 'ps'. */
+static unsigned char *int_slab_alloc(DC_CACHE *cache, unsigned int len,
+			unsigned int *ps)
+{
+	unsigned int cls = int_slab_class(cache, len);
+	/* Try our own class first (including taking a free slab for it, or
+	 * allocating one), and failing that, settle for a spare chunk in a
+	 * bigger class. */
+	if((cache->classes[cls].partial != DC_ITEM_NONE) ||
+			(cache->free_slab != DC_ITEM_NONE) ||
+			int_slab_grow(cache))
+		return int_slab_carve(cache, cls, ps);
+	while(++cls < cache->num_classes)
+		if(cache->classes[cls].partial != DC_ITEM_NONE)
+			return int_slab_carve(cache, cls, ps);
+	return NULL;
+}
+
+static void int_slab_free(DC_CACHE *cache, unsigned int s, unsigned char *ptr)
+{
+	DC_SLAB *slab = cache->slabs + s;
+	DC_SLAB_CLASS *c = cache->classes + slab->cls;
+	unsigned int chunk;
+	assert((s < cache->slabs_ready) && slab->used);
+	chunk = (unsigned int)(ptr - slab->mem) / c->chunk_size;
+	if(slab->used == c->chunks_per_slab)
+		/* It's about to become partial again */
+		int_slab_link(cache, &c->partial, s);
+	SYS_memcpy(unsigned int, (unsigned int *)ptr, &slab->free_chunk);
+	slab->free_chunk = chunk;
+	c->chunks_used--;
+	if(--slab->used == 0) {
+		/* Give the whole slab back */
+		int_slab_unlink(cache, &c->partial, s);
+		c->slabs--;
+		slab->next = cache->free_slab;
+		cache->free_slab = s;
+		cache->slabs_free++;
+	}
+}
+
+/******************************************************/
+/* Internal functions to manage the eviction policies */
+
+/* The policy used by caches we create (see DC_SERVER_set_default_cache_ex) */
+static DC_CACHE_EVICT default_policy = DC_CACHE_EVICT_EXPIRY;
+
+static void int_evict_link(DC_CACHE *cache, unsigned int idx)
+{
+	DC_ITEM *item = cache->items + idx;
+	item->referenced = 0;
+	item->prev = DC_ITEM_NONE;
+	item->next = cache->first;
+	if(cache->first == DC_ITEM_NONE)
+		cache->last = idx;
+	else
+		cache->items[cache->first].prev = idx;
+	cache->first = idx;
+}
+
+static void int_evict_unlink(DC_CACHE *cache, unsigned int idx)
+{
+	DC_ITEM *item = cache->items + idx;
+	/* SIEVE's hand moves on from an item that goes away */
+	if(cache->hand == idx)
+		cache->hand = item->prev;
+	if(item->prev == DC_ITEM_NONE)
+		cache->first = item->next;
+	else
+		cache->items[item->prev].next = item->next;
+	if(item->next == DC_ITEM_NONE)
+		cache->last = item->prev;
+	else
+		cache->items[item->next].prev = item->prev;
+}
+
+/* A "get" or "have" found this item */
+static void int_evict_touch(DC_CACHE *cache, unsigned int idx)
+{
+	switch(cache->policy) {
+	case DC_CACHE_EVICT_LRU:
+		if(cache->first != idx) {
+			int_evict_unlink(cache, idx);
+			int_evict_link(cache, idx);
+		}
+		break;
+	case DC_CACHE_EVICT_CLOCK:
+	case DC_CACHE_EVICT_SIEVE:
+		cache->items[idx].referenced = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+/* When a session needs a chunk of a particular size class, the victim has to
+ * come from that class or a bigger one. The policy passes over at most this
+ * many colder sessions of smaller classes looking for one. */
+#define DC_EVICT_SCAN		256
+
+#define ITEM_CLASS(c,i)		((c)->slabs[(c)->items[i].slab].cls)
+
+/* The expiry policy's victim from class 'cls' or bigger. The heap is searched
+ * best-first, so sessions are considered in the order they expire. */
+static unsigned int int_evict_victim_expiry(DC_CACHE *cache, unsigned int cls)
+{
+	unsigned int front[DC_EVICT_SCAN + 1];
+	unsigned int num = 1, loop, best, pos, scanned = 0;
+	front[0] = 0;
+	while(num && (scanned++ < DC_EVICT_SCAN)) {
+		for(best = 0, loop = 1; loop < num; loop++)
+			if(SYS_timecmp(HEAP_EXPIRY(cache, front[loop]),
+					HEAP_EXPIRY(cache, front[best])) < 0)
+				best = loop;
+		pos = front[best];
+		if(ITEM_CLASS(cache, cache->heap[pos]) >= cls)
+			return cache->heap[pos];
+		front[best] = front[--num];
+		if(pos * 2 + 1 < cache->items_used)
+			front[num++] = pos * 2 + 1;
+		if(pos * 2 + 2 < cache->items_used)
+			front[num++] = pos * 2 + 2;
+	}
+	return DC_ITEM_NONE;
+}
+
+/* Choose the item to evict when we need room, from size class 'cls' or bigger
+ * (so zero means any). Only called when the cache is non-empty, and returns
+ * DC_ITEM_NONE if 'cls' is non-zero and no victim was found in DC_EVICT_SCAN
+ * tries. */
+static unsigned int int_evict_victim(DC_CACHE *cache, unsigned int cls)
+{
+	unsigned int idx, prev, skipped = 0;
+	assert(cache->items_used);
+	switch(cache->policy) {
+	case DC_CACHE_EVICT_LRU:
+		for(idx = cache->last; idx != DC_ITEM_NONE;
+				idx = cache->items[idx].prev) {
+			if(ITEM_CLASS(cache, idx) >= cls)
+				return idx;
+			if(++skipped == DC_EVICT_SCAN)
+				break;
+		}
+		return DC_ITEM_NONE;
+	case DC_CACHE_EVICT_CLOCK:
+		/* Referenced items get a second chance by going back to the
+		 * front, this terminates because they lose the reference. */
+		idx = cache->last;
+		for(;;) {
+			prev = cache->items[idx].prev;
+			if(cache->items[idx].referenced) {
+				int_evict_unlink(cache, idx);
+				int_evict_link(cache, idx);
+			} else if(ITEM_CLASS(cache, idx) >= cls)
+				return idx;
+			else if(++skipped == DC_EVICT_SCAN)
+				return DC_ITEM_NONE;
+			idx = (prev == DC_ITEM_NONE) ? cache->last : prev;
+		}
+	case DC_CACHE_EVICT_SIEVE:
+		/* The hand sweeps from oldest to newest, clearing references
+		 * as it goes, and wraps around. Items aren't moved, so new
+		 * items behind the hand wait for the next sweep. */
+		idx = (cache->hand == DC_ITEM_NONE) ? cache->last : cache->hand;
+		for(;;) {
+			if(cache->items[idx].referenced)
+				cache->items[idx].referenced = 0;
+			else if(ITEM_CLASS(cache, idx) >= cls) {
+				cache->hand = idx;
+				return idx;
+			} else if(++skipped == DC_EVICT_SCAN)
+				return DC_ITEM_NONE;
+			idx = cache->items[idx].prev;
+			if(idx == DC_ITEM_NONE)
+				idx = cache->last;
+		}
+	default:
+		if(!cls)
+			return cache->heap[0];
+		return int_evict_victim_expiry(cache, cls);
+	}
+}
+
+/* Returns how many milli-seconds remain until 'expiry' (zero if it has
+ * passed). */
+static unsigned long int_msecs_left(const struct timeval *expiry,
+			const struct timeval *now)
+{
+	if(SYS_timecmp(expiry, now) <= 0)
+		return 0;
+	return (unsigned long)(expiry->tv_sec - now->tv_sec) * 1000 +
+		(expiry->tv_usec / 1000) - (now->tv_usec / 1000);
+}
+
 /**************************************************************/
 /* Internal functions to manage the session items in a server */
 
-static void int_pre_remove_DC_ITEM(DC_ITEM *item)
+static void int_remove_DC_ITEM(DC_CACHE *cache, unsigned int idx)
 {
-	SYS_free(unsigned char, item->ptr);
+	DC_ITEM *item;
+	assert(idx < cache->items_size);
+	item = cache->items + idx;
+	if(item->slab_prev == DC_ITEM_NONE)
+		cache->slabs[item->slab].items = item->slab_next;
+	else
+		cache->items[item->slab_prev].slab_next = item->slab_next;
+	if(item->slab_next != DC_ITEM_NONE)
+		cache->items[item->slab_next].slab_prev = item->slab_prev;
+	int_slab_free(cache, item->slab, item->ptr);
 	item->ptr = NULL;
+	int_hash_unlink(cache, idx);
+	if(cache->policy != DC_CACHE_EVICT_EXPIRY)
+		int_evict_unlink(cache, idx);
+	cache->items_used--;
+	int_heap_remove(cache, idx);
+	/* Put it on the free list */
+	item->next = cache->unused;
+	cache->unused = idx;
+	int_lookup_removed(cache, idx);
 }
 
-static void int_force_expire(DC_CACHE *cache, unsigned int num)
+/* Evicts the session the cache's policy chose */
+static void int_evict_item(DC_CACHE *cache, unsigned int idx,
+			const struct timeval *now)
 {
-	assert((num > 0) && (num <= cache->items_used));
-	/* Only "memmove" if we're not expiring everything */
-	if(num < cache->items_used)
-		SYS_memmove_n(DC_ITEM, cache->items, cache->items + num,
-				cache->items_used - num);
-	cache->items_used -= num;
-	/* How does this affect cached lookups? */
-	int_lookup_expired(cache, num);
+	DC_ITEM *item = cache->items + idx;
+	unsigned long left = int_msecs_left(&item->expiry, now);
+	cache->victim_age_last = (left < item->timeout) ?
+				item->timeout - left : 0;
+	cache->victim_age_total += cache->victim_age_last;
+	cache->evictions++;
+	int_remove_DC_ITEM(cache, idx);
 }
 
-static void int_expire(DC_CACHE *cache, const struct timeval *now)
+/* Make room by evicting one session according to the cache's policy */
+static void int_evict(DC_CACHE *cache, const struct timeval *now)
 {
-	unsigned int idx = 0, toexpire = 0;
-	DC_ITEM *item = cache->items;
-	while((idx < cache->items_used) && (SYS_timecmp(now,
-				&(item->expiry)) > 0)) {
-		/* Do pre-remove cleanup but don't do the remove, this is
-		 * because we can do one giant scroll in int_force_expire()
-		 * rather than lots of little ones by calling
-		 * int_remove_DC_ITEM(), for example. */
-		int_pre_remove_DC_ITEM(item);
-		idx++;
-		item++;
-		toexpire++;
+	int_evict_item(cache, int_evict_victim(cache, 0), now);
+}
+
+/* The arena is full and has no chunk for a session of 'len' bytes. Evicting
+ * the policy's victim from among the sessions big enough to leave a chunk that
+ * will do is enough. If the policy doesn't find one, the slab of its victim
+ * from any class is emptied (evicting the other sessions in it too) and goes
+ * back to the free pool, to be reassigned to the class that needs it. Either
+ * way no more than one slab's worth of sessions goes. Returns zero if the
+ * cache is empty. */
+static int int_slab_reclaim(DC_CACHE *cache, const struct timeval *now,
+			unsigned int len)
+{
+	unsigned int idx, s;
+	if(!cache->items_used)
+		return 0;
+	idx = int_evict_victim(cache, int_slab_class(cache, len));
+	if(idx != DC_ITEM_NONE) {
+		int_evict_item(cache, idx, now);
+		return 1;
 	}
-	if(toexpire)
-		int_force_expire(cache, toexpire);
+	s = cache->items[int_evict_victim(cache, 0)].slab;
+	cache->slab_moves++;
+	while(cache->slabs[s].used) {
+		cache->slab_evictions++;
+		int_remove_DC_ITEM(cache, cache->slabs[s].items);
+	}
+	return 1;
+}
+
+static void int_expire(DC_CACHE *cache, const struct timeval *now)
+{
+	while(cache->items_used && (SYS_timecmp(now,
+				HEAP_EXPIRY(cache, 0)) > 0))
+		int_remove_DC_ITEM(cache, cache->heap[0]);
 }
 
 static int int_find_DC_ITEM(DC_CACHE *cache, const unsigned char *ptr,
 				unsigned int len, const struct timeval *now)
 {
-	unsigned int idx;
-	DC_ITEM *item = cache->items;
+	unsigned int idx, hash;
+	DC_ITEM *item;
 	/* First flush out expired entries */
 	int_expire(cache, now);
 	/* See if we have a lookup for this session cached */
 	if(int_lookup_check(cache, ptr, len, &idx))
 		/* Yes! */
 		return idx;
-	idx = 0;
-	while(idx < cache->items_used) {
-		if((item->id_len == len) && (memcmp(item->ptr, ptr, len) == 0)) {
+	hash = int_hash(ptr, len);
+	idx = cache->buckets[hash & cache->buckets_mask];
+	while(idx != DC_ITEM_NONE) {
+		item = cache->items + idx;
+		if((item->hash == hash) && (item->id_len == len) &&
+				(memcmp(item->ptr, ptr, len) == 0)) {
 			/* Found the session - cache it and return the idx */
 			int_lookup_set(cache, ptr, len, idx);
 			return (int)idx;
 		}
-		idx++;
-		item++;
+		idx = item->hash_next;
 	}
 	return -1;
 }
 
-static int int_add_DC_ITEM(DC_CACHE *cache, unsigned int idx,
-		const struct timeval *expiry,
+static int int_add_DC_ITEM(DC_CACHE *cache,
+		const struct timeval *now, unsigned long timeout_msecs,
 		const unsigned char *session_id, unsigned int session_id_len,
 		const unsigned char *data, unsigned int data_len)
 {
 	unsigned char *ptr;
+	unsigned int idx, s;
 	DC_ITEM *item;
 
 	/* So we'll definitely insert - take care of the one remaining error
-	 * possibility first, malloc. */
-	ptr = SYS_malloc(unsigned char, session_id_len + data_len);
-	if(!ptr)
+	 * possibility first, room in the arena. */
+	if(((ptr = int_slab_alloc(cache, session_id_len + data_len,
+				&s)) == NULL) &&
+			(!int_slab_reclaim(cache, now,
+				session_id_len + data_len) ||
+			((ptr = int_slab_alloc(cache, session_id_len + data_len,
+				&s)) == NULL)))
 		return 0;
+	assert(cache->unused != DC_ITEM_NONE);
+	idx = cache->unused;
 	item = cache->items + idx;
-	/* Do we need to shuffle existing items? */
-	if(idx < cache->items_used)
-		/* This is a genuine insertion rather than an append */
-		SYS_memmove_n(DC_ITEM, item + 1, item,
-				cache->items_used - idx);
+	cache->unused = item->next;
 	/* Populate the entry */
-	SYS_timecpy(&item->expiry, expiry);
+	SYS_timeadd(&item->expiry, now, timeout_msecs);
+	item->timeout = timeout_msecs;
 	item->ptr = ptr;
+	item->slab = s;
+	item->slab_prev = DC_ITEM_NONE;
+	item->slab_next = cache->slabs[s].items;
+	if(item->slab_next != DC_ITEM_NONE)
+		cache->items[item->slab_next].slab_prev = idx;
+	cache->slabs[s].items = idx;
 	item->id_len = session_id_len;
 	item->data_len = data_len;
 	SYS_memcpy_n(unsigned char, item->ptr, session_id, session_id_len);
 	SYS_memcpy_n(unsigned char, item->ptr + item->id_len, data, data_len);
+	item->hash = int_hash(session_id, session_id_len);
+	int_hash_link(cache, idx);
 	cache->items_used++;
+	int_heap_insert(cache, idx);
+	if(cache->policy != DC_CACHE_EVICT_EXPIRY)
+		int_evict_link(cache, idx);
 	/* Cache this item as a lookup */
 	int_lookup_set(cache, session_id, session_id_len, idx);
 	return 1;
 }
 
-static void int_remove_DC_ITEM(DC_CACHE *cache, unsigned int idx)
+/**************************************************************/
+/* Internal functions to size, lay out and initialise a cache */
+
+/* The sizes of a cache's tables, see int_cache_dims() */
+typedef struct st_DC_CACHE_DIMS {
+	unsigned int sessions, slabs;
+	unsigned long buckets;
+} DC_CACHE_DIMS;
+
+/* Everything a cache uses is carved from one block, each piece of which is
+ * aligned to this. */
+#define DC_ALIGN(n)	(((unsigned long)(n) + 15) & ~(unsigned long)15)
+
+/* Either of 'max_sessions' and 'max_memory' may be zero, in which case it is
+ * derived from the other. */
+static int int_cache_dims(DC_CACHE_DIMS *dims, unsigned int max_sessions,
+			unsigned long max_memory)
 {
-	DC_ITEM *item;
-	assert(idx < cache->items_used);
-	item = cache->items + idx;
-	int_pre_remove_DC_ITEM(item);
-	cache->items_used--;
-	if(idx < cache->items_used)
-		SYS_memmove_n(DC_ITEM, cache->items + idx,
-				cache->items + (idx + 1),
-				cache->items_used - idx);
-	int_lookup_removed(cache, idx);
+	DC_SLAB_CLASS classes[DC_SLAB_MAX_CLASSES];
+	unsigned long num_slabs, min_slabs;
+	if(!max_sessions) {
+		unsigned long derived = max_memory /
+				(DC_ITEM_OVERHEAD + DC_MEMORY_AVG_ITEM);
+		if(derived > DC_CACHE_MAX_SIZE)
+			derived = DC_CACHE_MAX_SIZE;
+		max_sessions = (unsigned int)derived;
+	}
+	if((max_sessions < DC_CACHE_MIN_SIZE) ||
+			(max_sessions > DC_CACHE_MAX_SIZE))
+		return 0;
+	dims->sessions = max_sessions;
+	dims->buckets = 1;
+	while(dims->buckets < max_sessions)
+		dims->buckets <<= 1;
+	/* Every class needs to be able to have a couple of slabs */
+	min_slabs = int_slab_classes(classes) * 2;
+	if(max_memory) {
+		/* The arena gets whatever the item table and index don't use,
+		 * and a budget that leaves too little for it is refused rather
+		 * than exceeded. */
+		unsigned long overhead = sizeof(DC_CACHE) +
+				max_sessions * DC_ITEM_OVERHEAD;
+		if(max_memory <= overhead)
+			return 0;
+		num_slabs = (max_memory - overhead) / DC_SLAB_SIZE;
+		if(num_slabs < min_slabs)
+			return 0;
+	} else {
+		num_slabs = ((unsigned long)max_sessions * DC_SLAB_AVG_ITEM +
+				DC_SLAB_SIZE - 1) / DC_SLAB_SIZE;
+		if(num_slabs < min_slabs)
+			num_slabs = min_slabs;
+	}
+	dims->slabs = (unsigned int)num_slabs;
+	return 1;
+}
+
+/* The size of the block int_cache_carve() needs, including the arena if
+ * 'with_arena' is non-zero */
+static unsigned long int_cache_bytes(const DC_CACHE_DIMS *dims, int with_arena)
+{
+	return DC_ALIGN(sizeof(DC_CACHE)) +
+		DC_ALIGN((unsigned long)dims->sessions * sizeof(DC_ITEM)) +
+		DC_ALIGN((unsigned long)dims->sessions * sizeof(unsigned int)) +
+		DC_ALIGN(dims->buckets * sizeof(unsigned int)) +
+		DC_ALIGN((unsigned long)dims->slabs * sizeof(DC_SLAB)) +
+		(with_arena ? (unsigned long)dims->slabs * DC_SLAB_SIZE : 0);
+}
+
+/* Empties 'cache', which is also how a cache is first initialised */
+static void int_cache_init(DC_CACHE *cache)
+{
+	unsigned int idx;
+	unsigned long bucket = cache->buckets_mask + 1;
+	while(bucket--)
+		cache->buckets[bucket] = DC_ITEM_NONE;
+	/* All items start out on the free list */
+	for(idx = 0; idx < cache->items_size; idx++)
+		cache->items[idx].next = idx + 1;
+	cache->items[cache->items_size - 1].next = DC_ITEM_NONE;
+	cache->unused = 0;
+	cache->items_used = 0;
+	cache->first = cache->last = cache->hand = DC_ITEM_NONE;
+	cache->evictions = cache->victim_age_last = 0;
+	cache->victim_age_total = 0;
+	cache->slab_moves = cache->slab_evictions = 0;
+	int_slab_init(cache);
+	/* Make sure we have no weird cached-lookup state */
+	int_lookup_set(cache, NULL, 0, -1);
+}
+
+/* Lays out a cache of the given dimensions in 'block', which must be at least
+ * int_cache_bytes() long, and initialises it. If 'with_arena' is zero, slabs
+ * are malloc'd as they're needed. */
+static DC_CACHE *int_cache_carve(unsigned char *block,
+			const DC_CACHE_DIMS *dims, DC_CACHE_EVICT policy,
+			int with_arena)
+{
+	DC_CACHE *cache = (DC_CACHE *)block;
+	block += DC_ALIGN(sizeof(DC_CACHE));
+	cache->items = (DC_ITEM *)block;
+	block += DC_ALIGN((unsigned long)dims->sessions * sizeof(DC_ITEM));
+	cache->heap = (unsigned int *)block;
+	block += DC_ALIGN((unsigned long)dims->sessions * sizeof(unsigned int));
+	cache->buckets = (unsigned int *)block;
+	block += DC_ALIGN(dims->buckets * sizeof(unsigned int));
+	cache->slabs = (DC_SLAB *)block;
+	block += DC_ALIGN((unsigned long)dims->slabs * sizeof(DC_SLAB));
+	cache->arena = (with_arena ? block : NULL);
+	cache->items_size = dims->sessions;
+	cache->buckets_mask = dims->buckets - 1;
+	cache->slabs_total = dims->slabs;
+	cache->slabs_ready = 0;
+	cache->policy = policy;
+	int_cache_init(cache);
+	return cache;
 }
 
 /*********************************************************/
 /* Our high-level cache implementation handler functions */
 
-static DC_CACHE *cache_new(unsigned int max_sessions)
+static DC_CACHE *cache_new_ex(unsigned int max_sessions,
+			unsigned long max_memory)
 {
-	DC_CACHE *toret;
-	if((max_sessions < DC_CACHE_MIN_SIZE) ||
-			(max_sessions > DC_CACHE_MAX_SIZE))
-		return NULL;
-	toret = SYS_malloc(DC_CACHE, 1);
-	if(!toret)
+	DC_CACHE_DIMS dims;
+	unsigned char *block;
+	if(!int_cache_dims(&dims, max_sessions, max_memory))
 		return NULL;
-	toret->items = SYS_malloc(DC_ITEM, max_sessions);
-	if(!toret->items) {
-		SYS_free(DC_CACHE, toret);
+	block = SYS_malloc(unsigned char, int_cache_bytes(&dims, 0));
+	if(!block)
 		return NULL;
-	}
-	toret->items_used = 0;
-	toret->items_size = max_sessions;
-	/* Choose a "delta" for forced expiries. When making room for new
-	 * sessions (ie. when full), how many do we force out at a time? */
-	toret->expire_delta = max_sessions / 30;
-	if(!toret->expire_delta)
-		toret->expire_delta = 1;
-	/* Make sure we have no weird cached-lookup state */
-	int_lookup_set(toret, NULL, 0, -1);
-	return toret;
+	return int_cache_carve(block, &dims, default_policy, 0);
+}
+
+static DC_CACHE *cache_new(unsigned int max_sessions)
+{
+	return cache_new_ex(max_sessions, 0);
 }
 
+
 static void cache_free(DC_CACHE *cache)
 {
-	while(cache->items_used)
-		int_remove_DC_ITEM(cache, cache->items_used - 1);
-	SYS_free(DC_ITEM, cache->items);
-	SYS_free(DC_CACHE, cache);
+	unsigned int idx;
+	for(idx = 0; idx < cache->slabs_ready; idx++)
+		SYS_free(unsigned char, cache->slabs[idx].mem);
+	/* Everything else was carved from the one block, see cache_new_ex() */
+	SYS_free(unsigned char, (unsigned char *)cache);
 }
 
 static int cache_add_session(DC_CACHE *cache,
@@ -314,10 +978,7 @@ static int cache_add_session(DC_CACHE *cache,
 			const unsigned char *data,
 			unsigned int data_len)
 {
-	/* Use 'idx' to search for the insertion point based on 'expiry' */
-	DC_ITEM *item;
 	int idx;
-	struct timeval expiry;
 
 	/* The caller should already be making these checks */
 	assert(session_id_len && data_len &&
@@ -328,38 +989,10 @@ static int cache_add_session(DC_CACHE *cache,
 	idx = int_find_DC_ITEM(cache, session_id, session_id_len, now);
 	if(idx >= 0)
 		return 0;
-	/* Do we need to forcibly expire entries to make room? */
+	/* Do we need to evict a session to make room? */
 	if(cache->items_used == cache->items_size)
-		/* Yes, make room. We clear out 'expire_delta' sessions from the
-		 * front of the queue. If this value is one we get logical
-		 * behaviour but it's inefficient (we keep scrolling the entire
-		 * array to the left one space). If it's greater than one, it's
-		 * a little unfair on some extra sessions (expiring them when
-		 * it's not strictly necessary), but we don't do nearly as many
-		 * memmove operations. */
-		int_force_expire(cache, cache->expire_delta);
-	/* Set the time that the new session will expire */
-	SYS_timeadd(&expiry, now, timeout_msecs);
-	/* Find the insertion point based on expiry time */
-	idx = cache->items_used;
-	item = cache->items + idx;
-	while(idx > 0)  {
-		idx--;
-		item--;
-		/* So, if 'item' will expiry before or at the same time, we can
-		 * insert immediately after it. */
-		if(SYS_timecmp(&item->expiry, &expiry) <= 0) {
-			idx++;
-			item++;
-			goto found;
-		}
-	}
-	/* So, strangely, this item expires before all others (in reality, we're
-	 * probably inserting into an empty list!). But because of the "idx++"
-	 * logic, 'idx' and 'item' match the insertion/append point in all cases
-	 * at this point. */
-found:
-	return int_add_DC_ITEM(cache, idx, &expiry, session_id,
+		int_evict(cache, now);
+	return int_add_DC_ITEM(cache, now, timeout_msecs, session_id,
 					session_id_len, data, data_len);
 }
 
@@ -375,6 +1008,7 @@ static unsigned int cache_get_session(DC_CACHE *cache,
 			session_id, session_id_len, now);
 	if(idx < 0)
 		return 0;
+	int_evict_touch(cache, idx);
 	item = cache->items + idx;
 	if(store) {
 		unsigned int towrite = item->data_len;
@@ -387,6 +1021,29 @@ static unsigned int cache_get_session(DC_CACHE *cache,
 	return item->data_len;
 }
 
+/* Nothing else touches the cache until cache_release_session(), so there's
+ * nothing to do to pin the session. */
+static const unsigned char *cache_get_session_ref(DC_CACHE *cache,
+			const struct timeval *now,
+			const unsigned char *session_id,
+			unsigned int session_id_len,
+			unsigned int *len)
+{
+	DC_ITEM *item;
+	int idx = int_find_DC_ITEM(cache,
+			session_id, session_id_len, now);
+	if(idx < 0)
+		return NULL;
+	int_evict_touch(cache, idx);
+	item = cache->items + idx;
+	*len = item->data_len;
+	return item->ptr + item->id_len;
+}
+
+static void cache_release_session(DC_CACHE *cache)
+{
+}
+
 static int cache_remove_session(DC_CACHE *cache,
 			const struct timeval *now,
 			const unsigned char *session_id,
@@ -404,8 +1061,11 @@ static int cache_have_session(DC_CACHE *cache,
 			const unsigned char *session_id,
 			unsigned int session_id_len)
 {
-	return (int_find_DC_ITEM(cache, session_id,
-				session_id_len, now) < 0 ? 0 : 1);
+	int idx = int_find_DC_ITEM(cache, session_id, session_id_len, now);
+	if(idx < 0)
+		return 0;
+	int_evict_touch(cache, idx);
+	return 1;
 }
 
 static unsigned int cache_items_stored(DC_CACHE *cache,
@@ -418,8 +1078,370 @@ static unsigned int cache_items_stored(DC_CACHE *cache,
 	return cache->items_used;
 }
 
-/********************************************/
-/* The only external function in this file! */
+static int cache_stats(DC_CACHE *cache, DC_CACHE_STATS *stats)
+{
+	unsigned int idx;
+	const DC_SLAB_CLASS *c = cache->classes;
+	stats->num_classes = cache->num_classes;
+	for(idx = 0; idx < cache->num_classes; idx++, c++) {
+		stats->classes[idx].chunk_size = c->chunk_size;
+		stats->classes[idx].slabs = c->slabs;
+		stats->classes[idx].chunks_used = c->chunks_used;
+		stats->classes[idx].chunks_total = c->slabs * c->chunks_per_slab;
+	}
+	stats->evictions = cache->evictions;
+	stats->victim_age_last = cache->victim_age_last;
+	stats->victim_age_avg = cache->evictions ? (unsigned long)
+		(cache->victim_age_total / cache->evictions) : 0;
+	stats->slab_moves = cache->slab_moves;
+	stats->slab_evictions = cache->slab_evictions;
+	stats->slab_size = DC_SLAB_SIZE;
+	stats->slabs_total = cache->slabs_total;
+	stats->slabs_free = cache->slabs_free;
+	return 1;
+}
+
+/*********************************************************************/
+/* Caches shared between processes, see DC_SERVER_set_shared_cache() */
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && \
+		defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && \
+		defined(HAVE_PTHREAD_MUTEXATTR_SETPSHARED)
+#define DC_CACHE_SHARED
+#endif
+
+#ifdef DC_CACHE_SHARED
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* One partition of a shared cache, and the lock that guards it */
+typedef struct st_DC_STRIPE {
+	pthread_mutex_t lock;
+	DC_CACHE *cache;
+} DC_STRIPE;
+
+/* A shared cache is a single anonymous MAP_SHARED mapping, made before the
+ * processes using it are forked so that it has the same address in all of
+ * them. It starts with this header, followed by the stripes and then each
+ * stripe's cache. Sessions are spread across the stripes by hashing their ids,
+ * so processes only contend for a lock when they want the same stripe. */
+typedef struct st_DC_SHARED {
+	unsigned long map_size;
+	unsigned int num_stripes;
+	DC_STRIPE *stripes;
+} DC_SHARED;
+
+#define SHARED_CACHE(c)		((DC_SHARED *)(c))
+
+/* The number of stripes shared caches are created with, zero unless
+ * DC_SERVER_set_shared_cache() has been called. */
+static unsigned int shared_stripes = 0;
+
+/* DC_SERVER asks for a session's length and then for the session itself. The
+ * stripe is unlocked in between (and another process may change it), so the
+ * first call copies the session here and the second is served from the copy.
+ * This is private to each process. */
+static unsigned char shared_last_id[DC_MAX_ID_LEN];
+static unsigned char shared_last_data[DC_MAX_DATA_LEN];
+static unsigned int shared_last_id_len = 0, shared_last_data_len = 0;
+
+/* The bucket a session hashes to within a stripe uses the low bits of
+ * int_hash(), so the stripe is chosen from the high bits of a scrambled copy. */
+static DC_STRIPE *int_stripe(DC_SHARED *sh, const unsigned char *session_id,
+			unsigned int session_id_len)
+{
+	unsigned int hash = int_hash(session_id, session_id_len) * 2654435761U;
+	return sh->stripes + ((hash >> 16) % sh->num_stripes);
+}
+
+static int int_stripe_lock(DC_STRIPE *stripe)
+{
+	int res = pthread_mutex_lock(&stripe->lock);
+#if defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) && \
+		defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+	if(res == EOWNERDEAD) {
+		/* A process died while holding the lock, possibly half-way
+		 * through changing the stripe, so we start it afresh. */
+		int_cache_init(stripe->cache);
+		pthread_mutex_consistent(&stripe->lock);
+		res = 0;
+	}
+#endif
+	return (res == 0);
+}
+
+static void int_stripe_unlock(DC_STRIPE *stripe)
+{
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+static DC_CACHE *shared_new_ex(unsigned int max_sessions,
+			unsigned long max_memory)
+{
+	DC_SHARED *sh;
+	DC_CACHE_DIMS dims;
+	pthread_mutexattr_t attr;
+	unsigned char *map, *block;
+	unsigned long stripe_size, map_size;
+	unsigned int idx, num = shared_stripes;
+	/* Each stripe gets an equal share of the cache */
+	if(max_sessions) {
+		max_sessions /= num;
+		if(max_sessions < DC_CACHE_MIN_SIZE)
+			max_sessions = DC_CACHE_MIN_SIZE;
+	}
+	if(!int_cache_dims(&dims, max_sessions, max_memory / num))
+		return NULL;
+	stripe_size = DC_ALIGN(int_cache_bytes(&dims, 1));
+	map_size = DC_ALIGN(sizeof(DC_SHARED)) +
+			DC_ALIGN(num * sizeof(DC_STRIPE)) + num * stripe_size;
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED)
+		return NULL;
+	sh = (DC_SHARED *)map;
+	sh->map_size = map_size;
+	sh->num_stripes = num;
+	sh->stripes = (DC_STRIPE *)(map + DC_ALIGN(sizeof(DC_SHARED)));
+	block = (unsigned char *)sh->stripes + DC_ALIGN(num * sizeof(DC_STRIPE));
+	if(pthread_mutexattr_init(&attr) != 0)
+		goto err;
+	if((pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0)
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+			|| (pthread_mutexattr_setrobust(&attr,
+					PTHREAD_MUTEX_ROBUST) != 0)
+#endif
+			) {
+		pthread_mutexattr_destroy(&attr);
+		goto err;
+	}
+	for(idx = 0; idx < num; idx++, block += stripe_size) {
+		if(pthread_mutex_init(&sh->stripes[idx].lock, &attr) != 0) {
+			pthread_mutexattr_destroy(&attr);
+			goto err;
+		}
+		sh->stripes[idx].cache = int_cache_carve(block, &dims,
+						default_policy, 1);
+	}
+	pthread_mutexattr_destroy(&attr);
+	return (DC_CACHE *)sh;
+err:
+	munmap(map, map_size);
+	return NULL;
+}
+
+static DC_CACHE *shared_new(unsigned int max_sessions)
+{
+	return shared_new_ex(max_sessions, 0);
+}
+
+/* This only unmaps the cache from the calling process. The locks aren't
+ * destroyed because other processes may still be using them, and they need no
+ * cleaning up once nobody is. */
+static void shared_free(DC_CACHE *cache)
+{
+	munmap(cache, SHARED_CACHE(cache)->map_size);
+}
+
+static int shared_add_session(DC_CACHE *cache,
+			const struct timeval *now,
+			unsigned long timeout_msecs,
+			const unsigned char *session_id,
+			unsigned int session_id_len,
+			const unsigned char *data,
+			unsigned int data_len)
+{
+	int ret;
+	DC_STRIPE *stripe = int_stripe(SHARED_CACHE(cache), session_id,
+					session_id_len);
+	shared_last_id_len = 0;
+	if(!int_stripe_lock(stripe))
+		return 0;
+	ret = cache_add_session(stripe->cache, now, timeout_msecs,
+			session_id, session_id_len, data, data_len);
+	int_stripe_unlock(stripe);
+	return ret;
+}
+
+static unsigned int shared_get_session(DC_CACHE *cache,
+			const struct timeval *now,
+			const unsigned char *session_id,
+			unsigned int session_id_len,
+			unsigned char *store,
+			unsigned int store_len)
+{
+	DC_STRIPE *stripe;
+	if(!store || (shared_last_id_len != session_id_len) ||
+			(memcmp(shared_last_id, session_id,
+				session_id_len) != 0)) {
+		stripe = int_stripe(SHARED_CACHE(cache), session_id,
+					session_id_len);
+		shared_last_id_len = 0;
+		if(!int_stripe_lock(stripe))
+			return 0;
+		shared_last_data_len = cache_get_session(stripe->cache, now,
+				session_id, session_id_len, shared_last_data,
+				sizeof(shared_last_data));
+		int_stripe_unlock(stripe);
+		if(!shared_last_data_len)
+			return 0;
+		SYS_memcpy_n(unsigned char, shared_last_id, session_id,
+				session_id_len);
+		shared_last_id_len = session_id_len;
+	}
+	if(store) {
+		SYS_memcpy_n(unsigned char, store, shared_last_data,
+			(shared_last_data_len < store_len ?
+				shared_last_data_len : store_len));
+		shared_last_id_len = 0;
+	}
+	return shared_last_data_len;
+}
+
+/* The stripe holding a session returned by shared_get_session_ref() stays
+ * locked until shared_release_session(), which pins the session against
+ * other processes. */
+static DC_STRIPE *shared_pinned = NULL;
+
+static const unsigned char *shared_get_session_ref(DC_CACHE *cache,
+			const struct timeval *now,
+			const unsigned char *session_id,
+			unsigned int session_id_len,
+			unsigned int *len)
+{
+	const unsigned char *ret;
+	DC_STRIPE *stripe = int_stripe(SHARED_CACHE(cache), session_id,
+					session_id_len);
+	assert(!shared_pinned);
+	shared_last_id_len = 0;
+	if(!int_stripe_lock(stripe))
+		return NULL;
+	ret = cache_get_session_ref(stripe->cache, now, session_id,
+			session_id_len, len);
+	if(ret)
+		shared_pinned = stripe;
+	else
+		int_stripe_unlock(stripe);
+	return ret;
+}
+
+static void shared_release_session(DC_CACHE *cache)
+{
+	assert(shared_pinned);
+	int_stripe_unlock(shared_pinned);
+	shared_pinned = NULL;
+}
+
+static int shared_remove_session(DC_CACHE *cache,
+			const struct timeval *now,
+			const unsigned char *session_id,
+			unsigned int session_id_len)
+{
+	int ret;
+	DC_STRIPE *stripe = int_stripe(SHARED_CACHE(cache), session_id,
+					session_id_len);
+	shared_last_id_len = 0;
+	if(!int_stripe_lock(stripe))
+		return 0;
+	ret = cache_remove_session(stripe->cache, now, session_id,
+			session_id_len);
+	int_stripe_unlock(stripe);
+	return ret;
+}
+
+static int shared_have_session(DC_CACHE *cache,
+			const struct timeval *now,
+			const unsigned char *session_id,
+			unsigned int session_id_len)
+{
+	int ret;
+	DC_STRIPE *stripe = int_stripe(SHARED_CACHE(cache), session_id,
+					session_id_len);
+	if(!int_stripe_lock(stripe))
+		return 0;
+	ret = cache_have_session(stripe->cache, now, session_id,
+			session_id_len);
+	int_stripe_unlock(stripe);
+	return ret;
+}
+
+static unsigned int shared_items_stored(DC_CACHE *cache,
+			const struct timeval *now)
+{
+	unsigned int idx, ret = 0;
+	DC_SHARED *sh = SHARED_CACHE(cache);
+	for(idx = 0; idx < sh->num_stripes; idx++) {
+		if(!int_stripe_lock(sh->stripes + idx))
+			continue;
+		ret += cache_items_stored(sh->stripes[idx].cache, now);
+		int_stripe_unlock(sh->stripes + idx);
+	}
+	return ret;
+}
+
+/* Adds up the stripes' statistics. The average victim age is weighted by each
+ * stripe's evictions, and the most recent victim is taken to be the oldest of
+ * the stripes' most recent victims. */
+static int shared_stats(DC_CACHE *cache, DC_CACHE_STATS *stats)
+{
+	DC_CACHE_STATS st;
+	unsigned int idx, cls;
+	double age_total = 0;
+	DC_SHARED *sh = SHARED_CACHE(cache);
+	SYS_zero(DC_CACHE_STATS, stats);
+	for(idx = 0; idx < sh->num_stripes; idx++) {
+		if(!int_stripe_lock(sh->stripes + idx))
+			return 0;
+		cache_stats(sh->stripes[idx].cache, &st);
+		int_stripe_unlock(sh->stripes + idx);
+		stats->num_classes = st.num_classes;
+		for(cls = 0; cls < st.num_classes; cls++) {
+			stats->classes[cls].chunk_size =
+					st.classes[cls].chunk_size;
+			stats->classes[cls].slabs += st.classes[cls].slabs;
+			stats->classes[cls].chunks_used +=
+					st.classes[cls].chunks_used;
+			stats->classes[cls].chunks_total +=
+					st.classes[cls].chunks_total;
+		}
+		stats->slab_size = st.slab_size;
+		stats->slabs_total += st.slabs_total;
+		stats->slabs_free += st.slabs_free;
+		stats->evictions += st.evictions;
+		stats->slab_moves += st.slab_moves;
+		stats->slab_evictions += st.slab_evictions;
+		age_total += (double)st.victim_age_avg * st.evictions;
+		if(st.victim_age_last > stats->victim_age_last)
+			stats->victim_age_last = st.victim_age_last;
+	}
+	stats->victim_age_avg = (stats->evictions ?
+		(unsigned long)(age_total / stats->evictions) : 0);
+	return 1;
+}
+
+static const DC_CACHE_cb our_shared_implementation = {
+	shared_new,
+	shared_free,
+	shared_add_session,
+	shared_get_session,
+	shared_remove_session,
+	shared_have_session,
+	shared_items_stored
+};
+static const DC_CACHE_EXT_cb our_shared_ext = {
+	sizeof(DC_CACHE_EXT_cb),
+	shared_stats,
+	shared_new_ex,
+	shared_get_session_ref,
+	shared_release_session
+};
+
+#endif /* defined(DC_CACHE_SHARED) */
+
+/*********************************************/
+/* The only external functions in this file! */
 
 /* First the static structure used in this hook function */
 static const DC_CACHE_cb our_implementation = {
@@ -431,8 +1453,51 @@ static const DC_CACHE_cb our_implementation = {
 	cache_have_session,
 	cache_items_stored
 };
+static const DC_CACHE_EXT_cb our_ext = {
+	sizeof(DC_CACHE_EXT_cb),
+	cache_stats,
+	cache_new_ex,
+	cache_get_session_ref,
+	cache_release_session
+};
 
 int DC_SERVER_set_default_cache(void)
 {
-	return DC_SERVER_set_cache(&our_implementation);
+	return DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT_EXPIRY);
+}
+
+static int int_set_policy(DC_CACHE_EVICT policy)
+{
+	switch(policy) {
+	case DC_CACHE_EVICT_EXPIRY:
+	case DC_CACHE_EVICT_LRU:
+	case DC_CACHE_EVICT_CLOCK:
+	case DC_CACHE_EVICT_SIEVE:
+		break;
+	default:
+		return 0;
+	}
+	default_policy = policy;
+	return 1;
+}
+
+int DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT policy)
+{
+	if(!int_set_policy(policy))
+		return 0;
+	return DC_SERVER_set_cache_ex(&our_implementation, &our_ext);
+}
+
+int DC_SERVER_set_shared_cache(DC_CACHE_EVICT policy, unsigned int stripes)
+{
+#ifdef DC_CACHE_SHARED
+	if(!stripes || (stripes > DC_CACHE_MAX_STRIPES) ||
+			!int_set_policy(policy))
+		return 0;
+	shared_stripes = stripes;
+	return DC_SERVER_set_cache_ex(&our_shared_implementation,
+			&our_shared_ext);
+#else
+	return 0;
+#endif
 }
@@ -30,10 +30,19 @@
 #define SELECTOR_FLAG_SEND	0x02
 #define SELECTOR_FLAG_EXCEPT	0x04
 
-/* The select/poll-specific selector "ctrl" commands are enumerated here */
+/* The select/poll-specific selector "ctrl" commands are enumerated here. The
+ * BUFSET/BUFTEST commands are only supported by NAL_SELECTOR_TYPE_URING
+ * selectors, which do the reads and sends themselves. CHANGED tells the
+ * selector that an object's pre_select hook would now set different criteria
+ * (eg. it has data to send), which only matters to selectors that keep the
+ * criteria between selects (NAL_SELECTOR_TYPE_[EPOLL|URING]), the others
+ * ignore it. */
 typedef enum {
 	NAL_FD_CTRL_FDSET = NAL_SELECTOR_CTRL_FD,
-	NAL_FD_CTRL_FDTEST
+	NAL_FD_CTRL_FDTEST,
+	NAL_FD_CTRL_BUFSET,
+	NAL_FD_CTRL_BUFTEST,
+	NAL_FD_CTRL_CHANGED
 } NAL_FD_CTRL_TYPE;
 
 /* These are the corresponding structures passed to nal_selector_ctrl */
@@ -53,6 +62,28 @@ typedef struct st_nal_fd_fdtest {
 	/* Input value - file-descriptor */
 	int fd;
 } NAL_FD_FDTEST;
+typedef struct st_nal_fd_bufset {
+	/* Input value - token of listener/connection object */
+	NAL_SELECTOR_TOKEN token;
+	/* Input value - file-descriptor (already set with FDSET) */
+	int fd;
+	/* Input values - buffers to read into and send from */
+	NAL_BUFFER *b_read, *b_send;
+} NAL_FD_BUFSET;
+typedef struct st_nal_fd_buftest {
+	/* Return value - SELECTOR_FLAG_[READ|SEND] for the I/O that was done */
+	unsigned char done;
+	/* Return values - as nal_fd_buffer_[from|to]_fd() would have returned */
+	int read_ret, send_ret;
+	/* Input value - token of listener/connection object */
+	NAL_SELECTOR_TOKEN token;
+	/* Input value - file-descriptor */
+	int fd;
+} NAL_FD_BUFTEST;
+typedef struct st_nal_fd_changed {
+	/* Input value - token of listener/connection object */
+	NAL_SELECTOR_TOKEN token;
+} NAL_FD_CHANGED;
 
 #define nal_selector_fd_set(_sel, _tok, _fd, _flags) \
 	do { \
@@ -70,5 +101,30 @@ typedef struct st_nal_fd_fdtest {
 		nal_selector_ctrl((_sel), NAL_FD_CTRL_FDTEST, &args); \
 		*(_flags) = args.flags; \
 	} while(0)
+#define nal_selector_buf_set(_sel, _tok, _fd, _b_read, _b_send) \
+	do { \
+		NAL_FD_BUFSET args; \
+		args.token = (_tok); \
+		args.fd = (_fd); \
+		args.b_read = (_b_read); \
+		args.b_send = (_b_send); \
+		nal_selector_ctrl((_sel), NAL_FD_CTRL_BUFSET, &args); \
+	} while(0)
+#define nal_selector_buf_test(_done, _read_ret, _send_ret, _sel, _tok, _fd) \
+	do { \
+		NAL_FD_BUFTEST args; \
+		args.token = (_tok); \
+		args.fd = (_fd); \
+		nal_selector_ctrl((_sel), NAL_FD_CTRL_BUFTEST, &args); \
+		*(_done) = args.done; \
+		*(_read_ret) = args.read_ret; \
+		*(_send_ret) = args.send_ret; \
+	} while(0)
+#define nal_selector_fd_changed(_sel, _tok) \
+	do { \
+		NAL_FD_CHANGED args; \
+		args.token = (_tok); \
+		nal_selector_ctrl((_sel), NAL_FD_CTRL_CHANGED, &args); \
+	} while(0)
 
 #endif /* !defined(HEADER_PRIVATE_CTRL_FD_H) */
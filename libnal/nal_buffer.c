@@ -26,13 +26,75 @@
 #include "nal_internal.h"
 #include <libsys/post.h>
 
-/* Define the NAL_BUFFER structure */
+/* Define the NAL_BUFFER structure. It's a ring, the contents are the 'used'
+ * bytes from offset 'start', wrapping around the end of 'data' if need be.
+ * Consuming data only moves 'start', so there's no copying when a buffer is
+ * drained a piece at a time. The contents are only made contiguous again
+ * (lazily) when NAL_BUFFER_data() or NAL_BUFFER_write_ptr() need them to be,
+ * and the NAL_BUFFER_*_iov() functions avoid even that. */
 
 struct st_NAL_BUFFER {
 	unsigned char *data;
-	unsigned int used, size;
+	unsigned int start, used, size;
+	/* Called when the buffer becomes, or stops being, empty or full (see
+	 * nal_buffer_set_watch()) */
+	nal_buffer_watch_fn watch;
+	void *watch_arg;
 };
 
+/**********************/
+/* INTERNAL FUNCTIONS */
+/**********************/
+
+/* The offset one past the end of the contents (where writing continues) */
+static unsigned int int_tail(const NAL_BUFFER *b)
+{
+	unsigned int tail = b->start + b->used;
+	return (tail >= b->size ? tail - b->size : tail);
+}
+
+static int int_wrapped(const NAL_BUFFER *b)
+{
+	return (b->start + b->used > b->size);
+}
+
+static void int_reverse(unsigned char *p, unsigned int len)
+{
+	unsigned char *q = p + len;
+	while(p + 1 < q) {
+		unsigned char c = *p;
+		*(p++) = *(--q);
+		*q = c;
+	}
+}
+
+/* Tells the watcher if the buffer was empty or full before a change, with
+ * 'used' and 'size' as they were, and isn't now (or vice versa) */
+static void int_watch(NAL_BUFFER *b, unsigned int used, unsigned int size)
+{
+	if(b->watch && ((!used != !b->used) ||
+			((used == size) != (b->used == b->size))))
+		b->watch(b->watch_arg);
+}
+
+/* Moves the contents to the start of the storage */
+static void int_compact(NAL_BUFFER *b)
+{
+	if(!b->start)
+		return;
+	if(!b->used)
+		b->start = 0;
+	else if(int_wrapped(b)) {
+		/* Rotate the whole ring in place, left by 'start' */
+		int_reverse(b->data, b->start);
+		int_reverse(b->data + b->start, b->size - b->start);
+		int_reverse(b->data, b->size);
+	} else
+		SYS_memmove_n(unsigned char, b->data, b->data + b->start,
+				b->used);
+	b->start = 0;
+}
+
 /********************/
 /* BUFFER FUNCTIONS */
 /********************/
@@ -42,7 +104,9 @@ NAL_BUFFER *NAL_BUFFER_new(void)
 	NAL_BUFFER *b = SYS_malloc(NAL_BUFFER, 1);
 	if(b) {
 		b->data = NULL;
-		b->used = b->size = 0;
+		b->start = b->used = b->size = 0;
+		b->watch = NULL;
+		b->watch_arg = NULL;
 	}
 	return b;
 }
@@ -55,12 +119,15 @@ void NAL_BUFFER_free(NAL_BUFFER *b)
 
 void NAL_BUFFER_reset(NAL_BUFFER *b)
 {
-	b->used = 0;
+	unsigned int used = b->used;
+	b->start = b->used = 0;
+	int_watch(b, used, b->size);
 }
 
 int NAL_BUFFER_set_size(NAL_BUFFER *buf, unsigned int size)
 {
 	unsigned char *next;
+	unsigned int used = buf->used, old_size = buf->size;
 
 	/* Saves time, and avoids the degenerate case that fails realloc -
 	 * namely when ptr is NULL (realloc becomes malloc) *and* size is 0
@@ -79,7 +146,8 @@ int NAL_BUFFER_set_size(NAL_BUFFER *buf, unsigned int size)
 		return 0;
 	buf->data = next;
 	buf->size = size;
-	buf->used = 0;
+	buf->start = buf->used = 0;
+	int_watch(buf, used, old_size);
 	return 1;
 }
 
@@ -115,7 +183,11 @@ unsigned int NAL_BUFFER_unused(const NAL_BUFFER *buf)
 
 const unsigned char *NAL_BUFFER_data(const NAL_BUFFER *buf)
 {
-	return buf->data;
+	/* The API promises contiguous data, so unwrap it if need be. This
+	 * doesn't change the contents, so we cast away the const. */
+	if(int_wrapped(buf))
+		int_compact((NAL_BUFFER *)buf);
+	return buf->data + buf->start;
 }
 
 unsigned int NAL_BUFFER_size(const NAL_BUFFER *buf)
@@ -126,13 +198,21 @@ unsigned int NAL_BUFFER_size(const NAL_BUFFER *buf)
 unsigned int NAL_BUFFER_write(NAL_BUFFER *buf, const unsigned char *ptr,
 		                unsigned int size)
 {
-	unsigned int towrite = NAL_BUFFER_unused(buf);
+	NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+	unsigned int loop, num, towrite = NAL_BUFFER_unused(buf);
 	if(towrite > size)
 		towrite = size;
 	if(towrite == 0)
 		return 0;
-	SYS_memcpy_n(unsigned char, buf->data + buf->used, ptr, towrite);
+	num = NAL_BUFFER_unused_iov(buf, iov);
+	for(loop = 0, size = towrite; size && (loop < num); loop++) {
+		unsigned int len = (iov[loop].len < size ? iov[loop].len : size);
+		SYS_memcpy_n(unsigned char, iov[loop].ptr, ptr, len);
+		ptr += len;
+		size -= len;
+	}
 	buf->used += towrite;
+	int_watch(buf, buf->used - towrite, buf->size);
 	return towrite;
 }
 
@@ -144,33 +224,105 @@ unsigned int NAL_BUFFER_read(NAL_BUFFER *buf, unsigned char *ptr,
 		toread = size;
 	if(toread == 0)
 		return 0;
-	if(ptr)
-		SYS_memcpy_n(unsigned char, ptr, buf->data, toread);
+	if(ptr) {
+		NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+		unsigned int loop, num = NAL_BUFFER_data_iov(buf, iov);
+		for(loop = 0, size = toread; size && (loop < num); loop++) {
+			unsigned int len = (iov[loop].len < size ?
+						iov[loop].len : size);
+			SYS_memcpy_n(unsigned char, ptr, iov[loop].ptr, len);
+			ptr += len;
+			size -= len;
+		}
+	}
 	buf->used -= toread;
-	if(buf->used > 0)
-		SYS_memmove_n(unsigned char, buf->data,
-				buf->data + toread, buf->used);
+	/* Consuming is just a matter of moving the start along */
+	if(!buf->used)
+		buf->start = 0;
+	else if((buf->start += toread) >= buf->size)
+		buf->start -= buf->size;
+	int_watch(buf, buf->used + toread, buf->size);
 	return toread;
 }
 
 unsigned int NAL_BUFFER_transfer(NAL_BUFFER *dest, NAL_BUFFER *src,
 				unsigned int max)
 {
-	unsigned int tmp = NAL_BUFFER_unused(dest);
+	NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+	unsigned int loop, num, tmp, total = 0;
+	tmp = NAL_BUFFER_unused(dest);
 	if(!max || (max > tmp)) max = tmp;
 	if(!max) return 0;
-	tmp = NAL_BUFFER_read(src, NAL_BUFFER_write_ptr(dest), max);
-	NAL_BUFFER_wrote(dest, tmp);
-	return tmp;
+	/* Read directly into dest's unused space, whether it's wrapped or not */
+	num = NAL_BUFFER_unused_iov(dest, iov);
+	for(loop = 0; max && (loop < num); loop++) {
+		tmp = NAL_BUFFER_read(src, iov[loop].ptr,
+				(iov[loop].len < max ? iov[loop].len : max));
+		total += tmp;
+		max -= tmp;
+		if(tmp < iov[loop].len)
+			break;
+	}
+	NAL_BUFFER_wrote(dest, total);
+	return total;
+}
+
+unsigned int NAL_BUFFER_data_iov(const NAL_BUFFER *buf, NAL_BUFFER_IOV *iov)
+{
+	unsigned int first;
+	if(!buf->used)
+		return 0;
+	iov[0].ptr = buf->data + buf->start;
+	first = buf->size - buf->start;
+	if(buf->used <= first) {
+		iov[0].len = buf->used;
+		return 1;
+	}
+	iov[0].len = first;
+	iov[1].ptr = buf->data;
+	iov[1].len = buf->used - first;
+	return 2;
+}
+
+unsigned int NAL_BUFFER_unused_iov(const NAL_BUFFER *buf, NAL_BUFFER_IOV *iov)
+{
+	unsigned int tail;
+	if(buf->used == buf->size)
+		return 0;
+	tail = int_tail(buf);
+	iov[0].ptr = buf->data + tail;
+	if(tail < buf->start) {
+		/* The contents wrap, so the space between is all there is */
+		iov[0].len = buf->start - tail;
+		return 1;
+	}
+	iov[0].len = buf->size - tail;
+	if(!buf->start)
+		return 1;
+	iov[1].ptr = buf->data;
+	iov[1].len = buf->start;
+	return 2;
 }
 
 unsigned char *NAL_BUFFER_write_ptr(NAL_BUFFER *buf)
 {
-	return (buf->data + buf->used);
+	/* The API promises that all the unused space is contiguous from here,
+	 * which only needs work if the contents sit in the middle. */
+	if(buf->start && !int_wrapped(buf) && (buf->start + buf->used < buf->size))
+		int_compact(buf);
+	return (buf->data + int_tail(buf));
 }
 
 void NAL_BUFFER_wrote(NAL_BUFFER *buf, unsigned int size)
 {
 	assert(size <= NAL_BUFFER_unused(buf));
 	buf->used += size;
+	int_watch(buf, buf->used - size, buf->size);
+}
+
+void nal_buffer_set_watch(NAL_BUFFER *buf, nal_buffer_watch_fn watch,
+			void *watch_arg)
+{
+	buf->watch = watch;
+	buf->watch_arg = watch_arg;
 }
@@ -39,8 +39,25 @@ struct st_NAL_CONNECTION {
 	NAL_SELECTOR *sel;
 	/* ... and token */
 	NAL_SELECTOR_TOKEN sel_token;
+	/* Set, with links in the list, while on the selector's ready list */
+	int ready;
+	NAL_CONNECTION *ready_prev, *ready_next;
 };
 
+/* Takes 'conn' off its selector's ready list */
+static void int_ready_unlink(NAL_CONNECTION *conn)
+{
+	if(!conn->ready)
+		return;
+	if(conn->ready_prev)
+		conn->ready_prev->ready_next = conn->ready_next;
+	else
+		*nal_selector_ready_list(conn->sel) = conn->ready_next;
+	if(conn->ready_next)
+		conn->ready_next->ready_prev = conn->ready_prev;
+	conn->ready = 0;
+}
+
 /*************************/
 /* nal_devel.h functions */
 /*************************/
@@ -121,6 +138,41 @@ void nal_connection_set_selector_raw(NAL_CONNECTION *c, NAL_SELECTOR *sel,
 	c->sel_token = token;
 }
 
+/****************************/
+/* nal_internal.h functions */
+/****************************/
+
+void nal_connection_set_ready(NAL_CONNECTION *conn)
+{
+	NAL_CONNECTION **head;
+	assert(conn->sel != NULL);
+	if(conn->ready)
+		return;
+	head = nal_selector_ready_list(conn->sel);
+	conn->ready = 1;
+	conn->ready_prev = NULL;
+	if((conn->ready_next = *head) != NULL)
+		(*head)->ready_prev = conn;
+	*head = conn;
+}
+
+NAL_CONNECTION *nal_connection_ready_pop(NAL_CONNECTION **head)
+{
+	NAL_CONNECTION *conn = *head;
+	if(conn) {
+		if((*head = conn->ready_next) != NULL)
+			(*head)->ready_prev = NULL;
+		conn->ready = 0;
+	}
+	return conn;
+}
+
+void nal_connection_ready_clear(NAL_CONNECTION **head)
+{
+	while(nal_connection_ready_pop(head))
+		;
+}
+
 /*******************/
 /* nal.h functions */
 /*******************/
@@ -135,6 +187,7 @@ NAL_CONNECTION *NAL_CONNECTION_new(void)
 		conn->reset = NULL;
 		conn->sel = NULL;
 		conn->sel_token = NULL;
+		conn->ready = 0;
 	}
 	return conn;
 }
@@ -260,6 +313,7 @@ void NAL_CONNECTION_del_from_selector(NAL_CONNECTION *conn)
 		NAL_SELECTOR *sel = conn->sel;
 		if(conn->vt->pre_selector_del)
 			conn->vt->pre_selector_del(conn, sel, conn->sel_token);
+		int_ready_unlink(conn);
 		nal_selector_del_connection(conn->sel, conn, conn->sel_token);
 		conn->sel = NULL;
 		conn->sel_token = NULL;
@@ -45,6 +45,10 @@
 /* nal_sock code will use this as a default in its call to listen(2) */
 #define NAL_LISTENER_BACKLOG	511
 
+/* The default limit on accepts per listener readiness, see
+ * NAL_config_set_accept_batch(). */
+#define NAL_LISTENER_ACCEPT_BATCH	64
+
 /* An upper limit on the size of address strings that will be allowable */
 #define NAL_ADDRESS_MAX_STR_LEN	255
 
@@ -84,7 +88,8 @@ int nal_sock_sockaddr_from_unix(nal_sockaddr *addr, const char *start_ptr);
 int nal_sock_create_socket(int *fd, const nal_sockaddr *addr);
 int nal_sock_create_unix_pair(int sv[2]);
 int nal_sock_connect(int fd, const nal_sockaddr *addr, int *established);
-int nal_sock_listen(int fd, const nal_sockaddr *addr);
+int nal_sock_listen(int fd, const nal_sockaddr *addr, int reuseport);
+/* The accepted fd is non-blocking (and close-on-exec, if possible) */
 int nal_sock_accept(int listen_fd, int *conn);
 int nal_sock_is_connected(int fd);
 int nal_sockaddr_get(nal_sockaddr *addr, int fd);
@@ -92,11 +97,42 @@ int nal_sockaddr_chown(const nal_sockaddr *addr, const char *username,
 			const char *groupname);
 int nal_sockaddr_chmod(const nal_sockaddr *addr, const char *octal_string);
 
+/**************/
+/* util_uring */
+/**************/
+
+/* The io_uring selector builds on the epoll one, and the ring needs the
+ * __sync builtins for its memory barriers. */
+#if defined(HAVE_IO_URING) && defined(HAVE_SYNC_BUILTINS) && \
+		defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CTL)
+#define HAVE_URING_SELECTOR
+typedef struct st_nal_uring nal_uring;
+/* Returns NULL if the kernel doesn't support (or allow) io_uring */
+nal_uring *nal_uring_new(unsigned int entries);
+void nal_uring_free(nal_uring *r);
+/* These queue a request, returning zero if the ring is full (run it first).
+ * 'msg' (and the iovecs it points to) must stay valid until it completes. */
+int nal_uring_recv(nal_uring *r, int fd, struct msghdr *msg,
+			unsigned long data);
+int nal_uring_send(nal_uring *r, int fd, struct msghdr *msg,
+			unsigned long data);
+/* Submits everything queued and waits for it all to complete */
+int nal_uring_run(nal_uring *r);
+/* Pops a completion, returning zero when there are no more */
+int nal_uring_result(nal_uring *r, unsigned long *data, int *res);
+#endif
+
 /****************/
 /* NAL_SELECTOR */
 /****************/
 
-/* This symbol controls what implementation NAL_SELECTOR_new() uses. Note, that
+/* epoll(7) support requires both the header and the functions */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CTL)
+#define HAVE_EPOLL
+#endif
+
+/* This symbol is the portable implementation NAL_SELECTOR_new() falls back to,
+ * see nal_selector_dynamic_default() for the others it tries first. Note, that
  * NAL_SELECTOR_reset() will revert to the vtable it was initially created with
  * (this makes more sense when alternative constructors are made for other
  * vtables). */
@@ -104,27 +140,50 @@ int nal_sockaddr_chmod(const nal_sockaddr *addr, const char *octal_string);
 #ifdef HAVE_POLL
 /* Decide between the two */
 #ifdef PREFER_POLL
-#define NAL_SELECTOR_VT_DEFAULT		sel_fdpoll
+#define NAL_SELECTOR_VT_PORTABLE	sel_fdpoll
 #else
-#define NAL_SELECTOR_VT_DEFAULT		sel_fdselect
+#define NAL_SELECTOR_VT_PORTABLE	sel_fdselect
 #endif
 #else
 /* Only select() */
-#define NAL_SELECTOR_VT_DEFAULT		sel_fdselect
+#define NAL_SELECTOR_VT_PORTABLE	sel_fdselect
 #endif
 #else
 /* No select() */
 #ifdef HAVE_POLL
-#define NAL_SELECTOR_VT_DEFAULT		sel_fdpoll
+#define NAL_SELECTOR_VT_PORTABLE	sel_fdpoll
 #else
 #error "Neither HAVE_SELECT nor HAVE_POLL are defined"
 #endif
 #endif
 
+/* Gives a NAL_SELECTOR_new() selector its implementation, when the first
+ * object is added to it. PREFER_EPOLL (see --disable-epoll) chooses epoll over
+ * the portable implementation, where it's available. io_uring is only tried
+ * (first) if it's been asked for, see NAL_config_set_uring(). If a selector
+ * can't be created (eg. epoll or io_uring is refused by a seccomp policy), the
+ * next one down is used. */
+int nal_selector_dynamic_default(NAL_SELECTOR *sel);
+
 NAL_SELECTOR_TOKEN nal_selector_add_listener(NAL_SELECTOR *, NAL_LISTENER *);
 NAL_SELECTOR_TOKEN nal_selector_add_connection(NAL_SELECTOR *, NAL_CONNECTION *);
 void nal_selector_del_listener(NAL_SELECTOR *, NAL_LISTENER *, NAL_SELECTOR_TOKEN);
 void nal_selector_del_connection(NAL_SELECTOR *, NAL_CONNECTION *, NAL_SELECTOR_TOKEN);
+/* The head of the selector's list of connections that its last select
+ * reported on, see NAL_SELECTOR_get_ready() */
+NAL_CONNECTION **nal_selector_ready_list(NAL_SELECTOR *sel);
+
+/******************/
+/* NAL_CONNECTION */
+/******************/
+
+/* Connection implementations call this from their 'post_select' handler when
+ * the selector has reported an event on them. */
+void nal_connection_set_ready(NAL_CONNECTION *conn);
+/* These take connections off a selector's ready list, one at a time or all at
+ * once */
+NAL_CONNECTION *nal_connection_ready_pop(NAL_CONNECTION **head);
+void nal_connection_ready_clear(NAL_CONNECTION **head);
 
 /****************/
 /* NAL_LISTENER */
@@ -149,4 +208,11 @@ int nal_listener_set_def_buffer_size(NAL_LISTENER *l, unsigned int def_buffer_si
 #define NAL_BUFFER_MAX_SIZE  32768
 #define nal_check_buffer_size(sz) (((sz) > NAL_BUFFER_MAX_SIZE) ? 0 : 1)
 
+/* Connection implementations use this to hear when one of their buffers
+ * becomes, or stops being, empty or full. That's when what they select for
+ * changes, see NAL_FD_CTRL_CHANGED. */
+typedef void (*nal_buffer_watch_fn)(void *watch_arg);
+void nal_buffer_set_watch(NAL_BUFFER *buf, nal_buffer_watch_fn watch,
+			void *watch_arg);
+
 #endif /* !defined(HEADER_PRIVATE_NAL_INTERNAL_H) */
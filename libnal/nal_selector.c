@@ -35,8 +35,18 @@ struct st_NAL_SELECTOR {
 	size_t vt_data_size;
 	/* When resetting objects for reuse, this is set to allow 'vt' to be NULL */
 	const NAL_SELECTOR_vtable *reset;
+	/* The connections the last select reported on, in no particular order */
+	NAL_CONNECTION *ready;
 };
 
+/* This flag, if set, has NAL_SELECTOR_new() selectors try io_uring first (see
+ * --enable-io-uring). */
+#ifdef PREFER_IO_URING
+static int gb_use_uring = 1;
+#else
+static int gb_use_uring = 0;
+#endif
+
 /*****************************************/
 /* Intermediaire selector implementation */
 /*****************************************/
@@ -64,6 +74,20 @@ static const NAL_SELECTOR_vtable vtable_dyn = {
 	NULL
 };
 
+int nal_selector_dynamic_default(NAL_SELECTOR *s)
+{
+#ifdef HAVE_URING_SELECTOR
+	/* If the kernel has no io_uring, this behaves like sel_epoll */
+	if(gb_use_uring && nal_selector_dynamic_set(s, sel_uring()))
+		return 1;
+#endif
+#if defined(HAVE_EPOLL) && defined(PREFER_EPOLL)
+	if(nal_selector_dynamic_set(s, sel_epoll()))
+		return 1;
+#endif
+	return nal_selector_dynamic_set(s, NAL_SELECTOR_VT_PORTABLE());
+}
+
 /****************************/
 /* nal_internal.h functions */
 /****************************/
@@ -90,6 +114,11 @@ void nal_selector_del_connection(NAL_SELECTOR *s, NAL_CONNECTION *c, NAL_SELECTO
 	if(s->vt) s->vt->del_connection(s, c, k);
 }
 
+NAL_CONNECTION **nal_selector_ready_list(NAL_SELECTOR *s)
+{
+	return &s->ready;
+}
+
 /*************************/
 /* nal_devel.h functions */
 /*************************/
@@ -106,6 +135,7 @@ NAL_SELECTOR *nal_selector_new(const NAL_SELECTOR_vtable *vtable)
 	sel->vt = vtable;
 	sel->vt_data_size = vtable->vtdata_size;
 	sel->reset = NULL;
+	sel->ready = NULL;
 	SYS_zero_n(unsigned char, sel->vt_data, vtable->vtdata_size);
 	if(!vtable->on_create(sel)) goto err;
 	return sel;
@@ -155,6 +185,7 @@ int nal_selector_dynamic_set(NAL_SELECTOR *s, const NAL_SELECTOR_vtable *vt) {
 	s->vt_data_size = vt->vtdata_size;
 	if(!vt->on_create(s)) {
 		SYS_free(void, s->vt_data);
+		s->vt_data = NULL;
 		s->vt = &vtable_dyn;
 		s->vt_data_size = 0;
 		return 0;
@@ -166,6 +197,16 @@ int nal_selector_dynamic_set(NAL_SELECTOR *s, const NAL_SELECTOR_vtable *vt) {
 /* nal.h functions */
 /*******************/
 
+int NAL_config_set_uring(int enabled)
+{
+#ifdef HAVE_URING_SELECTOR
+	gb_use_uring = enabled;
+	return 1;
+#else
+	return !enabled;
+#endif
+}
+
 NAL_SELECTOR *NAL_SELECTOR_new(void)
 {
 	return nal_selector_new(&vtable_dyn);
@@ -185,15 +226,23 @@ void NAL_SELECTOR_reset(NAL_SELECTOR *sel)
 	assert(sel->vt);
 	if(sel->vt->pre_close) sel->vt->pre_close(sel);
 	sel->vt->on_reset(sel);
+	nal_connection_ready_clear(&sel->ready);
 }
 
 int NAL_SELECTOR_select(NAL_SELECTOR *sel, unsigned long usec_timeout,
 			int use_timeout)
 {
 	assert(sel->vt);
+	/* Only this select's connections are reported afterwards */
+	nal_connection_ready_clear(&sel->ready);
 	return sel->vt->select(sel, usec_timeout, use_timeout);
 }
 
+NAL_CONNECTION *NAL_SELECTOR_get_ready(NAL_SELECTOR *sel)
+{
+	return nal_connection_ready_pop(&sel->ready);
+}
+
 unsigned int NAL_SELECTOR_num_objects(const NAL_SELECTOR *sel)
 {
 	assert(sel->vt);
@@ -274,9 +274,11 @@ static int list_pre_selector_add(NAL_LISTENER *l, NAL_SELECTOR *sel)
 	switch(nal_selector_get_type(sel)) {
 	case NAL_SELECTOR_TYPE_FDSELECT:
 	case NAL_SELECTOR_TYPE_FDPOLL:
+	case NAL_SELECTOR_TYPE_EPOLL:
+	case NAL_SELECTOR_TYPE_URING:
 		return 1;
 	case NAL_SELECTOR_TYPE_DYNAMIC:
-		return nal_selector_dynamic_set(sel, NAL_SELECTOR_VT_DEFAULT());
+		return nal_selector_dynamic_default(sel);
 	default:
 		break;
 	}
@@ -314,6 +316,15 @@ static void list_post_select(NAL_LISTENER *l, NAL_SELECTOR *sel,
 /* Implementation of conn_vtable handlers */
 /******************************************/
 
+/* The watch on our buffers. They're what our criteria in conn_pre_select()
+ * depend on, so the selector needs to ask again when they change. */
+static void conn_changed(void *arg)
+{
+	NAL_SELECTOR_TOKEN tok;
+	NAL_SELECTOR *sel = nal_connection_get_selector(arg, &tok);
+	if(sel) nal_selector_fd_changed(sel, tok);
+}
+
 /* internal function shared by conn_connect and conn_accept */
 static int conn_ctx_setup(conn_ctx *ctx_conn, int fd_read, int fd_send,
 				unsigned int buf_size)
@@ -333,6 +344,8 @@ static int conn_on_create(NAL_CONNECTION *conn)
 	if(!ctx->b_read) ctx->b_read = NAL_BUFFER_new();
 	if(!ctx->b_send) ctx->b_send = NAL_BUFFER_new();
 	if(!ctx->b_read || !ctx->b_send) return 0;
+	nal_buffer_set_watch(ctx->b_read, conn_changed, conn);
+	nal_buffer_set_watch(ctx->b_send, conn_changed, conn);
 	ctx->fd_read = -1;
 	ctx->fd_send = -1;
 	return 1;
@@ -420,9 +433,11 @@ static int conn_pre_selector_add(NAL_CONNECTION *conn, NAL_SELECTOR *sel)
 	switch(nal_selector_get_type(sel)) {
 	case NAL_SELECTOR_TYPE_FDSELECT:
 	case NAL_SELECTOR_TYPE_FDPOLL:
+	case NAL_SELECTOR_TYPE_EPOLL:
+	case NAL_SELECTOR_TYPE_URING:
 		return 1;
 	case NAL_SELECTOR_TYPE_DYNAMIC:
-		return nal_selector_dynamic_set(sel, NAL_SELECTOR_VT_DEFAULT());
+		return nal_selector_dynamic_default(sel);
 	default:
 		break;
 	}
@@ -471,6 +486,8 @@ static void conn_post_select(NAL_CONNECTION *conn, NAL_SELECTOR *sel,
 		if(ctx->fd_send != -1)
 			nal_selector_fd_test(&ctx->flags, sel, token, ctx->fd_send);
 	}
+	if(ctx->flags)
+		nal_connection_set_ready(conn);
 }
 
 static int conn_do_io(NAL_CONNECTION *conn)
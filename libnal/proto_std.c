@@ -71,9 +71,11 @@ static void list_post_select(NAL_LISTENER *, NAL_SELECTOR *, NAL_SELECTOR_TOKEN)
 static int list_set_fs_owner(NAL_LISTENER *l, const char *ownername,
 				const char *groupname);
 static int list_set_fs_perms(NAL_LISTENER *l, const char *octal_string);
-/* This is the type we attach to our listeners */
+/* This is the type we attach to our listeners. 'caught' is the number of
+ * accepts still allowed since the listener was last found readable. */
 typedef struct st_list_ctx {
-	int fd, caught;
+	int fd;
+	unsigned int caught;
 	nal_sockaddr_type type;
 } list_ctx;
 static const NAL_LISTENER_vtable list_vtable = {
@@ -116,6 +118,9 @@ typedef struct st_conn_ctx {
 	unsigned char flags;
 	NAL_BUFFER *b_read;
 	NAL_BUFFER *b_send;
+	/* With an io_uring selector, the I/O it did for us and the results */
+	unsigned char io_done;
+	int io_read, io_send;
 } conn_ctx;
 static const NAL_CONNECTION_vtable conn_vtable = {
 	sizeof(conn_ctx),
@@ -146,6 +151,16 @@ static const NAL_CONNECTION_vtable conn_vtable = {
  * algorithm turned off (by setting TCP_NODELAY). */
 static int gb_use_nagle = 0;
 
+/* This flag, if set, will cause new ipv4 listeners to be created with
+ * SO_REUSEPORT, so that several listeners (usually in different processes)
+ * can be bound to the same address and have the kernel spread incoming
+ * connections between them. */
+static int gb_use_reuseport = 0;
+
+/* The maximum number of connections a listener will accept each time it is
+ * found readable, before it has to wait for the next select. */
+static unsigned int gb_accept_batch = NAL_LISTENER_ACCEPT_BATCH;
+
 /*****************/
 /* API functions */
 /*****************/
@@ -155,6 +170,34 @@ void NAL_config_set_nagle(int enabled)
 	gb_use_nagle = enabled;
 }
 
+int NAL_config_set_reuseport(int enabled)
+{
+#ifdef SO_REUSEPORT
+	gb_use_reuseport = enabled;
+	return 1;
+#else
+	return !enabled;
+#endif
+}
+
+int NAL_config_set_accept_batch(unsigned int max)
+{
+	if(!max)
+		return 0;
+	gb_accept_batch = max;
+	return 1;
+}
+
+int NAL_ADDRESS_can_reuseport(const NAL_ADDRESS *addr)
+{
+	const nal_sockaddr *ctx;
+	if(!gb_use_reuseport || (nal_address_get_vtable(addr) !=
+				&builtin_sock_addr_vtable))
+		return 0;
+	ctx = nal_address_get_vtdata(addr);
+	return (ctx->type == nal_sockaddr_type_ip);
+}
+
 int NAL_CONNECTION_create_pair(NAL_CONNECTION *conn1,
 				NAL_CONNECTION *conn2,
 				unsigned int def_buffer_size)
@@ -279,7 +322,8 @@ static int list_listen(NAL_LISTENER *l, const NAL_ADDRESS *addr)
 	ctx_listener->fd = -1;
 	if(!nal_sock_create_socket(&ctx_listener->fd, ctx_addr) ||
 			!nal_fd_make_non_blocking(ctx_listener->fd, 1) ||
-			!nal_sock_listen(ctx_listener->fd, ctx_addr)) {
+			!nal_sock_listen(ctx_listener->fd, ctx_addr,
+				gb_use_reuseport)) {
 		nal_fd_close(&ctx_listener->fd);
 		return 0;
 	}
@@ -291,7 +335,7 @@ static const NAL_CONNECTION_vtable *list_pre_accept(NAL_LISTENER *l)
 {
 	list_ctx *ctx = nal_listener_get_vtdata(l);
 	if(ctx->caught) {
-		/* ctx->caught = 0; */ /* this is unset in conn::accept */
+		/* this is decremented in conn::accept */
 		return &conn_vtable;
 	}
 	return NULL;
@@ -307,9 +351,11 @@ static int list_pre_selector_add(NAL_LISTENER *l, NAL_SELECTOR *sel)
 	switch(nal_selector_get_type(sel)) {
 	case NAL_SELECTOR_TYPE_FDSELECT:
 	case NAL_SELECTOR_TYPE_FDPOLL:
+	case NAL_SELECTOR_TYPE_EPOLL:
+	case NAL_SELECTOR_TYPE_URING:
 		return 1;
 	case NAL_SELECTOR_TYPE_DYNAMIC:
-		return nal_selector_dynamic_set(sel, NAL_SELECTOR_VT_DEFAULT());
+		return nal_selector_dynamic_default(sel);
 	default:
 		break;
 	}
@@ -335,12 +381,13 @@ static void list_post_select(NAL_LISTENER *l, NAL_SELECTOR *sel,
 {
 	unsigned char flags;
 	list_ctx *ctx = nal_listener_get_vtdata(l);
-	/* We detect readability on the listener socket and set "caught". */
+	/* We detect readability on the listener socket and set "caught" to
+	 * allow a batch of accepts, the listen queue may hold many. */
 	nal_selector_fd_test(&flags, sel, tok, ctx->fd);
 	if(flags & SELECTOR_FLAG_READ) {
 		/* We shouldn't have been selectable if this was already set */
 		assert(!ctx->caught);
-		ctx->caught = 1;
+		ctx->caught = gb_accept_batch;
 	}
 }
 
@@ -367,6 +414,23 @@ static int list_set_fs_perms(NAL_LISTENER *l, const char *octal_string)
 /* Implementation of conn_vtable handlers */
 /******************************************/
 
+/* Once a listener has used up its accepts, it selects for readability again */
+static void list_changed(const NAL_LISTENER *l)
+{
+	NAL_SELECTOR_TOKEN tok;
+	NAL_SELECTOR *sel = nal_listener_get_selector(l, &tok);
+	if(sel) nal_selector_fd_changed(sel, tok);
+}
+
+/* The watch on our buffers. They're what our criteria in conn_pre_select()
+ * depend on, so the selector needs to ask again when they change. */
+static void conn_changed(void *arg)
+{
+	NAL_SELECTOR_TOKEN tok;
+	NAL_SELECTOR *sel = nal_connection_get_selector(arg, &tok);
+	if(sel) nal_selector_fd_changed(sel, tok);
+}
+
 /* internal function shared by conn_connect and conn_accept */
 static int conn_ctx_setup(conn_ctx *ctx_conn, int fd, int established,
 				unsigned int buf_size)
@@ -385,6 +449,8 @@ static int conn_on_create(NAL_CONNECTION *conn)
 	if(!ctx->b_read) ctx->b_read = NAL_BUFFER_new();
 	if(!ctx->b_send) ctx->b_send = NAL_BUFFER_new();
 	if(!ctx->b_read || !ctx->b_send) return 0;
+	nal_buffer_set_watch(ctx->b_read, conn_changed, conn);
+	nal_buffer_set_watch(ctx->b_send, conn_changed, conn);
 	ctx->fd = -1;
 	return 1;
 }
@@ -404,6 +470,7 @@ static void conn_on_reset(NAL_CONNECTION *conn)
 	NAL_BUFFER_reset(ctx->b_read);
 	NAL_BUFFER_reset(ctx->b_send);
 	ctx->flags = 0;
+	ctx->io_done = 0;
 	ctx->established = 0;
 }
 
@@ -432,24 +499,16 @@ static int conn_accept(NAL_CONNECTION *conn, const NAL_LISTENER *l)
 	conn_ctx *ctx_conn = nal_connection_get_vtdata(conn);
 	assert(ctx_list->caught);
 	if(!nal_sock_accept(ctx_list->fd, &fd)) {
-#if 0 /* We only support one accept per readability so this stuff simply shouldn't occur */
-		switch(errno) {
-		case EAGAIN:
-#if EAGAIN != EWOULDBLOCK
-		case EWOULDBLOCK:
-#endif
-			/* We've exhausted the listen queue for now */
-			ctx_list->caught = 0;
-			break;
-		default:
-			break;
-		}
-#endif
+		/* Most likely EAGAIN, we've exhausted the listen queue for now.
+		 * Whatever the error, we go back to waiting for readability
+		 * rather than retry straight away. */
+		ctx_list->caught = 0;
+		list_changed(l);
 		goto err;
 	}
-	ctx_list->caught = 0;
-	if(!nal_fd_make_non_blocking(fd, 1) ||
-			!nal_sock_set_nagle(fd, gb_use_nagle, ctx_list->type) ||
+	if(!--ctx_list->caught)
+		list_changed(l);
+	if(!nal_sock_set_nagle(fd, gb_use_nagle, ctx_list->type) ||
 			!conn_ctx_setup(ctx_conn, fd, 1,
 				nal_listener_get_def_buffer_size(l)))
 		goto err;
@@ -491,9 +550,11 @@ static int conn_pre_selector_add(NAL_CONNECTION *conn, NAL_SELECTOR *sel)
 	switch(nal_selector_get_type(sel)) {
 	case NAL_SELECTOR_TYPE_FDSELECT:
 	case NAL_SELECTOR_TYPE_FDPOLL:
+	case NAL_SELECTOR_TYPE_EPOLL:
+	case NAL_SELECTOR_TYPE_URING:
 		return 1;
 	case NAL_SELECTOR_TYPE_DYNAMIC:
-		return nal_selector_dynamic_set(sel, NAL_SELECTOR_VT_DEFAULT());
+		return nal_selector_dynamic_default(sel);
 	default:
 		break;
 	}
@@ -504,6 +565,7 @@ static void conn_post_selector_del(NAL_CONNECTION *conn, NAL_SELECTOR *sel)
 {
 	conn_ctx *ctx = nal_connection_get_vtdata(conn);
 	ctx->flags = 0;
+	ctx->io_done = 0;
 }
 
 static void conn_pre_select(NAL_CONNECTION *conn, NAL_SELECTOR *sel,
@@ -520,6 +582,12 @@ static void conn_pre_select(NAL_CONNECTION *conn, NAL_SELECTOR *sel,
 		(!ctx->established || NAL_BUFFER_notempty(ctx->b_send) ?
 			SELECTOR_FLAG_SEND : 0) |
 		SELECTOR_FLAG_EXCEPT);
+	/* An io_uring selector can do the reads and sends for us, batched with
+	 * those of other connections. */
+	if(ctx->established &&
+			(nal_selector_get_type(sel) == NAL_SELECTOR_TYPE_URING))
+		nal_selector_buf_set(sel, token, ctx->fd, ctx->b_read,
+				ctx->b_send);
 }
 
 static void conn_post_select(NAL_CONNECTION *conn, NAL_SELECTOR *sel,
@@ -527,6 +595,14 @@ static void conn_post_select(NAL_CONNECTION *conn, NAL_SELECTOR *sel,
 {
 	conn_ctx *ctx = nal_connection_get_vtdata(conn);
 	nal_selector_fd_test(&ctx->flags, sel, token, ctx->fd);
+	if(ctx->established &&
+			(nal_selector_get_type(sel) == NAL_SELECTOR_TYPE_URING))
+		nal_selector_buf_test(&ctx->io_done, &ctx->io_read,
+				&ctx->io_send, sel, token, ctx->fd);
+	else
+		ctx->io_done = 0;
+	if(ctx->flags || ctx->io_done)
+		nal_connection_set_ready(conn);
 }
 
 static int conn_do_io(NAL_CONNECTION *conn)
@@ -548,17 +624,20 @@ static int conn_do_io(NAL_CONNECTION *conn)
 		nb = 1;
 	}
 	if(ctx->flags & SELECTOR_FLAG_READ) {
-		int io_ret = nal_fd_buffer_from_fd(ctx->b_read, ctx->fd, 0);
+		int io_ret = ((ctx->io_done & SELECTOR_FLAG_READ) ? ctx->io_read :
+				nal_fd_buffer_from_fd(ctx->b_read, ctx->fd, 0));
 		/* zero shouldn't happen if we're readable, and negative is err */
 		if(io_ret <= 0)
 			return 0;
 	}
 	if(ctx->flags & SELECTOR_FLAG_SEND) {
-		int io_ret = nal_fd_buffer_to_fd(ctx->b_send, ctx->fd, 0);
+		int io_ret = ((ctx->io_done & SELECTOR_FLAG_SEND) ? ctx->io_send :
+				nal_fd_buffer_to_fd(ctx->b_send, ctx->fd, 0));
 		if((io_ret < 0) || (!io_ret && !nb))
 			return 0;
 	}
 	ctx->flags = 0;
+	ctx->io_done = 0;
 	return 1;
 }
 
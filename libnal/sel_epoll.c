@@ -0,0 +1,935 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_LIB
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include "nal_internal.h"
+#include "ctrl_fd.h"
+#include <libsys/post.h>
+
+#ifndef HAVE_URING_SELECTOR
+
+/* If we don't build io_uring support, return a NULL vtable */
+const NAL_SELECTOR_vtable *sel_uring(void)
+{
+	return NULL;
+}
+NAL_SELECTOR *NAL_SELECTOR_new_uring(void)
+{
+	return NULL;
+}
+
+#endif
+
+#ifndef HAVE_EPOLL
+
+/* If we don't build epoll support, return a NULL vtable */
+const NAL_SELECTOR_vtable *sel_epoll(void)
+{
+	return NULL;
+}
+NAL_SELECTOR *NAL_SELECTOR_new_epoll(void)
+{
+	return NULL;
+}
+
+#else
+
+/* Unlike select() and poll(), the interest set lives in the kernel between
+ * calls, so we only ask an object for its interest (with its pre_select hook)
+ * when it may have changed. That's when the object is added, when it has been
+ * given results (its I/O changes its state), and when it tells us with
+ * NAL_FD_CTRL_CHANGED (eg. when a connection's buffers become empty or full,
+ * as the application reads and writes them). Those objects are kept on a
+ * "dirty" list, the others are left alone, and we only make a system call when
+ * the interest differs from what is already registered. Likewise, only the
+ * objects epoll_wait() reports (plus those that were reported last time, so
+ * they can clear their results) are given their post_select hooks. So the
+ * work for each select is proportional to the objects that are active, not to
+ * the number in the selector.
+ *
+ * The io_uring variant (NAL_SELECTOR_TYPE_URING) uses the same readiness
+ * logic, but connections also hand over their buffers (NAL_FD_CTRL_BUFSET) and
+ * the reads and sends for every ready connection are then submitted together
+ * and completed with one io_uring_enter(2), rather than costing a system call
+ * each. If the kernel doesn't support io_uring, it reports itself as
+ * NAL_SELECTOR_TYPE_EPOLL so that connections do their own I/O. */
+
+/* The number of distinct fds one object can register, the builtin protocols
+ * never need more than two (proto_fd's read and send descriptors). */
+#define SEL_OBJ_FDS		2
+
+/* The states of a fd slot */
+#define SEL_FD_UNUSED		0
+#define SEL_FD_NEW		1	/* fd_set this round, not yet registered */
+#define SEL_FD_REGISTERED	2	/* registered in the kernel */
+#define SEL_FD_STATIC		3	/* not pollable (eg. a regular file) */
+
+typedef struct st_sel_fd {
+	int fd;
+	unsigned char state;
+	/* Set if fd_set was called for this fd in the current round */
+	unsigned char seen;
+	/* SELECTOR_FLAG_* criteria, as requested this round and as currently
+	 * registered in the kernel */
+	unsigned char want, registered;
+	/* SELECTOR_FLAG_* results for fd_test */
+	unsigned char result;
+#ifdef HAVE_URING_SELECTOR
+	/* Buffers set this round for us to do I/O with, and the results */
+	NAL_BUFFER *b_read, *b_send;
+	/* Describe the buffer segments to the kernel while requests run */
+	struct iovec iov_read[NAL_BUFFER_IOV_MAX], iov_send[NAL_BUFFER_IOV_MAX];
+	struct msghdr msg_read, msg_send;
+	unsigned char done;
+	int read_ret, send_ret;
+#endif
+} sel_fd;
+typedef struct st_sel_obj {
+	union {
+		NAL_CONNECTION *conn;
+		NAL_LISTENER *listener;
+	} obj;
+	unsigned char what; /* 0==unused, 1==conn, 2==listener */
+	/* Set if the object is already in the ready list, or the dirty list */
+	unsigned char ready, dirty;
+	sel_fd fds[SEL_OBJ_FDS];
+	/* When unused, the index of the next unused object (or -1) */
+	int next_free;
+} sel_obj;
+typedef struct st_sel_ctx {
+	/* The epoll descriptor */
+	int epfd;
+	/* The table of connection and listener objects, unused entries are
+	 * chained together from 'first_free'. */
+	sel_obj *obj_table;
+	unsigned int obj_used, obj_size;
+	int first_free;
+	/* Indexes of the objects to run post_select hooks on */
+	unsigned int *ready;
+	unsigned int ready_used;
+	/* The number of objects the last select reported, at the front of
+	 * 'ready' until the next select. */
+	unsigned int ready_last;
+	/* Indexes of the objects whose pre_select hooks must run before the
+	 * next select. Entries for objects deleted since are skipped. */
+	unsigned int *dirty;
+	unsigned int dirty_used;
+	/* Indexes of the objects that requested a 'static' fd, in which case
+	 * the select doesn't block. These are always ready, so they're always
+	 * dirty and this is rebuilt by each pre_select. */
+	unsigned int *statics;
+	unsigned int statics_used;
+	/* The results buffer for epoll_wait() */
+	struct epoll_event *events;
+#ifdef HAVE_URING_SELECTOR
+	/* NULL unless this is an io_uring selector and the kernel supports it */
+	nal_uring *ring;
+#endif
+	/* Used during pre_select and post_select to check we only get
+	 * callbacks for tokens belonging to the object we're hooking at the
+	 * time. */
+	NAL_SELECTOR_TOKEN hook_current;
+} sel_ctx;
+#define OBJ_TABLE_START		32
+/* Tokens can't be NULL, so they're offset by one from the table index */
+#define IDX2TOKEN(idx) (NAL_SELECTOR_TOKEN)((unsigned long)(idx) + 1)
+#define TOKEN2IDX(tok) (unsigned int)((unsigned long)(tok) - 1)
+/* Kernel event data identifies the object and which of its fd slots */
+#define EVDATA(idx, slot) (((uint32_t)(idx) << 1) | (uint32_t)(slot))
+#define EVDATA2IDX(d) (unsigned int)((d) >> 1)
+#define EVDATA2SLOT(d) (unsigned int)((d) & 1)
+#ifdef HAVE_URING_SELECTOR
+/* The size of the io_uring submission queue, and so of each I/O batch */
+#define URING_ENTRIES		256
+/* io_uring request data is the event data, plus whether it's a send */
+#define URDATA(evdata, is_send) (((unsigned long)(evdata) << 1) | (is_send))
+#define URDATA2EVDATA(d) (uint32_t)((d) >> 1)
+#define URDATA2SEND(d) (int)((d) & 1)
+#endif
+
+/* Helper functions for the object table */
+static void obj_table_chain(sel_ctx *ctx, unsigned int from, unsigned int to)
+{
+	/* Chain items [from,to) in front of the existing free list */
+	while(to-- > from) {
+		ctx->obj_table[to].what = 0;
+		ctx->obj_table[to].next_free = ctx->first_free;
+		ctx->first_free = (int)to;
+	}
+}
+static int obj_table_init(sel_ctx *ctx)
+{
+#ifdef EPOLL_CLOEXEC
+	ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	ctx->epfd = epoll_create(OBJ_TABLE_START);
+#endif
+	if(ctx->epfd < 0) return 0;
+	ctx->obj_table = SYS_malloc(sel_obj, OBJ_TABLE_START);
+	ctx->ready = SYS_malloc(unsigned int, OBJ_TABLE_START);
+	ctx->dirty = SYS_malloc(unsigned int, OBJ_TABLE_START);
+	ctx->statics = SYS_malloc(unsigned int, OBJ_TABLE_START);
+	ctx->events = SYS_malloc(struct epoll_event, OBJ_TABLE_START);
+	if(!ctx->obj_table || !ctx->ready || !ctx->dirty || !ctx->statics ||
+			!ctx->events) {
+		if(ctx->obj_table) SYS_free(sel_obj, ctx->obj_table);
+		if(ctx->ready) SYS_free(unsigned int, ctx->ready);
+		if(ctx->dirty) SYS_free(unsigned int, ctx->dirty);
+		if(ctx->statics) SYS_free(unsigned int, ctx->statics);
+		if(ctx->events) SYS_free(struct epoll_event, ctx->events);
+		nal_fd_close(&ctx->epfd);
+		return 0;
+	}
+	SYS_zero_n(sel_obj, ctx->obj_table, OBJ_TABLE_START);
+	ctx->obj_used = 0;
+	ctx->obj_size = OBJ_TABLE_START;
+	ctx->first_free = -1;
+	obj_table_chain(ctx, 0, OBJ_TABLE_START);
+	ctx->ready_used = ctx->ready_last = 0;
+	ctx->dirty_used = ctx->statics_used = 0;
+	return 1;
+}
+static void obj_table_finish(sel_ctx *ctx)
+{
+	if(ctx->obj_used)
+		SYS_fprintf(SYS_stderr, "Warning, selector destruction leaves "
+				"dangling objects\n");
+	SYS_free(sel_obj, ctx->obj_table);
+	SYS_free(unsigned int, ctx->ready);
+	SYS_free(unsigned int, ctx->dirty);
+	SYS_free(unsigned int, ctx->statics);
+	SYS_free(struct epoll_event, ctx->events);
+	nal_fd_close(&ctx->epfd);
+}
+static void obj_table_reset(sel_ctx *ctx)
+{
+	if(ctx->obj_used)
+		SYS_fprintf(SYS_stderr, "Warning, selector reset leaves "
+				"dangling objects\n");
+	/* Forget everything the kernel knows too, the simplest way is with a
+	 * new epoll descriptor. */
+	obj_table_finish(ctx);
+	if(!obj_table_init(ctx)) {
+		/* XXX: on_reset can't fail, so we're left unusable */
+		SYS_fprintf(SYS_stderr, "Warning, selector reset failed\n");
+		ctx->obj_table = NULL;
+		ctx->ready = NULL;
+		ctx->dirty = NULL;
+		ctx->statics = NULL;
+		ctx->events = NULL;
+		ctx->obj_size = ctx->obj_used = 0;
+		ctx->first_free = -1;
+	}
+}
+static int obj_table_expand(sel_ctx *ctx)
+{
+	unsigned int newsize = ctx->obj_size * 3 / 2;
+	sel_obj *newitems = SYS_malloc(sel_obj, newsize);
+	unsigned int *newready = SYS_malloc(unsigned int, newsize);
+	unsigned int *newdirty = SYS_malloc(unsigned int, newsize);
+	unsigned int *newstatics = SYS_malloc(unsigned int, newsize);
+	struct epoll_event *newevents = SYS_malloc(struct epoll_event, newsize);
+	if(!newitems || !newready || !newdirty || !newstatics || !newevents) {
+		if(newitems) SYS_free(sel_obj, newitems);
+		if(newready) SYS_free(unsigned int, newready);
+		if(newdirty) SYS_free(unsigned int, newdirty);
+		if(newstatics) SYS_free(unsigned int, newstatics);
+		if(newevents) SYS_free(struct epoll_event, newevents);
+		return 0;
+	}
+	SYS_zero_n(sel_obj, newitems, newsize);
+	SYS_memcpy_n(sel_obj, newitems, ctx->obj_table, ctx->obj_size);
+	SYS_memcpy_n(unsigned int, newready, ctx->ready, ctx->ready_used);
+	SYS_memcpy_n(unsigned int, newdirty, ctx->dirty, ctx->dirty_used);
+	SYS_memcpy_n(unsigned int, newstatics, ctx->statics,
+			ctx->statics_used);
+	SYS_free(sel_obj, ctx->obj_table);
+	SYS_free(unsigned int, ctx->ready);
+	SYS_free(unsigned int, ctx->dirty);
+	SYS_free(unsigned int, ctx->statics);
+	SYS_free(struct epoll_event, ctx->events);
+	ctx->obj_table = newitems;
+	ctx->ready = newready;
+	ctx->dirty = newdirty;
+	ctx->statics = newstatics;
+	ctx->events = newevents;
+	obj_table_chain(ctx, ctx->obj_size, newsize);
+	ctx->obj_size = newsize;
+	return 1;
+}
+static void obj_make_dirty(sel_ctx *ctx, unsigned int idx)
+{
+	sel_obj *obj = ctx->obj_table + idx;
+	/* A deleted object may still be on the list, in which case the entry
+	 * covers whatever reuses its slot. */
+	if(!obj->dirty) {
+		obj->dirty = 1;
+		ctx->dirty[ctx->dirty_used++] = idx;
+	}
+}
+static int obj_table_add(sel_ctx *ctx)
+{
+	int loc;
+	if((ctx->first_free < 0) && !obj_table_expand(ctx))
+		return -1;
+	loc = ctx->first_free;
+	ctx->first_free = ctx->obj_table[loc].next_free;
+	ctx->obj_table[loc].ready = 0;
+	SYS_zero_n(sel_fd, ctx->obj_table[loc].fds, SEL_OBJ_FDS);
+	ctx->obj_used++;
+	/* The new object hasn't told us what it wants yet */
+	obj_make_dirty(ctx, (unsigned int)loc);
+	return loc;
+}
+static NAL_SELECTOR_TOKEN obj_table_add_listener(sel_ctx *ctx,
+					NAL_LISTENER *listener)
+{
+	int loc = obj_table_add(ctx);
+	if(loc < 0) return NAL_SELECTOR_TOKEN_NULL;
+	ctx->obj_table[loc].what = 2;
+	ctx->obj_table[loc].obj.listener = listener;
+	return IDX2TOKEN(loc);
+}
+static NAL_SELECTOR_TOKEN obj_table_add_connection(sel_ctx *ctx,
+					NAL_CONNECTION *conn)
+{
+	int loc = obj_table_add(ctx);
+	if(loc < 0) return NAL_SELECTOR_TOKEN_NULL;
+	ctx->obj_table[loc].what = 1;
+	ctx->obj_table[loc].obj.conn = conn;
+	return IDX2TOKEN(loc);
+}
+static void obj_fd_unregister(sel_ctx *ctx, sel_fd *sfd)
+{
+	/* The fd is still open when objects leave the selector, so removing
+	 * it here also stops a dup()'d copy (eg. in a forked child) leaving a
+	 * stale registration behind. */
+	if(sfd->state == SEL_FD_REGISTERED) {
+		struct epoll_event ev;
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sfd->fd, &ev);
+	}
+	sfd->state = SEL_FD_UNUSED;
+}
+static void obj_table_del(sel_ctx *ctx, NAL_SELECTOR_TOKEN tok)
+{
+	unsigned int loop, idx = TOKEN2IDX(tok);
+	sel_obj *obj = ctx->obj_table + idx;
+	assert(idx < ctx->obj_size);
+	assert(obj->what != 0);
+	assert(ctx->obj_used > 0);
+	for(loop = 0; loop < SEL_OBJ_FDS; loop++)
+		obj_fd_unregister(ctx, obj->fds + loop);
+	obj->what = 0;
+	obj->next_free = ctx->first_free;
+	ctx->first_free = (int)idx;
+	ctx->obj_used--;
+}
+/* Implemented lower down with the "fd_set" callbacks that will be used by the
+ * connection/listener implementations we hook. */
+static void obj_table_pre_select(sel_ctx *ctx);
+static void obj_table_post_select(sel_ctx *ctx, int num);
+/**************************/
+/* predeclare our vtables */
+/**************************/
+
+/* Predeclare the selector functions */
+static int sel_on_create(NAL_SELECTOR *);
+static void sel_on_destroy(NAL_SELECTOR *);
+static void sel_on_reset(NAL_SELECTOR *);
+static NAL_SELECTOR_TYPE sel_get_type(const NAL_SELECTOR *);
+static int sel_select(NAL_SELECTOR *, unsigned long usec_timeout, int use_timeout);
+static unsigned int sel_num_objects(const NAL_SELECTOR *);
+static NAL_SELECTOR_TOKEN sel_add_listener(NAL_SELECTOR *, NAL_LISTENER *);
+static NAL_SELECTOR_TOKEN sel_add_connection(NAL_SELECTOR *, NAL_CONNECTION *);
+static void sel_del_listener(NAL_SELECTOR *, NAL_LISTENER *, NAL_SELECTOR_TOKEN);
+static void sel_del_connection(NAL_SELECTOR *, NAL_CONNECTION *, NAL_SELECTOR_TOKEN);
+static int sel_ctrl(NAL_SELECTOR *, int, void *);
+static const NAL_SELECTOR_vtable sel_epoll_vtable = {
+	sizeof(sel_ctx),
+	sel_on_create,
+	sel_on_destroy,
+	sel_on_reset,
+	NULL, /* pre_close */
+	sel_get_type,
+	sel_select,
+	sel_num_objects,
+	sel_add_listener,
+	sel_add_connection,
+	sel_del_listener,
+	sel_del_connection,
+	sel_ctrl
+};
+/* Expose this implementation */
+const NAL_SELECTOR_vtable *sel_epoll(void)
+{
+	return &sel_epoll_vtable;
+}
+NAL_SELECTOR *NAL_SELECTOR_new_epoll(void)
+{
+	return nal_selector_new(&sel_epoll_vtable);
+}
+#ifdef HAVE_URING_SELECTOR
+/* The io_uring variant only differs in its construction and type */
+static int sel_uring_on_create(NAL_SELECTOR *);
+static void sel_uring_on_destroy(NAL_SELECTOR *);
+static NAL_SELECTOR_TYPE sel_uring_get_type(const NAL_SELECTOR *);
+static const NAL_SELECTOR_vtable sel_uring_vtable = {
+	sizeof(sel_ctx),
+	sel_uring_on_create,
+	sel_uring_on_destroy,
+	sel_on_reset,
+	NULL, /* pre_close */
+	sel_uring_get_type,
+	sel_select,
+	sel_num_objects,
+	sel_add_listener,
+	sel_add_connection,
+	sel_del_listener,
+	sel_del_connection,
+	sel_ctrl
+};
+const NAL_SELECTOR_vtable *sel_uring(void)
+{
+	return &sel_uring_vtable;
+}
+NAL_SELECTOR *NAL_SELECTOR_new_uring(void)
+{
+	return nal_selector_new(&sel_uring_vtable);
+}
+#endif
+
+/************************************/
+/* selector implementation handlers */
+/************************************/
+
+static int sel_on_create(NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(!obj_table_init(ctx)) return 0;
+	return 1;
+}
+
+static void sel_on_destroy(NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(ctx->obj_table)
+		obj_table_finish(ctx);
+}
+
+static void sel_on_reset(NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(ctx->obj_table)
+		obj_table_reset(ctx);
+}
+
+static NAL_SELECTOR_TYPE sel_get_type(const NAL_SELECTOR *sel)
+{
+	return NAL_SELECTOR_TYPE_EPOLL;
+}
+
+#ifdef HAVE_URING_SELECTOR
+static int sel_uring_on_create(NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(!sel_on_create(sel)) return 0;
+	/* No io_uring isn't an error, we just behave like sel_epoll */
+	ctx->ring = nal_uring_new(URING_ENTRIES);
+	return 1;
+}
+
+static void sel_uring_on_destroy(NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(ctx->ring)
+		nal_uring_free(ctx->ring);
+	sel_on_destroy(sel);
+}
+
+static NAL_SELECTOR_TYPE sel_uring_get_type(const NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	return (ctx->ring ? NAL_SELECTOR_TYPE_URING : NAL_SELECTOR_TYPE_EPOLL);
+}
+#endif
+
+static int sel_select(NAL_SELECTOR *sel, unsigned long usec_timeout,
+			int use_timeout)
+{
+	int res;
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(!ctx->obj_table) return -1;
+	/* Pre-select */
+	obj_table_pre_select(ctx);
+	/* Call the blocking epoll_wait(2) function */
+	res = epoll_wait(ctx->epfd, ctx->events, (int)ctx->obj_size,
+			ctx->statics_used ? 0 : (use_timeout ?
+				(int)(usec_timeout / 1000) : -1));
+	/* Post-select */
+	if(res >= 0) {
+		obj_table_post_select(ctx, res);
+		res = (int)ctx->ready_last;
+	}
+	return res;
+}
+
+static unsigned int sel_num_objects(const NAL_SELECTOR *sel)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	return ctx->obj_used;
+}
+
+static NAL_SELECTOR_TOKEN sel_add_listener(NAL_SELECTOR *sel,
+				NAL_LISTENER *listener)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(!ctx->obj_table) return NAL_SELECTOR_TOKEN_NULL;
+	return obj_table_add_listener(ctx, listener);
+}
+
+static NAL_SELECTOR_TOKEN sel_add_connection(NAL_SELECTOR *sel,
+				NAL_CONNECTION *conn)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	if(!ctx->obj_table) return NAL_SELECTOR_TOKEN_NULL;
+	return obj_table_add_connection(ctx, conn);
+}
+
+static void sel_del_listener(NAL_SELECTOR *sel, NAL_LISTENER *listener,
+				NAL_SELECTOR_TOKEN token)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	obj_table_del(ctx, token);
+}
+
+static void sel_del_connection(NAL_SELECTOR *sel, NAL_CONNECTION *conn,
+				NAL_SELECTOR_TOKEN token)
+{
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	obj_table_del(ctx, token);
+}
+
+/* The following code handles the hooking with listener and connection
+ * implementations. In particular, we use tokens so that we can invoke those
+ * implementations in such a way that they can callback to us whilst processing
+ * their hooks and we can understand what's up. */
+static uint32_t flags2events(unsigned char flags)
+{
+	/* EPOLLERR and EPOLLHUP are always reported, so SELECTOR_FLAG_EXCEPT
+	 * needs nothing. */
+	return ((flags & SELECTOR_FLAG_READ) ? EPOLLIN : 0) |
+		((flags & SELECTOR_FLAG_SEND) ? EPOLLOUT : 0);
+}
+static unsigned char events2flags(uint32_t events)
+{
+	unsigned char flags = 0;
+	if(events & EPOLLIN)
+		flags |= SELECTOR_FLAG_READ;
+	if(events & EPOLLOUT)
+		flags |= SELECTOR_FLAG_SEND;
+	/* As with poll(), only report EXCEPT if there's nothing else, so that
+	 * data that arrived before a close can still be read. */
+	if(!flags && (events & (EPOLLERR | EPOLLHUP)))
+		flags = SELECTOR_FLAG_EXCEPT;
+	return flags;
+}
+static void obj_make_ready(sel_ctx *ctx, unsigned int idx)
+{
+	sel_obj *obj = ctx->obj_table + idx;
+	if(!obj->ready) {
+		obj->ready = 1;
+		ctx->ready[ctx->ready_used++] = idx;
+	}
+}
+static void obj_fd_update(sel_ctx *ctx, unsigned int idx, unsigned int slot)
+{
+	struct epoll_event ev;
+	sel_fd *sfd = ctx->obj_table[idx].fds + slot;
+	if(sfd->state == SEL_FD_STATIC) {
+		/* The object's slots are updated together, so it can only be
+		 * at the end of the list already */
+		if((sfd->want & (SELECTOR_FLAG_READ | SELECTOR_FLAG_SEND)) &&
+				(!ctx->statics_used ||
+				(ctx->statics[ctx->statics_used - 1] != idx)))
+			ctx->statics[ctx->statics_used++] = idx;
+		return;
+	}
+	if((sfd->state == SEL_FD_REGISTERED) && (sfd->want == sfd->registered))
+		/* The common case, nothing to tell the kernel */
+		return;
+	ev.events = flags2events(sfd->want);
+	ev.data.u32 = EVDATA(idx, slot);
+	if(sfd->state == SEL_FD_REGISTERED) {
+		if(epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, sfd->fd, &ev) == 0) {
+			sfd->registered = sfd->want;
+			return;
+		}
+		/* The fd may have been closed and reopened behind our back */
+		sfd->state = SEL_FD_NEW;
+	}
+	if(epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sfd->fd, &ev) == 0) {
+		sfd->state = SEL_FD_REGISTERED;
+		sfd->registered = sfd->want;
+	} else if(errno == EPERM) {
+		/* Regular files can't be polled, they're always ready */
+		sfd->state = SEL_FD_STATIC;
+		obj_fd_update(ctx, idx, slot);
+	} else {
+		/* XXX: as with poll's fd_set expansion, NAL_SELECTOR_select()
+		 * can't report this. The object will simply see no events. */
+		SYS_fprintf(SYS_stderr, "Warning, epoll registration failed\n");
+		sfd->state = SEL_FD_UNUSED;
+	}
+}
+static void obj_table_pre_select(sel_ctx *ctx)
+{
+	unsigned int loop, slot;
+	ctx->statics_used = 0;
+	for(loop = 0; loop < ctx->dirty_used; loop++) {
+		unsigned int idx = ctx->dirty[loop];
+		sel_obj *item = ctx->obj_table + idx;
+		item->dirty = 0;
+		if(!item->what)
+			continue;
+		/* Let the hook register what it's interested in now, then
+		 * reconcile that with the kernel. */
+		for(slot = 0; slot < SEL_OBJ_FDS; slot++) {
+			item->fds[slot].seen = 0;
+			item->fds[slot].want = 0;
+#ifdef HAVE_URING_SELECTOR
+			item->fds[slot].b_read = NULL;
+			item->fds[slot].b_send = NULL;
+#endif
+		}
+		ctx->hook_current = IDX2TOKEN(idx);
+		if(item->what == 1)
+			nal_connection_pre_select(item->obj.conn);
+		else
+			nal_listener_pre_select(item->obj.listener);
+		for(slot = 0; slot < SEL_OBJ_FDS; slot++) {
+			sel_fd *sfd = item->fds + slot;
+			if(sfd->state == SEL_FD_UNUSED)
+				continue;
+			if(!sfd->seen)
+				obj_fd_unregister(ctx, sfd);
+			else
+				obj_fd_update(ctx, idx, slot);
+		}
+	}
+	ctx->dirty_used = 0;
+}
+static int obj_registered(const sel_obj *obj)
+{
+	unsigned int slot;
+	if(!obj->what)
+		return 0;
+	for(slot = 0; slot < SEL_OBJ_FDS; slot++)
+		if(obj->fds[slot].state && obj->fds[slot].seen)
+			return 1;
+	return 0;
+}
+#ifdef HAVE_URING_SELECTOR
+static void obj_uring_complete(sel_ctx *ctx)
+{
+	unsigned long data;
+	int res;
+	while(nal_uring_result(ctx->ring, &data, &res)) {
+		uint32_t d = URDATA2EVDATA(data);
+		sel_fd *sfd = ctx->obj_table[EVDATA2IDX(d)].fds + EVDATA2SLOT(d);
+		/* Map the results as nal_fd_buffer_[from|to]_fd() would */
+		if(res > 0) {
+			if(URDATA2SEND(data))
+				NAL_BUFFER_read(sfd->b_send, NULL, (unsigned int)res);
+			else
+				NAL_BUFFER_wrote(sfd->b_read, (unsigned int)res);
+		} else if((res == -EAGAIN) || (res == -EINTR))
+			res = 0;
+		else if(res < 0)
+			res = -1;
+		if(URDATA2SEND(data)) {
+			sfd->send_ret = res;
+			sfd->done |= SELECTOR_FLAG_SEND;
+		} else {
+			sfd->read_ret = res;
+			sfd->done |= SELECTOR_FLAG_READ;
+		}
+	}
+}
+static void obj_uring_run(sel_ctx *ctx)
+{
+	if(nal_uring_run(ctx->ring) < 0)
+		/* XXX: the requests that didn't complete aren't reported as
+		 * done, so those connections will do their own I/O. */
+		SYS_fprintf(SYS_stderr, "Warning, io_uring submission failed\n");
+	obj_uring_complete(ctx);
+}
+/* Points 'msg' at the buffer segments, returning zero if there are none */
+static int obj_uring_msg(struct msghdr *msg, struct iovec *v,
+			const NAL_BUFFER_IOV *iov, unsigned int num)
+{
+	unsigned int loop;
+	SYS_zero(struct msghdr, msg);
+	for(loop = 0; loop < num; loop++) {
+		v[loop].iov_base = iov[loop].ptr;
+		v[loop].iov_len = iov[loop].len;
+	}
+	msg->msg_iov = v;
+	msg->msg_iovlen = num;
+	return (num > 0);
+}
+static void obj_table_uring_io(sel_ctx *ctx)
+{
+	unsigned int loop, slot;
+	for(loop = 0; loop < ctx->ready_used; loop++) {
+		unsigned int idx = ctx->ready[loop];
+		sel_obj *obj = ctx->obj_table + idx;
+		for(slot = 0; slot < SEL_OBJ_FDS; slot++) {
+			sel_fd *sfd = obj->fds + slot;
+			unsigned long data = URDATA(EVDATA(idx, slot), 0);
+			NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+			if(!sfd->seen)
+				continue;
+			if((sfd->result & SELECTOR_FLAG_READ) && sfd->b_read &&
+					obj_uring_msg(&sfd->msg_read, sfd->iov_read, iov,
+					NAL_BUFFER_unused_iov(sfd->b_read, iov))) {
+				while(!nal_uring_recv(ctx->ring, sfd->fd,
+						&sfd->msg_read, data))
+					obj_uring_run(ctx);
+			}
+			if((sfd->result & SELECTOR_FLAG_SEND) && sfd->b_send &&
+					obj_uring_msg(&sfd->msg_send, sfd->iov_send, iov,
+					NAL_BUFFER_data_iov(sfd->b_send, iov))) {
+				while(!nal_uring_send(ctx->ring, sfd->fd,
+						&sfd->msg_send, data | 1))
+					obj_uring_run(ctx);
+			}
+		}
+	}
+	obj_uring_run(ctx);
+}
+#endif
+static void obj_table_post_select(sel_ctx *ctx, int num)
+{
+	unsigned int loop, slot, prev = ctx->ready_used;
+	/* Objects that were given results by the last select get their hooks
+	 * again, even if they now have no events, so they see their results
+	 * cleared as they would with select() or poll(). */
+	ctx->ready_used = 0;
+	for(loop = 0; loop < prev; loop++)
+		ctx->obj_table[ctx->ready[loop]].ready = 0;
+	for(loop = 0; loop < prev; loop++) {
+		unsigned int idx = ctx->ready[loop];
+		if(obj_registered(ctx->obj_table + idx))
+			obj_make_ready(ctx, idx);
+	}
+	ctx->ready_last = 0;
+	/* Objects with unpollable fds are always ready */
+	for(loop = 0; loop < ctx->statics_used; loop++) {
+		unsigned int idx = ctx->statics[loop];
+		sel_obj *obj = ctx->obj_table + idx;
+		if(!obj_registered(obj))
+			continue;
+		for(slot = 0; slot < SEL_OBJ_FDS; slot++) {
+			sel_fd *sfd = obj->fds + slot;
+			if((sfd->state == SEL_FD_STATIC) && sfd->seen &&
+					(sfd->want & (SELECTOR_FLAG_READ |
+						SELECTOR_FLAG_SEND))) {
+				sfd->result = sfd->want &
+					(SELECTOR_FLAG_READ | SELECTOR_FLAG_SEND);
+				obj_make_ready(ctx, idx);
+			}
+		}
+	}
+	/* Now the objects the kernel reported */
+	for(loop = 0; loop < (unsigned int)num; loop++) {
+		uint32_t d = ctx->events[loop].data.u32;
+		unsigned int idx = EVDATA2IDX(d);
+		sel_fd *sfd;
+		if(idx >= ctx->obj_size)
+			continue;
+		sfd = ctx->obj_table[idx].fds + EVDATA2SLOT(d);
+		/* Ignore anything stale */
+		if(!ctx->obj_table[idx].what || !sfd->seen ||
+				(sfd->state != SEL_FD_REGISTERED))
+			continue;
+		sfd->result = events2flags(ctx->events[loop].events);
+		obj_make_ready(ctx, idx);
+	}
+#ifdef HAVE_URING_SELECTOR
+	/* Do the I/O for the ready objects that gave us their buffers */
+	if(ctx->ring)
+		obj_table_uring_io(ctx);
+#endif
+	/* Run the hooks. The objects' I/O will change what they want, so they
+	 * are asked again before the next select. */
+	for(loop = 0; loop < ctx->ready_used; loop++) {
+		sel_obj *obj = ctx->obj_table + ctx->ready[loop];
+		int hit = 0;
+		obj_make_dirty(ctx, ctx->ready[loop]);
+		ctx->hook_current = IDX2TOKEN(ctx->ready[loop]);
+		if(obj->what == 1)
+			nal_connection_post_select(obj->obj.conn);
+		else
+			nal_listener_post_select(obj->obj.listener);
+		for(slot = 0; slot < SEL_OBJ_FDS; slot++) {
+			if(obj->fds[slot].result)
+				hit = 1;
+			obj->fds[slot].result = 0;
+#ifdef HAVE_URING_SELECTOR
+			obj->fds[slot].done = 0;
+#endif
+		}
+		if(hit)
+			ctx->ready_last++;
+	}
+}
+
+static void sel_fd_set(NAL_SELECTOR *sel, NAL_SELECTOR_TOKEN token,
+				int fd, unsigned char flags)
+{
+	unsigned int loop;
+	sel_fd *sfd = NULL;
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	unsigned int idx = TOKEN2IDX(token);
+	sel_obj *obj = ctx->obj_table + idx;
+	assert(token == ctx->hook_current);
+	assert(idx < ctx->obj_size);
+	assert((obj->what == 1) || (obj->what == 2));
+	/* If the same fd is set more than once, the criteria are merged (the
+	 * kernel only allows one registration per fd anyway). */
+	for(loop = 0; loop < SEL_OBJ_FDS; loop++) {
+		sel_fd *tmp = obj->fds + loop;
+		if(tmp->state != SEL_FD_UNUSED) {
+			if(tmp->fd == fd) {
+				sfd = tmp;
+				break;
+			}
+		} else if(!sfd)
+			sfd = tmp;
+	}
+	if(!sfd) {
+		SYS_fprintf(SYS_stderr, "Warning, too many fds for one "
+				"selector object\n");
+		return;
+	}
+	if(sfd->state == SEL_FD_UNUSED) {
+		sfd->fd = fd;
+		sfd->state = SEL_FD_NEW;
+		sfd->registered = 0;
+		sfd->want = 0;
+	}
+	sfd->seen = 1;
+	sfd->want |= flags;
+}
+
+static unsigned char sel_fd_test(const NAL_SELECTOR *sel,
+				NAL_SELECTOR_TOKEN token, int fd)
+{
+	unsigned int loop;
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	unsigned int idx = TOKEN2IDX(token);
+	sel_obj *obj = ctx->obj_table + idx;
+	assert(token == ctx->hook_current);
+	assert(idx < ctx->obj_size);
+	assert((obj->what == 1) || (obj->what == 2));
+	for(loop = 0; loop < SEL_OBJ_FDS; loop++) {
+		sel_fd *sfd = obj->fds + loop;
+		if(sfd->state && sfd->seen && (sfd->fd == fd))
+			return sfd->result;
+	}
+	return 0;
+}
+
+#ifdef HAVE_URING_SELECTOR
+static sel_fd *sel_fd_find(NAL_SELECTOR *sel, NAL_SELECTOR_TOKEN token, int fd)
+{
+	unsigned int loop;
+	sel_ctx *ctx = nal_selector_get_vtdata(sel);
+	unsigned int idx = TOKEN2IDX(token);
+	sel_obj *obj = ctx->obj_table + idx;
+	assert(token == ctx->hook_current);
+	assert(idx < ctx->obj_size);
+	for(loop = 0; loop < SEL_OBJ_FDS; loop++) {
+		sel_fd *sfd = obj->fds + loop;
+		if(sfd->state && sfd->seen && (sfd->fd == fd))
+			return sfd;
+	}
+	return NULL;
+}
+#endif
+
+static int sel_ctrl(NAL_SELECTOR *sel, int cmd, void *p)
+{
+	switch(cmd) {
+	case NAL_FD_CTRL_FDSET:
+		{
+		NAL_FD_FDSET *args = p;
+		sel_fd_set(sel, args->token, args->fd, args->flags);
+		}
+		break;
+	case NAL_FD_CTRL_FDTEST:
+		{
+		NAL_FD_FDTEST *args = p;
+		args->flags = sel_fd_test(sel, args->token, args->fd);
+		}
+		break;
+#ifdef HAVE_URING_SELECTOR
+	case NAL_FD_CTRL_BUFSET:
+		{
+		NAL_FD_BUFSET *args = p;
+		sel_fd *sfd = sel_fd_find(sel, args->token, args->fd);
+		if(sfd) {
+			sfd->b_read = args->b_read;
+			sfd->b_send = args->b_send;
+		}
+		}
+		break;
+	case NAL_FD_CTRL_BUFTEST:
+		{
+		NAL_FD_BUFTEST *args = p;
+		sel_fd *sfd = sel_fd_find(sel, args->token, args->fd);
+		args->done = (sfd ? sfd->done : 0);
+		args->read_ret = (sfd ? sfd->read_ret : 0);
+		args->send_ret = (sfd ? sfd->send_ret : 0);
+		}
+		break;
+#endif
+	case NAL_FD_CTRL_CHANGED:
+		{
+		NAL_FD_CHANGED *args = p;
+		sel_ctx *ctx = nal_selector_get_vtdata(sel);
+		if(ctx->obj_table) {
+			assert(TOKEN2IDX(args->token) < ctx->obj_size);
+			obj_make_dirty(ctx, TOKEN2IDX(args->token));
+		}
+		}
+		break;
+	default:
+		abort();
+		return 0;
+	}
+	return 1;
+}
+
+#endif
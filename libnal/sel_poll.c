@@ -440,6 +440,9 @@ static int sel_ctrl(NAL_SELECTOR *sel, int cmd, void *p)
 		args->flags = sel_fd_test(sel, args->token, args->fd);
 		}
 		break;
+	case NAL_FD_CTRL_CHANGED:
+		/* We ask every object for its criteria before each select */
+		break;
 	default:
 		abort();
 		return 0;
@@ -48,90 +48,142 @@ int nal_fd_make_non_blocking(int fd, int non_blocking)
 #endif
 }
 
+/* Without readv(2)/writev(2) (or on win32), only one segment of a buffer is
+ * passed to each system call, and the callers below loop to do the rest. */
+#if !defined(WIN32) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+#define NAL_FD_VECTORED
+#endif
+
+/* Trims the segments to 'max' bytes total (if non-zero), returning the number
+ * of segments still in use and storing their total length in 'len'. */
+static unsigned int int_iov_trim(NAL_BUFFER_IOV *iov, unsigned int num,
+				unsigned int max, unsigned int *len)
+{
+	unsigned int loop;
+	*len = 0;
+#ifndef NAL_FD_VECTORED
+	num = (num ? 1 : 0);
+#endif
+	for(loop = 0; loop < num; loop++) {
+		if(max && (*len + iov[loop].len >= max)) {
+			iov[loop].len = max - *len;
+			*len = max;
+			return loop + 1;
+		}
+		*len += iov[loop].len;
+	}
+	return num;
+}
+
+static ssize_t int_fd_send(int fd, const NAL_BUFFER_IOV *iov, unsigned int num)
+{
+#ifdef NAL_FD_VECTORED
+	struct iovec v[NAL_BUFFER_IOV_MAX];
+	unsigned int loop;
+	for(loop = 0; loop < num; loop++) {
+		v[loop].iov_base = iov[loop].ptr;
+		v[loop].iov_len = iov[loop].len;
+	}
+	return writev(fd, v, (int)num);
+#elif defined(WIN32)
+	return send(fd, iov[0].ptr, iov[0].len, 0);
+#else
+	return write(fd, iov[0].ptr, iov[0].len);
+#endif
+}
+
+static ssize_t int_fd_recv(int fd, const NAL_BUFFER_IOV *iov, unsigned int num)
+{
+#ifdef NAL_FD_VECTORED
+	struct iovec v[NAL_BUFFER_IOV_MAX];
+	unsigned int loop;
+	for(loop = 0; loop < num; loop++) {
+		v[loop].iov_base = iov[loop].ptr;
+		v[loop].iov_len = iov[loop].len;
+	}
+	return readv(fd, v, (int)num);
+#elif defined(WIN32)
+	return recv(fd, iov[0].ptr, iov[0].len, 0);
+#else
+	return read(fd, iov[0].ptr, iov[0].len);
+#endif
+}
+
+/* Both of these functions keep going until the fd would block (a short
+ * transfer, or EAGAIN), or the buffer is exhausted, or 'max' bytes have been
+ * transferred. So whether readiness is level- or edge-triggered, there's
+ * nothing left that another pass would pick up. The return value is the
+ * number of bytes transferred, zero if the fd would block straight away (or
+ * on end-of-file when reading), or -1 for an error. */
 int nal_fd_buffer_to_fd(NAL_BUFFER *buf, int fd, unsigned int max_send)
 {
+	int total = 0;
+	NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+	unsigned int num, len;
 	ssize_t ret;
-	unsigned int buf_used = NAL_BUFFER_used(buf);
 
-	/* Decide the maximum we should send */
-	if((max_send == 0) || (max_send > buf_used))
-		max_send = buf_used;
 	/* If there's nothing to send, don't waste a system call. This catches
 	 * the case of a non-blocking connect that completed, without adding
 	 * NAL_BUFFER_*** calls one level up. */
-	if(!max_send)
-		return 0;
-#ifdef WIN32
-	ret = send(fd, NAL_BUFFER_data(buf), max_send, 0);
-#else
-	ret = write(fd, NAL_BUFFER_data(buf), max_send);
-#endif
-#if 0
-	ret = send(fd, NAL_BUFFER_data(buf), max_send,
-		MSG_DONTWAIT | MSG_NOSIGNAL);
-#endif
-	/* There's a couple of "soft errors" we don't consider fatal */
-	if(ret < 0) {
-		switch(errno) {
-		case EAGAIN:
-		case EINTR:
-			return 0;
-		default:
-			break;
+	while((num = int_iov_trim(iov, NAL_BUFFER_data_iov(buf, iov),
+					max_send, &len)) > 0) {
+		ret = int_fd_send(fd, iov, num);
+		/* There's a couple of "soft errors" we don't consider fatal */
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+				break;
+			return -1;
 		}
-		return -1;
-	}
-	if(ret > 0) {
-		unsigned int uret = (unsigned int)ret;
 		/* Scroll the buffer forward */
-		NAL_BUFFER_read(buf, NULL, uret);
+		NAL_BUFFER_read(buf, NULL, (unsigned int)ret);
+		total += (int)ret;
 #if SYS_DEBUG_LEVEL > 1
 		SYS_fprintf(SYS_stderr, "Debug: net.c (fd=%d) sent %lu bytes\n",
-			fd, (unsigned long)uret);
+			fd, (unsigned long)ret);
 #endif
+		if((unsigned int)ret < len)
+			break;
+		if(max_send && !(max_send -= (unsigned int)ret))
+			break;
 	}
-	return ret;
+	return total;
 }
 
 int nal_fd_buffer_from_fd(NAL_BUFFER *buf, int fd, unsigned int max_read)
 {
+	int total = 0;
+	NAL_BUFFER_IOV iov[NAL_BUFFER_IOV_MAX];
+	unsigned int num, len;
 	ssize_t ret;
-	unsigned int buf_avail = NAL_BUFFER_unused(buf);
 
-	/* Decide the maximum we should read */
-	if((max_read == 0) || (max_read > buf_avail))
-		max_read = buf_avail;
 	/* If there's no room for reading, don't waste a system call */
-	if(!max_read)
-		return 0;
-#ifdef WIN32
-	ret = recv(fd, NAL_BUFFER_write_ptr(buf), max_read, 0);
-#else
-	ret = read(fd, NAL_BUFFER_write_ptr(buf), max_read);
-#endif
-#if 0
-	ret = recv(fd, NAL_BUFFER_write_ptr(buf), max_read, MSG_NOSIGNAL);
-#endif
-	/* There's a couple of "soft errors" we don't consider fatal */
-	if(ret < 0) {
-		switch(errno) {
-		case EINTR:
-		case EAGAIN:
-			return 0;
-		default:
-			break;
+	while((num = int_iov_trim(iov, NAL_BUFFER_unused_iov(buf, iov),
+					max_read, &len)) > 0) {
+		ret = int_fd_recv(fd, iov, num);
+		/* There's a couple of "soft errors" we don't consider fatal */
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+				break;
+			/* Report what we did read, the error will recur */
+			return (total ? total : -1);
 		}
-		return -1;
-	}
-	if(ret > 0) {
-		unsigned int uret = (unsigned int)ret;
-		NAL_BUFFER_wrote(buf, uret);
+		NAL_BUFFER_wrote(buf, (unsigned int)ret);
+		total += (int)ret;
 #if SYS_DEBUG_LEVEL > 1
 		SYS_fprintf(SYS_stderr, "Debug: net.c (fd=%d) received %lu bytes\n",
-			fd, (unsigned long)uret);
+			fd, (unsigned long)ret);
 #endif
+		/* A short read (including end-of-file) means we're drained */
+		if((unsigned int)ret < len)
+			break;
+		if(max_read && !(max_read -= (unsigned int)ret))
+			break;
 	}
-	return ret;
+	return total;
 }
 
 /* A handy little simple function that removes loads of lines of code from
@@ -19,6 +19,11 @@
  * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/* accept4(2) is a GNU extension */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define SYS_GENERATING_LIB
 
 #include <libsys/pre.h>
@@ -52,7 +57,7 @@ static int int_sockaddr_size(const nal_sockaddr *addr)
 	/* return 0; */
 }
 
-static int int_sock_set_reuse(int fd, const nal_sockaddr *addr)
+static int int_sock_set_reuse(int fd, const nal_sockaddr *addr, int reuseport)
 {
 	int reuseVal = 1;
 	if(addr->type != nal_sockaddr_type_ip)
@@ -60,6 +65,11 @@ static int int_sock_set_reuse(int fd, const nal_sockaddr *addr)
 	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
 			(char *)(&reuseVal), sizeof(reuseVal)) != 0)
 		return 0;
+#ifdef SO_REUSEPORT
+	if(reuseport && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			(char *)(&reuseVal), sizeof(reuseVal)) != 0))
+		return 0;
+#endif
 	return 1;
 }
 
@@ -262,9 +272,9 @@ int nal_sock_connect(int fd, const nal_sockaddr *addr,
 	return 1;
 }
 
-int nal_sock_listen(int fd, const nal_sockaddr *addr)
+int nal_sock_listen(int fd, const nal_sockaddr *addr, int reuseport)
 {
-	if(!int_sock_set_reuse(fd, addr) || !int_sock_bind(fd, addr))
+	if(!int_sock_set_reuse(fd, addr, reuseport) || !int_sock_bind(fd, addr))
 		return 0;
 	if(listen(fd, NAL_LISTENER_BACKLOG) != 0)
 		return 0;
@@ -273,7 +283,15 @@ int nal_sock_listen(int fd, const nal_sockaddr *addr)
 
 int nal_sock_accept(int listen_fd, int *conn)
 {
-	if((*conn = accept(listen_fd, NULL, NULL)) == -1) {
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	/* Accept and set the flags in the one system call */
+	*conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	if(((*conn = accept(listen_fd, NULL, NULL)) != -1) &&
+			!nal_fd_make_non_blocking(*conn, 1))
+		nal_fd_close(conn);
+#endif
+	if(*conn == -1) {
 #if SYS_DEBUG_LEVEL > 1
 		SYS_fprintf(SYS_stderr, "Error, accept failed\n\n");
 #endif
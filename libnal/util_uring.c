@@ -0,0 +1,198 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_LIB
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include "nal_internal.h"
+#include <libsys/post.h>
+
+#ifdef HAVE_URING_SELECTOR
+
+/* There's no dependency on liburing, this is the minimum needed to drive the
+ * rings directly: requests are queued, then submitted together and waited for
+ * with a single io_uring_enter(2). */
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct st_nal_uring {
+	int fd;
+	/* Submission queue */
+	unsigned char *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* Completion queue */
+	unsigned char *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Requests queued but not yet submitted, and submitted requests whose
+	 * completions haven't been waited for. */
+	unsigned int queued, inflight;
+};
+
+static int int_uring_enter(int fd, unsigned int to_submit,
+			unsigned int min_complete)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+nal_uring *nal_uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	nal_uring *r = SYS_malloc(nal_uring, 1);
+	if(!r) return NULL;
+	SYS_zero(nal_uring, r);
+	SYS_zero(struct io_uring_params, &p);
+	r->sq_ring = r->cq_ring = MAP_FAILED;
+	r->sqes = MAP_FAILED;
+	/* Kernels without io_uring (or sandboxes that forbid it) fail here */
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0) goto err;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if((r->sq_ring == MAP_FAILED) || (r->cq_ring == MAP_FAILED) ||
+			(r->sqes == MAP_FAILED))
+		goto err;
+	r->sq_head = (unsigned int *)(r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(r->sq_ring + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned int *)(r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(r->cq_ring + p.cq_off.cqes);
+	return r;
+err:
+	nal_uring_free(r);
+	return NULL;
+}
+
+void nal_uring_free(nal_uring *r)
+{
+	if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+	if(r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_size);
+	if(r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+	if(r->fd >= 0) close(r->fd);
+	SYS_free(nal_uring, r);
+}
+
+static int int_uring_queue(nal_uring *r, unsigned char op, int fd,
+			struct msghdr *msg, int msg_flags, unsigned long data)
+{
+	unsigned int tail, idx;
+	struct io_uring_sqe *sqe;
+	/* Completions aren't reaped until everything queued has been run, so
+	 * the submission queue size is also the batch size. */
+	if(r->queued + r->inflight >= r->sq_entries)
+		return 0;
+	tail = *r->sq_tail + r->queued;
+	idx = tail & *r->sq_mask;
+	sqe = r->sqes + idx;
+	SYS_zero(struct io_uring_sqe, sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)msg;
+	sqe->len = 1;
+	sqe->msg_flags = (unsigned int)msg_flags;
+	sqe->user_data = data;
+	r->sq_array[idx] = idx;
+	r->queued++;
+	return 1;
+}
+
+int nal_uring_recv(nal_uring *r, int fd, struct msghdr *msg,
+			unsigned long data)
+{
+	return int_uring_queue(r, IORING_OP_RECVMSG, fd, msg, MSG_DONTWAIT,
+			data);
+}
+
+int nal_uring_send(nal_uring *r, int fd, struct msghdr *msg,
+			unsigned long data)
+{
+	return int_uring_queue(r, IORING_OP_SENDMSG, fd, msg,
+			MSG_DONTWAIT | MSG_NOSIGNAL, data);
+}
+
+int nal_uring_run(nal_uring *r)
+{
+	int res;
+	unsigned int submit = r->queued;
+	if(!submit && !r->inflight)
+		return 0;
+	/* Publish the queued entries before the kernel looks at them */
+	__sync_synchronize();
+	*r->sq_tail += submit;
+	__sync_synchronize();
+	r->queued = 0;
+	r->inflight += submit;
+	/* The requests can't block (MSG_DONTWAIT), so waiting for all of them
+	 * costs nothing beyond the one system call. The kernel can stop short
+	 * of that though (a signal, or a partial submission), so we loop until
+	 * everything has been submitted and has completed. */
+	for(;;) {
+		__sync_synchronize();
+		if(!submit && ((*r->cq_tail - *r->cq_head) >= r->inflight))
+			return 1;
+		res = int_uring_enter(r->fd, submit, r->inflight);
+		if(res < 0) {
+			if((errno != EINTR) && (errno != EAGAIN) &&
+					(errno != EBUSY))
+				return -1;
+		} else
+			submit -= ((unsigned int)res < submit ?
+					(unsigned int)res : submit);
+	}
+}
+
+int nal_uring_result(nal_uring *r, unsigned long *data, int *res)
+{
+	unsigned int head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+	__sync_synchronize();
+	if(head == *r->cq_tail)
+		return 0;
+	cqe = r->cqes + (head & *r->cq_mask);
+	*data = (unsigned long)cqe->user_data;
+	*res = cqe->res;
+	__sync_synchronize();
+	*r->cq_head = head + 1;
+	if(r->inflight)
+		r->inflight--;
+	return 1;
+}
+
+#endif
@@ -21,15 +21,17 @@
 
 #include "private.h"
 
-/* The maximum number of client connections we can serve at a time */
-#define CLIENTS_MAX_ITEMS	1024
+/* The initial size of the hash table of clients, which doubles whenever there
+ * are more clients than chains */
+#define CLIENTS_HASH_START	64
 /* The maximum number of times to retry a request if it deserves retries */
 #define CLIENTS_MAX_RETRIES	5
 
 typedef struct st_client_ctx {
 	/* A unique id (within each 'clients_t' structure) for this client */
 	unsigned long uid;
-	/* The "plug" communicating with the client */
+	/* The client's connection, and the "plug" communicating over it */
+	NAL_CONNECTION *conn;
 	DC_PLUG *plug;
 	/* If this value is non-zero, the plug has an in-"read" request (that can
 	 * be resumed) that has not been consumed yet. */
@@ -46,21 +48,49 @@ typedef struct st_client_ctx {
 	 * request is not currently forwarded (ie. it's not referred to in the
 	 * multiplexer table) */
 	unsigned long multiplex_id;
-	/* The last time the current request was forwarded, used for
-	 * determining if a server has not responded in a suitable timeframe.
-	 * Only used if 'multiplexer_id' is non-zero. */
+	/* If 'multiplex_id' is non-zero, the server it was forwarded to */
+	unsigned int multiplex_server;
+	/* The last time the client was seen to be busy (when it connected,
+	 * did I/O, or had a request forwarded), used for idle timeouts. */
 	struct timeval timestamp;
+	/* How many times the current request has been forwarded again after
+	 * the server it was forwarded to went away */
+	unsigned int retries;
+	/* Links in the list of all clients, and in the chains of the hash
+	 * tables its uid and its connection fall in */
+	struct st_client_ctx *prev, *next, *hash_next, *conn_next;
+	/* If 'ready' is non-zero, the client has a request waiting to be
+	 * forwarded and these are its links in the ready queue */
+	int ready;
+	struct st_client_ctx *ready_prev, *ready_next;
+	/* The near-cache (NULL if there isn't one), and its count of writes to
+	 * the current request's session when the request was read */
+	nearcache_t *near;
+	unsigned long near_gen;
 } client_ctx;
 
+/* An intrusive queue of clients, linked through 'ready_prev' and 'ready_next' */
+typedef struct st_client_queue {
+	client_ctx *head, *tail;
+} client_queue;
+
 struct st_clients_t {
-	/* The arry of pointers to client_ctx items */
-	client_ctx *items[CLIENTS_MAX_ITEMS];
-	/* The number of client_ctx items currently used */
+	/* All the clients, in the order of their 'timestamp's, so the ones
+	 * that have been idle the longest are first */
+	client_ctx *head, *tail;
+	/* The number of clients */
 	unsigned int used;
+	/* The clients hashed by uid, and by connection, each in 'hash_size' (a
+	 * power of 2) chains */
+	client_ctx **hash, **conn_hash;
+	unsigned int hash_size;
+	/* The clients with requests waiting to be forwarded, round-robin in
+	 * the order they became ready */
+	client_queue ready;
 	/* Used to generate 'uid' values for new client_ctx items */
 	unsigned long uid_seed;
-	/* Used to handle scheduling of the array of clients */
-	unsigned int priorities[CLIENTS_MAX_ITEMS];
+	/* The near-cache, if any, shared by all the clients */
+	nearcache_t *near;
 };
 
 /************************************************/
@@ -85,13 +115,23 @@ restart:
 			return;
 		ctx->multiplex_id = 0;
 		ctx->response_done = 0;
+		ctx->retries = 0;
 		if(!DC_PLUG_write(ctx->plug, 0, ctx->request_uid,
 					ctx->request_cmd, NULL, 0)) {
 			assert(NULL == "shouldn't happen");
 			DC_PLUG_consume(ctx->plug);
 			ctx->request_open = 0;
+			return;
 		}
-		return;
+		if(!ctx->near)
+			return;
+		/* If the near-cache can answer it, that's the end of it */
+		ctx->near_gen = nearcache_request(ctx->near, ctx->request_cmd,
+				ctx->request_data, ctx->request_len);
+		if(!nearcache_answer(ctx->near, ctx->request_cmd,
+				ctx->request_data, ctx->request_len, ctx->plug))
+			return;
+		ctx->response_done = 1;
 	}
 	/* We already had a request ... has it been answered? */
 	if(!ctx->response_done)
@@ -111,15 +151,19 @@ restart:
 }
 
 static client_ctx *client_ctx_new(unsigned long uid, NAL_CONNECTION *conn,
-				const struct timeval *now)
+				nearcache_t *near, const struct timeval *now)
 {
 	client_ctx *c = SYS_malloc(client_ctx, 1);
 	if(!c)
 		return NULL;
 	c->uid = uid;
+	c->conn = conn;
 	c->request_open = 0;
 	c->response_done = 0;
 	c->multiplex_id = 0;
+	c->retries = 0;
+	c->ready = 0;
+	c->near = near;
 	SYS_timecpy(&c->timestamp, now);
 	c->plug = DC_PLUG_new(conn, 0);
 	if(!c->plug) {
@@ -153,6 +197,10 @@ static void client_ctx_digest_response(client_ctx *ctx,
 	assert(ctx->request_open != 0);
 	assert(ctx->plug != NULL);
 	assert(ctx->request_cmd == cmd);
+	if(ctx->near)
+		nearcache_response(ctx->near, ctx->near_gen, cmd,
+				ctx->request_data, ctx->request_len,
+				data, data_len);
 	/* Add the data in. NB: Even if the write_more doesn't work, we still
 	 * need to unblock the current situation and return *something* (let the
 	 * client worry about it!). */
@@ -162,103 +210,199 @@ static void client_ctx_digest_response(client_ctx *ctx,
 	client_ctx_flush(ctx);
 }
 
-static int client_ctx_should_timeout(client_ctx *c, unsigned long idle_timeout,
-			const struct timeval *now)
+/**************************************************/
+/* Functions operating on the 'client_queue' type */
+
+static void client_queue_push(client_queue *q, client_ctx *ctx)
 {
-	/* If we have a request (whether forwarded or not), don't "idle-timeout"
-	 * this client connection. */
-	if(c->request_open)
-		return 0;
-	/* Check the time-interval */
-	return SYS_expirycheck(&c->timestamp, idle_timeout, now);
+	ctx->ready_prev = q->tail;
+	ctx->ready_next = NULL;
+	if(q->tail)
+		q->tail->ready_next = ctx;
+	else
+		q->head = ctx;
+	q->tail = ctx;
 }
 
-/*************************************************************************/
-/* Functions operation in the 'priorities' array of the 'clients_t' type */
-
-static void priority_removed(clients_t *c, unsigned int idx)
+static void client_queue_unlink(client_queue *q, client_ctx *ctx)
 {
-	unsigned int *p_iterate = c->priorities;
-	unsigned int iterate = 0;
-	int convertedfound = 0;
-	unsigned int converted = c->priorities[idx];
-
-	assert(c->used >= idx);
-	while(iterate < c->used) {
-		/* If convertedfound is non-zero, we move priorities[x+1] to
-		 * priorities[x] with a decrement if the value exceeds
-		 * converted. If convertedfound is zero, we either decrement
-		 * priorities[x] (if the value exceeds converted), leave
-		 * priorities[x] alone (if the value is less than converted), or
-		 * set convertedfound. */
-		if(convertedfound) {
-just_found:
-			p_iterate[0] = p_iterate[1];
-			assert(p_iterate[0] != converted);
-			if(p_iterate[0] > converted)
-				p_iterate[0]--;
-		} else {
-			if(p_iterate[0] == converted) {
-				convertedfound = 1;
-				goto just_found;
-			} else if(p_iterate[0] > converted)
-				p_iterate[0]--;
-		}
-		iterate++;
-		p_iterate++;
-	}
-	/* Either 'converted' was found, or it was already the last entry in the
-	 * array and therefore wasn't touched */
-	assert(convertedfound || (*p_iterate == converted));
+	if(ctx->ready_prev)
+		ctx->ready_prev->ready_next = ctx->ready_next;
+	else
+		q->head = ctx->ready_next;
+	if(ctx->ready_next)
+		ctx->ready_next->ready_prev = ctx->ready_prev;
+	else
+		q->tail = ctx->ready_prev;
 }
 
-static void priority_totail(clients_t *c, unsigned int pre_index)
+/* Puts 'from' (in order) ahead of everything in 'q', leaving 'from' empty */
+static void client_queue_prepend(client_queue *q, client_queue *from)
 {
-	if(pre_index + 1 < c->used) {
-		/* The item wasn't already at the end of the priority array, so
-		 * store it, scroll everything else, then dump it at the tail */
-		unsigned int tmp = c->priorities[pre_index];
-		SYS_memmove_n(unsigned int, c->priorities + pre_index,
-				c->priorities + (pre_index + 1),
-				c->used - (pre_index + 1));
-		c->priorities[c->used - 1] = tmp;
-	}
+	if(!from->head)
+		return;
+	if(q->head) {
+		from->tail->ready_next = q->head;
+		q->head->ready_prev = from->tail;
+	} else
+		q->tail = from->tail;
+	q->head = from->head;
+	from->head = from->tail = NULL;
 }
 
 /***********************************************/
 /* Functions operating on the 'clients_t' type */
 
-static int int_find(clients_t *c, unsigned long client_uid, unsigned int *pos)
+static client_ctx **int_hash_chain(clients_t *c, unsigned long client_uid)
 {
-	unsigned int idx = 0;
-	client_ctx **item = c->items;
-	while(idx < c->used) {
-		if((*item)->uid == client_uid) {
-			*pos = idx;
-			return 1;
-		}
-		if((*item)->uid > client_uid)
-			return 0;
-		idx++;
-		item++;
+	return c->hash + (client_uid & (c->hash_size - 1));
+}
+
+/* Connections are allocated, so the low bits of their addresses are all the
+ * same */
+static client_ctx **int_conn_chain(clients_t *c, const NAL_CONNECTION *conn)
+{
+	unsigned long h = (unsigned long)conn;
+	return c->conn_hash + ((h ^ (h >> 4) ^ (h >> 12)) & (c->hash_size - 1));
+}
+
+static client_ctx *int_find(clients_t *c, unsigned long client_uid)
+{
+	client_ctx *ctx = *int_hash_chain(c, client_uid);
+	while(ctx && (ctx->uid != client_uid))
+		ctx = ctx->hash_next;
+	return ctx;
+}
+
+static client_ctx *int_find_conn(clients_t *c, const NAL_CONNECTION *conn)
+{
+	client_ctx *ctx = *int_conn_chain(c, conn);
+	while(ctx && (ctx->conn != conn))
+		ctx = ctx->conn_next;
+	return ctx;
+}
+
+static void int_hash_insert(clients_t *c, client_ctx *ctx)
+{
+	client_ctx **chain = int_hash_chain(c, ctx->uid);
+	ctx->hash_next = *chain;
+	*chain = ctx;
+	chain = int_conn_chain(c, ctx->conn);
+	ctx->conn_next = *chain;
+	*chain = ctx;
+}
+
+/* Doubles the hash tables. Uids are handed out in sequence, so they spread
+ * evenly over the chains by their low bits alone. */
+static int int_hash_expand(clients_t *c)
+{
+	client_ctx *ctx;
+	unsigned int newsize = c->hash_size * 2;
+	client_ctx **newhash = SYS_malloc(client_ctx *, newsize);
+	client_ctx **newconn = SYS_malloc(client_ctx *, newsize);
+	if(!newhash || !newconn) {
+		if(newhash)
+			SYS_free(client_ctx *, newhash);
+		if(newconn)
+			SYS_free(client_ctx *, newconn);
+		return 0;
 	}
-	return 0;
+	SYS_zero_n(client_ctx *, newhash, newsize);
+	SYS_zero_n(client_ctx *, newconn, newsize);
+	SYS_free(client_ctx *, c->hash);
+	SYS_free(client_ctx *, c->conn_hash);
+	c->hash = newhash;
+	c->conn_hash = newconn;
+	c->hash_size = newsize;
+	for(ctx = c->head; ctx; ctx = ctx->next)
+		int_hash_insert(c, ctx);
+	return 1;
 }
 
-clients_t *clients_new(void)
+static void int_list_unlink(clients_t *c, client_ctx *ctx)
+{
+	if(ctx->prev)
+		ctx->prev->next = ctx->next;
+	else
+		c->head = ctx->next;
+	if(ctx->next)
+		ctx->next->prev = ctx->prev;
+	else
+		c->tail = ctx->prev;
+}
+
+static void int_list_append(clients_t *c, client_ctx *ctx)
+{
+	ctx->prev = c->tail;
+	ctx->next = NULL;
+	if(c->tail)
+		c->tail->next = ctx;
+	else
+		c->head = ctx;
+	c->tail = ctx;
+}
+
+/* Notes that the client is busy. 'now' is never earlier than any client's
+ * timestamp, so moving it to the end keeps the list in order. */
+static void int_touch(clients_t *c, client_ctx *ctx, const struct timeval *now)
+{
+	SYS_timecpy(&ctx->timestamp, now);
+	if(c->tail == ctx)
+		return;
+	int_list_unlink(c, ctx);
+	int_list_append(c, ctx);
+}
+
+/* Keeps the client's place in the ready queue in step with whether it has a
+ * request waiting to be forwarded */
+static void int_check_ready(clients_t *c, client_ctx *ctx)
+{
+	int ready = (ctx->request_open && !ctx->response_done &&
+			!ctx->multiplex_id);
+	if(ready == ctx->ready)
+		return;
+	if(ready)
+		client_queue_push(&c->ready, ctx);
+	else
+		client_queue_unlink(&c->ready, ctx);
+	ctx->ready = ready;
+}
+
+clients_t *clients_new(nearcache_t *near)
 {
 	clients_t *c = SYS_malloc(clients_t, 1);
 	if(!c)
 		return NULL;
+	if((c->hash = SYS_malloc(client_ctx *, CLIENTS_HASH_START)) == NULL) {
+		SYS_free(clients_t, c);
+		return NULL;
+	}
+	if((c->conn_hash = SYS_malloc(client_ctx *,
+				CLIENTS_HASH_START)) == NULL) {
+		SYS_free(client_ctx *, c->hash);
+		SYS_free(clients_t, c);
+		return NULL;
+	}
+	SYS_zero_n(client_ctx *, c->hash, CLIENTS_HASH_START);
+	SYS_zero_n(client_ctx *, c->conn_hash, CLIENTS_HASH_START);
+	c->hash_size = CLIENTS_HASH_START;
+	c->head = c->tail = NULL;
 	c->used = 0;
+	c->ready.head = c->ready.tail = NULL;
 	c->uid_seed = 1;
+	c->near = near;
 	return c;
 }
 
 void clients_free(clients_t *c)
 {
-	while(c->used > 0)
-		client_ctx_free(c->items[--c->used]);
+	client_ctx *ctx;
+	while((ctx = c->head) != NULL) {
+		c->head = ctx->next;
+		client_ctx_free(ctx);
+	}
+	SYS_free(client_ctx *, c->hash);
+	SYS_free(client_ctx *, c->conn_hash);
 	SYS_free(clients_t, c);
 }
 
@@ -267,37 +411,65 @@ int clients_empty(const clients_t *c)
 	return !c->used;
 }
 
-static void clients_delete(clients_t *c, unsigned int idx, multiplexer_t *m)
+static void clients_delete(clients_t *c, client_ctx *ctx, servers_t *ss)
 {
-	client_ctx **ctx = c->items + idx;
+	client_ctx **chain = int_hash_chain(c, ctx->uid);
 
 #ifdef CLIENTS_PRINT_CONNECTS
-	SYS_fprintf(SYS_stderr, "Info: dead client connection (%u)\n", idx);
+	SYS_fprintf(SYS_stderr, "Info: dead client connection (%lu)\n",
+			ctx->uid);
 #endif
-	/* Notify the multiplexer */
-	multiplexer_mark_dead_client(m, (*ctx)->uid);
-	/* Clean up the client_ctx */
-	client_ctx_free(*ctx);
-	/* adjust the array */
-	if(idx + 1 < c->used)
-		SYS_memmove_n(client_ctx *, ctx, (const client_ctx **)ctx + 1,
-				c->used - (idx + 1));
+	/* Notify the multiplexer if a request is in flight */
+	if(ctx->multiplex_id)
+		servers_mark_dead_client(ss, ctx->multiplex_server,
+				ctx->multiplex_id, ctx->uid);
+	/* Unlink it from everything */
+	if(ctx->ready)
+		client_queue_unlink(&c->ready, ctx);
+	while(*chain != ctx)
+		chain = &(*chain)->hash_next;
+	*chain = ctx->hash_next;
+	chain = int_conn_chain(c, ctx->conn);
+	while(*chain != ctx)
+		chain = &(*chain)->conn_next;
+	*chain = ctx->conn_next;
+	int_list_unlink(c, ctx);
 	c->used--;
-	/* correct the priority array */
-	priority_removed(c, idx);
+	/* Clean up the client_ctx */
+	client_ctx_free(ctx);
 }
 
-int clients_io(clients_t *c, multiplexer_t *m, const struct timeval *now,
-			unsigned long idle_timeout)
+int clients_io(clients_t *c, servers_t *ss, NAL_SELECTOR *sel,
+			const struct timeval *now, unsigned long idle_timeout)
 {
-	unsigned int pos = 0;
-	while(pos < c->used) {
-		if(!client_ctx_io(c->items[pos]) || (idle_timeout &&
-				client_ctx_should_timeout(c->items[pos],
-					idle_timeout, now)))
-			clients_delete(c, pos, m);
+	NAL_CONNECTION *conn;
+	client_ctx *ctx;
+	if(c->near)
+		nearcache_set_time(c->near, now);
+	/* Only the connections the selector reported on have anything to do,
+	 * the rest have no I/O and nothing new in their plugs */
+	while((conn = NAL_SELECTOR_get_ready(sel)) != NULL) {
+		if((ctx = int_find_conn(c, conn)) == NULL)
+			/* One of the servers' connections */
+			continue;
+		if(!client_ctx_io(ctx))
+			clients_delete(c, ctx, ss);
+		else {
+			int_touch(c, ctx, now);
+			int_check_ready(c, ctx);
+		}
+	}
+	if(!idle_timeout)
+		return 1;
+	/* Clients idle for longest are first, so stop at the first one that
+	 * hasn't been idle for long enough. If a client has a request (whether
+	 * forwarded or not), it isn't idle, so it starts again from now. */
+	while(((ctx = c->head) != NULL) &&
+			SYS_expirycheck(&ctx->timestamp, idle_timeout, now)) {
+		if(ctx->request_open)
+			int_touch(c, ctx, now);
 		else
-			pos++;
+			clients_delete(c, ctx, ss);
 	}
 	return 1;
 }
@@ -305,15 +477,15 @@ int clients_io(clients_t *c, multiplexer_t *m, const struct timeval *now,
 int clients_new_client(clients_t *c, NAL_CONNECTION *conn,
 			const struct timeval *now)
 {
-	client_ctx **item = c->items + c->used;
+	client_ctx *ctx;
 
-	if(c->used >= CLIENTS_MAX_ITEMS) {
-		SYS_fprintf(SYS_stderr, "Error, rejected new client connection "
-				"already at maximum (%u)\n", CLIENTS_MAX_ITEMS);
+	if((c->used >= c->hash_size) && !int_hash_expand(c)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't grow the table of "
+				"client connections\n");
 		return 0;
 	}
-	*item = client_ctx_new(c->uid_seed, conn, now);
-	if(*item == NULL) {
+	ctx = client_ctx_new(c->uid_seed, conn, c->near, now);
+	if(ctx == NULL) {
 		SYS_fprintf(SYS_stderr, "Error, initialisation of new client "
 				"connection failed\n");
 		return 0;
@@ -322,8 +494,8 @@ int clients_new_client(clients_t *c, NAL_CONNECTION *conn,
 	if(c->uid_seed == 0)
 		/* eek! Just do the best we can */
 		c->uid_seed = 1;
-	/* Get this client into the priority table */
-	c->priorities[c->used] = c->used;
+	int_hash_insert(c, ctx);
+	int_list_append(c, ctx);
 	c->used++;
 #ifdef CLIENTS_PRINT_CONNECTS
 	SYS_fprintf(SYS_stderr, "Info: new client connection (%u)\n", c->used);
@@ -331,51 +503,71 @@ int clients_new_client(clients_t *c, NAL_CONNECTION *conn,
 	return 1;
 }
 
-int clients_to_server(clients_t *c, server_t *s, multiplexer_t *m,
-			const struct timeval *now)
+int clients_to_servers(clients_t *c, servers_t *ss, const struct timeval *now)
 {
-	/* The sliding window has this left edge of the priorities array that
-	 * lies after high-priority clients that can't provide any more
-	 * requests. */
-	unsigned int edge_l = 0;
-	while(edge_l < c->used) {
-		unsigned long m_uid;
-		unsigned int client_idx;
-		client_ctx *ctx;
-restart_loop:
-		client_idx = c->priorities[edge_l];
-		ctx = c->items[client_idx];
-		/* If the multiplex table won't take another request, we can
-		 * abandon now */
-		if(!multiplexer_has_space(m))
-			return 1;
-		/* If this context has no request or its request is already
-		 * in-progress, skip it and don't come back */
-		if(!ctx->request_open || ctx->multiplex_id)
-			goto skip;
-		if(!server_is_active(s)) {
+	/* Clients whose servers can't take their requests yet are set aside
+	 * here, and go back to the head of the queue so they keep their turn.
+	 * Clients that are dealt with go to the back of the queue if they have
+	 * another request, so the loop ends once every client in the queue has
+	 * been set aside. */
+	client_queue blocked = { NULL, NULL };
+	client_ctx *ctx;
+	while((ctx = c->ready.head) != NULL) {
+		unsigned long m_uid, batch_num;
+		unsigned int batch_len;
+		int server_idx;
+		multiplexer_t *m;
+		server_t *s;
+		assert(ctx->ready && ctx->request_open && !ctx->response_done &&
+				!ctx->multiplex_id);
+		client_queue_unlink(&c->ready, ctx);
+		ctx->ready = 0;
+		server_idx = servers_route(ss, ctx->request_cmd,
+				ctx->request_data, ctx->request_len,
+				&batch_num, &batch_len);
+		if(server_idx < 0) {
 			/* doomed */
 			client_ctx_digest_response(ctx, ctx->request_cmd, NULL, 0);
 			goto responded_locally;
 		}
-		m_uid = multiplexer_add(m, ctx->uid, server_get_uid(s));
-		if(!server_place_request(s, m_uid, ctx->request_cmd,
-				ctx->request_data, ctx->request_len)) {
-			/* There wasn't room so the server won't take this or
-			 * any other request. */
+		s = servers_get(ss, (unsigned int)server_idx, &m);
+		/* If another client's already waiting on the same GET or HAVE,
+		 * this one shares its response rather than asking again */
+		if(!batch_num && ((m_uid = multiplexer_join(m, ctx->uid,
+					ctx->request_cmd, ctx->request_data,
+					ctx->request_len)) != 0))
+			goto forwarded;
+		/* If the server's multiplex table won't take another request,
+		 * this one waits, but others may be for other servers */
+		if(!multiplexer_has_space(m))
+			goto blocked;
+		m_uid = multiplexer_add(m, ctx->uid, server_get_uid(s),
+				ctx->request_cmd, ctx->request_data,
+				ctx->request_len);
+		if(!(batch_num ? server_place_batch(s, m_uid, batch_num,
+					ctx->request_data + DC_BATCH_COUNT_SIZE,
+					batch_len) :
+				server_place_request(s, m_uid, ctx->request_cmd,
+					ctx->request_data, ctx->request_len))) {
+			/* There wasn't room so the server won't take this
+			 * request yet. */
 			multiplexer_delete_item(m, m_uid);
-			return 1;
+			goto blocked;
 		}
+forwarded:
 		ctx->multiplex_id = m_uid;
-		SYS_timecpy(&ctx->timestamp, now);
+		ctx->multiplex_server = (unsigned int)server_idx;
+		int_touch(c, ctx, now);
+		continue;
 responded_locally:
-		/* Adjust priorities and continue */
-		priority_totail(c, edge_l);
-		goto restart_loop;
-skip:
-		/* Skip this context and ensure we don't revisit it */
-		edge_l++;
+		/* The client may have another request now */
+		int_check_ready(c, ctx);
+		continue;
+blocked:
+		client_queue_push(&blocked, ctx);
+		ctx->ready = 1;
 	}
+	client_queue_prepend(&c->ready, &blocked);
 	return 1;
 }
 
@@ -384,23 +576,40 @@ void clients_digest_response(clients_t *c, unsigned long client_uid,
 				const unsigned char *data,
 				unsigned int data_len)
 {
-	unsigned int idx;
-	if(!int_find(c, client_uid, &idx)) {
+	client_ctx *ctx = int_find(c, client_uid);
+	if(!ctx) {
 		assert(NULL == "shouldn't happen!");
 		return;
 	}
-	client_ctx_digest_response(c->items[idx], cmd, data, data_len);
+	client_ctx_digest_response(ctx, cmd, data, data_len);
+	int_check_ready(c, ctx);
 }
 
 void clients_digest_error(clients_t *c, unsigned long client_uid)
 {
 	static const unsigned char errbyte = DC_ERR_DISCONNECTED;
-	client_ctx *ctx;
-	unsigned int idx;
-	if(!int_find(c, client_uid, &idx)) {
+	client_ctx *ctx = int_find(c, client_uid);
+	if(!ctx) {
 		assert(NULL == "shouldn't happen!");
 		return;
 	}
-	ctx = c->items[idx];
 	client_ctx_digest_response(ctx, ctx->request_cmd, &errbyte, 1);
+	int_check_ready(c, ctx);
+}
+
+void clients_reforward(clients_t *c, unsigned long client_uid)
+{
+	client_ctx *ctx = int_find(c, client_uid);
+	if(!ctx) {
+		assert(NULL == "shouldn't happen!");
+		return;
+	}
+	if(ctx->retries++ >= CLIENTS_MAX_RETRIES) {
+		clients_digest_error(c, client_uid);
+		return;
+	}
+	/* The next clients_to_servers() forwards it again, to whichever server
+	 * now owns the session */
+	ctx->multiplex_id = 0;
+	int_check_ready(c, ctx);
 }
@@ -21,11 +21,22 @@
 
 #include "private.h"
 
-#define MULTIPLEXER_MAX_ITEMS 512
+/* Multiplexer uids are what the server sees as request uids, so they have to
+ * fit in 32 bits. The low bits are the item's slot in the table, and the rest
+ * come from a counter that moves on with every item added, so a uid that's no
+ * longer in the table doesn't match whatever reuses its slot. */
+#define MULTIPLEXER_UID_MASK	0xffffffffUL
+
+/* A client waiting on another client's request for the same thing */
+typedef struct st_waiter_t {
+	unsigned long c_uid;
+	struct st_waiter_t *next;
+} waiter_t;
 
 /* An internal-only type used to represent a multiplexer item */
 typedef struct st_item_t {
-	/* The multiplexer's uid (also the server's translated request_uid) */
+	/* The multiplexer's uid (also the server's translated request_uid),
+	 * zero if the item is free */
 	unsigned long m_uid;
 	/* The client uid */
 	unsigned long c_uid;
@@ -33,137 +44,291 @@ typedef struct st_item_t {
 	unsigned long s_uid;
 	enum {
 		ITEM_NORMAL,
-		ITEM_CLIENT_DEAD,
-		ITEM_SERVER_DEAD
+		ITEM_CLIENT_DEAD
 	} state;
+	/* Links in the list of items in use, or (just 'next') in the list of
+	 * free items */
+	struct st_item_t *prev, *next;
+	/* If 'joinable', this is a GET or HAVE that other clients asking for
+	 * the same session can wait on rather than sending their own. The
+	 * command and session ID are kept, as the item is in the chain of the
+	 * 'joinable' table they hash to. */
+	int joinable;
+	DC_CMD key_cmd;
+	unsigned int key_len;
+	unsigned char key[DC_MAX_ID_LEN];
+	struct st_item_t *key_next;
+	/* The clients that have joined the request */
+	waiter_t *waiters;
 } item_t;
 
 struct st_multiplexer_t {
-	item_t items[MULTIPLEXER_MAX_ITEMS];
-	unsigned int used;
-	unsigned long uid_seed;
+	/* The table of items, 'size' of them, with 'slot_bits' bits being
+	 * enough to hold any slot number */
+	item_t *items;
+	unsigned int size, used, slot_bits;
+	/* The uid counter, which never exceeds 'seed_max' */
+	unsigned long uid_seed, seed_max;
+	/* The items in use, and the free ones */
+	item_t *in_use, *free_list;
+	/* The joinable items, hashed into 1 << 'slot_bits' chains */
+	item_t **joinable;
+	/* Waiters not in use */
+	waiter_t *free_waiters;
 };
 
 /***************************/
 /* Internal-only functions */
 
-static void int_remove(multiplexer_t *m, unsigned int idx)
+static item_t *int_find(multiplexer_t *m, unsigned long m_uid)
+{
+	unsigned long slot = m_uid & ((1UL << m->slot_bits) - 1);
+	item_t *item;
+	if(slot >= m->size)
+		return NULL;
+	item = m->items + slot;
+	if(!item->m_uid || (item->m_uid != m_uid))
+		return NULL;
+	return item;
+}
+
+static item_t **int_key_chain(multiplexer_t *m, DC_CMD cmd,
+			const unsigned char *id_data, unsigned int id_len)
+{
+	unsigned long h = 2166136261UL ^ (unsigned long)cmd;
+	while(id_len--) {
+		h ^= *(id_data++);
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	return m->joinable + (h & ((1UL << m->slot_bits) - 1));
+}
+
+static void int_unjoin(multiplexer_t *m, item_t *item)
 {
-	assert(idx < m->used);
-	if(idx + 1 < m->used)
-		/* We have to scroll items */
-		SYS_memmove_n(item_t, m->items + idx, m->items + (idx + 1),
-				m->used - (idx + 1));
+	item_t **chain = int_key_chain(m, item->key_cmd, item->key,
+				item->key_len);
+	while(*chain != item)
+		chain = &(*chain)->key_next;
+	*chain = item->key_next;
+	item->joinable = 0;
+}
+
+static void int_remove(multiplexer_t *m, item_t *item)
+{
+	waiter_t *w;
+	assert(item->m_uid && m->used);
+	if(item->joinable)
+		int_unjoin(m, item);
+	while((w = item->waiters) != NULL) {
+		item->waiters = w->next;
+		w->next = m->free_waiters;
+		m->free_waiters = w;
+	}
+	if(item->prev)
+		item->prev->next = item->next;
+	else
+		m->in_use = item->next;
+	if(item->next)
+		item->next->prev = item->prev;
+	item->m_uid = 0;
+	item->next = m->free_list;
+	m->free_list = item;
 	m->used--;
 }
 
 /**********************************/
 /* Exported functions (private.h) */
 
-multiplexer_t *multiplexer_new(void)
+multiplexer_t *multiplexer_new(unsigned int max_items)
 {
-	multiplexer_t *m = SYS_malloc(multiplexer_t, 1);
-	if(!m)
+	unsigned int loop;
+	multiplexer_t *m;
+	if(!max_items || (max_items > MULTIPLEXER_MAX_ITEMS))
 		return NULL;
+	if((m = SYS_malloc(multiplexer_t, 1)) == NULL)
+		return NULL;
+	m->size = max_items;
 	m->used = 0;
-	m->uid_seed = 1;
+	for(m->slot_bits = 1; (1UL << m->slot_bits) < max_items;
+			m->slot_bits++)
+		;
+	m->items = SYS_malloc(item_t, max_items);
+	m->joinable = SYS_malloc(item_t *, 1 << m->slot_bits);
+	if(!m->items || !m->joinable) {
+		if(m->items)
+			SYS_free(item_t, m->items);
+		if(m->joinable)
+			SYS_free(item_t *, m->joinable);
+		SYS_free(multiplexer_t, m);
+		return NULL;
+	}
+	SYS_zero_n(item_t *, m->joinable, 1 << m->slot_bits);
+	m->free_waiters = NULL;
+	m->uid_seed = 0;
+	m->seed_max = MULTIPLEXER_UID_MASK >> m->slot_bits;
+	m->in_use = NULL;
+	/* Hand out the low slots first */
+	m->free_list = NULL;
+	loop = max_items;
+	while(loop--) {
+		m->items[loop].m_uid = 0;
+		m->items[loop].next = m->free_list;
+		m->free_list = m->items + loop;
+	}
 	return m;
 }
 
 void multiplexer_free(multiplexer_t *m)
 {
+	waiter_t *w;
+	while(m->in_use)
+		int_remove(m, m->in_use);
+	while((w = m->free_waiters) != NULL) {
+		m->free_waiters = w->next;
+		SYS_free(waiter_t, w);
+	}
+	SYS_free(item_t *, m->joinable);
+	SYS_free(item_t, m->items);
 	SYS_free(multiplexer_t, m);
 }
 
-int multiplexer_run(multiplexer_t *m, clients_t *c, server_t *s,
-			const struct timeval *now)
+int multiplexer_run(servers_t *ss, clients_t *c, const struct timeval *now)
 {
-	if(server_is_active(s) && !server_to_clients(s, c, m, now))
-		return 0;
-	if(!clients_to_server(c, s, m, now))
+	unsigned int idx, num = servers_num(ss);
+	multiplexer_t *m;
+	server_t *s;
+	for(idx = 0; idx < num; idx++) {
+		s = servers_get(ss, idx, &m);
+		if(server_is_active(s) && !server_to_clients(s, c, m, now))
+			return 0;
+	}
+	if(!clients_to_servers(c, ss, now))
 		return 0;
 	return 1;
 }
 
-void multiplexer_mark_dead_client(multiplexer_t *m, unsigned long client_uid)
+void multiplexer_mark_dead_client(multiplexer_t *m, unsigned long m_uid,
+			unsigned long client_uid)
 {
-	unsigned int loop = 0;
-	item_t *item = m->items;
-	while(loop < m->used) {
-		if(item->c_uid == client_uid) {
-			if(item->state == ITEM_SERVER_DEAD)
-				/* The item already had an orphaned server, now
-				 * the client too! Just remove it. */
-				int_remove(m, loop);
-			else {
-				abort();
-				item->state = ITEM_CLIENT_DEAD;
-				loop++;
-				item++;
-			}
-		} else {
-			loop++;
-			item++;
-		}
+	waiter_t **w, *dead;
+	item_t *item = int_find(m, m_uid);
+	/* If the response has already come back, there's nothing to do */
+	if(!item)
+		return;
+	if(item->c_uid == client_uid) {
+		/* The response still goes to any waiters, otherwise it's
+		 * absorbed when it arrives */
+		item->state = ITEM_CLIENT_DEAD;
+		return;
 	}
+	for(w = &item->waiters; *w; w = &(*w)->next)
+		if((*w)->c_uid == client_uid) {
+			dead = *w;
+			*w = dead->next;
+			dead->next = m->free_waiters;
+			m->free_waiters = dead;
+			return;
+		}
 }
 
 void multiplexer_mark_dead_server(multiplexer_t *m, unsigned long server_uid,
 			clients_t *c)
 {
-	unsigned int loop = 0;
-	item_t *item = m->items;
-	while(loop < m->used) {
+	item_t *item = m->in_use, *next;
+	waiter_t *w;
+	while(item) {
+		next = item->next;
 		if(item->s_uid == server_uid) {
+			/* So the clients are waiting for a response they
+			 * will never get. Send their requests to the
+			 * session's new server, or give them an error. */
 			if(item->state != ITEM_CLIENT_DEAD)
-				/* So the client's waiting for a response it
-				 * will never get. Give it one. */
-				clients_digest_error(c, item->c_uid);
+				clients_reforward(c, item->c_uid);
+			for(w = item->waiters; w; w = w->next)
+				clients_reforward(c, w->c_uid);
 			/* Either way, the multiplexer item should now be
 			 * removed. */
-			int_remove(m, loop);
-		} else {
-			/* This item is unaffected, move to the next one */
-			loop++;
-			item++;
+			int_remove(m, item);
 		}
+		item = next;
 	}
 }
 
 int multiplexer_has_space(multiplexer_t *m)
 {
-	return (m->used < MULTIPLEXER_MAX_ITEMS);
+	return (m->free_list != NULL);
 }
 
 unsigned long multiplexer_add(multiplexer_t *m, unsigned long client_uid,
-			unsigned long server_uid)
+			unsigned long server_uid, DC_CMD cmd,
+			const unsigned char *data, unsigned int data_len)
 {
-	item_t *item = m->items + m->used;
+	item_t **chain, *item = m->free_list;
 
-	assert(m->used < MULTIPLEXER_MAX_ITEMS);
-	item->m_uid = m->uid_seed++;
+	assert(item != NULL);
+	m->free_list = item->next;
+	if(++m->uid_seed > m->seed_max)
+		m->uid_seed = 1;
+	item->m_uid = (m->uid_seed << m->slot_bits) |
+			(unsigned long)(item - m->items);
 	item->c_uid = client_uid;
 	item->s_uid = server_uid;
 	item->state = ITEM_NORMAL;
+	item->waiters = NULL;
+	/* GETs and HAVEs carry just the session ID, and can be shared */
+	item->joinable = (((cmd == DC_CMD_GET) || (cmd == DC_CMD_HAVE)) &&
+			data_len && (data_len <= DC_MAX_ID_LEN));
+	if(item->joinable) {
+		item->key_cmd = cmd;
+		item->key_len = data_len;
+		SYS_memcpy_n(unsigned char, item->key, data, data_len);
+		chain = int_key_chain(m, cmd, data, data_len);
+		item->key_next = *chain;
+		*chain = item;
+	}
+	item->prev = NULL;
+	item->next = m->in_use;
+	if(m->in_use)
+		m->in_use->prev = item;
+	m->in_use = item;
 	m->used++;
 	return item->m_uid;
 }
 
+unsigned long multiplexer_join(multiplexer_t *m, unsigned long client_uid,
+			DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len)
+{
+	item_t *item;
+	waiter_t *w;
+	if(((cmd != DC_CMD_GET) && (cmd != DC_CMD_HAVE)) || !data_len ||
+			(data_len > DC_MAX_ID_LEN))
+		return 0;
+	item = *int_key_chain(m, cmd, data, data_len);
+	while(item && ((item->key_cmd != cmd) || (item->key_len != data_len) ||
+			memcmp(item->key, data, data_len)))
+		item = item->key_next;
+	if(!item)
+		return 0;
+	if((w = m->free_waiters) != NULL)
+		m->free_waiters = w->next;
+	else if((w = SYS_malloc(waiter_t, 1)) == NULL)
+		/* Just forward it separately */
+		return 0;
+	w->c_uid = client_uid;
+	w->next = item->waiters;
+	item->waiters = w;
+	return item->m_uid;
+}
+
 void multiplexer_delete_item(multiplexer_t *m, unsigned long m_uid)
 {
-	/* Search in reverse because this is most commonly used to remove a
-	 * just-added item because the server couldn't accept it (after the
-	 * m_uid had been chosen). */
-	unsigned int loop = m->used;
-	item_t *item = m->items + loop;
-	while(loop--) {
-		item--;
-		if(item->m_uid == m_uid) {
-			int_remove(m, loop);
-			return;
-		}
+	item_t *item = int_find(m, m_uid);
+	if(!item) {
+		assert(NULL == "shouldn't happen!");
+		return;
 	}
-	assert(NULL == "shouldn't happen!");
+	int_remove(m, item);
 }
 
 void multiplexer_finish(multiplexer_t *m, clients_t *c, unsigned long uid,
@@ -171,21 +336,18 @@ void multiplexer_finish(multiplexer_t *m, clients_t *c, unsigned long uid,
 			unsigned int data_len)
 {
 	/* Find the matching item */
-	unsigned int loop = 0;
-	item_t *item = m->items;
-	while(loop < m->used) {
-		if(item->m_uid == uid)
-			goto found;
-		loop++;
-		item++;
+	item_t *item = int_find(m, uid);
+	waiter_t *w;
+	if(!item) {
+		assert(NULL == "shouldn't happen!");
+		return;
 	}
-	assert(NULL == "shouldn't happen!");
-	return;
-found:
 	/* If the client had disappeared since having its request forwarded,
 	 * just silently absorb the response. */
 	if(item->state != ITEM_CLIENT_DEAD)
 		clients_digest_response(c, item->c_uid, cmd, data, data_len);
-	int_remove(m, loop);
+	/* Every client that joined the request gets the same response */
+	for(w = item->waiters; w; w = w->next)
+		clients_digest_response(c, w->c_uid, cmd, data, data_len);
+	int_remove(m, item);
 }
-
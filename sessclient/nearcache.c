@@ -0,0 +1,250 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "private.h"
+
+/* The near-cache keeps copies of sessions that have recently passed through
+ * dc_client, so that lookups for them can be answered without a round trip to
+ * the cache servers. It uses the same cache implementation as dc_server, and
+ * nothing it holds outlives the TTL cap, which bounds how stale an answer can
+ * be if a session is removed by something other than this dc_client. */
+
+/* Writes are counted in this many buckets, by session id */
+#define NEARCACHE_GEN_BUCKETS	256
+
+struct st_nearcache_t {
+	/* The cache implementation and the cache itself */
+	const DC_CACHE_cb *vt;
+	DC_CACHE_EXT_cb ext;
+	DC_CACHE *cache;
+	/* The longest any session is kept for */
+	unsigned long ttl_msecs;
+	/* Count the writes seen to the sessions in each bucket, so a response
+	 * can tell if a write was seen after its request (see
+	 * nearcache_response()) */
+	unsigned long gens[NEARCACHE_GEN_BUCKETS];
+	/* The time of the current pass of the main loop */
+	struct timeval now;
+	/* Lookups are copied out here if the cache can't lend us its copy */
+	unsigned char buf[DC_MAX_DATA_LEN];
+};
+
+/**********************/
+/* Internal functions */
+
+static int int_id_ok(unsigned int id_len)
+{
+	return (id_len && (id_len <= DC_MAX_ID_LEN));
+}
+
+/* Finds the session id in a request, returns zero if it doesn't have one */
+static int int_get_id(DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len, const unsigned char **id,
+			unsigned int *id_len)
+{
+	unsigned long msecs, len;
+	switch(cmd) {
+	case DC_CMD_ADD:
+		/* The session id follows the 4-byte timeout and id length */
+		if(!NAL_decode_uint32(&data, &data_len, &msecs) ||
+				!NAL_decode_uint32(&data, &data_len, &len) ||
+				(len >= data_len))
+			return 0;
+		*id = data;
+		*id_len = (unsigned int)len;
+		break;
+	case DC_CMD_GET:
+	case DC_CMD_REMOVE:
+	case DC_CMD_HAVE:
+		*id = data;
+		*id_len = data_len;
+		break;
+	default:
+		return 0;
+	}
+	return int_id_ok(*id_len);
+}
+
+static unsigned long *int_gen(nearcache_t *nc, const unsigned char *id,
+			unsigned int id_len)
+{
+	unsigned long h = 2166136261UL;
+	while(id_len--) {
+		h ^= *(id++);
+		h = (h * 16777619UL) & 0xffffffffUL;
+	}
+	return nc->gens + (h % NEARCACHE_GEN_BUCKETS);
+}
+
+/* Drops the sessions that an ADD or REMOVE (or a batch of them) will change */
+static void int_invalidate(nearcache_t *nc, DC_CMD cmd,
+			const unsigned char *data, unsigned int data_len)
+{
+	unsigned char op;
+	unsigned long num, len;
+	const unsigned char *id;
+	unsigned int id_len;
+
+	if(cmd == DC_CMD_BATCH) {
+		if(!NAL_decode_uint32(&data, &data_len, &num))
+			return;
+		while(num-- && NAL_decode_char(&data, &data_len, &op) &&
+				NAL_decode_uint32(&data, &data_len, &len) &&
+				(len <= data_len)) {
+			if(op == DC_OP_ADD)
+				int_invalidate(nc, DC_CMD_ADD, data,
+						(unsigned int)len);
+			else if(op == DC_OP_REMOVE)
+				int_invalidate(nc, DC_CMD_REMOVE, data,
+						(unsigned int)len);
+			data += len;
+			data_len -= (unsigned int)len;
+		}
+		return;
+	}
+	if(((cmd != DC_CMD_ADD) && (cmd != DC_CMD_REMOVE)) ||
+			!int_get_id(cmd, data, data_len, &id, &id_len))
+		return;
+	nc->vt->cache_remove(nc->cache, &nc->now, id, id_len);
+	(*int_gen(nc, id, id_len))++;
+}
+
+/* Stores a session, replacing any copy we already have */
+static void int_store(nearcache_t *nc, unsigned long timeout_msecs,
+			const unsigned char *id, unsigned int id_len,
+			const unsigned char *data, unsigned int data_len)
+{
+	if(!int_id_ok(id_len) || !data_len || (data_len > DC_MAX_DATA_LEN))
+		return;
+	if(timeout_msecs > nc->ttl_msecs)
+		timeout_msecs = nc->ttl_msecs;
+	nc->vt->cache_remove(nc->cache, &nc->now, id, id_len);
+	nc->vt->cache_add(nc->cache, &nc->now, timeout_msecs, id, id_len,
+			data, data_len);
+}
+
+/***************************/
+/* Exposed (API) functions */
+
+nearcache_t *nearcache_new(unsigned int max_sessions, unsigned long ttl_msecs)
+{
+	nearcache_t *nc;
+	/* Recently used sessions are the ones worth keeping close */
+	if(!DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT_LRU))
+		return NULL;
+	if((nc = SYS_malloc(nearcache_t, 1)) == NULL)
+		return NULL;
+	nc->vt = DC_SERVER_get_cache();
+	SYS_memcpy(DC_CACHE_EXT_cb, &nc->ext, DC_SERVER_get_cache_ex());
+	if((nc->cache = nc->vt->cache_new(max_sessions)) == NULL) {
+		SYS_free(nearcache_t, nc);
+		return NULL;
+	}
+	nc->ttl_msecs = ttl_msecs;
+	SYS_zero_n(unsigned long, nc->gens, NEARCACHE_GEN_BUCKETS);
+	SYS_gettime(&nc->now);
+	return nc;
+}
+
+void nearcache_free(nearcache_t *nc)
+{
+	nc->vt->cache_free(nc->cache);
+	SYS_free(nearcache_t, nc);
+}
+
+void nearcache_set_time(nearcache_t *nc, const struct timeval *now)
+{
+	SYS_timecpy(&nc->now, now);
+}
+
+unsigned long nearcache_request(nearcache_t *nc, DC_CMD cmd,
+			const unsigned char *data, unsigned int data_len)
+{
+	const unsigned char *id;
+	unsigned int id_len;
+	int_invalidate(nc, cmd, data, data_len);
+	if(!int_get_id(cmd, data, data_len, &id, &id_len))
+		return 0;
+	return *int_gen(nc, id, id_len);
+}
+
+int nearcache_answer(nearcache_t *nc, DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len, DC_PLUG *plug)
+{
+	static const unsigned char yes = DC_ERR_OK;
+	const unsigned char *ref;
+	unsigned int len;
+	int ret;
+
+	if(!int_id_ok(data_len))
+		return 0;
+	switch(cmd) {
+	case DC_CMD_HAVE:
+		if(!nc->vt->cache_have(nc->cache, &nc->now, data, data_len))
+			return 0;
+		return DC_PLUG_write_more(plug, &yes, 1);
+	case DC_CMD_GET:
+		if(nc->ext.cache_get_ref) {
+			ref = nc->ext.cache_get_ref(nc->cache, &nc->now, data,
+					data_len, &len);
+			if(!ref)
+				return 0;
+			ret = DC_PLUG_write_more(plug, ref, len);
+			nc->ext.cache_release(nc->cache);
+			return ret;
+		}
+		len = nc->vt->cache_get(nc->cache, &nc->now, data, data_len,
+				nc->buf, DC_MAX_DATA_LEN);
+		return (len && DC_PLUG_write_more(plug, nc->buf, len));
+	default:
+		break;
+	}
+	return 0;
+}
+
+void nearcache_response(nearcache_t *nc, unsigned long gen, DC_CMD cmd,
+			const unsigned char *req_data, unsigned int req_len,
+			const unsigned char *data, unsigned int data_len)
+{
+	unsigned long msecs;
+	const unsigned char *id;
+	unsigned int id_len;
+
+	if(((cmd != DC_CMD_ADD) && (cmd != DC_CMD_GET)) ||
+			!int_get_id(cmd, req_data, req_len, &id, &id_len))
+		return;
+	/* If a write to the session was seen since the request, the response
+	 * may already be out of date (the write was sent after the request, so
+	 * the server answered the request first). */
+	if(gen != *int_gen(nc, id, id_len))
+		return;
+	if(cmd == DC_CMD_ADD) {
+		/* Keep what was added, if it was */
+		if((data_len != 1) || (*data != DC_ERR_OK) ||
+				!NAL_decode_uint32(&req_data, &req_len, &msecs))
+			return;
+		int_store(nc, msecs, id, id_len, id + id_len,
+				req_len - 4 - id_len);
+	} else if(data_len >= 5)
+		/* Shorter responses are errors, as DC_CTX_get_session() reads
+		 * them */
+		int_store(nc, nc->ttl_msecs, id, id_len, data, data_len);
+}
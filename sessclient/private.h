@@ -28,7 +28,9 @@
 #include <libsys/pre.h>
 #include <libnal/nal.h>
 #include <distcache/dc_plug.h>
+#include <distcache/dc_client.h>
 #include <distcache/dc_internal.h>
+#include <distcache/dc_server.h>
 #include <libsys/post.h>
 
 /* Some debugging symbols ... */
@@ -38,27 +40,32 @@
  * printed to stdout. */
 /* #define CLIENTS_PRINT_CONNECTS */
 
+/* The most requests that can be in flight to any one server */
+#define MULTIPLEXER_MAX_ITEMS	65536
+
 /* Predeclare "black-box" structures */
 typedef struct st_clients_t	clients_t;
 typedef struct st_server_t	server_t;
+typedef struct st_servers_t	servers_t;
 typedef struct st_multiplexer_t	multiplexer_t;
+typedef struct st_nearcache_t	nearcache_t;
 
 /* client functions */
-clients_t *clients_new(void);
+clients_t *clients_new(nearcache_t *near);
 void clients_free(clients_t *c);
 int clients_empty(const clients_t *c);
-int clients_io(clients_t *c, multiplexer_t *m, const struct timeval *now,
-			unsigned long idle_timeout);
+int clients_io(clients_t *c, servers_t *ss, NAL_SELECTOR *sel,
+			const struct timeval *now, unsigned long idle_timeout);
 int clients_new_client(clients_t *c, NAL_CONNECTION *conn,
 			const struct timeval *now);
-int clients_to_server(clients_t *c, server_t *s, multiplexer_t *m,
-			const struct timeval *now);
+int clients_to_servers(clients_t *c, servers_t *ss, const struct timeval *now);
 /* semi-static client functions - not called from sclient.c */
 void clients_digest_response(clients_t *c, unsigned long client_uid,
 				DC_CMD cmd,
 				const unsigned char *data,
 				unsigned int data_len);
 void clients_digest_error(clients_t *c, unsigned long client_uid);
+void clients_reforward(clients_t *c, unsigned long client_uid);
 
 /* server functions */
 server_t *server_new(const char *address, unsigned long retry_msecs,
@@ -71,23 +78,58 @@ int server_to_clients(server_t *s, clients_t *c, multiplexer_t *m,
 			const struct timeval *now);
 int server_place_request(server_t *s, unsigned long uid, DC_CMD cmd,
 			const unsigned char *data, unsigned int data_len);
+int server_place_batch(server_t *s, unsigned long uid, unsigned long num,
+			const unsigned char *entries, unsigned int entries_len);
 int server_is_active(server_t *s);
 unsigned long server_get_uid(server_t *s);
 
+/* servers functions - the set of back-end servers, each with its own
+ * multiplexer, and the consistent-hash ring that routes sessions to them */
+servers_t *servers_new(const char *const *addresses, unsigned int num,
+			unsigned long retry_msecs, unsigned int max_inflight,
+			const struct timeval *now);
+void servers_free(servers_t *ss);
+unsigned int servers_num(const servers_t *ss);
+server_t *servers_get(servers_t *ss, unsigned int idx, multiplexer_t **m);
+int servers_selector_hook(servers_t *ss, NAL_SELECTOR *sel,
+			const struct timeval *now);
+int servers_io(servers_t *ss, clients_t *c, const struct timeval *now);
+void servers_mark_dead_client(servers_t *ss, unsigned int idx,
+			unsigned long m_uid, unsigned long client_uid);
+int servers_route(servers_t *ss, DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len, unsigned long *batch_num,
+			unsigned int *batch_len);
+
 /* multiplexer functions */
-multiplexer_t *multiplexer_new(void);
+multiplexer_t *multiplexer_new(unsigned int max_items);
 void multiplexer_free(multiplexer_t *m);
-int multiplexer_run(multiplexer_t *m, clients_t *c, server_t *s,
-			const struct timeval *now);
-void multiplexer_mark_dead_client(multiplexer_t *m, unsigned long client_uid);
+int multiplexer_run(servers_t *ss, clients_t *c, const struct timeval *now);
+void multiplexer_mark_dead_client(multiplexer_t *m, unsigned long m_uid,
+			unsigned long client_uid);
 void multiplexer_mark_dead_server(multiplexer_t *m, unsigned long server_uid,
 			clients_t *c);
 int multiplexer_has_space(multiplexer_t *m);
 unsigned long multiplexer_add(multiplexer_t *m, unsigned long client_uid,
-			unsigned long server_uid);
+			unsigned long server_uid, DC_CMD cmd,
+			const unsigned char *data, unsigned int data_len);
+unsigned long multiplexer_join(multiplexer_t *m, unsigned long client_uid,
+			DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len);
 void multiplexer_delete_item(multiplexer_t *m, unsigned long m_uid);
 void multiplexer_finish(multiplexer_t *m, clients_t *c, unsigned long uid,
 			DC_CMD cmd, const unsigned char *data,
 			unsigned int data_len);
 
+/* nearcache functions - the optional local cache of recently used sessions */
+nearcache_t *nearcache_new(unsigned int max_sessions, unsigned long ttl_msecs);
+void nearcache_free(nearcache_t *nc);
+void nearcache_set_time(nearcache_t *nc, const struct timeval *now);
+unsigned long nearcache_request(nearcache_t *nc, DC_CMD cmd,
+			const unsigned char *data, unsigned int data_len);
+int nearcache_answer(nearcache_t *nc, DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len, DC_PLUG *plug);
+void nearcache_response(nearcache_t *nc, unsigned long gen, DC_CMD cmd,
+			const unsigned char *req_data, unsigned int req_len,
+			const unsigned char *data, unsigned int data_len);
+
 #endif /* !defined(HEADER_PRIVATE_SESSCLIENT_H) */
@@ -22,9 +22,10 @@
 #include "private.h"
 
 /* This file implements the "dc_client" utility - a self-contained program that
- * connects to a back-end session cache server, listens on a local address for
- * connections, and for each of those connections, manages the forwarding of
- * requests to back-end cache server (and demultiplexing its responses). */
+ * connects to one or more back-end session cache servers, listens on a local
+ * address for connections, and for each of those connections, manages the
+ * forwarding of requests to the back-end cache server that owns each session
+ * (and demultiplexing their responses). */
 
 #define CLIENT_BUFFER_SIZE	(sizeof(DC_MSG) * 2)
 
@@ -35,10 +36,20 @@
 #define MAX_RETRY_PERIOD	3600000 /* 1 hour */
 #define MIN_RETRY_PERIOD	1
 #define MAX_IDLE_PERIOD		3600000 /* 1 hour */
+#define MAX_SERVERS		64
+#define MIN_INFLIGHT		1
+#define MAX_INFLIGHT		MULTIPLEXER_MAX_ITEMS
+#define MIN_NEARCACHE		DC_CACHE_MIN_SIZE
+#define MAX_NEARCACHE		DC_CACHE_MAX_SIZE
+#define MIN_NEARTTL		1
+#define MAX_NEARTTL		3600000 /* 1 hour */
 
 static const char *def_listen_addr = "UNIX:/tmp/scache";
 static const unsigned long def_retry_period = 5000;
 static const unsigned long def_idle_timeout = 0;
+static const unsigned long def_inflight = 512;
+static const unsigned long def_nearcache = 0;
+static const unsigned long def_nearttl = 1000;
 #ifndef WIN32
 static const char *def_pidfile = NULL;
 static const char *def_user = NULL;
@@ -56,10 +67,13 @@ static const char *usage_msg[] = {
 "  -daemon            (detach and run in the background)",
 #endif
 "  -listen <addr>     (listen on address 'addr', def: UNIX:/tmp/scache)",
-"  -server <addr>     (connects to a cache server at 'addr')",
+"  -server <addr>     (connects to a cache server at 'addr', repeatable)",
 "  -connect <addr>    (alias for '-server')",
 "  -retry <num>       (retry period (msecs) for cache servers, def: 5000)",
 "  -idle <num>        (idle timeout (msecs) for client connections, def: 0)",
+"  -inflight <num>    (max requests in flight to each cache server, def: 512)",
+"  -nearcache <num>   (keep up to 'num' sessions locally, def: 0 (off))",
+"  -nearttl <num>     (longest (msecs) a session is kept locally, def: 1000)",
 #ifndef WIN32
 "  -user <user>       (run daemon as given user)",
 "  -sockowner <user>  (controls ownership of unix domain listening socket)",
@@ -72,7 +86,9 @@ static const char *usage_msg[] = {
 "",
 " Eg. dc_client -listen UNIX:/tmp/scache -server IP:192.168.2.5:9003",
 " will listen on a unix domain socket at /tmp/scache and will manage",
-" forwarding requests and responses to and from the cache server.",
+" forwarding requests and responses to and from the cache server. If more",
+" than one server is given, each session is kept on one of them, chosen by",
+" consistent hashing of the session ID.",
 "", NULL};
 
 static const char *CMD_HELP1 = "-h";
@@ -92,6 +108,9 @@ static const char *CMD_SERVER1 = "-server";
 static const char *CMD_SERVER2 = "-connect";
 static const char *CMD_RETRY = "-retry";
 static const char *CMD_IDLE = "-idle";
+static const char *CMD_INFLIGHT = "-inflight";
+static const char *CMD_NEARCACHE = "-nearcache";
+static const char *CMD_NEARTTL = "-nearttl";
 
 /* Little help functions to keep main() from bloating. */
 static int usage(void) {
@@ -138,10 +157,11 @@ int main(int argc, char *argv[])
 	NAL_CONNECTION *conn = NULL;
 	unsigned long timeout;
 	struct timeval now;
-	server_t *server;
+	servers_t *servers;
 	clients_t *clients;
-	multiplexer_t *multiplexer;
-	const char *server_address = NULL;
+	nearcache_t *near = NULL;
+	const char *server_addresses[MAX_SERVERS];
+	unsigned int num_servers = 0;
 	/* Overridables */
 #ifndef WIN32
 	int daemon_mode = 0;
@@ -155,6 +175,9 @@ int main(int argc, char *argv[])
 	const char *listen_addr = def_listen_addr;
 	unsigned long retry_period = def_retry_period;
 	unsigned long idle_timeout = def_idle_timeout;
+	unsigned long inflight = def_inflight;
+	unsigned long nearcache = def_nearcache;
+	unsigned long nearttl = def_nearttl;
 
 	/* Pull options off the command-line */
 	ARG_INC;
@@ -192,11 +215,11 @@ int main(int argc, char *argv[])
 		} else if((strcmp(*argv, CMD_SERVER1) == 0) ||
 				(strcmp(*argv, CMD_SERVER2) == 0)) {
 			ARG_CHECK(*argv);
-			if(server_address) {
+			if(num_servers == MAX_SERVERS) {
 				SYS_fprintf(SYS_stderr, "Error, too many servers\n");
 				return err_badarg(*(argv - 1));
 			}
-			server_address = *argv;
+			server_addresses[num_servers++] = *argv;
 		} else if(strcmp(*argv, CMD_RETRY) == 0) {
 			char *tmp_ptr;
 			ARG_CHECK(*argv);
@@ -214,12 +237,39 @@ int main(int argc, char *argv[])
 					(idle_timeout > MAX_IDLE_PERIOD)) {
 				return err_badarg(*(argv - 1));
 			}
+		} else if(strcmp(*argv, CMD_INFLIGHT) == 0) {
+			char *tmp_ptr;
+			ARG_CHECK(*argv);
+			inflight = strtoul(*argv, &tmp_ptr, 10);
+			if((tmp_ptr == *argv) || (*tmp_ptr != '\0') ||
+					(inflight < MIN_INFLIGHT) ||
+					(inflight > MAX_INFLIGHT)) {
+				return err_badarg(*(argv - 1));
+			}
+		} else if(strcmp(*argv, CMD_NEARCACHE) == 0) {
+			char *tmp_ptr;
+			ARG_CHECK(*argv);
+			nearcache = strtoul(*argv, &tmp_ptr, 10);
+			if((tmp_ptr == *argv) || (*tmp_ptr != '\0') ||
+					(nearcache && ((nearcache < MIN_NEARCACHE) ||
+					(nearcache > MAX_NEARCACHE)))) {
+				return err_badarg(*(argv - 1));
+			}
+		} else if(strcmp(*argv, CMD_NEARTTL) == 0) {
+			char *tmp_ptr;
+			ARG_CHECK(*argv);
+			nearttl = strtoul(*argv, &tmp_ptr, 10);
+			if((tmp_ptr == *argv) || (*tmp_ptr != '\0') ||
+					(nearttl < MIN_NEARTTL) ||
+					(nearttl > MAX_NEARTTL)) {
+				return err_badarg(*(argv - 1));
+			}
 		} else
 			return err_badswitch(*argv);
 		ARG_INC;
 	}
 
-	if(!server_address) {
+	if(!num_servers) {
 		SYS_fprintf(SYS_stderr, "Error, no server specified!\n");
 		return 1;
 	}
@@ -278,9 +328,12 @@ int main(int argc, char *argv[])
 	 * we were going to), so our ability to connect will be consistent now
 	 * with later retries. Also, we do this prior to going into daemon mode
 	 * to improve the chances failures would go noticed. */
-	if(((server = server_new(server_address, retry_period, &now)) == NULL) ||
-			((clients = clients_new()) == NULL) ||
-			((multiplexer = multiplexer_new()) == NULL)) {
+	if(((servers = servers_new(server_addresses, num_servers, retry_period,
+					(unsigned int)inflight, &now)) == NULL) ||
+			(nearcache && ((near = nearcache_new(
+					(unsigned int)nearcache,
+					nearttl)) == NULL)) ||
+			((clients = clients_new(near)) == NULL)) {
 		SYS_fprintf(SYS_stderr, "Error, internal initialisation problems\n");
 		return 1;
 	}
@@ -333,7 +386,7 @@ main_loop:
 	/* Because servers can be dropped and retried, we just provide this
 	 * opaque hook which handles the requirements of reconnecting and
 	 * adding to the selector. */
-	if(!server_selector_hook(server, sel, &now)) {
+	if(!servers_selector_hook(servers, sel, &now)) {
 		SYS_fprintf(SYS_stderr, "Error, selector problem\n");
 		goto err;
 	}
@@ -381,14 +434,14 @@ main_loop:
 			goto err;
 		}
 	}
-	if(!clients_io(clients, multiplexer, &now, idle_timeout) ||
-			!server_io(server, multiplexer, clients, &now)) {
+	if(!clients_io(clients, servers, sel, &now, idle_timeout) ||
+			!servers_io(servers, clients, &now)) {
 		SYS_fprintf(SYS_stderr, "Error, a fatal problem with the "
 			"client or server code occured. Closing.\n");
 		goto err;
 	}
 	/* Now the logic-loop, which is "multiplexer"-driven. */
-	if(!multiplexer_run(multiplexer, clients, server, &now)) {
+	if(!multiplexer_run(servers, clients, &now)) {
 		SYS_fprintf(SYS_stderr, "Error, a fatal problem with the "
 			"multiplexer has occured. Closing.\n");
 		goto err;
@@ -401,8 +454,9 @@ err:
 		NAL_CONNECTION_free(conn);
 	NAL_LISTENER_free(listener);
 	clients_free(clients);
-	server_free(server);
-	multiplexer_free(multiplexer);
+	if(near)
+		nearcache_free(near);
+	servers_free(servers);
 	NAL_SELECTOR_free(sel);
 	return res;
 }
@@ -22,6 +22,9 @@
 #include "private.h"
 
 #define SERVER_BUFFER_SIZE	(sizeof(DC_MSG) * 8)
+/* Each failed reconnect doubles the time before the next one, up to this many
+ * times the configured retry period */
+#define SERVER_MAX_BACKOFF	16
 
 static unsigned long uid_seed = 1;
 
@@ -35,16 +38,36 @@ struct st_server_t {
 	NAL_ADDRESS *address;
 	/* A timestamp for when the server last disconnected */
 	struct timeval last_fail;
-	/* How many milliseconds should pass before a reconnect is attempted */
-	unsigned long retry_msecs;
+	/* How many milliseconds should pass before a reconnect is attempted,
+	 * as configured and after backing off from failed reconnects */
+	unsigned long retry_msecs, retry_cur;
+	/* Non-zero once the current connection has produced a response */
+	int proven;
 };
 
+struct st_servers_t {
+	/* The servers, and a multiplexer for each */
+	server_t **items;
+	multiplexer_t **muxes;
+	unsigned int num;
+	/* The consistent-hash ring routing sessions to live servers */
+	DC_RING *ring;
+};
+
+/* A connection that failed before the server ever answered on it counts as a
+ * failed reconnect, so a server that's down isn't hammered */
+static void server_backoff_util(server_t *s)
+{
+	if(s->retry_cur < s->retry_msecs * SERVER_MAX_BACKOFF)
+		s->retry_cur *= 2;
+}
+
 /* Returns non-zero if a new plug was created (used for select logic) */
 static int server_retry_util(server_t *s, const struct timeval *now)
 {
 	NAL_CONNECTION *conn;
 	if(s->plug) return 0;
-	if(!SYS_expirycheck(&s->last_fail, s->retry_msecs, now))
+	if(!SYS_expirycheck(&s->last_fail, s->retry_cur, now))
 		return 0;
 	/* OK, we try to reconnect */
 	conn = NAL_CONNECTION_new();
@@ -55,9 +78,11 @@ static int server_retry_util(server_t *s, const struct timeval *now)
 			((s->plug = DC_PLUG_new(conn,
 				DC_PLUG_FLAG_TO_SERVER)) == NULL)) {
 		NAL_CONNECTION_free(conn);
+		server_backoff_util(s);
 		return 0;
 	}
 	s->uid = uid_seed++;
+	s->proven = 0;
 	return 1;
 }
 
@@ -67,6 +92,8 @@ static void server_dead_util(server_t *s, multiplexer_t *m, clients_t *c,
 	DC_PLUG_free(s->plug);
 	s->plug = NULL;
 	SYS_timecpy(&s->last_fail, now);
+	if(!s->proven)
+		server_backoff_util(s);
 	multiplexer_mark_dead_server(m, s->uid, c);
 }
 
@@ -94,7 +121,8 @@ server_t *server_new(const char *address, unsigned long retry_msecs,
 		goto err;
 	s->plug = NULL;
 	s->address = a;
-	s->retry_msecs = retry_msecs;
+	s->retry_msecs = s->retry_cur = retry_msecs;
+	s->proven = 0;
 	/* Ensure the "last_fail" is set so that we'll attempt a connect on the
 	 * very first attempt */
 	SYS_timesub(&s->last_fail, now, retry_msecs + 1);
@@ -141,6 +169,9 @@ int server_to_clients(server_t *s, clients_t *c, multiplexer_t *m,
 	while(DC_PLUG_read(s->plug, 0, &uid, &cmd, &data, &len)) {
 		multiplexer_finish(m, c, uid, cmd, data, len);
 		DC_PLUG_consume(s->plug);
+		/* The server's answering, so it's no longer backed off */
+		s->proven = 1;
+		s->retry_cur = s->retry_msecs;
 	}
 	return 1;
 }
@@ -159,3 +190,222 @@ int server_place_request(server_t *s, unsigned long uid, DC_CMD cmd,
 	}
 	return 1;
 }
+
+int server_place_batch(server_t *s, unsigned long uid, unsigned long num,
+			const unsigned char *entries, unsigned int entries_len)
+{
+	unsigned char count[DC_BATCH_COUNT_SIZE], *ptr = count;
+	unsigned int check = DC_BATCH_COUNT_SIZE;
+	assert(server_is_active(s)); /* shouldn't call this function otherwise */
+	if(!NAL_encode_uint32(&ptr, &check, num) ||
+			!DC_PLUG_write(s->plug, 0, uid, DC_CMD_BATCH,
+				count, DC_BATCH_COUNT_SIZE))
+		return 0;
+	if(!DC_PLUG_commit_data(s->plug, entries, entries_len)) {
+		assert(NULL == "shouldn't happen!");
+		DC_PLUG_rollback(s->plug);
+		return 0;
+	}
+	return 1;
+}
+
+/**************************************/
+/* Functions operating on 'servers_t' */
+
+/* Finds the session ID in an operation's request data, returning zero if there
+ * isn't one. See dc_internal.h for the encodings. */
+static int servers_id_util(unsigned char op, const unsigned char *data,
+			unsigned int len, const unsigned char **id_data,
+			unsigned int *id_len)
+{
+	unsigned long tmp;
+	switch(op) {
+	case DC_OP_ADD:
+		/* Skip the timeout to get the ID length */
+		if(!NAL_decode_uint32(&data, &len, &tmp) ||
+				!NAL_decode_uint32(&data, &len, &tmp) ||
+				!tmp || (tmp >= len))
+			return 0;
+		len = tmp;
+		break;
+	case DC_OP_GET:
+	case DC_OP_REMOVE:
+	case DC_OP_HAVE:
+		if(!len)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+	*id_data = data;
+	*id_len = len;
+	return 1;
+}
+
+/* The server a session belongs to. Requests that don't carry a session ID
+ * will be refused by whichever server gets them, so they go anywhere. */
+static int servers_lookup_util(servers_t *ss, unsigned char op,
+			const unsigned char *data, unsigned int len)
+{
+	const unsigned char *id_data;
+	unsigned int id_len;
+	if(!servers_id_util(op, data, len, &id_data, &id_len)) {
+		id_data = data;
+		id_len = len;
+	}
+	return DC_RING_lookup(ss->ring, id_data, id_len);
+}
+
+servers_t *servers_new(const char *const *addresses, unsigned int num,
+			unsigned long retry_msecs, unsigned int max_inflight,
+			const struct timeval *now)
+{
+	unsigned int idx;
+	servers_t *ss = SYS_malloc(servers_t, 1);
+	if(!ss)
+		return NULL;
+	ss->num = num;
+	ss->items = SYS_malloc(server_t *, num);
+	ss->muxes = SYS_malloc(multiplexer_t *, num);
+	ss->ring = DC_RING_new(addresses, num, 0);
+	if(!ss->items || !ss->muxes || !ss->ring)
+		goto err;
+	SYS_zero_n(server_t *, ss->items, num);
+	SYS_zero_n(multiplexer_t *, ss->muxes, num);
+	for(idx = 0; idx < num; idx++) {
+		if(((ss->items[idx] = server_new(addresses[idx], retry_msecs,
+						now)) == NULL) ||
+				((ss->muxes[idx] = multiplexer_new(
+						max_inflight)) == NULL))
+			goto err;
+		/* Nothing's connected until the first selector hook */
+		DC_RING_set_live(ss->ring, idx, 0);
+	}
+	return ss;
+err:
+	servers_free(ss);
+	return NULL;
+}
+
+void servers_free(servers_t *ss)
+{
+	unsigned int idx;
+	for(idx = 0; idx < ss->num; idx++) {
+		if(ss->items && ss->items[idx])
+			server_free(ss->items[idx]);
+		if(ss->muxes && ss->muxes[idx])
+			multiplexer_free(ss->muxes[idx]);
+	}
+	if(ss->items)
+		SYS_free(server_t *, ss->items);
+	if(ss->muxes)
+		SYS_free(multiplexer_t *, ss->muxes);
+	if(ss->ring)
+		DC_RING_free(ss->ring);
+	SYS_free(servers_t, ss);
+}
+
+unsigned int servers_num(const servers_t *ss)
+{
+	return ss->num;
+}
+
+server_t *servers_get(servers_t *ss, unsigned int idx, multiplexer_t **m)
+{
+	assert(idx < ss->num);
+	*m = ss->muxes[idx];
+	return ss->items[idx];
+}
+
+int servers_selector_hook(servers_t *ss, NAL_SELECTOR *sel,
+			const struct timeval *now)
+{
+	unsigned int idx;
+	for(idx = 0; idx < ss->num; idx++) {
+		if(!server_selector_hook(ss->items[idx], sel, now))
+			return 0;
+		DC_RING_set_live(ss->ring, idx,
+				server_is_active(ss->items[idx]));
+	}
+	return 1;
+}
+
+int servers_io(servers_t *ss, clients_t *c, const struct timeval *now)
+{
+	unsigned int idx;
+	for(idx = 0; idx < ss->num; idx++) {
+		if(!server_io(ss->items[idx], ss->muxes[idx], c, now))
+			return 0;
+		/* A server that's dropped out of the ring has its sessions
+		 * spread over the next servers round it until it's back */
+		DC_RING_set_live(ss->ring, idx,
+				server_is_active(ss->items[idx]));
+	}
+	return 1;
+}
+
+void servers_mark_dead_client(servers_t *ss, unsigned int idx,
+			unsigned long m_uid, unsigned long client_uid)
+{
+	assert(idx < ss->num);
+	multiplexer_mark_dead_client(ss->muxes[idx], m_uid, client_uid);
+}
+
+int servers_route(servers_t *ss, DC_CMD cmd, const unsigned char *data,
+			unsigned int data_len, unsigned long *batch_num,
+			unsigned int *batch_len)
+{
+	const unsigned char *p = data, *id_data;
+	unsigned int p_len = data_len, id_len, fwd_len = 0;
+	unsigned long num, len;
+	unsigned char op;
+	int idx = -1;
+	*batch_num = 0;
+	switch(cmd) {
+	case DC_CMD_ADD:
+		return servers_lookup_util(ss, DC_OP_ADD, data, data_len);
+	case DC_CMD_GET:
+		return servers_lookup_util(ss, DC_OP_GET, data, data_len);
+	case DC_CMD_REMOVE:
+		return servers_lookup_util(ss, DC_OP_REMOVE, data, data_len);
+	case DC_CMD_HAVE:
+		return servers_lookup_util(ss, DC_OP_HAVE, data, data_len);
+	default:
+		break;
+	}
+	/* A batch goes to the server owning its first entry's session, and
+	 * carries only the entries after it that belong to the same server.
+	 * The response count then tells the client to send the rest again,
+	 * as it would if the server had run out of room for them. */
+	if(!NAL_decode_uint32(&p, &p_len, &num))
+		num = 0;
+	while(*batch_num < num) {
+		if(!NAL_decode_char(&p, &p_len, &op) ||
+				!NAL_decode_uint32(&p, &p_len, &len) ||
+				(len > p_len)) {
+			/* Garbled, so the server can refuse the lot */
+			*batch_num = num;
+			break;
+		}
+		if(idx < 0) {
+			if((idx = servers_lookup_util(ss, op, p, len)) < 0)
+				return -1;
+		} else if(servers_id_util(op, p, len, &id_data, &id_len) &&
+				(DC_RING_lookup(ss->ring, id_data,
+					id_len) != idx))
+			break;
+		p += len;
+		p_len -= len;
+		fwd_len = data_len - p_len;
+		(*batch_num)++;
+	}
+	if(idx < 0)
+		/* Empty or garbled from the start */
+		return servers_lookup_util(ss, DC_OP_BATCH, data, data_len);
+	if(*batch_num == num)
+		/* The whole batch goes as it is */
+		*batch_num = 0;
+	else
+		*batch_len = fwd_len - DC_BATCH_COUNT_SIZE;
+	return idx;
+}
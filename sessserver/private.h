@@ -0,0 +1,75 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef HEADER_PRIVATE_SESSSERVER_H
+#define HEADER_PRIVATE_SESSSERVER_H
+
+/* All this code is for building/linking an executable */
+#define SYS_GENERATING_EXE
+
+/* Save space in the C files... */
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include <distcache/dc_server.h>
+#include <distcache/dc_plug.h>
+#include <distcache/dc_internal.h>
+#include <libsys/post.h>
+
+/* The "-threads" mode needs POSIX threads and atomic compare-and-swap */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && \
+		defined(HAVE_SYNC_BUILTINS)
+#define SESSSERVER_THREADS
+#endif
+
+/* The "-processes" mode needs fork() and a cache that can be shared between
+ * processes (which libdistcacheserver decides at run-time) */
+#if !defined(WIN32) && defined(HAVE_FORK) && defined(HAVE_WAITPID)
+#define SESSSERVER_PROCESSES
+#endif
+
+/* The maximum number of worker threads "-threads" can ask for */
+#define WORKERS_MAX		64
+/* The maximum number of worker processes "-processes" can ask for */
+#define PROCESSES_MAX		64
+
+/* Predeclare "black-box" structures */
+typedef struct st_workers_t	workers_t;
+
+/* worker functions, used for "-threads". Each worker thread runs its own event
+ * loop and owns one shard of the cache, and the main thread passes accepted
+ * connections to them. workers_new() returns NULL if threads aren't supported
+ * by this build. The cache implementation must be set before calling it. */
+workers_t *workers_new(unsigned int num, unsigned int max_sessions,
+			unsigned long max_memory);
+void workers_free(workers_t *w);
+int workers_new_client(workers_t *w, NAL_CONNECTION *conn);
+int workers_clients_empty(workers_t *w);
+unsigned long workers_num_operations(workers_t *w);
+unsigned int workers_items_stored(workers_t *w, const struct timeval *now);
+int workers_get_stats(workers_t *w, DC_CACHE_STATS *stats);
+
+/* process functions, used for "-processes". processes_run() forks 'num' worker
+ * processes and returns 1 in each of them. The original process stays behind to
+ * restart any worker that is killed by a signal (eg. crashes), and returns 0
+ * once every worker has exited or -1 if it couldn't get started. If 'killable'
+ * is set and '*got_signal' becomes set, the workers are sent SIGUSR1. */
+int processes_run(unsigned int num, int killable, const int *got_signal);
+
+#endif /* !defined(HEADER_PRIVATE_SESSSERVER_H) */
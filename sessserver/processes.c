@@ -0,0 +1,119 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "private.h"
+
+#ifdef SESSSERVER_PROCESSES
+
+/* A worker that dies within this many milli-seconds of being started is only
+ * restarted after a pause, so that one that can't run doesn't turn us into a
+ * fork loop. */
+#define PROCESSES_RESTART_MSECS		1000
+
+typedef struct st_proc_t {
+	pid_t pid;
+	/* Set once the worker has exited of its own accord */
+	int finished;
+	struct timeval started;
+} proc_t;
+
+static void int_signal_all(proc_t *procs, unsigned int num, int signum)
+{
+	unsigned int idx;
+	for(idx = 0; idx < num; idx++)
+		if(procs[idx].pid)
+			kill(procs[idx].pid, signum);
+}
+
+int processes_run(unsigned int num, int killable, const int *got_signal)
+{
+	int status, stopping = 0;
+	unsigned int idx, live = 0;
+	struct timeval now;
+	pid_t pid;
+	proc_t *procs = SYS_malloc(proc_t, num);
+	if(!procs)
+		return -1;
+	SYS_zero_n(proc_t, procs, num);
+	for(;;) {
+		if(killable && *got_signal && !stopping) {
+			stopping = 1;
+			int_signal_all(procs, num, SIGUSR1);
+		}
+		SYS_gettime(&now);
+		for(idx = 0; !stopping && (idx < num); idx++) {
+			if(procs[idx].pid || procs[idx].finished)
+				continue;
+			if((pid = fork()) == 0) {
+				SYS_free(proc_t, procs);
+				return 1;
+			}
+			if(pid < 0) {
+				SYS_fprintf(SYS_stderr, "Error, couldn't fork a "
+						"worker process\n");
+				stopping = 1;
+				int_signal_all(procs, num,
+						killable ? SIGUSR1 : SIGTERM);
+				break;
+			}
+			procs[idx].pid = pid;
+			SYS_timecpy(&procs[idx].started, &now);
+			live++;
+		}
+		if(!live)
+			break;
+		if((pid = waitpid(-1, &status, 0)) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		for(idx = 0; (idx < num) && (procs[idx].pid != pid); idx++)
+			;
+		if(idx == num)
+			continue;
+		procs[idx].pid = 0;
+		live--;
+		if(stopping)
+			continue;
+		if(!WIFSIGNALED(status)) {
+			procs[idx].finished = 1;
+			continue;
+		}
+		SYS_fprintf(SYS_stderr, "Warning, worker process %lu was killed "
+			"by signal %d, restarting it\n", (unsigned long)pid,
+			WTERMSIG(status));
+		SYS_gettime(&now);
+		if(SYS_msecs_between(&procs[idx].started, &now) <
+				PROCESSES_RESTART_MSECS)
+			sleep(1);
+	}
+	SYS_free(proc_t, procs);
+	return 0;
+}
+
+#else /* !defined(SESSSERVER_PROCESSES) */
+
+int processes_run(unsigned int num, int killable, const int *got_signal)
+{
+	return -1;
+}
+
+#endif /* !defined(SESSSERVER_PROCESSES) */
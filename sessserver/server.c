@@ -19,18 +19,13 @@
  * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#define SYS_GENERATING_EXE
-
-#include <libsys/pre.h>
-#include <libnal/nal.h>
-#include <distcache/dc_server.h>
-#include <distcache/dc_plug.h>
-#include <distcache/dc_internal.h>
-#include <libsys/post.h>
+#include "private.h"
 
 static const char *def_server = NULL;
 static const unsigned int def_sessions = 512;
 static const unsigned long def_progress = 0;
+static const unsigned int def_threads = 1;
+static const unsigned int def_processes = 1;
 #ifndef WIN32
 static const char *def_pidfile = NULL;
 static const char *def_user = NULL;
@@ -49,7 +44,18 @@ static const char *usage_msg[] = {
 #endif
 "  -listen <addr>     (act as a server listening on address 'addr')",
 "  -sessions <num>    (make the cache hold a maximum of 'num' sessions)",
+"  -memory <size>     (bound the cache's storage to 'size' bytes, eg. 512M, 2G)",
+"  -evict <policy>    (choose sessions to evict when full, 'policy' is one of",
+"                      'expiry' (the default), 'lru', 'clock', or 'sieve')",
 "  -progress <num>    (report cache progress at least every 'num' operations)",
+"  -stats             (include cache storage statistics in progress reports)",
+#ifdef SESSSERVER_THREADS
+"  -threads <num>     (serve clients from 'num' threads, each with a share of",
+"                      the cache)",
+#endif
+#ifdef SESSSERVER_PROCESSES
+"  -processes <num>   (serve clients from 'num' processes sharing one cache)",
+#endif
 #ifndef WIN32
 "  -user <user>       (run daemon as given user)",
 "  -sockowner <user>  (controls ownership of unix domain listening socket)",
@@ -71,7 +77,9 @@ static const char *usage_msg[] = {
 
 /* Prototypes used by main() */
 static int do_server(const char *address, unsigned int max_sessions,
-			unsigned long progress, int daemon_mode,
+			unsigned long max_memory, DC_CACHE_EVICT evict,
+			unsigned int threads, unsigned int processes,
+			unsigned long progress, int stats, int daemon_mode,
 			const char *pidfile, int killable, const char *user,
 			const char *sockowner, const char *sockgroup,
 			const char *sockperms);
@@ -99,7 +107,16 @@ static const char *CMD_KILLABLE = "-killable";
 #endif
 static const char *CMD_SERVER = "-listen";
 static const char *CMD_SESSIONS = "-sessions";
+static const char *CMD_MEMORY = "-memory";
+static const char *CMD_EVICT = "-evict";
 static const char *CMD_PROGRESS = "-progress";
+static const char *CMD_STATS = "-stats";
+#ifdef SESSSERVER_THREADS
+static const char *CMD_THREADS = "-threads";
+#endif
+#ifdef SESSSERVER_PROCESSES
+static const char *CMD_PROCESSES = "-processes";
+#endif
 
 static int err_noarg(const char *arg)
 {
@@ -120,6 +137,65 @@ static int err_badswitch(const char *arg)
 	return 1;
 }
 
+/* Parses a size in bytes, with an optional K, M or G suffix */
+static int parse_memory(const char *str, unsigned long *val)
+{
+	char *end;
+	unsigned long unit = 1;
+	*val = strtoul(str, &end, 10);
+	if(end == str)
+		return 0;
+	switch(*end) {
+	case 'k': case 'K': unit = 1024; end++; break;
+	case 'm': case 'M': unit = 1024 * 1024; end++; break;
+	case 'g': case 'G': unit = 1024 * 1024 * 1024; end++; break;
+	default: break;
+	}
+	if(*end || !*val || (*val > ULONG_MAX / unit))
+		return 0;
+	*val *= unit;
+	return 1;
+}
+
+static int parse_evict(const char *str, DC_CACHE_EVICT *val)
+{
+	if(strcmp(str, "expiry") == 0)
+		*val = DC_CACHE_EVICT_EXPIRY;
+	else if(strcmp(str, "lru") == 0)
+		*val = DC_CACHE_EVICT_LRU;
+	else if(strcmp(str, "clock") == 0)
+		*val = DC_CACHE_EVICT_CLOCK;
+	else if(strcmp(str, "sieve") == 0)
+		*val = DC_CACHE_EVICT_SIEVE;
+	else
+		return 0;
+	return 1;
+}
+
+static void print_stats(DC_SERVER *server, workers_t *workers)
+{
+	unsigned int idx;
+	DC_CACHE_STATS st;
+	if(!(workers ? workers_get_stats(workers, &st) :
+			DC_SERVER_get_stats(server, &st)))
+		return;
+	SYS_fprintf(SYS_stderr, "Info, evictions = %lu, victim age (msecs) = "
+		"%lu  (average %lu)\n", st.evictions, st.victim_age_last,
+		st.victim_age_avg);
+	SYS_fprintf(SYS_stderr, "Info, slabs free = %u/%u (%u bytes each), "
+		"slabs moved = %lu (evicting %lu)\n", st.slabs_free,
+		st.slabs_total, st.slab_size, st.slab_moves,
+		st.slab_evictions);
+	for(idx = 0; idx < st.num_classes; idx++)
+		if(st.classes[idx].slabs)
+			SYS_fprintf(SYS_stderr, "Info,   class %2u (%5u bytes): "
+				"slabs = %5u, chunks used = %7u/%7u\n", idx,
+				st.classes[idx].chunk_size,
+				st.classes[idx].slabs,
+				st.classes[idx].chunks_used,
+				st.classes[idx].chunks_total);
+}
+
 /*****************/
 /* MAIN FUNCTION */
 /*****************/
@@ -138,8 +214,13 @@ int main(int argc, char *argv[])
 	int sessions_set = 0;
 	/* Overridables */
 	unsigned int sessions = 0;
+	unsigned long memory = 0;
+	DC_CACHE_EVICT evict = DC_CACHE_EVICT_EXPIRY;
 	const char *server = def_server;
 	unsigned long progress = def_progress;
+	unsigned int threads = def_threads;
+	unsigned int processes = def_processes;
+	int stats = 0;
 #ifndef WIN32
 	int daemon_mode = 0;
 	int killable = 0;
@@ -185,11 +266,35 @@ int main(int argc, char *argv[])
 			ARG_CHECK(CMD_SESSIONS);
 			sessions = (unsigned int)atoi(*argv);
 			sessions_set = 1;
+		} else if(strcmp(*argv, CMD_MEMORY) == 0) {
+			ARG_CHECK(CMD_MEMORY);
+			if(!parse_memory(*argv, &memory))
+				return err_badrange(CMD_MEMORY);
+		} else if(strcmp(*argv, CMD_EVICT) == 0) {
+			ARG_CHECK(CMD_EVICT);
+			if(!parse_evict(*argv, &evict))
+				return err_badrange(CMD_EVICT);
 		} else if(strcmp(*argv, CMD_PROGRESS) == 0) {
 			ARG_CHECK(CMD_PROGRESS);
 			progress = (unsigned long)atoi(*argv);
 			if(progress > MAX_PROGRESS)
 				return err_badrange(CMD_PROGRESS);
+		} else if(strcmp(*argv, CMD_STATS) == 0) {
+			stats = 1;
+#ifdef SESSSERVER_THREADS
+		} else if(strcmp(*argv, CMD_THREADS) == 0) {
+			ARG_CHECK(CMD_THREADS);
+			threads = (unsigned int)atoi(*argv);
+			if((threads < 1) || (threads > WORKERS_MAX))
+				return err_badrange(CMD_THREADS);
+#endif
+#ifdef SESSSERVER_PROCESSES
+		} else if(strcmp(*argv, CMD_PROCESSES) == 0) {
+			ARG_CHECK(CMD_PROCESSES);
+			processes = (unsigned int)atoi(*argv);
+			if((processes < 1) || (processes > PROCESSES_MAX))
+				return err_badrange(CMD_PROCESSES);
+#endif
 		} else
 			return err_badswitch(*argv);
 		ARG_INC;
@@ -201,9 +306,15 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	if(!sessions_set)
-		sessions = def_sessions;
-	if((sessions < 1) || (sessions > MAX_SESSIONS))
+		/* With only a memory budget, the cache sizes itself */
+		sessions = (memory ? 0 : def_sessions);
+	else if((sessions < 1) || (sessions > MAX_SESSIONS))
 		return err_badrange(CMD_SESSIONS);
+	if((threads > 1) && (processes > 1)) {
+		SYS_fprintf(SYS_stderr, "Error, -threads and -processes can't "
+				"be used together\n");
+		return 1;
+	}
 	if(!SYS_sigpipe_ignore()) {
 #if SYS_DEBUG_LEVEL > 0
 		SYS_fprintf(SYS_stderr, "Error, couldn't ignore SIGPIPE\n");
@@ -216,12 +327,15 @@ int main(int argc, char *argv[])
 #endif
 		return 1;
 	}
-	return do_server(server, sessions, progress, daemon_mode, pidfile,
-			killable, user, sockowner, sockgroup, sockperms);
+	return do_server(server, sessions, memory, evict, threads, processes,
+			progress, stats, daemon_mode, pidfile, killable, user, sockowner,
+			sockgroup, sockperms);
 }
 
 static int do_server(const char *address, unsigned int max_sessions,
-			unsigned long progress, int daemon_mode,
+			unsigned long max_memory, DC_CACHE_EVICT evict,
+			unsigned int threads, unsigned int processes,
+			unsigned long progress, int stats, int daemon_mode,
 			const char *pidfile, int killable, const char *user,
 			const char *sockowner, const char *sockgroup,
 			const char *sockperms)
@@ -234,14 +348,47 @@ static int do_server(const char *address, unsigned int max_sessions,
 	NAL_ADDRESS *addr = NAL_ADDRESS_new();
 	NAL_SELECTOR *sel = NAL_SELECTOR_new();
 	NAL_LISTENER *listener = NAL_LISTENER_new();
+	/* With "-processes", a worker's own listener on the same address, if
+	 * the kernel can spread connections between listeners */
+	NAL_LISTENER *own_listener = NULL;
+	NAL_LISTENER *l;
 	DC_SERVER *server = NULL;
+	/* With "-threads", the workers serve the clients instead of 'server' */
+	workers_t *workers = NULL;
+#ifdef SESSSERVER_PROCESSES
+	/* With "-processes", worker processes note their supervisor's pid */
+	pid_t supervisor = 0;
+#endif
 
-	if(!DC_SERVER_set_default_cache() ||
-			((server = DC_SERVER_new(max_sessions)) == NULL) ||
-			!conn || !addr || !sel || !listener) {
+	if(!conn || !addr || !sel || !listener) {
 		SYS_fprintf(SYS_stderr, "Error, malloc/initialisation failure\n");
 		goto err;
 	}
+	if(processes > 1) {
+		/* A few stripes per process keeps lock contention down */
+		if(!DC_SERVER_set_shared_cache(evict, processes * 4)) {
+			SYS_fprintf(SYS_stderr, "Error, this platform can't "
+				"share a cache between processes\n");
+			goto err;
+		}
+		if(!NAL_config_set_reuseport(1))
+			SYS_fprintf(SYS_stderr, "Warning, SO_REUSEPORT isn't "
+				"supported, the processes will share one "
+				"listener\n");
+	} else if(!DC_SERVER_set_default_cache_ex(evict)) {
+		SYS_fprintf(SYS_stderr, "Error, malloc/initialisation failure\n");
+		goto err;
+	}
+	if((threads == 1) && ((server = DC_SERVER_new_ex(max_sessions,
+					max_memory)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't create a cache of the "
+				"requested size\n");
+		if(max_memory)
+			SYS_fprintf(SYS_stderr, "(-memory must leave room for "
+				"the sessions' bookkeeping and a few MB of "
+				"session data)\n");
+		goto err;
+	}
 	if(!NAL_ADDRESS_create(addr, address, SERVER_BUFFER_SIZE) ||
 			!NAL_ADDRESS_can_listen(addr) ||
 			!NAL_LISTENER_create(listener, addr)) {
@@ -286,6 +433,46 @@ static int do_server(const char *address, unsigned int max_sessions,
 			return 1;
 		}
 	}
+#endif
+	/* The worker threads start after any daemon fork, so that they're in
+	 * the right process. */
+	if((threads > 1) && ((workers = workers_new(threads, max_sessions,
+					max_memory)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't start %u threads with "
+				"a cache of the requested size\n", threads);
+		if(max_memory)
+			SYS_fprintf(SYS_stderr, "(-memory must leave each "
+				"thread's share room for its sessions' "
+				"bookkeeping and a few MB of session data)\n");
+		goto err;
+	}
+#ifdef SESSSERVER_PROCESSES
+	if(processes > 1) {
+		/* The supervisor stays in processes_run() until its workers
+		 * have finished, only the workers carry on from here. */
+		res = processes_run(processes, killable, &got_signal);
+		if(res <= 0) {
+			if(res < 0)
+				SYS_fprintf(SYS_stderr, "Error, couldn't start "
+					"the worker processes\n");
+			else
+				ret = 0;
+			goto err;
+		}
+		supervisor = getppid();
+		/* Each worker still accepts on the listener it inherited (so
+		 * no connection waiting there is lost), but takes its own
+		 * share of the address as well where the kernel allows. */
+		if(NAL_ADDRESS_can_reuseport(addr) &&
+				(((own_listener = NAL_LISTENER_new()) == NULL) ||
+				!NAL_LISTENER_create(own_listener, addr) ||
+				!NAL_LISTENER_add_to_selector(own_listener,
+								sel))) {
+			SYS_fprintf(SYS_stderr, "Error, can't listen on '%s'\n",
+					address);
+			goto err;
+		}
+	}
 #endif
 	/* Add the listener to the selector */
 	if(!NAL_LISTENER_add_to_selector(listener, sel)) {
@@ -296,7 +483,8 @@ static int do_server(const char *address, unsigned int max_sessions,
 	SYS_gettime(&last_now);
 network_loop:
 	if(NAL_LISTENER_finished(listener)) {
-		if(DC_SERVER_clients_empty(server)) {
+		if(workers ? workers_clients_empty(workers) :
+				DC_SERVER_clients_empty(server)) {
 			/* Clean shutdown */
 			ret = 0;
 			goto err;
@@ -334,18 +522,27 @@ network_loop:
 	/* This entire state-machine logic will operate with one single idea of
 	 * "the time". */
 	SYS_gettime(&now);
-	tmp_ops = DC_SERVER_num_operations(server);
+	tmp_ops = (workers ? workers_num_operations(workers) :
+			DC_SERVER_num_operations(server));
 	if(SYS_msecs_between(&last_now, &now) < 1000) {
 		/* We try to observe a 1-second noise limit and only violate it
 		 * if a "-progress" counter was specified that we've tripped. */
 		if(!progress || ((tmp_ops / progress) == (ops / progress)))
 			goto skip_totals;
 	}
+#ifdef SESSSERVER_PROCESSES
+	/* A worker process shuts down if its supervisor has gone away */
+	if(supervisor && (getppid() != supervisor)) {
+		ret = 0;
+		goto err;
+	}
+#endif
 	/* It's at least a second since the last update - so now we check (a) if
 	 * the numer of stored sessions has changed, and (b) if the number of
 	 * cache operations (divided by 'progress') has increased. If neither,
 	 * we don't create any noise. */
-	tmp_total = DC_SERVER_items_stored(server, &now);
+	tmp_total = (workers ? workers_items_stored(workers, &now) :
+			DC_SERVER_items_stored(server, &now));
 	if((tmp_total == total) && (!progress ||
 			((tmp_ops / progress) == (ops / progress)))) {
 		if(res <= 0)
@@ -363,34 +560,43 @@ network_loop:
 		tmp_total, (tmp_total > total ? '+' :
 			(tmp_total == total ? '=' : '-')),
 		(tmp_total > total ? tmp_total - total : total - tmp_total));
+	if(stats)
+		print_stats(server, workers);
 	SYS_timecpy(&last_now, &now);
 	total = tmp_total;
 	ops = tmp_ops;
 skip_totals:
 	/* Do I/O first, in case clients are dropped making room for accepts
 	 * that would otherwise fail. */
-	if(!DC_SERVER_clients_io(server, &now)) {
+	if(server && !DC_SERVER_clients_io(server, &now)) {
 		SYS_fprintf(SYS_stderr, "Error, I/O failed\n");
 		goto err;
 	}
-	/* Now handle new connections */
-	while(!NAL_LISTENER_finished(listener) &&
-			NAL_CONNECTION_accept(conn, listener)) {
-		/* New client! */
-		if(!NAL_CONNECTION_add_to_selector(conn, sel) ||
-				!DC_SERVER_new_client(server, conn,
-					DC_CLIENT_FLAG_IN_SERVER)) {
-			SYS_fprintf(SYS_stderr, "Error, accept couldn't be handled\n");
-			goto err;
+	/* Now handle new connections (on our own listener too, if any) */
+	for(l = listener; l; l = (l == listener ? own_listener : NULL)) {
+		while(!NAL_LISTENER_finished(l) &&
+				NAL_CONNECTION_accept(conn, l)) {
+			/* New client! (The workers take turns at these) */
+			if(workers ? !workers_new_client(workers, conn) :
+					(!NAL_CONNECTION_add_to_selector(conn, sel) ||
+					!DC_SERVER_new_client(server, conn,
+						DC_CLIENT_FLAG_IN_SERVER))) {
+				SYS_fprintf(SYS_stderr, "Error, accept couldn't be "
+						"handled\n");
+				goto err;
+			}
+			/* 'conn' is consumed, create a new one */
+			if((conn = NAL_CONNECTION_new()) == NULL) goto err;
 		}
-		/* 'conn' is consumed, create a new one */
-		if((conn = NAL_CONNECTION_new()) == NULL) goto err;
 	}
 	goto network_loop;
 err:
 	if(addr) NAL_ADDRESS_free(addr);
 	if(conn) NAL_CONNECTION_free(conn);
 	if(listener) NAL_LISTENER_free(listener);
+	if(own_listener) NAL_LISTENER_free(own_listener);
+	if(workers)
+		workers_free(workers);
 	if(server)
 		DC_SERVER_free(server);
 	if(sel) NAL_SELECTOR_free(sel);
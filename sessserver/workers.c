@@ -0,0 +1,560 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "private.h"
+
+#ifdef SESSSERVER_THREADS
+
+typedef struct st_worker_t	worker_t;
+typedef struct st_job_t		job_t;
+
+/* Reads and writes of values shared between threads. The __sync builtins
+ * used here are all full barriers. */
+#define ATOMIC_GET(p)		__sync_fetch_and_add((p), 0)
+#define ATOMIC_GET_PTR(p)	__sync_val_compare_and_swap((p), NULL, NULL)
+#define ATOMIC_SET(p,v)		do { } while(!__sync_bool_compare_and_swap((p), \
+					ATOMIC_GET(p), (v)))
+
+/* The most request data an operation can be forwarded with. Anything larger
+ * isn't a valid request, and is answered (as an error) by the worker that
+ * received it. */
+#define JOB_MAX_DATA		(8 + DC_MAX_ID_LEN + DC_MAX_DATA_LEN)
+/* The most finished jobs a worker keeps to forward operations with */
+#define WORKER_SPARE_JOBS	32
+/* How often (in milli-seconds) a worker publishes its session count and cache
+ * statistics for the main thread */
+#define WORKER_REPORT_MSECS	250
+
+/* A piece of work run by a worker thread on behalf of another thread. Nobody
+ * waits for a job to run, it carries everything it needs and its 'fn' passes
+ * it on, keeps it for reuse or frees it. */
+struct st_job_t {
+	job_t *next;
+	void (*fn)(worker_t *w, job_t *job);
+	/* For job_client(), the connection to take on */
+	NAL_CONNECTION *conn;
+	/* For job_op() and job_done(), the worker and client that forwarded an
+	 * operation, the operation itself and then its result */
+	worker_t *from;
+	DC_CLIENT *clnt;
+	int op;
+	unsigned int data_len, room;
+	int result;
+	unsigned char data[JOB_MAX_DATA];
+	unsigned char res[DC_MAX_DATA_LEN];
+};
+
+struct st_worker_t {
+	workers_t *parent;
+	pthread_t thread;
+	int started;
+	NAL_SELECTOR *sel;
+	/* The server handling this worker's clients, whose cache is this
+	 * worker's shard. Operations on sessions in other workers' shards are
+	 * forwarded to their owners (see int_forward()), and the client is
+	 * answered when the result comes back. */
+	DC_SERVER *server;
+	/* The time of the current pass of the worker's loop */
+	struct timeval now;
+	/* Jobs posted by other threads. This is a lock-free stack that any
+	 * thread can push to, and that only this thread empties (all at once). */
+	job_t *inbox;
+	/* Posting a job writes a byte to 'wake_fd' to break this thread out of
+	 * NAL_SELECTOR_select(), 'wake_conn' is the other end of the pipe. While
+	 * 'wake_pending' is set, a byte is already on its way. */
+	int wake_fd;
+	NAL_CONNECTION *wake_conn;
+	int wake_pending;
+	/* Finished jobs kept for forwarding more operations */
+	job_t *spare;
+	unsigned int num_spare;
+	/* What the worker publishes for the main thread, see int_report().
+	 * 'adopted' counts the connections it has taken on, and 'busy' is set
+	 * while it has clients. The session count and statistics are updated
+	 * every WORKER_REPORT_MSECS, under 'lock'. */
+	unsigned int adopted;
+	int busy;
+	unsigned long ops;
+	struct timeval reported;
+	pthread_mutex_t lock;
+	int lock_ok;
+	unsigned int items;
+	int stats_ok;
+	DC_CACHE_STATS stats;
+};
+
+struct st_workers_t {
+	worker_t *items;
+	unsigned int num;
+	/* The worker the next accepted connection goes to */
+	unsigned int next;
+	/* The number of connections handed to the workers */
+	unsigned int handed;
+	/* Set to stop the workers */
+	int quit;
+};
+
+/****************************/
+/* Posting and running jobs */
+/****************************/
+
+static void int_wake(worker_t *w)
+{
+	/* Only the thread that sets 'wake_pending' writes to the pipe */
+	if(!__sync_lock_test_and_set(&w->wake_pending, 1))
+		while((write(w->wake_fd, "", 1) < 0) && (errno == EINTR))
+			;
+}
+
+static void int_post(worker_t *w, job_t *job)
+{
+	job_t *head;
+	do {
+		head = ATOMIC_GET_PTR(&w->inbox);
+		job->next = head;
+	} while(!__sync_bool_compare_and_swap(&w->inbox, head, job));
+	int_wake(w);
+}
+
+static void int_run_inbox(worker_t *w)
+{
+	job_t *list, *job, *fifo = NULL;
+	do {
+		list = ATOMIC_GET_PTR(&w->inbox);
+	} while(list && !__sync_bool_compare_and_swap(&w->inbox, list, NULL));
+	/* The stack is newest-first, run the jobs in the order they came */
+	while(list) {
+		job = list;
+		list = job->next;
+		job->next = fifo;
+		fifo = job;
+	}
+	while(fifo) {
+		job = fifo;
+		fifo = job->next;
+		job->fn(w, job);
+	}
+}
+
+static job_t *int_job_new(worker_t *w)
+{
+	job_t *job = w->spare;
+	if(!job)
+		return SYS_malloc(job_t, 1);
+	w->spare = job->next;
+	w->num_spare--;
+	return job;
+}
+
+static void int_job_free(worker_t *w, job_t *job)
+{
+	if(w->num_spare >= WORKER_SPARE_JOBS) {
+		SYS_free(job_t, job);
+		return;
+	}
+	job->next = w->spare;
+	w->spare = job;
+	w->num_spare++;
+}
+
+/* The result of an operation this worker forwarded. If the client has failed,
+ * DC_SERVER_clients_io() cleans it up. */
+static void job_done(worker_t *w, job_t *job)
+{
+	DC_SERVER_forwarded(job->clnt, &w->now, job->res, job->result);
+	int_job_free(w, job);
+}
+
+/* An operation forwarded by another worker, the job goes back with the result */
+static void job_op(worker_t *w, job_t *job)
+{
+	job->result = DC_SERVER_do_op(w->server, &w->now, job->op,
+			job->data, job->data_len, job->res, job->room);
+	job->fn = job_done;
+	int_post(job->from, job);
+}
+
+static void job_client(worker_t *w, job_t *job)
+{
+	/* We're busy before the connection counts as ours, so that
+	 * workers_clients_empty() can't see it counted and us idle. */
+	ATOMIC_SET(&w->busy, 1);
+	if(!NAL_CONNECTION_add_to_selector(job->conn, w->sel) ||
+			!DC_SERVER_new_client(w->server, job->conn,
+				DC_CLIENT_FLAG_IN_SERVER)) {
+		SYS_fprintf(SYS_stderr, "Error, accept couldn't be handled\n");
+		NAL_CONNECTION_free(job->conn);
+	}
+	__sync_fetch_and_add(&w->adopted, 1);
+	SYS_free(job_t, job);
+}
+
+/***********************************/
+/* Forwarding operations to owners */
+/***********************************/
+
+/* Chooses the worker that owns a session. This is deliberately a different
+ * hash to the one the builtin cache indexes sessions with, so that each shard's
+ * sessions still spread across all of its hash buckets. */
+static worker_t *int_owner(workers_t *ws, const unsigned char *id,
+			unsigned int id_len)
+{
+	unsigned long h = 5381;
+	while(id_len--)
+		h = (h * 33) ^ *(id++);
+	h ^= h >> 15;
+	h *= 0x2c1b3c6dUL;
+	h ^= h >> 12;
+	return ws->items + (h % ws->num);
+}
+
+/* The forwarding callback of each worker's server. Operations on sessions that
+ * another worker owns are posted to it, and anything else (including requests
+ * too broken to have a session id) is left to our own shard. */
+static int int_forward(void *fwd_arg, DC_CLIENT *clnt, int op,
+			const unsigned char *data, unsigned int data_len,
+			unsigned int room)
+{
+	job_t *job;
+	worker_t *owner, *w = fwd_arg;
+	const unsigned char *id = data;
+	unsigned int id_len = data_len;
+	unsigned long msecs, len;
+	if(op == DC_OP_ADD) {
+		/* The session id follows the timeout and id length */
+		if(!NAL_decode_uint32(&id, &id_len, &msecs) ||
+				!NAL_decode_uint32(&id, &id_len, &len) ||
+				(len >= id_len))
+			return 0;
+		id_len = (unsigned int)len;
+	}
+	if(!id_len || (id_len > DC_MAX_ID_LEN) || (data_len > JOB_MAX_DATA))
+		return 0;
+	if((owner = int_owner(w->parent, id, id_len)) == w)
+		return 0;
+	if((job = int_job_new(w)) == NULL)
+		return -1;
+	job->fn = job_op;
+	job->from = w;
+	job->clnt = clnt;
+	job->op = op;
+	SYS_memcpy_n(unsigned char, job->data, data, data_len);
+	job->data_len = data_len;
+	job->room = (room < DC_MAX_DATA_LEN ? room : DC_MAX_DATA_LEN);
+	int_post(owner, job);
+	return 1;
+}
+
+/**********************/
+/* The worker threads */
+/**********************/
+
+/* Publishes what the main thread asks about, see workers_clients_empty() and
+ * the functions after it. */
+static void int_report(worker_t *w, int force)
+{
+	ATOMIC_SET(&w->ops, DC_SERVER_num_operations(w->server));
+	ATOMIC_SET(&w->busy, !DC_SERVER_clients_empty(w->server));
+	if(!force && (SYS_msecs_between(&w->reported, &w->now) <
+				WORKER_REPORT_MSECS))
+		return;
+	SYS_timecpy(&w->reported, &w->now);
+	pthread_mutex_lock(&w->lock);
+	w->items = DC_SERVER_items_stored(w->server, &w->now);
+	w->stats_ok = DC_SERVER_get_stats(w->server, &w->stats);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *int_worker_main(void *arg)
+{
+	worker_t *w = arg;
+	workers_t *ws = w->parent;
+	NAL_BUFFER *wake_buf = NAL_CONNECTION_get_read(w->wake_conn);
+	while(!ATOMIC_GET(&ws->quit)) {
+		NAL_SELECTOR_select(w->sel, 500000, 1);
+		/* Drain the pipe, then clear 'wake_pending', then look at the
+		 * inbox. A job posted before 'wake_pending' is cleared is in
+		 * the inbox when we look, and one posted after writes a byte
+		 * that's still in the pipe when we next select. Clearing it
+		 * before the drain would let the drain eat the byte of a post
+		 * that set it again, leaving it set with nothing to wake us. */
+		NAL_CONNECTION_io(w->wake_conn);
+		NAL_BUFFER_read(wake_buf, NULL, NAL_BUFFER_used(wake_buf));
+		ATOMIC_SET(&w->wake_pending, 0);
+		SYS_gettime(&w->now);
+		int_run_inbox(w);
+		DC_SERVER_clients_io(w->server, &w->now);
+		int_report(w, 0);
+	}
+	/* Anything posted to us from here on is cleaned up by workers_free() */
+	return NULL;
+}
+
+static int int_worker_init(workers_t *ws, worker_t *w,
+			unsigned int max_sessions, unsigned long max_memory)
+{
+	int fds[2];
+	char wake_addr[32];
+	NAL_ADDRESS *addr;
+	w->parent = ws;
+	if(pthread_mutex_init(&w->lock, NULL) != 0)
+		return 0;
+	w->lock_ok = 1;
+	if(((w->sel = NAL_SELECTOR_new()) == NULL) ||
+			((w->wake_conn = NAL_CONNECTION_new()) == NULL) ||
+			((addr = NAL_ADDRESS_new()) == NULL))
+		return 0;
+	if(pipe(fds) != 0) {
+		NAL_ADDRESS_free(addr);
+		return 0;
+	}
+	w->wake_fd = fds[1];
+	sprintf(wake_addr, "FD:%d:-1", fds[0]);
+	if(!NAL_ADDRESS_create(addr, wake_addr, 64) ||
+			!NAL_CONNECTION_create(w->wake_conn, addr)) {
+		close(fds[0]);
+		NAL_ADDRESS_free(addr);
+		return 0;
+	}
+	NAL_ADDRESS_free(addr);
+	if(!NAL_CONNECTION_add_to_selector(w->wake_conn, w->sel) ||
+			((w->server = DC_SERVER_new_ex(max_sessions,
+					max_memory)) == NULL))
+		return 0;
+	DC_SERVER_set_forward(w->server, int_forward, w);
+	SYS_gettime(&w->now);
+	int_report(w, 1);
+	return 1;
+}
+
+static void int_worker_finish(worker_t *w)
+{
+	job_t *job;
+	/* Jobs posted after the worker stopped are never run */
+	while((job = w->inbox) != NULL) {
+		w->inbox = job->next;
+		if(job->fn == job_client)
+			NAL_CONNECTION_free(job->conn);
+		SYS_free(job_t, job);
+	}
+	while((job = w->spare) != NULL) {
+		w->spare = job->next;
+		SYS_free(job_t, job);
+	}
+	if(w->server)
+		DC_SERVER_free(w->server);
+	if(w->wake_conn)
+		NAL_CONNECTION_free(w->wake_conn);
+	if(w->wake_fd != -1)
+		close(w->wake_fd);
+	if(w->sel)
+		NAL_SELECTOR_free(w->sel);
+	if(w->lock_ok)
+		pthread_mutex_destroy(&w->lock);
+}
+
+/******************************/
+/* API functions for server.c */
+/******************************/
+
+workers_t *workers_new(unsigned int num, unsigned int max_sessions,
+			unsigned long max_memory)
+{
+	unsigned int idx;
+	sigset_t sigs, oldsigs;
+	workers_t *ws;
+	if(!num || (num > WORKERS_MAX) || !DC_SERVER_get_cache())
+		return NULL;
+	if((ws = SYS_malloc(workers_t, 1)) == NULL)
+		return NULL;
+	if((ws->items = SYS_malloc(worker_t, num)) == NULL) {
+		SYS_free(workers_t, ws);
+		return NULL;
+	}
+	SYS_zero_n(worker_t, ws->items, num);
+	for(idx = 0; idx < num; idx++)
+		ws->items[idx].wake_fd = -1;
+	ws->num = num;
+	ws->next = 0;
+	ws->handed = 0;
+	ws->quit = 0;
+	/* Each shard gets an equal share of the cache */
+	if(max_sessions) {
+		max_sessions /= num;
+		if(max_sessions < DC_CACHE_MIN_SIZE)
+			max_sessions = DC_CACHE_MIN_SIZE;
+	}
+	max_memory /= num;
+	for(idx = 0; idx < num; idx++)
+		if(!int_worker_init(ws, ws->items + idx, max_sessions,
+					max_memory))
+			goto err;
+	/* SIGUSR1 and SIGUSR2 are left for the main thread to handle, the new
+	 * threads inherit this mask. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	for(idx = 0; idx < num; idx++) {
+		worker_t *w = ws->items + idx;
+		if(pthread_create(&w->thread, NULL, int_worker_main, w) != 0)
+			break;
+		w->started = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	if(idx < num)
+		goto err;
+	return ws;
+err:
+	workers_free(ws);
+	return NULL;
+}
+
+void workers_free(workers_t *ws)
+{
+	unsigned int idx;
+	ATOMIC_SET(&ws->quit, 1);
+	for(idx = 0; idx < ws->num; idx++)
+		if(ws->items[idx].started)
+			int_wake(ws->items + idx);
+	for(idx = 0; idx < ws->num; idx++)
+		if(ws->items[idx].started)
+			pthread_join(ws->items[idx].thread, NULL);
+	for(idx = 0; idx < ws->num; idx++)
+		int_worker_finish(ws->items + idx);
+	SYS_free(worker_t, ws->items);
+	SYS_free(workers_t, ws);
+}
+
+int workers_new_client(workers_t *ws, NAL_CONNECTION *conn)
+{
+	job_t *job = SYS_malloc(job_t, 1);
+	if(!job)
+		return 0;
+	job->fn = job_client;
+	job->conn = conn;
+	int_post(ws->items + ws->next, job);
+	ws->next = (ws->next + 1) % ws->num;
+	ws->handed++;
+	return 1;
+}
+
+/* Once every connection handed out has been taken on, a worker's 'busy' flag
+ * says whether it still has any of them (see job_client()). */
+int workers_clients_empty(workers_t *ws)
+{
+	unsigned int idx, adopted = 0;
+	for(idx = 0; idx < ws->num; idx++)
+		adopted += ATOMIC_GET(&ws->items[idx].adopted);
+	if(adopted != ws->handed)
+		return 0;
+	for(idx = 0; idx < ws->num; idx++)
+		if(ATOMIC_GET(&ws->items[idx].busy))
+			return 0;
+	return 1;
+}
+
+unsigned long workers_num_operations(workers_t *ws)
+{
+	unsigned int idx;
+	unsigned long ops = 0;
+	for(idx = 0; idx < ws->num; idx++)
+		ops += ATOMIC_GET(&ws->items[idx].ops);
+	return ops;
+}
+
+/* The total as of each worker's last report, 'now' isn't needed */
+unsigned int workers_items_stored(workers_t *ws, const struct timeval *now)
+{
+	worker_t *w;
+	unsigned int idx, total = 0;
+	for(idx = 0; idx < ws->num; idx++) {
+		w = ws->items + idx;
+		pthread_mutex_lock(&w->lock);
+		total += w->items;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return total;
+}
+
+/* Adds up the shards' statistics (as of each worker's last report). The
+ * average victim age is weighted by each shard's evictions, and the most recent
+ * victim is taken to be the oldest of the shards' most recent victims. */
+int workers_get_stats(workers_t *ws, DC_CACHE_STATS *stats)
+{
+	int ok;
+	worker_t *w;
+	DC_CACHE_STATS st;
+	unsigned int idx, cls;
+	double age_total = 0;
+	for(idx = 0; idx < ws->num; idx++) {
+		w = ws->items + idx;
+		pthread_mutex_lock(&w->lock);
+		if((ok = w->stats_ok) != 0)
+			SYS_memcpy(DC_CACHE_STATS, (idx ? &st : stats),
+					&w->stats);
+		pthread_mutex_unlock(&w->lock);
+		if(!ok)
+			return 0;
+		if(!idx) {
+			age_total = (double)stats->victim_age_avg *
+					stats->evictions;
+			continue;
+		}
+		for(cls = 0; cls < st.num_classes; cls++) {
+			stats->classes[cls].slabs += st.classes[cls].slabs;
+			stats->classes[cls].chunks_used +=
+					st.classes[cls].chunks_used;
+			stats->classes[cls].chunks_total +=
+					st.classes[cls].chunks_total;
+		}
+		stats->slabs_total += st.slabs_total;
+		stats->slabs_free += st.slabs_free;
+		stats->evictions += st.evictions;
+		stats->slab_moves += st.slab_moves;
+		stats->slab_evictions += st.slab_evictions;
+		age_total += (double)st.victim_age_avg * st.evictions;
+		if(st.victim_age_last > stats->victim_age_last)
+			stats->victim_age_last = st.victim_age_last;
+	}
+	stats->victim_age_avg = (stats->evictions ?
+		(unsigned long)(age_total / stats->evictions) : 0);
+	return 1;
+}
+
+#else /* !defined(SESSSERVER_THREADS) */
+
+workers_t *workers_new(unsigned int num, unsigned int max_sessions,
+			unsigned long max_memory)
+{
+	return NULL;
+}
+void workers_free(workers_t *w) { }
+int workers_new_client(workers_t *w, NAL_CONNECTION *conn) { return 0; }
+int workers_clients_empty(workers_t *w) { return 1; }
+unsigned long workers_num_operations(workers_t *w) { return 0; }
+unsigned int workers_items_stored(workers_t *w, const struct timeval *now)
+{
+	return 0;
+}
+int workers_get_stats(workers_t *w, DC_CACHE_STATS *stats) { return 0; }
+
+#endif /* !defined(SESSSERVER_THREADS) */
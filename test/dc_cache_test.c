@@ -0,0 +1,615 @@
+/* distcache, Distributed Session Caching technology
+ * Copyright (C) 2000-2003  Geoff Thorpe, and Cryptographic Appliances, Inc.
+ * Copyright (C) 2004       The Distcache.org project
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; using version 2.1 of the License. The copyright holders
+ * may elect to allow the application of later versions of the License to this
+ * software, please contact the author (geoff@distcache.org) if you wish us to
+ * review any later version released by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define SYS_GENERATING_EXE
+
+#include <libsys/pre.h>
+#include <libnal/nal.h>
+#include <distcache/dc_server.h>
+#include <libsys/post.h>
+
+/* Avoid the dreaded "greater than the length `509' ISO C89 compilers are
+ * required to support" warning by splitting this into an array of strings. */
+static const char *usage_msg[] = {
+"",
+"Usage: dc_cache_test [options]     where 'options' are from;",
+"  -<h|help|?>      (display this usage message)",
+"",
+"Checks which sessions the default cache implementation evicts under each of",
+"its eviction policies (including when sessions of different sizes compete for",
+"its storage), how many it evicts when its storage is full, and that a shared",
+"cache recovers from a process dying while it has part of the cache locked.",
+"", NULL};
+
+/* The size of the cache under test */
+#define NUM_SESSIONS		DC_CACHE_MIN_SIZE
+
+/* The sessions first put in the cache are numbered from zero and time out
+ * sooner the later they're added, so the expiry policy evicts the newest
+ * first. The sessions added after that to make the cache evict are numbered
+ * from NUM_SESSIONS and outlive them all. */
+#define TIMEOUT_FIRST(n)	(unsigned long)(60000 - 10 * (n))
+#define TIMEOUT_LATER		(unsigned long)120000
+/* Sessions that time out in no particular order, so the ones the expiry
+ * policy evicts are spread across the slabs */
+#define TIMEOUT_MIXED(n)	(unsigned long)(60000 + ((n) * 7919) % 60000)
+
+/* After filling the cache, sessions 0, 1 and 0 again are looked up. Then
+ * 'added' more sessions are added, after which 'session' should be in the
+ * cache iff 'present' is non-zero. */
+typedef struct st_evict_check {
+	DC_CACHE_EVICT policy;
+	unsigned int added;
+	unsigned int session;
+	int present;
+} evict_check;
+
+static const evict_check evict_checks[] = {
+	/* Lookups make no difference, the soonest to expire go first */
+	{ DC_CACHE_EVICT_EXPIRY, 1, NUM_SESSIONS - 1, 0 },
+	{ DC_CACHE_EVICT_EXPIRY, 1, 2, 1 },
+	{ DC_CACHE_EVICT_EXPIRY, NUM_SESSIONS - 1, 1, 0 },
+	{ DC_CACHE_EVICT_EXPIRY, NUM_SESSIONS - 1, 0, 1 },
+	/* The oldest of those not looked up go first, then 1 as it was used
+	 * less recently than 0 */
+	{ DC_CACHE_EVICT_LRU, 1, 2, 0 },
+	{ DC_CACHE_EVICT_LRU, 1, NUM_SESSIONS - 1, 1 },
+	{ DC_CACHE_EVICT_LRU, NUM_SESSIONS - 1, 1, 0 },
+	{ DC_CACHE_EVICT_LRU, NUM_SESSIONS - 1, 0, 1 },
+	/* Same, except 0 and 1 got their second chances in the order they
+	 * were added, so 0 goes before 1 */
+	{ DC_CACHE_EVICT_CLOCK, 1, 2, 0 },
+	{ DC_CACHE_EVICT_CLOCK, 1, NUM_SESSIONS - 1, 1 },
+	{ DC_CACHE_EVICT_CLOCK, NUM_SESSIONS - 1, 0, 0 },
+	{ DC_CACHE_EVICT_CLOCK, NUM_SESSIONS - 1, 1, 1 },
+	/* Same, except that once the hand has passed 0 and 1 it reaches the
+	 * new sessions before coming back around to them */
+	{ DC_CACHE_EVICT_SIEVE, 1, 2, 0 },
+	{ DC_CACHE_EVICT_SIEVE, 1, NUM_SESSIONS - 1, 1 },
+	{ DC_CACHE_EVICT_SIEVE, NUM_SESSIONS - 1, 0, 1 },
+	{ DC_CACHE_EVICT_SIEVE, NUM_SESSIONS - 1, 1, 1 },
+	{ DC_CACHE_EVICT_SIEVE, NUM_SESSIONS - 1, NUM_SESSIONS, 0 },
+	{ DC_CACHE_EVICT_SIEVE, NUM_SESSIONS - 1, NUM_SESSIONS + 1, 1 }
+};
+#define NUM_EVICT_CHECKS	(sizeof(evict_checks) / sizeof(evict_check))
+
+/* The mixed-size checks fill a cache's storage exactly, half of it with
+ * sessions of MIXED_SMALL bytes and half with sessions of MIXED_BIG bytes,
+ * added alternately (so the small ones are the even-numbered ones, and all of
+ * the last to be added). Sessions 0, 1 and 0 again are looked up, then a
+ * session of 'len' bytes is added. Only sessions at least that big can make
+ * room for it, so 'session' should be in the cache iff 'present' is non-zero,
+ * and 'moved' says whether a slab had to change hands because there were no
+ * sessions that big. */
+#define MIXED_SESSIONS		(DC_CACHE_MIN_SIZE * 8)
+#define MIXED_SMALL		8000
+#define MIXED_BIG		20000
+#define MIXED_HUGE		32000
+/* 'session' can also refer to the last big session or the last of all */
+#define MIXED_LAST_BIG		-1
+#define MIXED_LAST		-2
+
+typedef struct st_mixed_check {
+	DC_CACHE_EVICT policy;
+	unsigned int len;
+	int session;
+	int present;
+	int moved;
+} mixed_check;
+
+static const mixed_check mixed_checks[] = {
+	/* The big session that expires soonest goes, though small ones
+	 * expire sooner still */
+	{ DC_CACHE_EVICT_EXPIRY, MIXED_BIG, MIXED_LAST_BIG, 0, 0 },
+	{ DC_CACHE_EVICT_EXPIRY, MIXED_BIG, MIXED_LAST, 1, 0 },
+	{ DC_CACHE_EVICT_EXPIRY, MIXED_BIG, 1, 1, 0 },
+	/* The big session not looked up that was added first, as 2 is small */
+	{ DC_CACHE_EVICT_LRU, MIXED_BIG, 3, 0, 0 },
+	{ DC_CACHE_EVICT_LRU, MIXED_BIG, 1, 1, 0 },
+	{ DC_CACHE_EVICT_LRU, MIXED_BIG, 2, 1, 0 },
+	{ DC_CACHE_EVICT_CLOCK, MIXED_BIG, 3, 0, 0 },
+	{ DC_CACHE_EVICT_CLOCK, MIXED_BIG, 2, 1, 0 },
+	{ DC_CACHE_EVICT_SIEVE, MIXED_BIG, 3, 0, 0 },
+	{ DC_CACHE_EVICT_SIEVE, MIXED_BIG, 2, 1, 0 },
+	/* Nothing is big enough, so the slab holding the session the policy
+	 * would evict is emptied, and the big sessions are left alone */
+	{ DC_CACHE_EVICT_EXPIRY, MIXED_HUGE, MIXED_LAST, 0, 1 },
+	{ DC_CACHE_EVICT_EXPIRY, MIXED_HUGE, MIXED_LAST_BIG, 1, 1 },
+	{ DC_CACHE_EVICT_LRU, MIXED_HUGE, 2, 0, 1 },
+	{ DC_CACHE_EVICT_LRU, MIXED_HUGE, 1, 1, 1 },
+	{ DC_CACHE_EVICT_CLOCK, MIXED_HUGE, 2, 0, 1 },
+	{ DC_CACHE_EVICT_CLOCK, MIXED_HUGE, 1, 1, 1 },
+	{ DC_CACHE_EVICT_SIEVE, MIXED_HUGE, 2, 0, 1 },
+	{ DC_CACHE_EVICT_SIEVE, MIXED_HUGE, 1, 1, 1 }
+};
+#define NUM_MIXED_CHECKS	(sizeof(mixed_checks) / sizeof(mixed_check))
+
+/* A cache created with 'sessions' and 'memory' (see DC_CACHE_EXT_cb's
+ * cache_new_ex) is filled with sessions of 'small' bytes until its storage
+ * runs out, then sessions of 'big' bytes are added. Making room for the first
+ * of those must evict no more sessions than share a slab, and the next must
+ * fit in the room made. With 'sessions' zero, the session limit is derived
+ * from the budget on the assumption that sessions are smaller than these. */
+typedef struct st_arena_check {
+	unsigned int sessions;
+	unsigned long memory;
+	unsigned int small, big;
+} arena_check;
+
+static const arena_check arena_checks[] = {
+	{ 200000, 24UL << 20, 100, 2048 },
+	{ 40000, 24UL << 20, 1024, 4096 },
+	{ 0, 24UL << 20, 1024, 4096 },
+	{ 0, 24UL << 20, 600, 16000 }
+};
+#define NUM_ARENA_CHECKS	(sizeof(arena_checks) / sizeof(arena_check))
+
+/* The shared cache check needs a process to die with a stripe locked, and
+ * locks that notice that */
+#if !defined(WIN32) && defined(HAVE_FORK) && defined(HAVE_WAITPID) && \
+		defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) && \
+		defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+#define DC_CACHE_TEST_SHARED
+#endif
+#define SHARED_STRIPES		4
+
+/* Prototypes */
+static int do_evict_checks(void);
+static int do_mixed_checks(void);
+static int do_arena_checks(void);
+static int do_shared_check(void);
+
+static int usage(void)
+{
+	const char **u = usage_msg;
+	while(*u)
+		SYS_fprintf(SYS_stderr, "%s\n", *(u++));
+	/* Return 0 because main() can use this is as a help
+	 * screen which shouldn't return an "error" */
+	return 0;
+}
+static const char *CMD_HELP1 = "-h";
+static const char *CMD_HELP2 = "-help";
+static const char *CMD_HELP3 = "-?";
+
+static int err_badswitch(const char *arg)
+{
+	SYS_fprintf(SYS_stderr, "Error, \"%s\" not recognised\n", arg);
+	usage();
+	return 1;
+}
+
+/*****************/
+/* MAIN FUNCTION */
+/*****************/
+
+#define ARG_INC {argc--;argv++;}
+
+int main(int argc, char *argv[])
+{
+	ARG_INC;
+	while(argc > 0) {
+		if((strcmp(*argv, CMD_HELP1) == 0) ||
+				(strcmp(*argv, CMD_HELP2) == 0) ||
+				(strcmp(*argv, CMD_HELP3) == 0))
+			return usage();
+		else
+			return err_badswitch(*argv);
+		ARG_INC;
+	}
+
+	if(!do_evict_checks() || !do_mixed_checks() || !do_arena_checks() ||
+			!do_shared_check())
+		return 1;
+	SYS_fprintf(SYS_stderr, "Info, all tests complete\n");
+	return 0;
+}
+
+static const char *int_policy_name(DC_CACHE_EVICT policy)
+{
+	switch(policy) {
+	case DC_CACHE_EVICT_LRU:
+		return "lru";
+	case DC_CACHE_EVICT_CLOCK:
+		return "clock";
+	case DC_CACHE_EVICT_SIEVE:
+		return "sieve";
+	default:
+		break;
+	}
+	return "expiry";
+}
+
+/* Session 'n' has a 4-byte id and a 32-byte payload, both derived from 'n' */
+static void int_session(unsigned int n, unsigned char *id, unsigned char *data)
+{
+	unsigned int loop;
+	id[0] = (unsigned char)(n >> 24);
+	id[1] = (unsigned char)(n >> 16);
+	id[2] = (unsigned char)(n >> 8);
+	id[3] = (unsigned char)n;
+	for(loop = 0; loop < 32; loop++)
+		data[loop] = (unsigned char)(n + loop);
+}
+
+/* Runs the scenario described for 'evict_check' and reports whether the
+ * session was where it was meant to be (and whether the cache counted the
+ * right number of evictions). */
+static int int_evict_check(const evict_check *chk)
+{
+	const DC_CACHE_cb *vt;
+	const DC_CACHE_EXT_cb *ext;
+	DC_CACHE *cache;
+	DC_CACHE_STATS stats;
+	struct timeval now;
+	unsigned char id[4], data[32];
+	unsigned int n;
+	int ret = 0;
+
+	if(!DC_SERVER_set_default_cache_ex(chk->policy) ||
+			((vt = DC_SERVER_get_cache()) == NULL) ||
+			((ext = DC_SERVER_get_cache_ex()) == NULL) ||
+			((cache = vt->cache_new(NUM_SESSIONS)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't create a cache\n");
+		return 0;
+	}
+	SYS_gettime(&now);
+	for(n = 0; n < NUM_SESSIONS; n++) {
+		int_session(n, id, data);
+		if(!vt->cache_add(cache, &now, TIMEOUT_FIRST(n), id, 4,
+					data, 32))
+			goto add_err;
+	}
+	for(n = 0; n < 3; n++) {
+		int_session(n & 1, id, data);
+		if(!vt->cache_have(cache, &now, id, 4)) {
+			SYS_fprintf(SYS_stderr, "Error, session %u missing\n",
+					n & 1);
+			goto end;
+		}
+	}
+	for(n = NUM_SESSIONS; n < NUM_SESSIONS + chk->added; n++) {
+		int_session(n, id, data);
+		if(!vt->cache_add(cache, &now, TIMEOUT_LATER, id, 4, data, 32))
+			goto add_err;
+	}
+	if(vt->cache_num_items(cache, &now) != NUM_SESSIONS) {
+		SYS_fprintf(SYS_stderr, "Error, the cache should be full\n");
+		goto end;
+	}
+	if(!ext->cache_stats || !ext->cache_stats(cache, &stats) ||
+			(stats.evictions != chk->added)) {
+		SYS_fprintf(SYS_stderr, "Error, wrong number of evictions\n");
+		goto end;
+	}
+	int_session(chk->session, id, data);
+	if(!vt->cache_have(cache, &now, id, 4) != !chk->present) {
+		SYS_fprintf(SYS_stderr, "Error, with the %s policy and %u "
+			"sessions added, session %u should%s be in the cache\n",
+			int_policy_name(chk->policy), chk->added, chk->session,
+			chk->present ? "" : "n't");
+		goto end;
+	}
+	ret = 1;
+	goto end;
+add_err:
+	SYS_fprintf(SYS_stderr, "Error, couldn't add session %u\n", n);
+end:
+	vt->cache_free(cache);
+	return ret;
+}
+
+static int do_evict_checks(void)
+{
+	unsigned int loop;
+	for(loop = 0; loop < NUM_EVICT_CHECKS; loop++)
+		if(!int_evict_check(evict_checks + loop))
+			return 0;
+	SYS_fprintf(SYS_stderr, "Info, %u eviction checks passed\n",
+			(unsigned int)NUM_EVICT_CHECKS);
+	/* Leave the default as we found it */
+	return DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT_EXPIRY);
+}
+
+/* The number of sessions of 'len' bytes that fit in one slab */
+static unsigned int int_per_slab(const DC_CACHE_STATS *stats, unsigned int len)
+{
+	unsigned int cls = 0;
+	while(stats->classes[cls].chunk_size < len)
+		cls++;
+	return stats->slab_size / stats->classes[cls].chunk_size;
+}
+
+static int int_mixed_check(const mixed_check *chk)
+{
+	static unsigned char data[DC_MAX_DATA_LEN];
+	const DC_CACHE_cb *vt;
+	const DC_CACHE_EXT_cb *ext;
+	DC_CACHE *cache;
+	DC_CACHE_STATS stats;
+	struct timeval now;
+	unsigned char id[4];
+	unsigned long evictions, moves;
+	unsigned int n, len, small_left, big_left, last_big = 0;
+	int ret = 0;
+
+	if(!DC_SERVER_set_default_cache_ex(chk->policy) ||
+			((vt = DC_SERVER_get_cache()) == NULL) ||
+			((ext = DC_SERVER_get_cache_ex()) == NULL) ||
+			!ext->cache_stats ||
+			((cache = vt->cache_new(MIXED_SESSIONS)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't create a cache\n");
+		return 0;
+	}
+	ext->cache_stats(cache, &stats);
+	small_left = (stats.slabs_total / 2) * int_per_slab(&stats,
+						MIXED_SMALL);
+	big_left = (stats.slabs_total - stats.slabs_total / 2) *
+					int_per_slab(&stats, MIXED_BIG);
+	SYS_gettime(&now);
+	for(n = 0; small_left || big_left; n++) {
+		if(((n & 1) && big_left) || !small_left) {
+			len = MIXED_BIG;
+			big_left--;
+			last_big = n;
+		} else {
+			len = MIXED_SMALL;
+			small_left--;
+		}
+		int_session(n, id, data);
+		if(!vt->cache_add(cache, &now, TIMEOUT_FIRST(n), id, 4, data,
+					len - 4))
+			goto add_err;
+	}
+	ext->cache_stats(cache, &stats);
+	if(stats.slabs_free || stats.evictions ||
+			(vt->cache_num_items(cache, &now) != n)) {
+		SYS_fprintf(SYS_stderr, "Error, the cache should be exactly "
+				"full\n");
+		goto end;
+	}
+	evictions = stats.evictions;
+	moves = stats.slab_moves;
+	for(len = 0; len < 3; len++) {
+		int_session(len & 1, id, data);
+		if(!vt->cache_have(cache, &now, id, 4)) {
+			SYS_fprintf(SYS_stderr, "Error, session %u missing\n",
+					len & 1);
+			goto end;
+		}
+	}
+	int_session(n, id, data);
+	if(!vt->cache_add(cache, &now, TIMEOUT_LATER, id, 4, data,
+				chk->len - 4))
+		goto add_err;
+	ext->cache_stats(cache, &stats);
+	if((stats.slab_moves - moves != (chk->moved ? 1 : 0)) ||
+			(stats.evictions - evictions != (chk->moved ? 0 : 1))) {
+		SYS_fprintf(SYS_stderr, "Error, with the %s policy a %u byte "
+			"session should%s have needed a slab moved\n",
+			int_policy_name(chk->policy), chk->len,
+			chk->moved ? "" : "n't");
+		goto end;
+	}
+	if(!vt->cache_have(cache, &now, id, 4)) {
+		SYS_fprintf(SYS_stderr, "Error, session %u missing\n", n);
+		goto end;
+	}
+	len = (chk->session == MIXED_LAST_BIG) ? last_big :
+		(chk->session == MIXED_LAST) ? n - 1 :
+		(unsigned int)chk->session;
+	int_session(len, id, data);
+	if(!vt->cache_have(cache, &now, id, 4) != !chk->present) {
+		SYS_fprintf(SYS_stderr, "Error, with the %s policy and a %u "
+			"byte session added, session %u should%s be in the "
+			"cache\n", int_policy_name(chk->policy), chk->len, len,
+			chk->present ? "" : "n't");
+		goto end;
+	}
+	ret = 1;
+	goto end;
+add_err:
+	SYS_fprintf(SYS_stderr, "Error, couldn't add session %u\n", n);
+end:
+	vt->cache_free(cache);
+	return ret;
+}
+
+/* Adds sessions numbered from 'n' with 'len' bytes of id and data until
+ * 'stop' sessions have been added or, if 'full' is set, the cache has to evict
+ * to make room. Returns the number of the next session, or zero on error. */
+static unsigned int int_arena_fill(const DC_CACHE_cb *vt,
+			const DC_CACHE_EXT_cb *ext, DC_CACHE *cache,
+			const struct timeval *now, unsigned int n,
+			unsigned int stop, unsigned int len, int full)
+{
+	static unsigned char data[DC_MAX_DATA_LEN];
+	DC_CACHE_STATS stats;
+	unsigned char id[4];
+	for(; n < stop; n++) {
+		int_session(n, id, data);
+		if(!vt->cache_add(cache, now, TIMEOUT_MIXED(n), id, 4, data,
+					len - 4)) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't add session "
+					"%u\n", n);
+			return 0;
+		}
+		if(full && (!ext->cache_stats(cache, &stats) ||
+				stats.evictions || stats.slab_evictions))
+			return n + 1;
+	}
+	return n;
+}
+
+static int int_arena_check(const arena_check *chk)
+{
+	const DC_CACHE_cb *vt = DC_SERVER_get_cache();
+	const DC_CACHE_EXT_cb *ext = DC_SERVER_get_cache_ex();
+	DC_CACHE *cache;
+	DC_CACHE_STATS stats;
+	struct timeval now;
+	unsigned long evicted, bound;
+	unsigned int n, items;
+	int ret = 0;
+
+	if(!ext || !ext->cache_new_ex || !ext->cache_stats || ((cache =
+			ext->cache_new_ex(chk->sessions, chk->memory)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't create a cache\n");
+		return 0;
+	}
+	SYS_gettime(&now);
+	n = int_arena_fill(vt, ext, cache, &now, 0, DC_CACHE_MAX_SIZE,
+			chk->small, 1);
+	if(!n)
+		goto end;
+	items = vt->cache_num_items(cache, &now);
+	ext->cache_stats(cache, &stats);
+	if(stats.slabs_free) {
+		SYS_fprintf(SYS_stderr, "Error, the session limit was reached "
+				"before the storage ran out\n");
+		goto end;
+	}
+	/* Only as many sessions as share a slab should be evicted */
+	evicted = stats.evictions + stats.slab_evictions;
+	bound = stats.slab_size / chk->small;
+	if(!int_arena_fill(vt, ext, cache, &now, n, n + 2, chk->big, 0))
+		goto end;
+	ext->cache_stats(cache, &stats);
+	evicted = stats.evictions + stats.slab_evictions - evicted;
+	if((evicted > bound) || (vt->cache_num_items(cache, &now) + evicted !=
+				items + 2)) {
+		SYS_fprintf(SYS_stderr, "Error, adding %u byte sessions to a "
+			"cache full of %u byte sessions evicted %lu of them "
+			"(at most %lu share a slab)\n", chk->big, chk->small,
+			evicted, bound);
+		goto end;
+	}
+	ret = 1;
+end:
+	vt->cache_free(cache);
+	return ret;
+}
+
+static int do_mixed_checks(void)
+{
+	unsigned int loop;
+	for(loop = 0; loop < NUM_MIXED_CHECKS; loop++)
+		if(!int_mixed_check(mixed_checks + loop))
+			return 0;
+	SYS_fprintf(SYS_stderr, "Info, %u mixed-size checks passed\n",
+			(unsigned int)NUM_MIXED_CHECKS);
+	/* Leave the default as we found it */
+	return DC_SERVER_set_default_cache_ex(DC_CACHE_EVICT_EXPIRY);
+}
+
+static int do_arena_checks(void)
+{
+	unsigned int loop;
+	if(!DC_SERVER_set_default_cache())
+		return 0;
+	for(loop = 0; loop < NUM_ARENA_CHECKS; loop++)
+		if(!int_arena_check(arena_checks + loop))
+			return 0;
+	SYS_fprintf(SYS_stderr, "Info, %u storage checks passed\n",
+			(unsigned int)NUM_ARENA_CHECKS);
+	return 1;
+}
+
+/* A child process pins a session in a shared cache, which keeps its stripe
+ * locked, and exits. The next lock of that stripe should start it afresh, and
+ * leave the other stripes as they were. */
+static int do_shared_check(void)
+{
+#ifdef DC_CACHE_TEST_SHARED
+	const DC_CACHE_cb *vt;
+	const DC_CACHE_EXT_cb *ext;
+	DC_CACHE *cache;
+	struct timeval now;
+	unsigned char id[4], data[32];
+	unsigned int n, len, items;
+	int status, ret = 0;
+	pid_t pid;
+
+	if(!DC_SERVER_set_shared_cache(DC_CACHE_EVICT_EXPIRY,
+					SHARED_STRIPES)) {
+		SYS_fprintf(SYS_stderr, "Info, shared caches aren't supported, "
+				"skipping that check\n");
+		return DC_SERVER_set_default_cache();
+	}
+	vt = DC_SERVER_get_cache();
+	ext = DC_SERVER_get_cache_ex();
+	if(!ext || !ext->cache_get_ref || ((cache = vt->cache_new(
+				NUM_SESSIONS * SHARED_STRIPES)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't create a cache\n");
+		goto restore;
+	}
+	SYS_gettime(&now);
+	for(n = 0; n < NUM_SESSIONS; n++) {
+		int_session(n, id, data);
+		if(!vt->cache_add(cache, &now, TIMEOUT_LATER, id, 4, data, 32)) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't add session "
+					"%u\n", n);
+			goto end;
+		}
+	}
+	int_session(0, id, data);
+	if((pid = fork()) == 0)
+		/* Die without releasing the session */
+		_exit(ext->cache_get_ref(cache, &now, id, 4, &len) ? 0 : 1);
+	if((pid < 0) || (waitpid(pid, &status, 0) != pid) ||
+			!WIFEXITED(status) || WEXITSTATUS(status)) {
+		SYS_fprintf(SYS_stderr, "Error, the child process couldn't pin "
+				"a session\n");
+		goto end;
+	}
+	if(vt->cache_have(cache, &now, id, 4)) {
+		SYS_fprintf(SYS_stderr, "Error, the stripe the child had "
+				"locked wasn't started afresh\n");
+		goto end;
+	}
+	items = vt->cache_num_items(cache, &now);
+	if(!items || (items >= NUM_SESSIONS)) {
+		SYS_fprintf(SYS_stderr, "Error, %u of %u sessions are left, "
+			"only one stripe should have been emptied\n", items,
+			NUM_SESSIONS);
+		goto end;
+	}
+	if(!vt->cache_add(cache, &now, TIMEOUT_LATER, id, 4, data, 32) ||
+			!vt->cache_have(cache, &now, id, 4)) {
+		SYS_fprintf(SYS_stderr, "Error, the stripe isn't usable again\n");
+		goto end;
+	}
+	SYS_fprintf(SYS_stderr, "Info, shared cache recovery checked (%u of %u "
+			"sessions kept)\n", items, NUM_SESSIONS);
+	ret = 1;
+end:
+	vt->cache_free(cache);
+restore:
+	/* Leave the default as we found it */
+	if(!DC_SERVER_set_default_cache())
+		return 0;
+	return ret;
+#else
+	SYS_fprintf(SYS_stderr, "Info, processes can't share a cache here, "
+			"skipping that check\n");
+	return 1;
+#endif
+}
@@ -45,7 +45,16 @@
 #include <openssl/ssl.h>
 #endif
 
+/* "-pool" needs threads to share the pool between */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#define DC_TEST_THREADS
+#endif
+
 static const char *def_client = NULL;
+static const char *def_silent = NULL;
+static const char *def_cluster = NULL;
+static const char *def_coalesce = NULL;
+static const char *def_nearcache = NULL;
 static const unsigned int def_sessions = 10;
 static const unsigned int def_datamin = 50;
 static const unsigned int def_datamax = 2100;
@@ -53,6 +62,9 @@ static const unsigned int def_withcert = 0;
 static const unsigned int def_timeout = 60;
 static const unsigned int def_timevar = 5;
 static const unsigned long def_progress = 0;
+static const unsigned int def_batch = 0;
+static const unsigned int def_async = 0;
+static const unsigned int def_pool = 0;
 
 /* Avoid the dreaded "greater than the length `509' ISO C89 compilers are
  * required to support" warning by splitting this into an array of strings. */
@@ -60,6 +72,18 @@ static const char *usage_msg[] = {
 "",
 "Usage: dc_test [options]     where 'options' are from;",
 "  -connect <addr>  (connect to server at address 'addr')",
+"  -silent <addr>   (first check timeouts against a server that never answers,",
+"                    which dc_test starts listening on address 'addr')",
+"  -cluster <addr>  (first check that a DC_CLUSTER of '-connect' and a server at",
+"                    'addr' ejects the latter until it starts, then takes it",
+"                    back)",
+"  -coalesce <addr> (first check that identical lookups through '-connect', a",
+"                    dc_client whose server is 'addr', share one request to",
+"                    it, dc_test standing in for the server)",
+"  -nearcache <addr> (first check that lookups through '-connect', a dc_client",
+"                    with a near-cache whose server is 'addr', are answered",
+"                    locally until a write invalidates them, dc_test standing",
+"                    in for the server)",
 "  -progress <num>  (report transaction count every 'num' operations)",
 "  -sessions <num>  (create 'num' sessions to use for testing)",
 "  -datamin <num>   (each session's data must be at least <num> bytes)",
@@ -71,6 +95,13 @@ static const char *usage_msg[] = {
 "  -timevar <secs>  (randomly offset '-timeout' +/- 'secs')",
 "  -ops <num>       (run <num> random tests, def: 10 * ('sessions')^2)",
 "  -persistent      (use a persistent connection for all operations)",
+"  -batch <num>     (send operations in batches of up to <num>)",
+"  -async <num>     (keep up to <num> asynchronous operations outstanding,",
+"                    implies -persistent)",
+#ifdef DC_TEST_THREADS
+"  -pool <num>      (run the operations from <num> threads sharing a DC_POOL,",
+"                    each with its own share of the sessions)",
+#endif
 "  -<h|help|?>      (display this usage message)",
 "",
 "Eg. dc_test -connect UNIX:/tmp/session_cache -sessions 10 -withcert 3",
@@ -87,17 +118,51 @@ static const char *usage_msg[] = {
 #define MAX_TIMEOUT		3600 /* 1 hour */
 #define MAX_OPS			1000000
 #define MAX_PROGRESS		(unsigned long)1000000
+#define MAX_BATCH		256
+#define MAX_ASYNC		256
+#define MAX_POOL		64
+/* How many connections the threads in "-pool" share */
+#define POOL_CONNS		4
+/* The timeouts used against the server that never answers, and how much
+ * later than that an operation may give up */
+#define SILENT_OP_MSECS		(unsigned long)300
+#define SILENT_CALL_MSECS	(unsigned long)100
+#define SILENT_SLACK		(unsigned long)1000
+/* How long "-cluster" keeps a server ejected, and how long it waits for the
+ * server to start and be taken back */
+#define CLUSTER_RETRY_MSECS	(unsigned long)200
+#define CLUSTER_WAIT_MSECS	(unsigned long)10000
+/* How many sessions of each server "-cluster" uses */
+#define CLUSTER_SESSIONS	8
+/* How long dc_test waits for a dc_client to connect to it when standing in
+ * for its server, and how long it holds requests so that identical ones pile
+ * up behind them */
+#define UPSTREAM_WAIT_MSECS	(unsigned long)10000
+#define UPSTREAM_HOLD_MSECS	(unsigned long)200
+/* How many clients send the same lookup in "-coalesce" */
+#define COALESCE_CLIENTS	4
+/* The size of the session that's fetched repeatedly to check that a batch
+ * is cut short when its response doesn't fit, and how many times it's
+ * fetched */
+#define OVERFLOW_LEN		4096
+#define OVERFLOW_GETS		(DC_MAX_TOTAL_DATA / OVERFLOW_LEN + 2)
 
 /* When contructing sessions with peer-certificates, we use this cert */
 #define CERT_PATH		"A-client.pem"
 
 /* Prototypes */
 static void generate_random_bytes(unsigned char *buf, unsigned int num);
+static int do_timeouts(const char *silent, const char *address);
+static int do_cluster(const char *address, const char *late);
+static int do_coalesce(const char *address, const char *upstream);
+static int do_nearcache(const char *address, const char *upstream);
 static int do_client(const char *address, unsigned int num_sessions,
 			unsigned int datamin, unsigned int datamax,
 			unsigned int withcert, unsigned int timeout,
 			unsigned int timevar, unsigned int tests,
-			unsigned long progress, int persistent);
+			unsigned long progress, int persistent,
+			unsigned int batch, unsigned int async,
+			unsigned int pool);
 
 static int usage(void)
 {
@@ -112,6 +177,10 @@ static const char *CMD_HELP1 = "-h";
 static const char *CMD_HELP2 = "-help";
 static const char *CMD_HELP3 = "-?";
 static const char *CMD_CLIENT = "-connect";
+static const char *CMD_SILENT = "-silent";
+static const char *CMD_CLUSTER = "-cluster";
+static const char *CMD_COALESCE = "-coalesce";
+static const char *CMD_NEARCACHE = "-nearcache";
 static const char *CMD_SESSIONS = "-sessions";
 static const char *CMD_DATAMIN = "-datamin";
 static const char *CMD_DATAMAX = "-datamax";
@@ -121,6 +190,9 @@ static const char *CMD_TIMEVAR = "-timevar";
 static const char *CMD_PROGRESS = "-progress";
 static const char *CMD_OPS = "-ops";
 static const char *CMD_PERSISTENT = "-persistent";
+static const char *CMD_BATCH = "-batch";
+static const char *CMD_ASYNC = "-async";
+static const char *CMD_POOL = "-pool";
 
 static int err_noarg(const char *arg)
 {
@@ -159,11 +231,18 @@ int main(int argc, char *argv[])
 	unsigned int datamin = def_datamin;
 	unsigned int datamax = def_datamax;
 	const char *client = def_client;
+	const char *silent = def_silent;
+	const char *cluster = def_cluster;
+	const char *coalesce = def_coalesce;
+	const char *nearcache = def_nearcache;
 	unsigned int withcert = def_withcert;
 	unsigned int timeout = def_timeout;
 	unsigned int timevar = def_timevar;
 	unsigned long progress = def_progress;
 	int persistent = 0;
+	unsigned int batch = def_batch;
+	unsigned int async = def_async;
+	unsigned int pool = def_pool;
 	unsigned int ops = MAX_OPS + 1;
 
 	ARG_INC;
@@ -177,6 +256,18 @@ int main(int argc, char *argv[])
 		else if(strcmp(*argv, CMD_CLIENT) == 0) {
 			ARG_CHECK(CMD_CLIENT);
 			client = *argv;
+		} else if(strcmp(*argv, CMD_SILENT) == 0) {
+			ARG_CHECK(CMD_SILENT);
+			silent = *argv;
+		} else if(strcmp(*argv, CMD_CLUSTER) == 0) {
+			ARG_CHECK(CMD_CLUSTER);
+			cluster = *argv;
+		} else if(strcmp(*argv, CMD_COALESCE) == 0) {
+			ARG_CHECK(CMD_COALESCE);
+			coalesce = *argv;
+		} else if(strcmp(*argv, CMD_NEARCACHE) == 0) {
+			ARG_CHECK(CMD_NEARCACHE);
+			nearcache = *argv;
 		} else if(strcmp(*argv, CMD_SESSIONS) == 0) {
 			ARG_CHECK(CMD_SESSIONS);
 			sessions = (unsigned int)atoi(*argv);
@@ -215,6 +306,27 @@ int main(int argc, char *argv[])
 			ops = (unsigned int)atoi(*argv);
 			if(ops > MAX_OPS)
 				return err_badrange(CMD_OPS);
+		} else if(strcmp(*argv, CMD_BATCH) == 0) {
+			ARG_CHECK(CMD_BATCH);
+			batch = (unsigned int)atoi(*argv);
+			if(!batch || (batch > MAX_BATCH))
+				return err_badrange(CMD_BATCH);
+		} else if(strcmp(*argv, CMD_ASYNC) == 0) {
+			ARG_CHECK(CMD_ASYNC);
+			async = (unsigned int)atoi(*argv);
+			if(!async || (async > MAX_ASYNC))
+				return err_badrange(CMD_ASYNC);
+			persistent = 1;
+		} else if(strcmp(*argv, CMD_POOL) == 0) {
+#ifndef DC_TEST_THREADS
+			SYS_fprintf(SYS_stderr, "Error, no thread support "
+				"compiled in, -pool not available.\n");
+			return 1;
+#endif
+			ARG_CHECK(CMD_POOL);
+			pool = (unsigned int)atoi(*argv);
+			if(!pool || (pool > MAX_POOL))
+				return err_badrange(CMD_POOL);
 		} else
 			return err_badswitch(*argv);
 		ARG_INC;
@@ -248,6 +360,16 @@ int main(int argc, char *argv[])
 		SYS_fprintf(SYS_stderr, "Error, -datamax should be at most 4096\n");
 		return 1;
 	}
+	if((batch && async) || (pool && (batch || async))) {
+		SYS_fprintf(SYS_stderr, "Error, only one of -batch, -async and "
+				"-pool can be used\n");
+		return 1;
+	}
+	if(pool > sessions) {
+		SYS_fprintf(SYS_stderr, "Error, -pool can't be larger than "
+				"-sessions\n");
+		return 1;
+	}
 
 	if(!SYS_sigpipe_ignore()) {
 #if SYS_DEBUG_LEVEL > 0
@@ -263,8 +385,16 @@ int main(int argc, char *argv[])
 	/* Since we're using rand() in places, the generator needs seeding */
 	srand(time(NULL));
 
+	if(silent && do_timeouts(silent, client))
+		return 1;
+	if(cluster && do_cluster(client, cluster))
+		return 1;
+	if(coalesce && do_coalesce(client, coalesce))
+		return 1;
+	if(nearcache && do_nearcache(client, nearcache))
+		return 1;
 	return do_client(client, sessions, datamin, datamax, withcert, timeout, timevar,
-			ops, progress, persistent);
+			ops, progress, persistent, batch, async, pool);
 }
 
 /* Generate 'num' pseudo-random bytes of a specified length, placing them in
@@ -337,11 +467,1174 @@ static void int_random_test(unsigned int *res, unsigned int num_sessions,
 }
 #endif
 
+/* Checks the result of a batched or asynchronous operation (0-3, as chosen by
+ * int_random_test()) against whether the session is meant to be in the cache,
+ * and keeps that up to date. 'how' describes the operation for error messages.
+ * Returns zero if the result is wrong. */
+static int int_check_result(const char *how, unsigned int op, int ret,
+			int *present, const unsigned char *data,
+			unsigned int len, const unsigned char *enc,
+			unsigned int enc_len)
+{
+	static const char *names[] = { "add", "remove", "get", "have" };
+	if(ret < 0) {
+		SYS_fprintf(SYS_stderr, "Error, %s %s got no result\n", how,
+				names[op]);
+		return 0;
+	}
+	/* An add succeeds iff the session wasn't there, the others iff it
+	 * was */
+	if(ret != ((op == 0) ? !*present : *present)) {
+		SYS_fprintf(SYS_stderr, "Error, %s %s %s\n", how, names[op],
+				ret ? "succeeded and shouldn't have!" :
+				"failed!");
+		return 0;
+	}
+	if((op == 2) && ret && ((len != enc_len) ||
+			(memcmp(data, enc, len) != 0))) {
+		SYS_fprintf(SYS_stderr, "Error, received mismatched session "
+				"from %s get\n", how);
+		return 0;
+	}
+	if(op == 0)
+		*present = 1;
+	else if(op == 1)
+		*present = 0;
+	return 1;
+}
+
+/* Fetches one session more times in a batch than its response can hold, so
+ * the cache has to stop short and the rest has to be sent again. */
+static int int_batch_overflow(DC_CTX *ctx, unsigned int timeout)
+{
+	unsigned char id[16], sess[OVERFLOW_LEN];
+	const unsigned char *data;
+	unsigned int len, idx, left = OVERFLOW_GETS, sends = 0;
+	int ret;
+
+	generate_random_bytes(id, sizeof(id));
+	generate_random_bytes(sess, sizeof(sess));
+	if(!DC_CTX_add_session(ctx, id, sizeof(id), sess, sizeof(sess),
+				1000 * timeout)) {
+		SYS_fprintf(SYS_stderr, "Error, add failed!\n");
+		return 0;
+	}
+	while(left) {
+		for(idx = 0; idx < left; idx++)
+			if(!DC_CTX_batch_get_session(ctx, id, sizeof(id))) {
+				SYS_fprintf(SYS_stderr, "Error, couldn't "
+						"queue batched get\n");
+				return 0;
+			}
+		ret = DC_CTX_batch_send(ctx);
+		if((ret <= 0) || ((unsigned int)ret > left)) {
+			SYS_fprintf(SYS_stderr, "Error, batch send failed\n");
+			return 0;
+		}
+		for(idx = 0; idx < (unsigned int)ret; idx++)
+			if((DC_CTX_batch_result(ctx, &data, &len) != 1) ||
+					(len != sizeof(sess)) ||
+					(memcmp(data, sess, len) != 0)) {
+				SYS_fprintf(SYS_stderr, "Error, batched get "
+						"failed!\n");
+				return 0;
+			}
+		if(DC_CTX_batch_result(ctx, NULL, NULL) != -1) {
+			SYS_fprintf(SYS_stderr, "Error, more batch results "
+					"than operations performed\n");
+			return 0;
+		}
+		left -= (unsigned int)ret;
+		sends++;
+	}
+	if(sends < 2) {
+		SYS_fprintf(SYS_stderr, "Error, a batch too big to answer "
+				"wasn't cut short\n");
+		return 0;
+	}
+	if(!DC_CTX_remove_session(ctx, id, sizeof(id))) {
+		SYS_fprintf(SYS_stderr, "Error, remove failed!\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* A random operation waiting to be batched or for an asynchronous result */
+typedef struct st_batch_op {
+	unsigned int s, op, msecs;
+} batch_op;
+
+/* Runs 'tests' random operations in batches of up to 'batch'. When the cache
+ * only performs part of a batch, the rest go out again at the front of the
+ * next one. Returns the number of operations that passed before the first
+ * failure, or 'tests'. */
+static unsigned int int_batch_tests(DC_CTX *ctx, unsigned int batch,
+			unsigned int tests, unsigned int num_sessions,
+			int *sessions_bool, unsigned char **sessions_id,
+			unsigned int *sessions_idlen,
+			unsigned char **sessions_enc,
+			unsigned int *sessions_len, unsigned int timeout,
+			unsigned int timevar, unsigned long progress)
+{
+	batch_op ops[MAX_BATCH];
+	unsigned int c[3], queued = 0, idx = 0, num, loop, s;
+	unsigned long partial = 0;
+	const unsigned char *data;
+	unsigned int len;
+	int ret;
+
+	if(!int_batch_overflow(ctx, timeout))
+		return 0;
+	while(idx < tests) {
+		/* Top the batch up with new operations */
+		while((queued < batch) && (idx + queued < tests)) {
+			int_random_test(c, num_sessions, timeout, timevar);
+			ops[queued].s = c[0] % num_sessions;
+			ops[queued].op = c[1];
+			ops[queued].msecs = c[2];
+			queued++;
+		}
+		/* Queue as many as fit */
+		for(num = 0; num < queued; num++) {
+			s = ops[num].s;
+			switch(ops[num].op) {
+			case 0:
+				ret = DC_CTX_batch_add_session(ctx,
+					sessions_id[s], sessions_idlen[s],
+					sessions_enc[s], sessions_len[s],
+					ops[num].msecs);
+				break;
+			case 1:
+				ret = DC_CTX_batch_remove_session(ctx,
+					sessions_id[s], sessions_idlen[s]);
+				break;
+			case 2:
+				ret = DC_CTX_batch_get_session(ctx,
+					sessions_id[s], sessions_idlen[s]);
+				break;
+			default:
+				ret = DC_CTX_batch_has_session(ctx,
+					sessions_id[s], sessions_idlen[s]);
+				break;
+			}
+			if(!ret)
+				break;
+		}
+		if(!num) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't queue a "
+					"batched operation\n");
+			return idx;
+		}
+		if((ret = DC_CTX_batch_send(ctx)) <= 0) {
+			SYS_fprintf(SYS_stderr, "Error, batch send failed\n");
+			return idx;
+		}
+		if((unsigned int)ret < num)
+			partial++;
+		num = (unsigned int)ret;
+		for(loop = 0; loop < num; loop++) {
+			s = ops[loop].s;
+			ret = DC_CTX_batch_result(ctx, &data, &len);
+			if(!int_check_result("batched", ops[loop].op, ret,
+					sessions_bool + s, data, len,
+					sessions_enc[s], sessions_len[s]))
+				return idx + loop;
+		}
+		if(DC_CTX_batch_result(ctx, NULL, NULL) != -1) {
+			SYS_fprintf(SYS_stderr, "Error, more batch results "
+					"than operations performed\n");
+			return idx + num;
+		}
+		/* Whatever wasn't performed goes again */
+		queued -= num;
+		for(loop = 0; loop < queued; loop++)
+			ops[loop] = ops[loop + num];
+		if(progress && ((idx % progress) + num >= progress))
+			SYS_fprintf(SYS_stderr, "Info, total operations = "
+					"%7u\n", idx + num);
+		idx += num;
+	}
+	SYS_fprintf(SYS_stderr, "Info, %lu batches were cut short\n", partial);
+	return idx;
+}
+
+/* The state of int_async_tests(), which int_async_done() checks results
+ * against */
+typedef struct st_async_test {
+	/* The operations awaiting results, in the order they were submitted */
+	batch_op ops[MAX_ASYNC];
+	unsigned int first, num;
+	/* How many have completed, and whether any went wrong */
+	unsigned int done;
+	int failed;
+	int *sessions_bool;
+	unsigned char **sessions_enc;
+	unsigned int *sessions_len;
+} async_test;
+
+/* The completion callback for int_async_tests(). The cache answers in the
+ * order it was asked, so this is always the oldest outstanding operation. */
+static void int_async_done(void *cb_arg, int result,
+			const unsigned char *sess_data, unsigned int sess_len)
+{
+	async_test *t = cb_arg;
+	batch_op *o = t->ops + t->first;
+	if(!t->num) {
+		SYS_fprintf(SYS_stderr, "Error, asynchronous result with "
+				"nothing outstanding\n");
+		t->failed = 1;
+		return;
+	}
+	if(!t->failed && !int_check_result("asynchronous", o->op, result,
+				t->sessions_bool + o->s, sess_data, sess_len,
+				t->sessions_enc[o->s], t->sessions_len[o->s]))
+		t->failed = 1;
+	t->first = (t->first + 1) % MAX_ASYNC;
+	t->num--;
+	if(!t->failed)
+		t->done++;
+}
+
+/* Runs 'tests' random operations asynchronously, keeping up to 'async' of
+ * them outstanding on the one connection. Returns the number of operations
+ * that passed before the first failure, or 'tests'. */
+static unsigned int int_async_tests(DC_CTX *ctx, unsigned int async,
+			unsigned int tests, unsigned int num_sessions,
+			int *sessions_bool, unsigned char **sessions_id,
+			unsigned int *sessions_idlen,
+			unsigned char **sessions_enc,
+			unsigned int *sessions_len, unsigned int timeout,
+			unsigned int timevar, unsigned long progress)
+{
+	async_test t;
+	batch_op *o;
+	NAL_SELECTOR *sel;
+	unsigned int c[3], submitted = 0, s;
+	unsigned long next_progress = progress;
+	int ret;
+
+	t.first = t.num = t.done = 0;
+	t.failed = 0;
+	t.sessions_bool = sessions_bool;
+	t.sessions_enc = sessions_enc;
+	t.sessions_len = sessions_len;
+	if(((sel = NAL_SELECTOR_new()) == NULL) ||
+			!DC_CTX_to_select(ctx, sel)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't set up asynchronous "
+				"operations\n");
+		goto end;
+	}
+	while(!t.failed && (t.done < tests)) {
+		/* Keep the pipeline full */
+		while((t.num < async) && (submitted < tests)) {
+			int_random_test(c, num_sessions, timeout, timevar);
+			o = t.ops + (t.first + t.num) % MAX_ASYNC;
+			o->s = s = c[0] % num_sessions;
+			o->op = c[1];
+			o->msecs = c[2];
+			t.num++;
+			switch(o->op) {
+			case 0:
+				ret = DC_CTX_async_add_session(ctx,
+					sessions_id[s], sessions_idlen[s],
+					sessions_enc[s], sessions_len[s],
+					o->msecs, int_async_done, &t);
+				break;
+			case 1:
+				ret = DC_CTX_async_remove_session(ctx,
+					sessions_id[s], sessions_idlen[s],
+					int_async_done, &t);
+				break;
+			case 2:
+				ret = DC_CTX_async_get_session(ctx,
+					sessions_id[s], sessions_idlen[s],
+					int_async_done, &t);
+				break;
+			default:
+				ret = DC_CTX_async_has_session(ctx,
+					sessions_id[s], sessions_idlen[s],
+					int_async_done, &t);
+				break;
+			}
+			if(!ret) {
+				SYS_fprintf(SYS_stderr, "Error, couldn't submit "
+						"an asynchronous operation\n");
+				goto end;
+			}
+			submitted++;
+		}
+		if(DC_CTX_async_num(ctx) != t.num) {
+			SYS_fprintf(SYS_stderr, "Error, %u asynchronous "
+					"operations outstanding, expected %u\n",
+					DC_CTX_async_num(ctx), t.num);
+			goto end;
+		}
+		if((NAL_SELECTOR_select(sel, 0, 0) < 0) && (errno != EINTR)) {
+			SYS_fprintf(SYS_stderr, "Error, select failed\n");
+			goto end;
+		}
+		if(!DC_CTX_process(ctx)) {
+			SYS_fprintf(SYS_stderr, "Error, asynchronous I/O "
+					"failed\n");
+			goto end;
+		}
+		if(progress && (t.done >= next_progress)) {
+			SYS_fprintf(SYS_stderr, "Info, total operations = "
+					"%7u\n", t.done);
+			next_progress += progress;
+		}
+	}
+end:
+	if(sel) {
+		DC_CTX_from_select(ctx);
+		NAL_SELECTOR_free(sel);
+	}
+	return t.done;
+}
+
+#ifdef DC_TEST_THREADS
+/* Each thread in int_pool_tests() has its own share of the sessions, those
+ * whose index modulo 'stride' is 'first', so they don't interfere. */
+typedef struct st_pool_thread {
+	pthread_t thread;
+	DC_POOL *pool;
+	unsigned int first, stride, tests, done;
+	unsigned int num_sessions, timeout, timevar;
+	int *sessions_bool;
+	unsigned char **sessions_id;
+	unsigned int *sessions_idlen;
+	unsigned char **sessions_enc;
+	unsigned int *sessions_len;
+	unsigned char tmp[DC_MAX_TOTAL_DATA];
+} pool_thread;
+
+static void *int_pool_main(void *arg)
+{
+	pool_thread *t = arg;
+	unsigned int c[3], s, used = 0;
+	unsigned int mine = (t->num_sessions - t->first + t->stride - 1) /
+				t->stride;
+	int ret;
+
+	while(t->done < t->tests) {
+		int_random_test(c, mine, t->timeout, t->timevar);
+		s = t->first + t->stride * (c[0] % mine);
+		switch(c[1]) {
+		case 0:
+			ret = DC_POOL_add_session(t->pool, t->sessions_id[s],
+					t->sessions_idlen[s], t->sessions_enc[s],
+					t->sessions_len[s], c[2]);
+			break;
+		case 1:
+			ret = DC_POOL_remove_session(t->pool, t->sessions_id[s],
+					t->sessions_idlen[s]);
+			break;
+		case 2:
+			ret = DC_POOL_get_session(t->pool, t->sessions_id[s],
+					t->sessions_idlen[s], t->tmp,
+					DC_MAX_TOTAL_DATA, &used);
+			break;
+		default:
+			ret = DC_POOL_has_session(t->pool, t->sessions_id[s],
+					t->sessions_idlen[s]);
+			break;
+		}
+		if(!int_check_result("pooled", c[1], ret,
+				t->sessions_bool + s, t->tmp, used,
+				t->sessions_enc[s], t->sessions_len[s]))
+			break;
+		t->done++;
+	}
+	return NULL;
+}
+
+/* Runs 'tests' random operations between 'num' threads sharing a DC_POOL.
+ * Returns the number of operations that passed. */
+static unsigned int int_pool_tests(const char *address, unsigned int num,
+			unsigned int tests, unsigned int num_sessions,
+			int *sessions_bool, unsigned char **sessions_id,
+			unsigned int *sessions_idlen,
+			unsigned char **sessions_enc,
+			unsigned int *sessions_len, unsigned int timeout,
+			unsigned int timevar)
+{
+	DC_POOL *pool;
+	pool_thread *threads;
+	unsigned int loop, started, done = 0;
+
+	if((pool = DC_POOL_new(address, POOL_CONNS)) == NULL) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_POOL' creation failed\n");
+		return 0;
+	}
+	if((threads = SYS_malloc(pool_thread, num)) == NULL) {
+		SYS_fprintf(SYS_stderr, "Error, malloc failure\n");
+		DC_POOL_free(pool);
+		return 0;
+	}
+	for(started = 0; started < num; started++) {
+		pool_thread *t = threads + started;
+		t->pool = pool;
+		t->first = started;
+		t->stride = num;
+		/* The first threads pick up what doesn't divide evenly */
+		t->tests = tests / num + ((started < tests % num) ? 1 : 0);
+		t->done = 0;
+		t->num_sessions = num_sessions;
+		t->timeout = timeout;
+		t->timevar = timevar;
+		t->sessions_bool = sessions_bool;
+		t->sessions_id = sessions_id;
+		t->sessions_idlen = sessions_idlen;
+		t->sessions_enc = sessions_enc;
+		t->sessions_len = sessions_len;
+		if(pthread_create(&t->thread, NULL, int_pool_main, t) != 0) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't start a "
+					"thread\n");
+			break;
+		}
+	}
+	for(loop = 0; loop < started; loop++) {
+		pthread_join(threads[loop].thread, NULL);
+		done += threads[loop].done;
+	}
+	SYS_free(pool_thread, threads);
+	DC_POOL_free(pool);
+	return done;
+}
+#endif
+
+/* Times a "have" against the server that never answers, which should fail
+ * with DC_CTX_ERR_TIMEOUT after 'msecs' (give or take SILENT_SLACK). */
+static int int_silent_have(DC_CTX *ctx, unsigned long msecs)
+{
+	static const unsigned char id[] = "dc_test";
+	struct timeval start, finish;
+	unsigned long took;
+	int ret;
+
+	SYS_gettime(&start);
+	ret = DC_CTX_has_session(ctx, id, sizeof(id));
+	SYS_gettime(&finish);
+	took = SYS_msecs_between(&start, &finish);
+	if((ret != -1) || (DC_CTX_get_error(ctx) != DC_CTX_ERR_TIMEOUT)) {
+		SYS_fprintf(SYS_stderr, "Error, an operation didn't time out "
+				"against a server that never answers\n");
+		return 0;
+	}
+	/* The clock's granularity can make it look a little early */
+	if((took + 10 < msecs) || (took >= msecs + SILENT_SLACK)) {
+		SYS_fprintf(SYS_stderr, "Error, an operation timed out after %lu "
+				"msecs rather than %lu\n", took, msecs);
+		return 0;
+	}
+	return 1;
+}
+
+#ifdef DC_TEST_THREADS
+/* Checks that a DC_POOL's operations time out against the server that never
+ * answers, and that it recovers to time out the next one too */
+static int int_silent_pool(const char *silent)
+{
+	static const unsigned char id[] = "dc_test";
+	DC_POOL *pool;
+	struct timeval start, finish;
+	unsigned long took;
+	unsigned int loop;
+	int ret = 0;
+
+	if((pool = DC_POOL_new(silent, 1)) == NULL) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_POOL' creation failed\n");
+		return 0;
+	}
+	DC_POOL_set_timeouts(pool, SILENT_OP_MSECS, SILENT_OP_MSECS);
+	for(loop = 0; loop < 2; loop++) {
+		SYS_gettime(&start);
+		if(DC_POOL_has_session(pool, id, sizeof(id)) != -1) {
+			SYS_fprintf(SYS_stderr, "Error, a pooled operation "
+					"didn't fail against a server that "
+					"never answers\n");
+			goto end;
+		}
+		SYS_gettime(&finish);
+		took = SYS_msecs_between(&start, &finish);
+		if((took + 10 < SILENT_OP_MSECS) ||
+				(took >= SILENT_OP_MSECS + SILENT_SLACK)) {
+			SYS_fprintf(SYS_stderr, "Error, a pooled operation "
+					"timed out after %lu msecs rather than "
+					"%lu\n", took, SILENT_OP_MSECS);
+			goto end;
+		}
+	}
+	ret = 1;
+end:
+	DC_POOL_free(pool);
+	return ret;
+}
+#endif
+
+/* The completion callback for the asynchronous operations in do_timeouts(),
+ * which counts how many fail outright */
+static void int_silent_done(void *cb_arg, int result,
+			const unsigned char *sess_data, unsigned int sess_len)
+{
+	if(result < 0)
+		(*(unsigned int *)cb_arg)++;
+}
+
+/* Checks asynchronous operations against the server that never answers stay
+ * outstanding until the caller gives up on them with DC_CTX_async_abort(). */
+static int int_silent_async(DC_CTX *ctx)
+{
+	static const unsigned char id[] = "dc_test";
+	NAL_SELECTOR *sel;
+	struct timeval deadline, now;
+	unsigned int loop, failed = 0;
+	int ret = 0;
+
+	if(((sel = NAL_SELECTOR_new()) == NULL) ||
+			!DC_CTX_to_select(ctx, sel)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't set up asynchronous "
+				"operations\n");
+		goto end;
+	}
+	for(loop = 0; loop < 3; loop++)
+		if(!DC_CTX_async_has_session(ctx, id, sizeof(id),
+					int_silent_done, &failed)) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't submit an "
+					"asynchronous operation\n");
+			goto end;
+		}
+	SYS_gettime(&deadline);
+	SYS_timeadd(&deadline, &deadline, SILENT_OP_MSECS);
+	do {
+		if(!DC_CTX_process(ctx)) {
+			SYS_fprintf(SYS_stderr, "Error, asynchronous I/O "
+					"failed\n");
+			goto end;
+		}
+		NAL_SELECTOR_select(sel, SILENT_CALL_MSECS * 1000, 1);
+		SYS_gettime(&now);
+	} while(SYS_timecmp(&now, &deadline) < 0);
+	if(!DC_CTX_async_connected(ctx) || (DC_CTX_async_num(ctx) != 3) ||
+			failed) {
+		SYS_fprintf(SYS_stderr, "Error, asynchronous operations "
+				"should be connected and outstanding\n");
+		goto end;
+	}
+	DC_CTX_async_abort(ctx);
+	if(DC_CTX_async_num(ctx) || (failed != 3)) {
+		SYS_fprintf(SYS_stderr, "Error, aborting didn't fail every "
+				"asynchronous operation\n");
+		goto end;
+	}
+	ret = 1;
+end:
+	if(sel) {
+		DC_CTX_from_select(ctx);
+		NAL_SELECTOR_free(sel);
+	}
+	return ret;
+}
+
+/* Checks that blocking operations time out as configured (and per-call
+ * timeouts only apply to the one call) against a server that accepts
+ * connections but never answers, which is simply a listener we never
+ * service. Then checks that timeouts don't get in the way of the real server
+ * at 'address', and that it not finding a session isn't reported as an
+ * error. */
+static int do_timeouts(const char *silent, const char *address)
+{
+	static const unsigned char id[] = "dc_test";
+	NAL_ADDRESS *addr = NAL_ADDRESS_new();
+	NAL_LISTENER *list = NAL_LISTENER_new();
+	DC_CTX *ctx = NULL, *pctx = NULL;
+	int ret = 1;
+
+	if(!addr || !list || !NAL_ADDRESS_create(addr, silent, 2048) ||
+			!NAL_LISTENER_create(list, addr)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't listen on %s\n",
+				silent);
+		goto end;
+	}
+	if(((ctx = DC_CTX_new(silent, 0)) == NULL) || ((pctx =
+			DC_CTX_new(silent, DC_CTX_FLAG_PERSISTENT)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_CTX' creation failed\n");
+		goto end;
+	}
+	DC_CTX_set_timeouts(ctx, SILENT_OP_MSECS, SILENT_OP_MSECS);
+	DC_CTX_set_timeouts(pctx, SILENT_OP_MSECS, SILENT_OP_MSECS);
+	if(!int_silent_have(ctx, SILENT_OP_MSECS))
+		goto end;
+	DC_CTX_set_call_timeout(ctx, SILENT_CALL_MSECS);
+	if(!int_silent_have(ctx, SILENT_CALL_MSECS) ||
+			!int_silent_have(ctx, SILENT_OP_MSECS) ||
+			!int_silent_have(pctx, SILENT_OP_MSECS) ||
+			/* The persistent connection was dropped, make sure
+			 * there's a new one */
+			!int_silent_have(pctx, SILENT_OP_MSECS) ||
+			!int_silent_async(pctx))
+		goto end;
+#ifdef DC_TEST_THREADS
+	if(!int_silent_pool(silent))
+		goto end;
+#endif
+	DC_CTX_free(ctx);
+	if((ctx = DC_CTX_new(address, 0)) == NULL) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_CTX' creation failed\n");
+		goto end;
+	}
+	DC_CTX_set_timeouts(ctx, SILENT_OP_MSECS, SILENT_OP_MSECS);
+	if((DC_CTX_has_session(ctx, id, sizeof(id)) != 0) ||
+			(DC_CTX_get_error(ctx) != DC_CTX_ERR_NONE)) {
+		SYS_fprintf(SYS_stderr, "Error, a session missing from the "
+				"cache was reported as an error\n");
+		goto end;
+	}
+	SYS_fprintf(SYS_stderr, "Info, timeouts checked\n");
+	ret = 0;
+end:
+	if(pctx)
+		DC_CTX_free(pctx);
+	if(ctx)
+		DC_CTX_free(ctx);
+	if(list)
+		NAL_LISTENER_free(list);
+	if(addr)
+		NAL_ADDRESS_free(addr);
+	return ret;
+}
+
+/* The ids of the sessions "-cluster" uses are CLUSTER_SESSIONS of those
+ * belonging to each server, in 'ids[server][n]'. */
+static int int_cluster_ids(const char *const *targets,
+			unsigned char ids[2][CLUSTER_SESSIONS][16])
+{
+	DC_RING *ring = DC_RING_new(targets, 2, 0);
+	unsigned int found[2] = { 0, 0 };
+	unsigned char id[16];
+	int idx;
+
+	if(!ring)
+		return 0;
+	while((found[0] < CLUSTER_SESSIONS) || (found[1] < CLUSTER_SESSIONS)) {
+		generate_random_bytes(id, sizeof(id));
+		if(((idx = DC_RING_lookup(ring, id, sizeof(id))) < 0) ||
+				(found[idx] == CLUSTER_SESSIONS))
+			continue;
+		SYS_memcpy_n(unsigned char, ids[idx][found[idx]++], id,
+				sizeof(id));
+	}
+	DC_RING_free(ring);
+	return 1;
+}
+
+/* Returns non-zero if the server behind 'ctx' has session 'id' */
+static int int_cluster_has(DC_CTX *ctx, const unsigned char *id)
+{
+	return (DC_CTX_has_session(ctx, id, 16) == 1);
+}
+
+/* Checks a DC_CLUSTER of 'address' and 'late', where no server is listening on
+ * 'late' yet but one will start shortly. The cluster should eject 'late' and
+ * keep its sessions on 'address' until that server starts, and then take it
+ * back. */
+static int do_cluster(const char *address, const char *late)
+{
+	static const unsigned char data[] = "dc_test cluster session";
+	const char *targets[2];
+	unsigned char ids[2][CLUSTER_SESSIONS][16];
+	DC_CLUSTER *cl = NULL;
+	DC_CTX *direct[2] = { NULL, NULL };
+	struct timeval deadline, now;
+	unsigned int loop;
+	int ret = 1;
+
+	targets[0] = address;
+	targets[1] = late;
+	if(!int_cluster_ids(targets, ids) ||
+			((direct[0] = DC_CTX_new(address, 0)) == NULL) ||
+			((direct[1] = DC_CTX_new(late, 0)) == NULL) ||
+			((cl = DC_CLUSTER_new(targets, 2,
+				DC_CTX_FLAG_PERSISTENT)) == NULL)) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_CLUSTER' creation "
+				"failed\n");
+		goto end;
+	}
+	DC_CLUSTER_set_ejection(cl, 2, CLUSTER_RETRY_MSECS);
+	if(DC_CTX_has_session(direct[1], ids[1][0], 16) != -1) {
+		SYS_fprintf(SYS_stderr, "Error, the server at %s should start "
+				"after dc_test\n", late);
+		goto end;
+	}
+	/* The first add for the missing server ejects it, and so they all end
+	 * up on the other server */
+	for(loop = 0; loop < CLUSTER_SESSIONS; loop++)
+		if(!DC_CLUSTER_add_session(cl, ids[0][loop], 16, data,
+					sizeof(data), 60000) ||
+				!DC_CLUSTER_add_session(cl, ids[1][loop], 16,
+					data, sizeof(data), 60000) ||
+				!int_cluster_has(direct[0], ids[0][loop]) ||
+				!int_cluster_has(direct[0], ids[1][loop])) {
+			SYS_fprintf(SYS_stderr, "Error, sessions weren't kept "
+					"on the remaining server\n");
+			goto end;
+		}
+	if(DC_CLUSTER_num_live(cl) != 1) {
+		SYS_fprintf(SYS_stderr, "Error, the missing server wasn't "
+				"ejected\n");
+		goto end;
+	}
+	/* Wait for the server to start and the cluster to take it back (which
+	 * it only considers when it's used). Its sessions are looked up there
+	 * once it does, so they're missing. */
+	SYS_gettime(&deadline);
+	SYS_timeadd(&deadline, &deadline, CLUSTER_WAIT_MSECS);
+	while((DC_CLUSTER_has_session(cl, ids[1][0], 16) != 0) ||
+			(DC_CLUSTER_num_live(cl) != 2)) {
+		SYS_gettime(&now);
+		if(SYS_timecmp(&now, &deadline) >= 0) {
+			SYS_fprintf(SYS_stderr, "Error, the server wasn't taken "
+					"back\n");
+			goto end;
+		}
+		usleep(CLUSTER_RETRY_MSECS * 1000);
+	}
+	/* Now sessions go to the servers they belong to, and the rest stayed
+	 * where they were */
+	for(loop = 0; loop < CLUSTER_SESSIONS; loop++) {
+		if(DC_CLUSTER_has_session(cl, ids[0][loop], 16) != 1) {
+			SYS_fprintf(SYS_stderr, "Error, a session was lost from "
+					"the server that stayed\n");
+			goto end;
+		}
+		if(!DC_CTX_remove_session(direct[0], ids[1][loop], 16) ||
+				!DC_CLUSTER_add_session(cl, ids[1][loop], 16,
+					data, sizeof(data), 60000) ||
+				!int_cluster_has(direct[1], ids[1][loop]) ||
+				int_cluster_has(direct[0], ids[1][loop])) {
+			SYS_fprintf(SYS_stderr, "Error, a session didn't go to "
+					"the server that was taken back\n");
+			goto end;
+		}
+		if(!DC_CLUSTER_remove_session(cl, ids[0][loop], 16) ||
+				!DC_CLUSTER_remove_session(cl, ids[1][loop],
+					16)) {
+			SYS_fprintf(SYS_stderr, "Error, remove failed!\n");
+			goto end;
+		}
+	}
+	SYS_fprintf(SYS_stderr, "Info, cluster checked\n");
+	ret = 0;
+end:
+	if(cl)
+		DC_CLUSTER_free(cl);
+	for(loop = 0; loop < 2; loop++)
+		if(direct[loop])
+			DC_CTX_free(direct[loop]);
+	return ret;
+}
+
+/* A stand-in for the cache server behind a dc_client, so that tests can see
+ * which requests get past it. It holds at most one session, and hands out
+ * 'upstream_data' for it however it was added. */
+typedef struct st_upstream {
+	NAL_SELECTOR *sel;
+	NAL_ADDRESS *addr;
+	NAL_LISTENER *list;
+	DC_PLUG *plug;
+	unsigned char id[DC_MAX_ID_LEN];
+	unsigned int id_len;
+	/* While set, requests are left unanswered */
+	int hold;
+	/* How many of each request have been answered */
+	unsigned int gets, haves, adds, removes;
+} upstream;
+
+static const unsigned char upstream_data[] = "dc_test upstream session";
+
+/* Listens on 'address' and waits for a dc_client to connect. Returns zero on
+ * failure. */
+static int int_upstream_new(upstream *u, const char *address)
+{
+	NAL_CONNECTION *conn = NULL;
+	struct timeval deadline, now;
+
+	SYS_zero(upstream, u);
+	if(((u->sel = NAL_SELECTOR_new()) == NULL) ||
+			((u->addr = NAL_ADDRESS_new()) == NULL) ||
+			((u->list = NAL_LISTENER_new()) == NULL) ||
+			((conn = NAL_CONNECTION_new()) == NULL) ||
+			!NAL_ADDRESS_create(u->addr, address, 2048) ||
+			!NAL_LISTENER_create(u->list, u->addr) ||
+			!NAL_LISTENER_add_to_selector(u->list, u->sel)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't listen on %s\n",
+				address);
+		goto err;
+	}
+	SYS_gettime(&deadline);
+	SYS_timeadd(&deadline, &deadline, UPSTREAM_WAIT_MSECS);
+	while(NAL_SELECTOR_select(u->sel, 100000, 1) >= 0) {
+		if(NAL_CONNECTION_accept(conn, u->list)) {
+			NAL_LISTENER_del_from_selector(u->list);
+			if(((u->plug = DC_PLUG_new(conn, 0)) == NULL) ||
+					!DC_PLUG_to_select(u->plug, u->sel))
+				goto err;
+			return 1;
+		}
+		SYS_gettime(&now);
+		if(SYS_timecmp(&now, &deadline) >= 0)
+			break;
+	}
+	SYS_fprintf(SYS_stderr, "Error, dc_client didn't connect to %s\n",
+			address);
+err:
+	/* The plug owns the connection once it exists */
+	if(conn && !u->plug)
+		NAL_CONNECTION_free(conn);
+	return 0;
+}
+
+static void int_upstream_free(upstream *u)
+{
+	if(u->plug)
+		DC_PLUG_free(u->plug);
+	if(u->list)
+		NAL_LISTENER_free(u->list);
+	if(u->addr)
+		NAL_ADDRESS_free(u->addr);
+	if(u->sel)
+		NAL_SELECTOR_free(u->sel);
+}
+
+/* Answers whatever requests have arrived, unless they're being held */
+static int int_upstream_answer(upstream *u)
+{
+	static const unsigned char yes = DC_ERR_OK, no = DC_ERR_NOTOK;
+	unsigned long uid, msecs, len;
+	DC_CMD cmd;
+	const unsigned char *data, *res;
+	unsigned int data_len, res_len;
+	int match;
+
+	if(!DC_PLUG_io(u->plug))
+		return 0;
+	while(!u->hold && DC_PLUG_read(u->plug, 0, &uid, &cmd, &data,
+				&data_len)) {
+		match = (u->id_len && (data_len == u->id_len) &&
+				(memcmp(data, u->id, data_len) == 0));
+		res = match ? &yes : &no;
+		res_len = 1;
+		switch(cmd) {
+		case DC_CMD_GET:
+			if(match) {
+				res = upstream_data;
+				res_len = sizeof(upstream_data);
+			}
+			break;
+		case DC_CMD_REMOVE:
+			if(match)
+				u->id_len = 0;
+			break;
+		case DC_CMD_ADD:
+			/* Just note the session id, which follows the timeout
+			 * and its length */
+			res = &no;
+			if(!u->id_len && NAL_decode_uint32(&data, &data_len,
+						&msecs) &&
+					NAL_decode_uint32(&data, &data_len,
+						&len) && len &&
+					(len <= DC_MAX_ID_LEN) &&
+					(len < data_len)) {
+				u->id_len = (unsigned int)len;
+				SYS_memcpy_n(unsigned char, u->id, data,
+						u->id_len);
+				res = &yes;
+			}
+			break;
+		default:
+			break;
+		}
+		if(!DC_PLUG_write(u->plug, 0, uid, cmd, res, res_len))
+			/* Still sending the last answer */
+			break;
+		if(!DC_PLUG_commit(u->plug))
+			return 0;
+		switch(cmd) {
+		case DC_CMD_GET: u->gets++; break;
+		case DC_CMD_HAVE: u->haves++; break;
+		case DC_CMD_ADD: u->adds++; break;
+		case DC_CMD_REMOVE: u->removes++; break;
+		default: break;
+		}
+		if(!DC_PLUG_consume(u->plug))
+			return 0;
+	}
+	return 1;
+}
+
+/* What asynchronous requests through dc_client should get back (and for a
+ * "get", if 'data' is set, the session it should get), and how many of them
+ * have completed and how many got that */
+typedef struct st_expect {
+	int result;
+	const unsigned char *data;
+	unsigned int len;
+	unsigned int done, good;
+} expect;
+
+static void int_expect_done(void *cb_arg, int result,
+			const unsigned char *sess_data, unsigned int sess_len)
+{
+	expect *e = cb_arg;
+	e->done++;
+	if((result == e->result) && (!e->data || ((sess_len == e->len) &&
+			(memcmp(sess_data, e->data, sess_len) == 0))))
+		e->good++;
+}
+
+static void int_expect(expect *e, int result, const unsigned char *data,
+			unsigned int len)
+{
+	e->result = result;
+	e->data = data;
+	e->len = len;
+	e->done = e->good = 0;
+}
+
+/* Runs the network for the stand-in server and the clients for 'msecs', or
+ * until 'num' requests have completed according to 'e1' and 'e2' (if 'num' is
+ * non-zero). Returns zero if I/O fails or the requests don't complete. */
+static int int_upstream_run(upstream *u, DC_CTX **ctxs, unsigned int num_ctxs,
+			unsigned long msecs, const expect *e1, const expect *e2,
+			unsigned int num)
+{
+	struct timeval deadline, now;
+	unsigned int loop;
+
+	SYS_gettime(&deadline);
+	SYS_timeadd(&deadline, &deadline, msecs);
+	do {
+		if((NAL_SELECTOR_select(u->sel, 10000, 1) < 0) &&
+				(errno != EINTR))
+			return 0;
+		if(!int_upstream_answer(u))
+			return 0;
+		for(loop = 0; loop < num_ctxs; loop++)
+			if(!DC_CTX_process(ctxs[loop]))
+				return 0;
+		if(num && (e1->done + (e2 ? e2->done : 0) >= num))
+			return 1;
+		SYS_gettime(&now);
+	} while(SYS_timecmp(&now, &deadline) < 0);
+	return !num;
+}
+
+/* Checks that identical lookups from several clients of the dc_client at
+ * 'address', while one is already waiting on its server, share that request
+ * rather than each sending their own. dc_test stands in for the server, on
+ * 'address'. */
+static int do_coalesce(const char *address, const char *up_address)
+{
+	static const unsigned char id[] = "dc_test-coalesce";
+	upstream u;
+	DC_CTX *ctxs[2 * COALESCE_CLIENTS];
+	expect gets, haves;
+	unsigned int loop, num = 0;
+	int ret = 1;
+
+	if(!int_upstream_new(&u, up_address))
+		goto end;
+	for(num = 0; num < 2 * COALESCE_CLIENTS; num++)
+		if(((ctxs[num] = DC_CTX_new(address,
+				DC_CTX_FLAG_PERSISTENT)) == NULL) ||
+				!DC_CTX_to_select(ctxs[num], u.sel)) {
+			if(ctxs[num])
+				DC_CTX_free(ctxs[num]);
+			SYS_fprintf(SYS_stderr, "Error, 'DC_CTX' creation "
+					"failed\n");
+			goto end;
+		}
+	/* Make sure requests get through before holding any */
+	int_expect(&gets, 1, NULL, 0);
+	if(!DC_CTX_async_add_session(ctxs[0], id, sizeof(id), id,
+				sizeof(id), 60000, int_expect_done, &gets) ||
+			!int_upstream_run(&u, ctxs, num, UPSTREAM_WAIT_MSECS,
+				&gets, NULL, 1) || (gets.good != 1)) {
+		SYS_fprintf(SYS_stderr, "Error, couldn't add a session "
+				"through dc_client\n");
+		goto end;
+	}
+	/* The server sits on the first lookups so that the rest arrive while
+	 * they're outstanding */
+	u.gets = u.haves = 0;
+	u.hold = 1;
+	int_expect(&gets, 1, upstream_data, sizeof(upstream_data));
+	int_expect(&haves, 1, NULL, 0);
+	for(loop = 0; loop < COALESCE_CLIENTS; loop++)
+		if(!DC_CTX_async_get_session(ctxs[loop], id, sizeof(id),
+					int_expect_done, &gets) ||
+				!DC_CTX_async_has_session(
+					ctxs[COALESCE_CLIENTS + loop], id,
+					sizeof(id), int_expect_done, &haves)) {
+			SYS_fprintf(SYS_stderr, "Error, couldn't submit an "
+					"asynchronous operation\n");
+			goto end;
+		}
+	if(!int_upstream_run(&u, ctxs, num, UPSTREAM_HOLD_MSECS, &gets,
+				&haves, 0)) {
+		SYS_fprintf(SYS_stderr, "Error, I/O failed\n");
+		goto end;
+	}
+	u.hold = 0;
+	if(!int_upstream_run(&u, ctxs, num, UPSTREAM_WAIT_MSECS, &gets,
+				&haves, 2 * COALESCE_CLIENTS) ||
+			(gets.good != COALESCE_CLIENTS) ||
+			(haves.good != COALESCE_CLIENTS)) {
+		SYS_fprintf(SYS_stderr, "Error, clients didn't all get the "
+				"answer to their lookup\n");
+		goto end;
+	}
+	if((u.gets != 1) || (u.haves != 1)) {
+		SYS_fprintf(SYS_stderr, "Error, the server saw %u gets and %u "
+				"haves rather than one of each\n", u.gets,
+				u.haves);
+		goto end;
+	}
+	SYS_fprintf(SYS_stderr, "Info, coalescing checked\n");
+	ret = 0;
+end:
+	for(loop = 0; loop < num; loop++)
+		DC_CTX_free(ctxs[loop]);
+	int_upstream_free(&u);
+	return ret;
+}
+
+/* The steps of "-nearcache", each an operation through dc_client on the one
+ * session and what it should do. 'data' says which session a "get" should
+ * return, 0 for the stand-in server's and 1 for the one added by the test.
+ * 'upstream' is the number of 'cmd' requests the server should have answered
+ * afterwards. */
+typedef struct st_near_step {
+	DC_CMD cmd;
+	int result;
+	int data;
+	unsigned int upstream;
+} near_step;
+
+static const near_step near_steps[] = {
+	/* The first lookup fetches the session, so later ones don't go to the
+	 * server */
+	{ DC_CMD_GET, 1, 0, 1 },
+	{ DC_CMD_GET, 1, 0, 1 },
+	{ DC_CMD_HAVE, 1, 0, 0 },
+	/* Removing it goes to the server, which no longer has it */
+	{ DC_CMD_REMOVE, 1, 0, 1 },
+	{ DC_CMD_GET, 0, 0, 2 },
+	{ DC_CMD_HAVE, 0, 0, 1 },
+	/* Whatever gets added is what lookups get */
+	{ DC_CMD_ADD, 1, 0, 1 },
+	{ DC_CMD_GET, 1, 1, 2 },
+	{ DC_CMD_HAVE, 1, 0, 1 },
+	{ DC_CMD_REMOVE, 1, 0, 2 }
+};
+#define NUM_NEAR_STEPS	(sizeof(near_steps) / sizeof(near_step))
+
+/* Checks that the near-cache of the dc_client at 'address' answers lookups of
+ * sessions that passed through it, and that removing or adding a session
+ * through it stops it answering from what it had. dc_test stands in for the
+ * server, on 'up_address'. */
+static int do_nearcache(const char *address, const char *up_address)
+{
+	static const unsigned char id[] = "dc_test-nearcache";
+	static const unsigned char added[] = "dc_test nearcache session";
+	upstream u;
+	DC_CTX *ctx = NULL;
+	expect e;
+	const near_step *step = near_steps;
+	unsigned int loop, seen = 0;
+	int ok = 0, ret = 1;
+
+	if(!int_upstream_new(&u, up_address))
+		goto end;
+	if(((ctx = DC_CTX_new(address, DC_CTX_FLAG_PERSISTENT)) == NULL) ||
+			!DC_CTX_to_select(ctx, u.sel)) {
+		SYS_fprintf(SYS_stderr, "Error, 'DC_CTX' creation failed\n");
+		goto end;
+	}
+	/* The server starts out with the session */
+	u.id_len = sizeof(id);
+	SYS_memcpy_n(unsigned char, u.id, id, sizeof(id));
+	for(loop = 0; loop < NUM_NEAR_STEPS; loop++, step++) {
+		/* A "get" that misses has no session to compare */
+		if((step->cmd == DC_CMD_GET) && step->result)
+			int_expect(&e, step->result, step->data ? added :
+				upstream_data, step->data ? sizeof(added) :
+				sizeof(upstream_data));
+		else
+			int_expect(&e, step->result, NULL, 0);
+		switch(step->cmd) {
+		case DC_CMD_GET:
+			ok = DC_CTX_async_get_session(ctx, id, sizeof(id),
+					int_expect_done, &e);
+			break;
+		case DC_CMD_HAVE:
+			ok = DC_CTX_async_has_session(ctx, id, sizeof(id),
+					int_expect_done, &e);
+			break;
+		case DC_CMD_ADD:
+			ok = DC_CTX_async_add_session(ctx, id, sizeof(id),
+					added, sizeof(added), 60000,
+					int_expect_done, &e);
+			break;
+		case DC_CMD_REMOVE:
+			ok = DC_CTX_async_remove_session(ctx, id, sizeof(id),
+					int_expect_done, &e);
+			break;
+		default:
+			break;
+		}
+		if(!ok || !int_upstream_run(&u, &ctx, 1, UPSTREAM_WAIT_MSECS,
+					&e, NULL, 1)) {
+			SYS_fprintf(SYS_stderr, "Error, step %u didn't "
+					"complete\n", loop);
+			goto end;
+		}
+		if(!e.good) {
+			SYS_fprintf(SYS_stderr, "Error, step %u got the wrong "
+					"answer\n", loop);
+			goto end;
+		}
+		switch(step->cmd) {
+		case DC_CMD_GET: seen = u.gets; break;
+		case DC_CMD_HAVE: seen = u.haves; break;
+		case DC_CMD_ADD: seen = u.adds; break;
+		case DC_CMD_REMOVE: seen = u.removes; break;
+		default: break;
+		}
+		if(seen != step->upstream) {
+			SYS_fprintf(SYS_stderr, "Error, after step %u the server "
+					"had seen %u of its requests rather "
+					"than %u\n", loop, seen,
+					step->upstream);
+			goto end;
+		}
+	}
+	SYS_fprintf(SYS_stderr, "Info, near-cache checked\n");
+	ret = 0;
+end:
+	if(ctx)
+		DC_CTX_free(ctx);
+	int_upstream_free(&u);
+	return ret;
+}
+
 static int do_client(const char *address, unsigned int num_sessions,
 			unsigned int datamin, unsigned int datamax,
 			unsigned int withcert, unsigned int timeout,
 			unsigned int timevar, unsigned int tests,
-			unsigned long progress, int persistent)
+			unsigned long progress, int persistent,
+			unsigned int batch, unsigned int async,
+			unsigned int pool)
 {
 	int to_return = 1;
 	int sessions_bool[MAX_SESSIONS];
@@ -415,6 +1708,34 @@ static int do_client(const char *address, unsigned int num_sessions,
 	SYS_fprintf(SYS_stderr, "Info, %u sessions generated, will run %u "
 			"random tests\n", num_sessions, tests);
 	idx = 0;
+	if(batch) {
+		idx = int_batch_tests(ctx, batch, tests, num_sessions,
+				sessions_bool, sessions_id, sessions_idlen,
+				sessions_enc, sessions_len, timeout, timevar,
+				progress);
+		if(idx == tests)
+			to_return = 0;
+		goto bail;
+	}
+#ifdef DC_TEST_THREADS
+	if(pool) {
+		idx = int_pool_tests(address, pool, tests, num_sessions,
+				sessions_bool, sessions_id, sessions_idlen,
+				sessions_enc, sessions_len, timeout, timevar);
+		if(idx == tests)
+			to_return = 0;
+		goto bail;
+	}
+#endif
+	if(async) {
+		idx = int_async_tests(ctx, async, tests, num_sessions,
+				sessions_bool, sessions_id, sessions_idlen,
+				sessions_enc, sessions_len, timeout, timevar,
+				progress);
+		if(idx == tests)
+			to_return = 0;
+		goto bail;
+	}
 	while(idx < tests) {
 		int ret;
 		unsigned int s;